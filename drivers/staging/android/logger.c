@@ -25,6 +25,8 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -33,17 +35,25 @@
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * Positions in the log are free-running byte sequence numbers; the offset in
+ * the ring buffer is the sequence number modulo the (power of two) size. The
+ * spinlock 'lock' serializes writers while they copy an already assembled
+ * entry into the ring. Readers never take it: the data at a sequence number
+ * is intact as long as that sequence number is not before 'head', which
+ * writers advance before they overwrite anything. Both are mirrored into
+ * 'hdr', the page mapped ahead of the ring by logger_mmap(). The header page
+ * and the ring are one vmalloc_user() area, allocated by init_log().
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
+	struct logger_mmap_header *hdr;	/* header page, ahead of the ring */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
-	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
+	spinlock_t		lock;	/* serializes writers */
+	unsigned long		w_seq;	/* sequence number of the write head */
+	unsigned long		head;	/* oldest intact entry, readers start here */
 	size_t			size;	/* size of the log */
 };
 
@@ -51,17 +61,24 @@ struct logger_log {
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The mutex only serializes readers sharing one file.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
-	struct list_head	list;	/* entry in logger_log's list */
-	size_t			r_off;	/* current read head offset */
+	struct mutex		mutex;	/* protects r_seq */
+	unsigned long		r_seq;	/* sequence number of the read head */
+	int			batch;	/* LOGGER_READ_BATCH mode */
 };
 
-/* logger_offset - returns index 'n' into the log via (optimized) modulus */
+/* logger_offset - returns index of sequence number 'n' into the log */
 #define logger_offset(n)	((n) & (log->size - 1))
 
+/*
+ * Entries with payloads this small are assembled on the writer's stack, larger
+ * ones in a kmalloc()ed buffer.
+ */
+#define LOGGER_STACK_ENTRY_LEN	256
+
 /*
  * file_get_log - Given a file structure, return the associated log
  *
@@ -87,12 +104,14 @@ static inline struct logger_log *file_get_log(struct file *file)
 
 /*
  * get_entry_len - Grabs the length of the payload of the next entry starting
- * from 'off'.
+ * from sequence number 'seq'.
  *
- * Caller needs to hold log->mutex.
+ * Writers call this under log->lock. Readers must check logger_reader_lapped()
+ * before trusting the result.
  */
-static __u32 get_entry_len(struct logger_log *log, size_t off)
+static __u32 get_entry_len(struct logger_log *log, unsigned long seq)
 {
+	size_t off = logger_offset(seq);
 	__u16 val;
 
 	switch (log->size - off) {
@@ -107,17 +126,96 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 	return sizeof(struct logger_entry) + val;
 }
 
+/*
+ * get_batch_len - returns the length of the longest run of complete entries
+ * at the reader's position that fits in 'count' bytes, or the length of the
+ * first entry if not even that fits. 'avail' is what logger_reader_avail()
+ * returned.
+ *
+ * Caller must hold reader->mutex and check logger_reader_lapped() before
+ * trusting the result.
+ */
+static size_t get_batch_len(struct logger_log *log,
+			    struct logger_reader *reader,
+			    size_t avail, size_t count)
+{
+	size_t len = get_entry_len(log, reader->r_seq);
+
+	while (len < avail) {
+		size_t next = get_entry_len(log, reader->r_seq + len);
+
+		if (len + next > count)
+			break;
+		len += next;
+	}
+
+	return len;
+}
+
+/*
+ * logger_reader_avail - returns the number of bytes the reader has yet to
+ * read. A reader the writers have lapped is first pulled forward to the
+ * oldest intact entry.
+ *
+ * Caller must hold reader->mutex.
+ */
+static size_t logger_reader_avail(struct logger_log *log,
+				  struct logger_reader *reader)
+{
+	unsigned long head, w_seq;
+
+	head = ACCESS_ONCE(log->head);
+	smp_rmb();
+	w_seq = ACCESS_ONCE(log->w_seq);
+
+	if ((long) (reader->r_seq - head) < 0 ||
+	    (long) (w_seq - reader->r_seq) < 0)
+		reader->r_seq = head;
+
+	/* pairs with the smp_wmb() before the w_seq update in do_write_log */
+	smp_rmb();
+
+	return w_seq - reader->r_seq;
+}
+
+/*
+ * logger_reader_lapped - checks whether the data just read at the reader's
+ * position may have been overwritten while we were reading it. If so, the
+ * reader is pulled forward to the oldest intact entry and 1 is returned.
+ *
+ * Caller must hold reader->mutex.
+ */
+static int logger_reader_lapped(struct logger_log *log,
+				struct logger_reader *reader)
+{
+	unsigned long head;
+
+	/* pairs with the smp_wmb() after the head update in do_write_log */
+	smp_rmb();
+	head = ACCESS_ONCE(log->head);
+
+	if (likely((long) (reader->r_seq - head) >= 0))
+		return 0;
+
+	reader->r_seq = head;
+	return 1;
+}
+
 /*
  * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
  * user-space buffer 'buf'. Returns 'count' on success.
  *
- * Caller must hold log->mutex.
+ * Does not advance the reader, as the caller has to check that the data was
+ * not overwritten while it was being copied.
+ *
+ * Caller must hold reader->mutex.
  */
 static ssize_t do_read_log_to_user(struct logger_log *log,
 				   struct logger_reader *reader,
 				   char __user *buf,
 				   size_t count)
 {
+	size_t off = logger_offset(reader->r_seq);
 	size_t len;
 
 	/*
@@ -125,8 +223,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the current read head offset up to 'count' bytes or to the end of
 	 * the log, whichever comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	len = min(count, log->size - off);
+	if (copy_to_user(buf, log->buffer + off, len))
 		return -EFAULT;
 
 	/*
@@ -137,8 +235,6 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
-
 	return count;
 }
 
@@ -149,16 +245,19 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
  *
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * 	- Atomically reads exactly one log entry, or in LOGGER_READ_BATCH mode
+ * 	  as many complete entries as fit in the buffer
  *
- * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
- * buffer is insufficient to hold next entry.
+ * Optimal read size is LOGGER_ENTRY_MAX_LEN, or the size of the log in batch
+ * mode. Will set errno to EINVAL if read buffer is insufficient to hold next
+ * entry.
  */
 static ssize_t logger_read(struct file *file, char __user *buf,
 			   size_t count, loff_t *pos)
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	size_t avail;
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
@@ -166,9 +265,7 @@ start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		ret = (ACCESS_ONCE(log->w_seq) == ACCESS_ONCE(reader->r_seq));
 		if (!ret)
 			break;
 
@@ -189,194 +286,153 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
+	mutex_lock(&reader->mutex);
 
+retry:
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+	avail = logger_reader_avail(log, reader);
+	if (unlikely(!avail)) {
+		mutex_unlock(&reader->mutex);
 		goto start;
 	}
 
-	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
+	/* get the size of the next entry, or of all that fit */
+	if (reader->batch)
+		ret = get_batch_len(log, reader, avail, count);
+	else
+		ret = get_entry_len(log, reader->r_seq);
+	if (logger_reader_lapped(log, reader))
+		goto retry;
 	if (count < ret) {
 		ret = -EINVAL;
 		goto out;
 	}
 
-	/* get exactly one entry from the log */
+	/* get exactly those entries from the log */
 	ret = do_read_log_to_user(log, reader, buf, ret);
+	if (ret < 0)
+		goto out;
+	if (logger_reader_lapped(log, reader))
+		goto retry;
+
+	reader->r_seq += ret;
 
 out:
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
- *
- * Caller must hold log->mutex.
- */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
-{
-	size_t count = 0;
-
-	do {
-		size_t nr = get_entry_len(log, off);
-		off = logger_offset(off + nr);
-		count += nr;
-	} while (count < len);
-
-	return off;
-}
-
-/*
- * clock_interval - is a < c < b in mod-space? Put another way, does the line
- * from a to b cross c?
- */
-static inline int clock_interval(size_t a, size_t b, size_t c)
-{
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
-	}
-
-	return 0;
-}
-
-/*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * do_write_log - writes the 'count' byte entry 'buf' to 'log'
  *
- * The caller needs to hold log->mutex.
- */
-static void fix_up_readers(struct logger_log *log, size_t len)
-{
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
-
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
-
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
-}
-
-/*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * The head is first pulled forward past every entry the write is going to
+ * clobber, so that readers still looking at them notice they were lapped.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 {
-	size_t len;
+	unsigned long w_seq = log->w_seq;
+	unsigned long head = log->head;
+	size_t off, len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	while (w_seq + count - head > log->size)
+		head += get_entry_len(log, head);
 
-	if (count != len)
-		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log->w_off + count);
-
-}
-
-/*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
- *
- * Returns 'count' on success, negative error code on failure.
- */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
-{
-	size_t len;
+	if (head != log->head) {
+		ACCESS_ONCE(log->head) = head;
+		ACCESS_ONCE(log->hdr->head) = head;
+		smp_wmb();
+	}
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	off = logger_offset(w_seq);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			return -EFAULT;
-
-	log->w_off = logger_offset(log->w_off + count);
+		memcpy(log->buffer, buf + len, count - len);
 
-	return count;
+	smp_wmb();
+	ACCESS_ONCE(log->w_seq) = w_seq + count;
+	ACCESS_ONCE(log->hdr->w_seq) = w_seq + count;
 }
 
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * The entry is assembled, and the payload copied from user-space, before
+ * taking log->lock, so writers only contend for the final memcpy into the
+ * ring and a fault on a user buffer never leaves a partial entry behind.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
-	struct logger_entry header;
+	unsigned long stack_entry[LOGGER_STACK_ENTRY_LEN / sizeof(long)];
+	struct logger_entry *entry;
 	struct timespec now;
+	size_t len, count;
 	ssize_t ret = 0;
 
-	now = current_kernel_time();
-
-	header.pid = current->tgid;
-	header.tid = current->pid;
-	header.sec = now.tv_sec;
-	header.nsec = now.tv_nsec;
-	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
+	len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
 
 	/* null writes succeed, return zero */
-	if (unlikely(!header.len))
+	if (unlikely(!len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+	count = sizeof(struct logger_entry) + len;
+	if (count <= sizeof(stack_entry))
+		entry = (struct logger_entry *) stack_entry;
+	else {
+		entry = kmalloc(count, GFP_KERNEL);
+		if (!entry)
+			return -ENOMEM;
+	}
 
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	entry->len = len;
+	entry->__pad = 0;
+	entry->pid = current->tgid;
+	entry->tid = current->pid;
 
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
+	while (nr_segs-- > 0 && ret < len) {
+		size_t seg;
 
 		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
-
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+		seg = min_t(size_t, iov->iov_len, len - ret);
+
+		/* copy in this segment's payload */
+		if (unlikely(copy_from_user(entry->msg + ret, iov->iov_base,
+					    seg))) {
+			ret = -EFAULT;
+			goto out;
 		}
 
 		iov++;
-		ret += nr;
+		ret += seg;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_lock(&log->lock);
+
+	/* stamp under the lock so that the log stays ordered by time */
+	now = current_kernel_time();
+	entry->sec = now.tv_sec;
+	entry->nsec = now.tv_nsec;
+
+	do_write_log(log, entry, count);
+
+	spin_unlock(&log->lock);
 
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	/* wake up any blocked readers, pairs with prepare_to_wait() */
+	smp_mb();
+	if (waitqueue_active(&log->wq))
+		wake_up_interruptible(&log->wq);
+
+out:
+	if (entry != (struct logger_entry *) stack_entry)
+		kfree(entry);
 
 	return ret;
 }
@@ -409,12 +465,9 @@ static int logger_open(struct inode *inode, struct file *file)
 			return -ENOMEM;
 
 		reader->log = log;
-		INIT_LIST_HEAD(&reader->list);
-
-		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
-		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		mutex_init(&reader->mutex);
+		reader->r_seq = ACCESS_ONCE(log->head);
+		reader->batch = 0;
 
 		file->private_data = reader;
 	} else
@@ -432,7 +485,6 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
-		list_del(&reader->list);
 		kfree(reader);
 	}
 
@@ -462,10 +514,8 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	if (ACCESS_ONCE(log->w_seq) != ACCESS_ONCE(reader->r_seq))
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
 
 	return ret;
 }
@@ -476,8 +526,6 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	struct logger_reader *reader;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
-
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
 		ret = log->size;
@@ -488,10 +536,9 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		mutex_lock(&reader->mutex);
+		ret = logger_reader_avail(log, reader);
+		mutex_unlock(&reader->mutex);
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -499,28 +546,87 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
-			ret = get_entry_len(log, reader->r_off);
-		else
-			ret = 0;
+		mutex_lock(&reader->mutex);
+		do {
+			if (!logger_reader_avail(log, reader)) {
+				ret = 0;
+				break;
+			}
+			ret = get_entry_len(log, reader->r_seq);
+		} while (logger_reader_lapped(log, reader));
+		mutex_unlock(&reader->mutex);
 		break;
 	case LOGGER_FLUSH_LOG:
 		if (!(file->f_mode & FMODE_WRITE)) {
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+		/* readers behind the new head notice they were lapped */
+		spin_lock(&log->lock);
+		ACCESS_ONCE(log->head) = log->w_seq;
+		ACCESS_ONCE(log->hdr->head) = log->w_seq;
+		spin_unlock(&log->lock);
+		ret = 0;
+		break;
+	case LOGGER_SET_READ_MODE:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		if (arg != LOGGER_READ_ENTRY && arg != LOGGER_READ_BATCH) {
+			ret = -EINVAL;
+			break;
+		}
+		reader = file->private_data;
+		mutex_lock(&reader->mutex);
+		reader->batch = (arg == LOGGER_READ_BATCH);
+		mutex_unlock(&reader->mutex);
+		ret = 0;
+		break;
+	case LOGGER_SET_READ_SEQ:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		/*
+		 * The mmap header only carries the low 32 bits of the sequence
+		 * numbers; extend 'arg' relative to the write head.
+		 */
+		reader = file->private_data;
+		mutex_lock(&reader->mutex);
+		reader->r_seq = ACCESS_ONCE(log->w_seq);
+		reader->r_seq -= (u32) ((u32) reader->r_seq - (u32) arg);
+		logger_reader_avail(log, reader);
+		mutex_unlock(&reader->mutex);
 		ret = 0;
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
-
 	return ret;
 }
 
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the header page followed by the ring, read-only, so that collectors
+ * can drain the log without copying; see struct logger_mmap_header.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_log *log = file_get_log(file);
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	if (vma->vm_pgoff || size > PAGE_SIZE + log->size)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_vmalloc_range(vma, log->hdr, 0);
+}
+
 static const struct file_operations logger_fops = {
 	.owner = THIS_MODULE,
 	.read = logger_read,
@@ -528,6 +634,7 @@ static const struct file_operations logger_fops = {
 	.poll = logger_poll,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
+	.mmap = logger_mmap,
 	.open = logger_open,
 	.release = logger_release,
 };
@@ -535,12 +642,11 @@ static const struct file_operations logger_fops = {
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
  * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * LONG_MAX minus LOGGER_ENTRY_MAX_LEN. It must also be at least PAGE_SIZE, as
+ * the buffer is mapped into collectors by logger_mmap().
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -548,9 +654,8 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
-	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
-	.w_off = 0, \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
+	.w_seq = 0, \
 	.head = 0, \
 	.size = SIZE, \
 };
@@ -573,14 +678,34 @@ static struct logger_log *get_log_from_minor(int minor)
 	return NULL;
 }
 
+/*
+ * The header page and the ring are allocated together with vmalloc_user(),
+ * which zeroes them and allows logger_mmap() to hand them to userspace with
+ * remap_vmalloc_range(); the logger may be a module, so nothing static or in
+ * the linear map is involved.
+ */
 static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	log->hdr = vmalloc_user(PAGE_SIZE + log->size);
+	if (unlikely(!log->hdr)) {
+		printk(KERN_ERR "logger: failed to allocate buffer "
+		       "for log '%s'!\n", log->misc.name);
+		return -ENOMEM;
+	}
+	log->hdr->version = LOGGER_MMAP_VERSION;
+	log->hdr->data_offset = PAGE_SIZE;
+	log->hdr->size = log->size;
+	log->buffer = (unsigned char *)log->hdr + PAGE_SIZE;
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
+		vfree(log->hdr);
+		log->hdr = NULL;
+		log->buffer = NULL;
 		return ret;
 	}
 
@@ -30,6 +30,29 @@ struct logger_entry {
 	char		msg[0];	/* the entry's payload */
 };
 
+/*
+ * struct logger_mmap_header - first page of a read-only mmap() of a log
+ *
+ * The ring itself follows at 'data_offset' bytes into the mapping. Positions
+ * are free-running byte sequence numbers; the entry at sequence number 'seq'
+ * starts at byte (seq & (size - 1)) of the ring and may wrap around its end.
+ * To drain the log, read 'w_seq', issue a read barrier, copy out the entries
+ * from the last position up to 'w_seq', issue another read barrier and check
+ * that (__s32) (position - head) is not negative. If it is, the writers
+ * lapped the collector while it was copying and it restarts from 'head'.
+ * Collectors report the position they drained up to with LOGGER_SET_READ_SEQ,
+ * so that poll() only wakes them up again for new entries.
+ */
+struct logger_mmap_header {
+	__u32		version;	/* LOGGER_MMAP_VERSION */
+	__u32		data_offset;	/* offset of the ring in the mapping */
+	__u32		size;		/* size of the ring, a power of two */
+	__u32		head;		/* sequence number of the oldest entry */
+	__u32		w_seq;		/* sequence number of the write head */
+};
+
+#define LOGGER_MMAP_VERSION	1
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -45,5 +68,11 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_SET_READ_MODE		_IO(__LOGGERIO, 5) /* read() mode */
+#define LOGGER_SET_READ_SEQ		_IO(__LOGGERIO, 6) /* mmap read pos */
+
+/* read() modes, the argument of LOGGER_SET_READ_MODE */
+#define LOGGER_READ_ENTRY	0	/* exactly one entry per read() */
+#define LOGGER_READ_BATCH	1	/* as many entries as fit per read() */
 
 #endif /* _LINUX_LOGGER_H */
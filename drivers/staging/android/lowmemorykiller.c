@@ -16,6 +16,17 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Rather than walking the task list on every shrinker call, the driver keeps
+ * the thread groups indexed by oom_adj and sorted by RSS, updated from the
+ * oom_adj notifier on fork, exit and oom_adj writes. A group's RSS is sampled
+ * at those events, so the victim is the group that was largest when last
+ * indexed; its current RSS is read again for the kill. Kills are further
+ * gated by reclaim pressure,
+ * sampled vmpressure-style once per 'pressure_window' pages the shrinker is
+ * asked to scan: below 'pressure_medium' percent no process is killed, and at
+ * 'pressure_critical' percent or above the next lower adj level is used.
+ * Setting 'pressure_medium' to 0 turns the gating off.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +46,12 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/vmstat.h>
+
+#define CREATE_TRACE_POINTS
+#include "trace/lowmemorykiller.h"
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -52,6 +69,10 @@ static size_t lowmem_minfree[6] = {
 };
 static int lowmem_minfree_size = 4;
 
+static uint32_t lowmem_pressure_window = 512;
+static uint32_t lowmem_pressure_medium = 60;
+static uint32_t lowmem_pressure_critical = 95;
+
 static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
 
@@ -61,6 +82,133 @@ static unsigned long lowmem_deathpending_timeout;
 			printk(x);			\
 	} while (0)
 
+/*
+ * The candidate index: one rbtree of signal_structs per oom_adj value, sorted
+ * by the RSS sampled when each was indexed, so the largest is the last node.
+ * Only thread groups with an mm are indexed. lowmem_index_lock also protects
+ * the kill latency state below.
+ */
+#define LOWMEM_ADJ_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+
+static struct rb_root lowmem_buckets[LOWMEM_ADJ_BUCKETS];
+static DEFINE_SPINLOCK(lowmem_index_lock);
+
+static struct signal_struct *lowmem_killed_signal;
+static ktime_t lowmem_killed_time;
+
+/* Reclaim pressure window, protected by lowmem_pressure_lock */
+static DEFINE_SPINLOCK(lowmem_pressure_lock);
+static unsigned long lowmem_window_scanned;
+static unsigned long lowmem_last_scan;
+static unsigned long lowmem_last_steal;
+static int lowmem_pressure_level = -1;
+
+static inline int lowmem_bucket(int adj)
+{
+	return clamp(adj, OOM_DISABLE, OOM_ADJUST_MAX) - OOM_DISABLE;
+}
+
+/* Returns the RSS of the thread group of 'task', 0 once no thread has an mm */
+static unsigned long lowmem_task_rss(struct task_struct *task)
+{
+	struct task_struct *p;
+	unsigned long rss = 0;
+
+	rcu_read_lock();
+	p = find_lock_task_mm(task);
+	if (p) {
+		rss = get_mm_rss(p->mm);
+		task_unlock(p);
+	}
+	rcu_read_unlock();
+	return rss;
+}
+
+static inline int lowmem_indexed(struct signal_struct *sig)
+{
+	return !RB_EMPTY_NODE(&sig->lowmem_node);
+}
+
+/* Caller must hold lowmem_index_lock. */
+static void lowmem_index_add(struct signal_struct *sig, unsigned long rss)
+{
+	struct rb_root *root = &lowmem_buckets[lowmem_bucket(sig->oom_adj)];
+	struct rb_node **p = &root->rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*p) {
+		parent = *p;
+		if (rss < rb_entry(parent, struct signal_struct,
+				   lowmem_node)->lowmem_rss)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+
+	sig->lowmem_adj = sig->oom_adj;
+	sig->lowmem_rss = rss;
+	rb_link_node(&sig->lowmem_node, parent, p);
+	rb_insert_color(&sig->lowmem_node, root);
+}
+
+/* Caller must hold lowmem_index_lock. */
+static void lowmem_index_del(struct signal_struct *sig)
+{
+	rb_erase(&sig->lowmem_node,
+		 &lowmem_buckets[lowmem_bucket(sig->lowmem_adj)]);
+	RB_CLEAR_NODE(&sig->lowmem_node);
+}
+
+static int
+oom_adj_notify_func(struct notifier_block *self, unsigned long val, void *data)
+{
+	struct task_struct *task = data;
+	struct signal_struct *sig = task->signal;
+	unsigned long rss = 0;
+	int indexed;
+
+	if (val != OOM_ADJ_NOTIFY_EXIT)
+		rss = lowmem_task_rss(task);
+
+	spin_lock(&lowmem_index_lock);
+	indexed = lowmem_indexed(sig);
+
+	switch (val) {
+	case OOM_ADJ_NOTIFY_FORK:
+		/* lowmem_index_init() may have beaten us to it */
+		if (!indexed && task->mm)
+			lowmem_index_add(sig, rss);
+		break;
+	case OOM_ADJ_NOTIFY_CHANGE:
+		/*
+		 * A group that already went through OOM_ADJ_NOTIFY_EXIT has
+		 * no live threads left and must not be indexed again.
+		 */
+		if (indexed)
+			lowmem_index_del(sig);
+		if (indexed || (task->mm && atomic_read(&sig->live)))
+			lowmem_index_add(sig, rss);
+		break;
+	case OOM_ADJ_NOTIFY_EXIT:
+		if (indexed)
+			lowmem_index_del(sig);
+		if (sig == lowmem_killed_signal) {
+			trace_lowmemory_kill_done(task,
+				ktime_us_delta(ktime_get(), lowmem_killed_time));
+			lowmem_killed_signal = NULL;
+		}
+		break;
+	}
+
+	spin_unlock(&lowmem_index_lock);
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block oom_adj_nb = {
+	.notifier_call	= oom_adj_notify_func,
+};
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data);
 
@@ -79,16 +227,123 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	return NOTIFY_OK;
 }
 
-static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+#ifdef CONFIG_VM_EVENT_COUNTERS
+static unsigned long lowmem_sum_zone_events(enum vm_event_item normal)
+{
+	enum vm_event_item first = normal - ZONE_NORMAL;
+	unsigned long sum = 0;
+	int cpu, i;
+
+	for_each_online_cpu(cpu) {
+		struct vm_event_state *this = &per_cpu(vm_event_states, cpu);
+
+		for (i = 0; i < MAX_NR_ZONES; i++)
+			sum += this->event[first + i];
+	}
+
+	return sum;
+}
+#endif
+
+/*
+ * lowmem_pressure - returns the reclaim pressure of the last window closed,
+ * possibly by the 'nr_to_scan' pages just requested from us, as the
+ * percentage of scanned pages that reclaim failed to free, or -1 if no
+ * window has closed yet. Without vm event counters every window reports
+ * medium pressure.
+ */
+static int lowmem_pressure(int nr_to_scan)
+{
+	unsigned long scan = 0, steal = 0;
+	int pressure;
+
+	spin_lock(&lowmem_pressure_lock);
+
+	lowmem_window_scanned += nr_to_scan;
+	if (lowmem_window_scanned < lowmem_pressure_window) {
+		pressure = lowmem_pressure_level;
+		spin_unlock(&lowmem_pressure_lock);
+		return pressure;
+	}
+	lowmem_window_scanned = 0;
+
+#ifdef CONFIG_VM_EVENT_COUNTERS
+	scan = lowmem_sum_zone_events(PGSCAN_KSWAPD_NORMAL) +
+	       lowmem_sum_zone_events(PGSCAN_DIRECT_NORMAL);
+	steal = lowmem_sum_zone_events(PGSTEAL_NORMAL);
+	scan -= lowmem_last_scan;
+	steal -= lowmem_last_steal;
+	lowmem_last_scan += scan;
+	lowmem_last_steal += steal;
+
+	if (!scan)
+		pressure = 0;
+	else
+		pressure = 100 - (min(steal, scan) * 100) / scan;
+#else
+	pressure = lowmem_pressure_medium;
+#endif
+	lowmem_pressure_level = pressure;
+
+	spin_unlock(&lowmem_pressure_lock);
+
+	lowmem_print(4, "lowmem_pressure scan %lu, steal %lu, pressure %d\n",
+		     scan, steal, pressure);
+
+	return pressure;
+}
+
+/*
+ * lowmem_select - picks the largest process in the highest non-empty oom_adj
+ * bucket at or above 'min_adj', as of when it was last indexed. Returns it
+ * with a reference held, and its current RSS in 'size'.
+ */
+static struct task_struct *lowmem_select(int min_adj, int *adj, int *size)
 {
-	struct task_struct *p;
 	struct task_struct *selected = NULL;
+	struct rb_node *node;
+	int bucket;
+
+	spin_lock(&lowmem_index_lock);
+	rcu_read_lock();
+	for (bucket = LOWMEM_ADJ_BUCKETS - 1;
+	     bucket >= lowmem_bucket(min_adj) && !selected; bucket--) {
+		/* only a group whose leader already went is skipped */
+		for (node = rb_last(&lowmem_buckets[bucket]);
+		     node && !selected; node = rb_prev(node)) {
+			struct signal_struct *sig = rb_entry(node,
+				struct signal_struct, lowmem_node);
+
+			selected = pid_task(sig->leader_pid, PIDTYPE_PID);
+			*adj = sig->lowmem_adj;
+		}
+	}
+	if (selected) {
+		get_task_struct(selected);
+		lowmem_killed_signal = selected->signal;
+		lowmem_killed_time = ktime_get();
+	}
+	rcu_read_unlock();
+	spin_unlock(&lowmem_index_lock);
+
+	if (!selected)
+		return NULL;
+
+	*size = lowmem_task_rss(selected);
+	lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+		     selected->pid, selected->comm, *adj, *size);
+	return selected;
+}
+
+static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+{
+	struct task_struct *selected;
 	int rem = 0;
-	int tasksize;
 	int i;
 	int min_adj = OOM_ADJUST_MAX + 1;
-	int selected_tasksize = 0;
+	int selected_tasksize;
 	int selected_oom_adj;
+	int pressure;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
@@ -129,55 +384,36 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 			     nr_to_scan, gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
+	pressure = -1;
+	if (lowmem_pressure_medium)
+		pressure = lowmem_pressure(nr_to_scan);
+	if (pressure >= 0 && pressure < (int) lowmem_pressure_medium) {
+		lowmem_print(5, "lowmem_shrink %d, %x, pressure %d, "
+			     "return %d\n", nr_to_scan, gfp_mask, pressure,
+			     rem);
+		return rem;
 	}
+	if (pressure >= (int) lowmem_pressure_critical && i > 0)
+		min_adj = lowmem_adj[i - 1];
+
+	selected = lowmem_select(min_adj, &selected_oom_adj,
+				 &selected_tasksize);
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
 			     selected_oom_adj, selected_tasksize);
+		trace_lowmemory_kill(selected, selected_oom_adj,
+				     selected_tasksize, min_adj, pressure,
+				     other_free, other_file);
 		lowmem_deathpending = selected;
 		lowmem_deathpending_timeout = jiffies + HZ;
 		force_sig(SIGKILL, selected);
+		put_task_struct(selected);
 		rem -= selected_tasksize;
 	}
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
@@ -186,8 +422,33 @@ static struct shrinker lowmem_shrinker = {
 	.seeks = DEFAULT_SEEKS * 16
 };
 
+/*
+ * Index the thread groups that already exist. The notifier is registered
+ * first, under tasklist_lock, so that no fork or exit is missed in between.
+ */
+static void __init lowmem_index_init(void)
+{
+	struct task_struct *p;
+	int i;
+
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+		lowmem_buckets[i] = RB_ROOT;
+
+	read_lock(&tasklist_lock);
+	register_oom_adj_notifier(&oom_adj_nb);
+	spin_lock(&lowmem_index_lock);
+	for_each_process(p) {
+		if (p->mm && atomic_read(&p->signal->live) &&
+		    !lowmem_indexed(p->signal))
+			lowmem_index_add(p->signal, lowmem_task_rss(p));
+	}
+	spin_unlock(&lowmem_index_lock);
+	read_unlock(&tasklist_lock);
+}
+
 static int __init lowmem_init(void)
 {
+	lowmem_index_init();
 	task_free_register(&task_nb);
 	register_shrinker(&lowmem_shrinker);
 	return 0;
@@ -197,6 +458,7 @@ static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
 	task_free_unregister(&task_nb);
+	unregister_oom_adj_notifier(&oom_adj_nb);
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
@@ -205,6 +467,13 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(pressure_window, lowmem_pressure_window, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_medium, lowmem_pressure_medium, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_critical, lowmem_pressure_critical, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure, lowmem_pressure_level, int, S_IRUGO);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
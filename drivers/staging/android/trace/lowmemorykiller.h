@@ -0,0 +1,72 @@
+#undef TRACE_SYSTEM
+#define TRACE_INCLUDE_PATH ../../drivers/staging/android/trace
+#define TRACE_SYSTEM lowmemorykiller
+
+#if !defined(_TRACE_LOWMEMORYKILLER_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_LOWMEMORYKILLER_H
+
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(lowmemory_kill,
+
+	TP_PROTO(struct task_struct *killed_task, int adj, int tasksize,
+		 int min_adj, int pressure, int other_free, int other_file),
+
+	TP_ARGS(killed_task, adj, tasksize, min_adj, pressure,
+		other_free, other_file),
+
+	TP_STRUCT__entry(
+		__array(	char,	comm,	TASK_COMM_LEN	)
+		__field(	pid_t,	pid			)
+		__field(	int,	adj			)
+		__field(	int,	tasksize		)
+		__field(	int,	min_adj			)
+		__field(	int,	pressure		)
+		__field(	int,	other_free		)
+		__field(	int,	other_file		)
+	),
+
+	TP_fast_assign(
+		memcpy(__entry->comm, killed_task->comm, TASK_COMM_LEN);
+		__entry->pid		= killed_task->pid;
+		__entry->adj		= adj;
+		__entry->tasksize	= tasksize;
+		__entry->min_adj	= min_adj;
+		__entry->pressure	= pressure;
+		__entry->other_free	= other_free;
+		__entry->other_file	= other_file;
+	),
+
+	TP_printk("%s pid=%d adj=%d size=%d min_adj=%d pressure=%d free=%d file=%d",
+		__entry->comm, __entry->pid, __entry->adj, __entry->tasksize,
+		__entry->min_adj, __entry->pressure, __entry->other_free,
+		__entry->other_file)
+);
+
+TRACE_EVENT(lowmemory_kill_done,
+
+	TP_PROTO(struct task_struct *task, s64 latency_us),
+
+	TP_ARGS(task, latency_us),
+
+	TP_STRUCT__entry(
+		__array(	char,	comm,	TASK_COMM_LEN	)
+		__field(	pid_t,	tgid			)
+		__field(	s64,	latency_us		)
+	),
+
+	TP_fast_assign(
+		memcpy(__entry->comm, task->comm, TASK_COMM_LEN);
+		__entry->tgid		= task->tgid;
+		__entry->latency_us	= latency_us;
+	),
+
+	TP_printk("%s tgid=%d latency=%lldus",
+		__entry->comm, __entry->tgid, __entry->latency_us)
+);
+
+#endif /* _TRACE_LOWMEMORYKILLER_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
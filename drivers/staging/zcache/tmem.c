@@ -25,6 +25,7 @@
  */
 
 #include <linux/list.h>
+#include <linux/rcupdate.h>
 #include <linux/spinlock.h>
 #include <linux/atomic.h>
 
@@ -69,7 +70,7 @@ void tmem_register_pamops(struct tmem_pamops *m)
  * Each hashbucket also has a lock to manage concurrent access.
  *
  * The following routines manage tmem_objs.  When any tmem_obj is accessed,
- * the hashbucket lock must be held.
+ * the hashbucket lock must be held, except by tmem_obj_find_rcu().
  */
 
 /* searches for object==oid in pool, returns locked object if found */
@@ -99,6 +100,60 @@ out:
 	return obj;
 }
 
+/* an rbtree of N objs is never deeper than 2*log2(N+1) */
+#define TMEM_OBJ_MAX_DEPTH	(2 * BITS_PER_LONG)
+
+/*
+ * Lockless search used by gets, which on a cleancache workload mostly
+ * miss.  Must be called under rcu_read_lock().  The rbtree code does not
+ * support walking a tree that is being rebalanced, so the result is only
+ * trusted if hb->seq shows that no insert or erase ran during the walk,
+ * and the walk is bounded in case it wandered into a loop.  Returns true
+ * with *objp set (NULL for a definite miss) if the walk was clean, false
+ * if the caller must search again under the hashbucket lock.  An obj
+ * found here may be freed at any time and must be revalidated with
+ * tmem_obj_live() once the lock is held.
+ */
+static bool tmem_obj_find_rcu(struct tmem_hashbucket *hb,
+				struct tmem_oid *oidp, struct tmem_obj **objp)
+{
+	struct rb_node *rbnode;
+	struct tmem_obj *obj = NULL;
+	unsigned seq;
+	int depth = 0;
+
+	seq = read_seqcount_begin(&hb->seq);
+	rbnode = rcu_dereference(hb->obj_rb_root.rb_node);
+	while (rbnode) {
+		if (++depth > TMEM_OBJ_MAX_DEPTH)
+			return false;
+		obj = rb_entry(rbnode, struct tmem_obj, rb_tree_node);
+		switch (tmem_oid_compare(oidp, &obj->oid)) {
+		case 0: /* equal */
+			goto out;
+		case -1:
+			rbnode = rcu_dereference(rbnode->rb_left);
+			break;
+		case 1:
+			rbnode = rcu_dereference(rbnode->rb_right);
+			break;
+		}
+	}
+	obj = NULL;
+out:
+	if (read_seqcount_retry(&hb->seq, seq))
+		return false;
+	*objp = obj;
+	return true;
+}
+
+/* with the hashbucket lock held, is obj still the live object for oid? */
+static inline bool tmem_obj_live(struct tmem_obj *obj, struct tmem_pool *pool,
+					struct tmem_oid *oidp)
+{
+	return obj->pool == pool && tmem_oid_compare(&obj->oid, oidp) == 0;
+}
+
 static void tmem_pampd_destroy_all_in_obj(struct tmem_obj *);
 
 /* free an object that has no more pampds in it */
@@ -118,9 +173,11 @@ static void tmem_obj_free(struct tmem_obj *obj, struct tmem_hashbucket *hb)
 	atomic_dec(&pool->obj_count);
 	BUG_ON(atomic_read(&pool->obj_count) < 0);
 	INVERT_SENTINEL(obj, OBJ);
+	write_seqcount_begin(&hb->seq);
 	obj->pool = NULL;
 	tmem_oid_set_invalid(&obj->oid);
 	rb_erase(&obj->rb_tree_node, &hb->obj_rb_root);
+	write_seqcount_end(&hb->seq);
 }
 
 /*
@@ -138,11 +195,13 @@ static void tmem_obj_init(struct tmem_obj *obj, struct tmem_hashbucket *hb,
 	atomic_inc(&pool->obj_count);
 	obj->objnode_tree_height = 0;
 	obj->objnode_tree_root = NULL;
-	obj->pool = pool;
-	obj->oid = *oidp;
 	obj->objnode_count = 0;
 	obj->pampd_count = 0;
 	SET_SENTINEL(obj, OBJ);
+	/* obj may be a recycled one that a lockless search is looking at */
+	write_seqcount_begin(&hb->seq);
+	obj->pool = pool;
+	obj->oid = *oidp;
 	while (*new) {
 		BUG_ON(RB_EMPTY_NODE(*new));
 		this = rb_entry(*new, struct tmem_obj, rb_tree_node);
@@ -161,6 +220,7 @@ static void tmem_obj_init(struct tmem_obj *obj, struct tmem_hashbucket *hb,
 	}
 	rb_link_node(&obj->rb_tree_node, parent, new);
 	rb_insert_color(&obj->rb_tree_node, root);
+	write_seqcount_end(&hb->seq);
 }
 
 /*
@@ -571,20 +631,31 @@ out:
  * That is, if a get is done with a certain handle and fails, any
  * subsequent "get" must also fail (unless of course there is a
  * "put" done with the same handle).
-
+ *
+ * The obj is looked up without the hashbucket lock so that misses, the
+ * common case for cleancache, never touch it.
  */
 int tmem_get(struct tmem_pool *pool, struct tmem_oid *oidp,
 				uint32_t index, struct page *page)
 {
-	struct tmem_obj *obj;
+	struct tmem_obj *obj = NULL;
 	void *pampd;
 	bool ephemeral = is_ephemeral(pool);
 	uint32_t ret = -1;
 	struct tmem_hashbucket *hb;
+	bool clean;
 
 	hb = &pool->hashbucket[tmem_oid_hash(oidp)];
+	rcu_read_lock();
+	clean = tmem_obj_find_rcu(hb, oidp, &obj);
+	if (clean && obj == NULL) {
+		rcu_read_unlock();
+		return ret;
+	}
 	spin_lock(&hb->lock);
-	obj = tmem_obj_find(hb, oidp);
+	if (!clean || !tmem_obj_live(obj, pool, oidp))
+		obj = tmem_obj_find(hb, oidp);
+	rcu_read_unlock();
 	if (obj == NULL)
 		goto out;
 	ephemeral = is_ephemeral(pool);
@@ -700,6 +771,7 @@ void tmem_new_pool(struct tmem_pool *pool, uint32_t flags)
 	for (i = 0; i < TMEM_HASH_BUCKETS; i++, hb++) {
 		hb->obj_rb_root = RB_ROOT;
 		spin_lock_init(&hb->lock);
+		seqcount_init(&hb->seq);
 	}
 	INIT_LIST_HEAD(&pool->pool_list);
 	atomic_set(&pool->obj_count, 0);
@@ -12,6 +12,8 @@
 #include <linux/types.h>
 #include <linux/highmem.h>
 #include <linux/hash.h>
+#include <linux/rbtree.h>
+#include <linux/seqlock.h>
 #include <linux/atomic.h>
 
 /*
@@ -54,7 +56,9 @@
  * usually corresponds to a large independent set of pages such as
  * a filesystem.  Each pool has an id, and certain attributes and counters.
  * It also contains a set of hash buckets, each of which contains an rbtree
- * of objects and a lock to manage concurrency within the pool.
+ * of objects and a lock to manage concurrency within the pool.  The
+ * seqcount is bumped, under the lock, around every insert into and erase
+ * from the rbtree so that gets can search it without the lock.
  */
 
 #define TMEM_HASH_BUCKET_BITS	8
@@ -63,6 +67,7 @@
 struct tmem_hashbucket {
 	struct rb_root obj_rb_root;
 	spinlock_t lock;
+	seqcount_t seq;
 };
 
 struct tmem_pool {
@@ -173,7 +178,12 @@ struct tmem_pamops {
 };
 extern void tmem_register_pamops(struct tmem_pamops *m);
 
-/* memory allocation methods provided by the host implementation */
+/*
+ * memory allocation methods provided by the host implementation; tmem_objs
+ * are looked up locklessly, so obj_free must not let the memory be reused
+ * as anything other than a tmem_obj before an RCU grace period has passed
+ * (e.g. use a SLAB_DESTROY_BY_RCU cache)
+ */
 struct tmem_hostops {
 	struct tmem_obj *(*obj_alloc)(struct tmem_pool *);
 	void (*obj_free)(struct tmem_obj *, struct tmem_pool *);
@@ -64,6 +64,12 @@
  * (3) one of PAGE_SIZE/64 "unbuddied" lists indexed by how many chunks
  * the one unbuddied zbud uses.  The data inside a zbpg cannot be
  * read or written unless the zbpg's lock is held.
+ *
+ * The unused and unbuddied lists are per-cpu, each cpu's set under its
+ * own lock, and zbpg->cpu records whose lists a zbpg is on.  A zbpg that
+ * is freed (or loses a buddy) goes on the lists of the cpu that freed
+ * it; a cpu looking for a buddy or a page searches its own lists first
+ * and only then steals from the other cpus' lists.
  */
 
 #define ZBH_SENTINEL  0x43214321
@@ -82,6 +88,7 @@ struct zbud_hdr {
 struct zbud_page {
 	struct list_head bud_list;
 	spinlock_t lock;
+	int cpu; /* whose unused/unbuddied list, protected by lock */
 	struct zbud_hdr buddy[ZBUD_MAX_BUDS];
 	DECL_SENTINEL
 	/* followed by NUM_CHUNK aligned CHUNK_SIZE-byte chunks */
@@ -94,25 +101,27 @@ struct zbud_page {
 				CHUNK_MASK) >> CHUNK_SHIFT)
 #define MAX_CHUNK	(NCHUNKS-1)
 
-static struct {
-	struct list_head list;
-	unsigned count;
-} zbud_unbuddied[NCHUNKS];
-/* list N contains pages with N chunks USED and NCHUNKS-N unused */
-/* element 0 is never used but optimizing that isn't worth it */
+struct zbud_cpu_lists {
+	/* protects this cpu's unbuddied lists and unused page list */
+	spinlock_t lock;
+	struct {
+		struct list_head list;
+		unsigned count;
+	} unbuddied[NCHUNKS];
+	/* list N contains pages with N chunks USED and NCHUNKS-N unused */
+	/* element 0 is never used but optimizing that isn't worth it */
+	struct list_head unused;
+	unsigned unused_count;
+};
+static DEFINE_PER_CPU(struct zbud_cpu_lists, zbud_cpu_lists);
+
 static unsigned long zbud_cumul_chunk_counts[NCHUNKS];
 
 struct list_head zbud_buddied_list;
 static unsigned long zcache_zbud_buddied_count;
 
-/* protects the buddied list and all unbuddied lists */
-static DEFINE_SPINLOCK(zbud_budlists_spinlock);
-
-static LIST_HEAD(zbpg_unused_list);
-static unsigned long zcache_zbpg_unused_list_count;
-
-/* protects the unused page list */
-static DEFINE_SPINLOCK(zbpg_unused_list_spinlock);
+/* protects the buddied list */
+static DEFINE_SPINLOCK(zbud_buddied_spinlock);
 
 static atomic_t zcache_zbud_curr_raw_pages;
 static atomic_t zcache_zbud_curr_zpages;
@@ -120,6 +129,7 @@ static unsigned long zcache_zbud_curr_zbytes;
 static unsigned long zcache_zbud_cumul_zpages;
 static unsigned long zcache_zbud_cumul_zbytes;
 static unsigned long zcache_compress_poor;
+static unsigned long zcache_zbud_steals;
 
 /* forward references */
 static void *zcache_get_free_page(void);
@@ -180,29 +190,56 @@ static char *zbud_data(struct zbud_hdr *zh, unsigned size)
  * zbud raw page management
  */
 
-static struct zbud_page *zbud_alloc_raw_page(void)
+/* take a zbpg off cpu's unused list, or NULL if it is empty */
+static struct zbud_page *zbud_take_unused(int cpu, bool wait)
 {
+	struct zbud_cpu_lists *zl = &per_cpu(zbud_cpu_lists, cpu);
 	struct zbud_page *zbpg = NULL;
-	struct zbud_hdr *zh0, *zh1;
-	bool recycled = 0;
 
-	/* if any pages on the zbpg list, use one */
-	spin_lock(&zbpg_unused_list_spinlock);
-	if (!list_empty(&zbpg_unused_list)) {
-		zbpg = list_first_entry(&zbpg_unused_list,
+	if (list_empty(&zl->unused))
+		goto out;
+	if (wait)
+		spin_lock(&zl->lock);
+	else if (!spin_trylock(&zl->lock))
+		goto out;
+	if (!list_empty(&zl->unused)) {
+		zbpg = list_first_entry(&zl->unused,
 				struct zbud_page, bud_list);
 		list_del_init(&zbpg->bud_list);
-		zcache_zbpg_unused_list_count--;
-		recycled = 1;
+		zl->unused_count--;
 	}
-	spin_unlock(&zbpg_unused_list_spinlock);
+	spin_unlock(&zl->lock);
+out:
+	return zbpg;
+}
+
+static struct zbud_page *zbud_alloc_raw_page(void)
+{
+	struct zbud_page *zbpg = NULL;
+	struct zbud_hdr *zh0, *zh1;
+	bool recycled = 0;
+	int this_cpu = smp_processor_id(), cpu;
+
+	/* if any pages on a zbpg list, use one, preferably our own */
+	zbpg = zbud_take_unused(this_cpu, true);
 	if (zbpg == NULL)
+		for_each_possible_cpu(cpu) {
+			if (cpu == this_cpu)
+				continue;
+			zbpg = zbud_take_unused(cpu, false);
+			if (zbpg != NULL)
+				break;
+		}
+	if (zbpg != NULL)
+		recycled = 1;
+	else
 		/* none on zbpg list, try to get a kernel page */
 		zbpg = zcache_get_free_page();
 	if (likely(zbpg != NULL)) {
 		INIT_LIST_HEAD(&zbpg->bud_list);
 		zh0 = &zbpg->buddy[0]; zh1 = &zbpg->buddy[1];
 		spin_lock_init(&zbpg->lock);
+		zbpg->cpu = this_cpu;
 		if (recycled) {
 			ASSERT_INVERTED_SENTINEL(zbpg, ZBPG);
 			SET_SENTINEL(zbpg, ZBPG);
@@ -223,6 +260,7 @@ static struct zbud_page *zbud_alloc_raw_page(void)
 static void zbud_free_raw_page(struct zbud_page *zbpg)
 {
 	struct zbud_hdr *zh0 = &zbpg->buddy[0], *zh1 = &zbpg->buddy[1];
+	struct zbud_cpu_lists *zl;
 
 	ASSERT_SENTINEL(zbpg, ZBPG);
 	BUG_ON(!list_empty(&zbpg->bud_list));
@@ -231,10 +269,11 @@ static void zbud_free_raw_page(struct zbud_page *zbpg)
 	BUG_ON(zh1->size != 0 || tmem_oid_valid(&zh1->oid));
 	INVERT_SENTINEL(zbpg, ZBPG);
 	spin_unlock(&zbpg->lock);
-	spin_lock(&zbpg_unused_list_spinlock);
-	list_add(&zbpg->bud_list, &zbpg_unused_list);
-	zcache_zbpg_unused_list_count++;
-	spin_unlock(&zbpg_unused_list_spinlock);
+	zl = &per_cpu(zbud_cpu_lists, smp_processor_id());
+	spin_lock(&zl->lock);
+	list_add(&zbpg->bud_list, &zl->unused);
+	zl->unused_count++;
+	spin_unlock(&zl->lock);
 }
 
 /*
@@ -264,6 +303,7 @@ static void zbud_free_and_delist(struct zbud_hdr *zh)
 	unsigned budnum = zbud_budnum(zh), size;
 	struct zbud_page *zbpg =
 		container_of(zh, struct zbud_page, buddy[budnum]);
+	struct zbud_cpu_lists *zl;
 
 	spin_lock(&zbpg->lock);
 	if (list_empty(&zbpg->bud_list)) {
@@ -276,47 +316,84 @@ static void zbud_free_and_delist(struct zbud_hdr *zh)
 	zh_other = &zbpg->buddy[(budnum == 0) ? 1 : 0];
 	if (zh_other->size == 0) { /* was unbuddied: unlist and free */
 		chunks = zbud_size_to_chunks(size) ;
-		spin_lock(&zbud_budlists_spinlock);
-		BUG_ON(list_empty(&zbud_unbuddied[chunks].list));
+		zl = &per_cpu(zbud_cpu_lists, zbpg->cpu);
+		spin_lock(&zl->lock);
+		BUG_ON(list_empty(&zl->unbuddied[chunks].list));
 		list_del_init(&zbpg->bud_list);
-		zbud_unbuddied[chunks].count--;
-		spin_unlock(&zbud_budlists_spinlock);
+		zl->unbuddied[chunks].count--;
+		spin_unlock(&zl->lock);
 		zbud_free_raw_page(zbpg);
-	} else { /* was buddied: move remaining buddy to unbuddied list */
+	} else { /* was buddied: move remaining buddy to our unbuddied list */
 		chunks = zbud_size_to_chunks(zh_other->size) ;
-		spin_lock(&zbud_budlists_spinlock);
+		spin_lock(&zbud_buddied_spinlock);
 		list_del_init(&zbpg->bud_list);
 		zcache_zbud_buddied_count--;
-		list_add_tail(&zbpg->bud_list, &zbud_unbuddied[chunks].list);
-		zbud_unbuddied[chunks].count++;
-		spin_unlock(&zbud_budlists_spinlock);
+		spin_unlock(&zbud_buddied_spinlock);
+		zbpg->cpu = smp_processor_id();
+		zl = &per_cpu(zbud_cpu_lists, zbpg->cpu);
+		spin_lock(&zl->lock);
+		list_add_tail(&zbpg->bud_list, &zl->unbuddied[chunks].list);
+		zl->unbuddied[chunks].count++;
+		spin_unlock(&zl->lock);
 		spin_unlock(&zbpg->lock);
 	}
 }
 
+/*
+ * Find a zbpg on one of cpu's unbuddied lists with room for nchunks more
+ * chunks and return it locked and delisted, or NULL.  Other cpus' lists
+ * are only trylocked: stealing is not worth waiting for.
+ */
+static struct zbud_page *zbud_find_buddy(int cpu, unsigned nchunks,
+						bool wait)
+{
+	struct zbud_cpu_lists *zl = &per_cpu(zbud_cpu_lists, cpu);
+	struct zbud_page *zbpg;
+	int i;
+
+	for (i = MAX_CHUNK - nchunks + 1; i > 0; i--) {
+		if (list_empty(&zl->unbuddied[i].list))
+			continue;
+		if (wait)
+			spin_lock(&zl->lock);
+		else if (!spin_trylock(&zl->lock))
+			break;
+		list_for_each_entry(zbpg, &zl->unbuddied[i].list, bud_list) {
+			if (spin_trylock(&zbpg->lock)) {
+				list_del_init(&zbpg->bud_list);
+				zl->unbuddied[i].count--;
+				spin_unlock(&zl->lock);
+				return zbpg;
+			}
+		}
+		spin_unlock(&zl->lock);
+	}
+	return NULL;
+}
+
 static struct zbud_hdr *zbud_create(uint32_t pool_id, struct tmem_oid *oid,
 					uint32_t index, struct page *page,
 					void *cdata, unsigned size)
 {
 	struct zbud_hdr *zh0, *zh1, *zh = NULL;
-	struct zbud_page *zbpg = NULL, *ztmp;
+	struct zbud_page *zbpg = NULL;
+	struct zbud_cpu_lists *zl;
 	unsigned nchunks;
 	char *to;
-	int i, found_good_buddy = 0;
+	int this_cpu = smp_processor_id(), cpu;
 
 	nchunks = zbud_size_to_chunks(size) ;
-	for (i = MAX_CHUNK - nchunks + 1; i > 0; i--) {
-		spin_lock(&zbud_budlists_spinlock);
-		if (!list_empty(&zbud_unbuddied[i].list)) {
-			list_for_each_entry_safe(zbpg, ztmp,
-				    &zbud_unbuddied[i].list, bud_list) {
-				if (spin_trylock(&zbpg->lock)) {
-					found_good_buddy = i;
-					goto found_unbuddied;
-				}
-			}
+	zbpg = zbud_find_buddy(this_cpu, nchunks, true);
+	if (zbpg != NULL)
+		goto found_unbuddied;
+	for_each_possible_cpu(cpu) {
+		if (cpu == this_cpu)
+			continue;
+		zbpg = zbud_find_buddy(cpu, nchunks, false);
+		if (zbpg != NULL) {
+			zcache_zbud_steals++;
+			goto found_unbuddied;
 		}
-		spin_unlock(&zbud_budlists_spinlock);
 	}
 	/* didn't find a good buddy, try allocating a new page */
 	zbpg = zbud_alloc_raw_page();
@@ -324,9 +401,11 @@ static struct zbud_hdr *zbud_create(uint32_t pool_id, struct tmem_oid *oid,
 		goto out;
 	/* ok, have a page, now compress the data before taking locks */
 	spin_lock(&zbpg->lock);
-	spin_lock(&zbud_budlists_spinlock);
-	list_add_tail(&zbpg->bud_list, &zbud_unbuddied[nchunks].list);
-	zbud_unbuddied[nchunks].count++;
+	zl = &per_cpu(zbud_cpu_lists, zbpg->cpu);
+	spin_lock(&zl->lock);
+	list_add_tail(&zbpg->bud_list, &zl->unbuddied[nchunks].list);
+	zl->unbuddied[nchunks].count++;
+	spin_unlock(&zl->lock);
 	zh = &zbpg->buddy[0];
 	goto init_zh;
 
@@ -342,10 +421,10 @@ found_unbuddied:
 		zh = zh0;
 	} else
 		BUG();
-	list_del_init(&zbpg->bud_list);
-	zbud_unbuddied[found_good_buddy].count--;
+	spin_lock(&zbud_buddied_spinlock);
 	list_add_tail(&zbpg->bud_list, &zbud_buddied_list);
 	zcache_zbud_buddied_count++;
+	spin_unlock(&zbud_buddied_spinlock);
 
 init_zh:
 	SET_SENTINEL(zh, ZBH);
@@ -353,8 +432,6 @@ init_zh:
 	zh->index = index;
 	zh->oid = *oid;
 	zh->pool_id = pool_id;
-	/* can wait to copy the data until the list locks are dropped */
-	spin_unlock(&zbud_budlists_spinlock);
 
 	to = zbud_data(zh, size);
 	memcpy(to, cdata, size);
@@ -456,58 +533,66 @@ static void zbud_evict_zbpg(struct zbud_page *zbpg)
  */
 static void zbud_evict_pages(int nr)
 {
+	struct zbud_cpu_lists *zl;
 	struct zbud_page *zbpg;
-	int i;
+	int i, cpu;
 
-	/* first try freeing any pages on unused list */
+	/* first try freeing any pages on unused lists */
+	for_each_possible_cpu(cpu) {
+		zl = &per_cpu(zbud_cpu_lists, cpu);
 retry_unused_list:
-	spin_lock_bh(&zbpg_unused_list_spinlock);
-	if (!list_empty(&zbpg_unused_list)) {
-		/* can't walk list here, since it may change when unlocked */
-		zbpg = list_first_entry(&zbpg_unused_list,
-				struct zbud_page, bud_list);
-		list_del_init(&zbpg->bud_list);
-		zcache_zbpg_unused_list_count--;
-		atomic_dec(&zcache_zbud_curr_raw_pages);
-		spin_unlock_bh(&zbpg_unused_list_spinlock);
-		zcache_free_page(zbpg);
-		zcache_evicted_raw_pages++;
-		if (--nr <= 0)
-			goto out;
-		goto retry_unused_list;
+		spin_lock_bh(&zl->lock);
+		if (!list_empty(&zl->unused)) {
+			/* can't walk list, it may change when unlocked */
+			zbpg = list_first_entry(&zl->unused,
+					struct zbud_page, bud_list);
+			list_del_init(&zbpg->bud_list);
+			zl->unused_count--;
+			atomic_dec(&zcache_zbud_curr_raw_pages);
+			spin_unlock_bh(&zl->lock);
+			zcache_free_page(zbpg);
+			zcache_evicted_raw_pages++;
+			if (--nr <= 0)
+				goto out;
+			goto retry_unused_list;
+		}
+		spin_unlock_bh(&zl->lock);
 	}
-	spin_unlock_bh(&zbpg_unused_list_spinlock);
 
 	/* now try freeing unbuddied pages, starting with least space avail */
 	for (i = 0; i < MAX_CHUNK; i++) {
+		for_each_possible_cpu(cpu) {
+			zl = &per_cpu(zbud_cpu_lists, cpu);
 retry_unbud_list_i:
-		spin_lock_bh(&zbud_budlists_spinlock);
-		if (list_empty(&zbud_unbuddied[i].list)) {
-			spin_unlock_bh(&zbud_budlists_spinlock);
-			continue;
-		}
-		list_for_each_entry(zbpg, &zbud_unbuddied[i].list, bud_list) {
-			if (unlikely(!spin_trylock(&zbpg->lock)))
+			spin_lock_bh(&zl->lock);
+			if (list_empty(&zl->unbuddied[i].list)) {
+				spin_unlock_bh(&zl->lock);
 				continue;
-			list_del_init(&zbpg->bud_list);
-			zbud_unbuddied[i].count--;
-			spin_unlock(&zbud_budlists_spinlock);
-			zcache_evicted_unbuddied_pages++;
-			/* want budlists unlocked when doing zbpg eviction */
-			zbud_evict_zbpg(zbpg);
-			local_bh_enable();
-			if (--nr <= 0)
-				goto out;
-			goto retry_unbud_list_i;
+			}
+			list_for_each_entry(zbpg, &zl->unbuddied[i].list,
+						bud_list) {
+				if (unlikely(!spin_trylock(&zbpg->lock)))
+					continue;
+				list_del_init(&zbpg->bud_list);
+				zl->unbuddied[i].count--;
+				spin_unlock(&zl->lock);
+				zcache_evicted_unbuddied_pages++;
+				/* want lists unlocked when doing zbpg eviction */
+				zbud_evict_zbpg(zbpg);
+				local_bh_enable();
+				if (--nr <= 0)
+					goto out;
+				goto retry_unbud_list_i;
+			}
+			spin_unlock_bh(&zl->lock);
 		}
-		spin_unlock_bh(&zbud_budlists_spinlock);
 	}
 
 	/* as a last resort, free buddied pages */
 retry_bud_list:
-	spin_lock_bh(&zbud_budlists_spinlock);
+	spin_lock_bh(&zbud_buddied_spinlock);
 	if (list_empty(&zbud_buddied_list)) {
-		spin_unlock_bh(&zbud_budlists_spinlock);
+		spin_unlock_bh(&zbud_buddied_spinlock);
 		goto out;
 	}
 	list_for_each_entry(zbpg, &zbud_buddied_list, bud_list) {
@@ -515,7 +600,7 @@ retry_bud_list:
 			continue;
 		list_del_init(&zbpg->bud_list);
 		zcache_zbud_buddied_count--;
-		spin_unlock(&zbud_budlists_spinlock);
+		spin_unlock(&zbud_buddied_spinlock);
 		zcache_evicted_buddied_pages++;
 		/* want budlists unlocked when doing zbpg eviction */
 		zbud_evict_zbpg(zbpg);
@@ -524,20 +609,27 @@ retry_bud_list:
 			goto out;
 		goto retry_bud_list;
 	}
-	spin_unlock_bh(&zbud_budlists_spinlock);
+	spin_unlock_bh(&zbud_buddied_spinlock);
 out:
 	return;
 }
 
 static void zbud_init(void)
 {
-	int i;
+	struct zbud_cpu_lists *zl;
+	int i, cpu;
 
 	INIT_LIST_HEAD(&zbud_buddied_list);
 	zcache_zbud_buddied_count = 0;
-	for (i = 0; i < NCHUNKS; i++) {
-		INIT_LIST_HEAD(&zbud_unbuddied[i].list);
-		zbud_unbuddied[i].count = 0;
+	for_each_possible_cpu(cpu) {
+		zl = &per_cpu(zbud_cpu_lists, cpu);
+		spin_lock_init(&zl->lock);
+		for (i = 0; i < NCHUNKS; i++) {
+			INIT_LIST_HEAD(&zl->unbuddied[i].list);
+			zl->unbuddied[i].count = 0;
+		}
+		INIT_LIST_HEAD(&zl->unused);
+		zl->unused_count = 0;
 	}
 }
 
@@ -547,17 +639,37 @@ static void zbud_init(void)
  * currently (and have ever been placed) in each unbuddied list.  It's fun
  * to watch but can probably go away before final merge.
  */
+static unsigned zbud_unbuddied_count(int i)
+{
+	unsigned count = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		count += per_cpu(zbud_cpu_lists, cpu).unbuddied[i].count;
+	return count;
+}
+
 static int zbud_show_unbuddied_list_counts(char *buf)
 {
 	int i;
 	char *p = buf;
 
 	for (i = 0; i < NCHUNKS - 1; i++)
-		p += sprintf(p, "%u ", zbud_unbuddied[i].count);
-	p += sprintf(p, "%d\n", zbud_unbuddied[i].count);
+		p += sprintf(p, "%u ", zbud_unbuddied_count(i));
+	p += sprintf(p, "%u\n", zbud_unbuddied_count(i));
 	return p - buf;
 }
 
+static int zbud_show_unused_list_count(char *buf)
+{
+	unsigned long count = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		count += per_cpu(zbud_cpu_lists, cpu).unused_count;
+	return sprintf(buf, "%lu\n", count);
+}
+
 static int zbud_show_cumul_chunk_counts(char *buf)
 {
 	unsigned long i, chunks = 0, total_chunks = 0, sum_total_chunks = 0;
@@ -1112,7 +1224,7 @@ ZCACHE_SYSFS_RO(zbud_curr_zbytes);
 ZCACHE_SYSFS_RO(zbud_cumul_zpages);
 ZCACHE_SYSFS_RO(zbud_cumul_zbytes);
 ZCACHE_SYSFS_RO(zbud_buddied_count);
-ZCACHE_SYSFS_RO(zbpg_unused_list_count);
+ZCACHE_SYSFS_RO(zbud_steals);
 ZCACHE_SYSFS_RO(evicted_raw_pages);
 ZCACHE_SYSFS_RO(evicted_unbuddied_pages);
 ZCACHE_SYSFS_RO(evicted_buddied_pages);
@@ -1130,6 +1242,8 @@ ZCACHE_SYSFS_RO_CUSTOM(zbud_unbuddied_list_counts,
 			zbud_show_unbuddied_list_counts);
 ZCACHE_SYSFS_RO_CUSTOM(zbud_cumul_chunk_counts,
 			zbud_show_cumul_chunk_counts);
+ZCACHE_SYSFS_RO_CUSTOM(zbpg_unused_list_count,
+			zbud_show_unused_list_count);
 
 static struct attribute *zcache_attrs[] = {
 	&zcache_curr_obj_count_attr.attr,
@@ -1150,6 +1264,7 @@ static struct attribute *zcache_attrs[] = {
 	&zcache_zbud_cumul_zbytes_attr.attr,
 	&zcache_zbud_buddied_count_attr.attr,
 	&zcache_zbpg_unused_list_count_attr.attr,
+	&zcache_zbud_steals_attr.attr,
 	&zcache_evicted_raw_pages_attr.attr,
 	&zcache_evicted_unbuddied_pages_attr.attr,
 	&zcache_evicted_buddied_pages_attr.attr,
@@ -1619,8 +1734,10 @@ static int __init zcache_init(void)
 	}
 	zcache_objnode_cache = kmem_cache_create("zcache_objnode",
 				sizeof(struct tmem_objnode), 0, 0, NULL);
+	/* tmem looks objs up locklessly, see struct tmem_hostops */
 	zcache_obj_cache = kmem_cache_create("zcache_obj",
-				sizeof(struct tmem_obj), 0, 0, NULL);
+				sizeof(struct tmem_obj), 0,
+				SLAB_DESTROY_BY_RCU, NULL);
 #endif
 #ifdef CONFIG_CLEANCACHE
 	if (zcache_enabled && use_cleancache) {
@@ -25,13 +25,22 @@
 #include <linux/bitops.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/completion.h>
 #include <linux/device.h>
+#include <linux/fs.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/jiffies.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
+#include <linux/crypto.h>
+#include <linux/err.h>
+#include <linux/sched.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
 
@@ -42,14 +51,17 @@ struct zram *devices;
 /* Module params (documentation at end) */
 unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
+/* Shared objects of devices with dedup enabled */
+static struct kmem_cache *zram_entry_cache;
+
+static void zram_stat_inc(atomic_t *v)
 {
-	*v = *v + 1;
+	atomic_inc(v);
 }
 
-static void zram_stat_dec(u32 *v)
+static void zram_stat_dec(atomic_t *v)
 {
-	*v = *v - 1;
+	atomic_dec(v);
 }
 
 static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
@@ -71,6 +83,11 @@ static void zram_stat64_inc(struct zram *zram, u64 *v)
 	zram_stat64_add(zram, v, 1);
 }
 
+static spinlock_t *zram_table_lock(struct zram *zram, u32 index)
+{
+	return &zram->table_lock[index & (ZRAM_TABLE_LOCKS - 1)];
+}
+
 static int zram_test_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
@@ -89,18 +106,19 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
 			return 0;
 	}
 
+	*element = page[0];
 	return 1;
 }
 
@@ -133,56 +151,370 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+static u32 zram_dedup_checksum(void *user_mem)
+{
+	return jhash2(user_mem, PAGE_SIZE / sizeof(u32), 0);
+}
+
+static struct hlist_head *zram_dedup_bucket(struct zram *zram, u32 checksum)
+{
+	return &zram->dedup_hash[checksum & zram->dedup_mask];
+}
+
+static spinlock_t *zram_dedup_lock(struct zram *zram, u32 checksum)
+{
+	return &zram->dedup_lock[checksum & (ZRAM_TABLE_LOCKS - 1)];
+}
+
+/*
+ * zram_dedup_find - look up an object identical to the page just
+ * compressed into 'strm', or 'page' itself if it is stored uncompressed
+ *
+ * Identical pages compress to identical objects, so candidates are
+ * compared in compressed form. Returns the entry with a reference taken,
+ * or NULL.
+ */
+static struct zram_entry *zram_dedup_find(struct zram *zram,
+		struct zram_strm *strm, struct page *page, u32 checksum,
+		size_t clen, u8 flags)
+{
+	int same;
+	struct zram_entry *entry, *found = NULL;
+	struct hlist_node *pos;
+	unsigned char *cmem, *src;
+	spinlock_t *lock = zram_dedup_lock(zram, checksum);
+
+	spin_lock(lock);
+	hlist_for_each_entry(entry, pos, zram_dedup_bucket(zram, checksum),
+			     node) {
+		if (entry->checksum != checksum || entry->size != clen ||
+		    entry->flags != flags)
+			continue;
+
+		cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+		if (flags) {
+			src = kmap_atomic(page, KM_USER0);
+			same = !memcmp(cmem, src, clen);
+			kunmap_atomic(src, KM_USER0);
+		} else {
+			same = !memcmp(cmem, strm->buffer, clen);
+		}
+		zs_unmap_object(zram->mem_pool, entry->handle);
+
+		if (same) {
+			entry->refcount++;
+			found = entry;
+			break;
+		}
+	}
+	spin_unlock(lock);
+
+	return found;
+}
+
+static void zram_dedup_insert(struct zram *zram, struct zram_entry *entry)
+{
+	spinlock_t *lock = zram_dedup_lock(zram, entry->checksum);
+
+	spin_lock(lock);
+	hlist_add_head(&entry->node, zram_dedup_bucket(zram, entry->checksum));
+	spin_unlock(lock);
+	zram_stat_inc(&zram->stats.dedup_entries);
+}
+
+/*
+ * Drop a reference to a shared object. Returns 1 if it was the last one
+ * and the object has been freed.
+ */
+static int zram_dedup_put(struct zram *zram, struct zram_entry *entry)
+{
+	int last;
+	spinlock_t *lock = zram_dedup_lock(zram, entry->checksum);
+
+	spin_lock(lock);
+	last = !--entry->refcount;
+	if (last)
+		hlist_del(&entry->node);
+	spin_unlock(lock);
+
+	if (!last)
+		return 0;
+
+	zs_free(zram->mem_pool, entry->handle);
+	kmem_cache_free(zram_entry_cache, entry);
+	zram_stat_dec(&zram->stats.dedup_entries);
+	return 1;
+}
+
+/* zsmalloc handle of a stored page, caller holds its table lock */
+static unsigned long zram_obj_handle(struct zram *zram, u32 index)
+{
+	if (zram_test_flag(zram, index, ZRAM_DEDUP))
+		return ((struct zram_entry *)zram->table[index].handle)->handle;
+
+	return zram->table[index].handle;
+}
+
+/* Seconds since boot, for slot idle ages */
+static u32 zram_now(void)
+{
+	return (u32)div_u64(get_jiffies_64(), HZ);
+}
+
+/*
+ * Backing device blocks are page sized; block 0 is never used so that a
+ * block number can be told apart from "none". Blocks are handed out
+ * next-fit. A block is counted once for the slot that owns it and once
+ * for every read of it in flight, and only goes back to the bitmap when
+ * the count drops to zero, so a slot overwritten while it is being read
+ * cannot have its old block rewritten under the read.
+ */
+static unsigned long zram_alloc_bdev_block(struct zram *zram)
+{
+	unsigned long blk, flags;
+
+	spin_lock_irqsave(&zram->wb_lock, flags);
+	blk = find_next_zero_bit(zram->bd_bitmap, zram->bd_nr_pages,
+				 zram->bd_cursor);
+	if (blk >= zram->bd_nr_pages)
+		blk = find_next_zero_bit(zram->bd_bitmap, zram->bd_nr_pages, 1);
+	if (blk < zram->bd_nr_pages) {
+		__set_bit(blk, zram->bd_bitmap);
+		zram->bd_refs[blk] = 1;
+		zram->bd_cursor = blk + 1;
+	} else {
+		blk = 0;
+	}
+	spin_unlock_irqrestore(&zram->wb_lock, flags);
+
+	return blk;
+}
+
+/* Caller holds the table lock of the slot that owns 'blk' */
+static void zram_get_bdev_block(struct zram *zram, unsigned long blk)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&zram->wb_lock, flags);
+	zram->bd_refs[blk]++;
+	spin_unlock_irqrestore(&zram->wb_lock, flags);
+}
+
+static void zram_put_bdev_block(struct zram *zram, unsigned long blk)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&zram->wb_lock, flags);
+	if (!--zram->bd_refs[blk])
+		__clear_bit(blk, zram->bd_bitmap);
+	spin_unlock_irqrestore(&zram->wb_lock, flags);
+}
+
+/*
+ * Reads from the backing device cannot wait for completion in the
+ * make_request path, since bios submitted there are only issued after it
+ * returns. The original bio completes when the last one has finished,
+ * and only then are the blocks read let go of.
+ */
+struct zram_read_ctx {
+	struct zram *zram;
+	struct bio *parent;
+	atomic_t pending;
+	int error;
+	unsigned short nr_blks;
+	unsigned long blks[0];
+};
+
+static void zram_read_ctx_put(struct zram_read_ctx *ctx, int error)
+{
+	int i;
+
+	if (error)
+		ctx->error = error;
+
+	if (!atomic_dec_and_test(&ctx->pending))
+		return;
+
+	for (i = 0; i < ctx->nr_blks; i++)
+		zram_put_bdev_block(ctx->zram, ctx->blks[i]);
+
+	if (ctx->error) {
+		bio_io_error(ctx->parent);
+	} else {
+		set_bit(BIO_UPTODATE, &ctx->parent->bi_flags);
+		bio_endio(ctx->parent, 0);
+	}
+	kfree(ctx);
+}
+
+static void zram_bdev_read_end_io(struct bio *bio, int error)
+{
+	struct zram_read_ctx *ctx = bio->bi_private;
+
+	if (!error && !test_bit(BIO_UPTODATE, &bio->bi_flags))
+		error = -EIO;
+	if (!error)
+		flush_dcache_page(bio->bi_io_vec[0].bv_page);
+
+	bio_put(bio);
+	zram_read_ctx_put(ctx, error);
+}
+
+/*
+ * Issue the read of 'blk', on which the caller took a reference; it is
+ * dropped when the parent bio completes, or at once if the read cannot be
+ * issued.
+ */
+static int zram_bdev_read(struct zram *zram, struct page *page,
+			  unsigned long blk, struct bio *parent,
+			  struct zram_read_ctx **ctxp)
+{
+	struct bio *bio;
+	struct zram_read_ctx *ctx = *ctxp;
+
+	if (!ctx) {
+		ctx = kmalloc(sizeof(*ctx) + parent->bi_vcnt *
+			      sizeof(ctx->blks[0]), GFP_NOIO);
+		if (!ctx) {
+			zram_put_bdev_block(zram, blk);
+			return -ENOMEM;
+		}
+		ctx->zram = zram;
+		ctx->parent = parent;
+		ctx->error = 0;
+		ctx->nr_blks = 0;
+		/* dropped by zram_read once all pages are issued */
+		atomic_set(&ctx->pending, 1);
+		*ctxp = ctx;
+	}
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio) {
+		zram_put_bdev_block(zram, blk);
+		return -ENOMEM;
+	}
+	ctx->blks[ctx->nr_blks++] = blk;
+
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = blk << SECTORS_PER_PAGE_SHIFT;
+	bio_add_page(bio, page, PAGE_SIZE, 0);
+	bio->bi_end_io = zram_bdev_read_end_io;
+	bio->bi_private = ctx;
+
+	atomic_inc(&ctx->pending);
+	zram_stat64_inc(zram, &zram->stats.bd_reads);
+	submit_bio(READ, bio);
+
+	return 0;
+}
+
+static void zram_bdev_write_end_io(struct bio *bio, int error)
+{
+	complete(bio->bi_private);
+}
+
+static int zram_bdev_write(struct zram *zram, struct page *page,
+			   unsigned long blk)
+{
+	int ret;
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = blk << SECTORS_PER_PAGE_SHIFT;
+	bio_add_page(bio, page, PAGE_SIZE, 0);
+	bio->bi_end_io = zram_bdev_write_end_io;
+	bio->bi_private = &done;
+
+	submit_bio(WRITE, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+/*
+ * Caller must hold the table lock of 'index'.
+ */
 static void zram_free_page(struct zram *zram, size_t index)
 {
-	u32 clen;
-	void *obj;
+	unsigned long handle = zram->table[index].handle;
+	u32 clen = zram->table[index].size;
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	/* tell a writeback in progress that the slot changed */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
 
-	if (unlikely(!page)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
+	/*
+	 * No memory is allocated for same filled pages.
+	 * Simply clear same page flag.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		if (!handle)
 			zram_stat_dec(&zram->stats.pages_zero);
-		}
+		zram_stat_dec(&zram->stats.pages_same);
+		zram->table[index].handle = 0;
 		return;
 	}
 
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		clen = PAGE_SIZE;
-		__free_page(page);
-		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_dec(&zram->stats.pages_expand);
+	if (unlikely(!handle))
+		return;
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_put_bdev_block(zram, handle);
+		zram_stat_dec(&zram->stats.bd_count);
+		zram_stat_dec(&zram->stats.pages_stored);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		zram_clear_flag(zram, index, ZRAM_DEDUP);
+		if (!zram_dedup_put(zram, (struct zram_entry *)handle)) {
+			/* the object lives on for other pages */
+			zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
+			zram_stat_dec(&zram->stats.pages_dup);
+			zram_stat64_sub(zram, &zram->stats.dup_size, clen);
+			zram_stat_dec(&zram->stats.pages_stored);
+			goto out;
+		}
+	} else {
+		zs_free(zram->mem_pool, handle);
+	}
 
-	xv_free(zram->mem_pool, page, offset);
-	if (clen <= PAGE_SIZE / 2)
+	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
+		zram_stat_dec(&zram->stats.pages_expand);
+	} else if (clen <= PAGE_SIZE / 2) {
 		zram_stat_dec(&zram->stats.good_compress);
+	}
 
-out:
 	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+out:
+	zram->table[index].handle = 0;
+	zram->table[index].size = 0;
 }
 
-static void handle_zero_page(struct page *page)
+static void handle_same_page(struct page *page, unsigned long element)
 {
-	void *user_mem;
+	unsigned int pos;
+	unsigned long *user_mem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	memset(user_mem, 0, PAGE_SIZE);
+	if (!element) {
+		memset(user_mem, 0, PAGE_SIZE);
+	} else {
+		for (pos = 0; pos != PAGE_SIZE / sizeof(*user_mem); pos++)
+			user_mem[pos] = element;
+	}
 	kunmap_atomic(user_mem, KM_USER0);
 
 	flush_dcache_page(page);
@@ -191,144 +523,231 @@ static void handle_zero_page(struct page *page)
 static void handle_uncompressed_page(struct zram *zram,
 				struct page *page, u32 index)
 {
+	unsigned long handle = zram_obj_handle(zram, index);
 	unsigned char *user_mem, *cmem;
 
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-			zram->table[index].offset;
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
-	kunmap_atomic(cmem, KM_USER1);
+	zs_unmap_object(zram->mem_pool, handle);
 
 	flush_dcache_page(page);
 }
 
-static void zram_read(struct zram *zram, struct bio *bio)
+/*
+ * zram_compress - compress one page into this CPU's stream buffer
+ *
+ * Must be called with the stream pinned by get_cpu_ptr().
+ */
+static int zram_compress(struct zram_strm *strm, struct page *page,
+			 size_t *clen)
 {
+	int ret;
+	u64 start;
+	unsigned int dlen = ZRAM_STRM_BUF_SIZE;
+	unsigned char *user_mem;
 
-	int i;
-	u32 index;
-	struct bio_vec *bvec;
+	start = local_clock();
+	user_mem = kmap_atomic(page, KM_USER0);
+	ret = crypto_comp_compress(strm->tfm, user_mem, PAGE_SIZE,
+				   strm->buffer, &dlen);
+	kunmap_atomic(user_mem, KM_USER0);
 
-	zram_stat64_inc(zram, &zram->stats.num_reads);
-	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+	strm->stats.comp_ns += local_clock() - start;
+	if (!ret) {
+		strm->stats.comp_pages++;
+		strm->stats.comp_bytes += dlen;
+	}
 
-	bio_for_each_segment(bvec, bio, i) {
-		int ret;
-		size_t clen;
-		struct page *page;
-		struct zobj_header *zheader;
-		unsigned char *user_mem, *cmem;
+	*clen = dlen;
+	return ret;
+}
 
-		page = bvec->bv_page;
+static int zram_decompress(struct zram *zram, unsigned char *cmem,
+			   size_t clen, struct page *page)
+{
+	int ret;
+	u64 start;
+	unsigned int dlen = PAGE_SIZE;
+	struct zram_strm *strm;
+	unsigned char *user_mem;
 
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			handle_zero_page(page);
-			index++;
-			continue;
-		}
+	strm = get_cpu_ptr(zram->strm);
+	start = local_clock();
+	user_mem = kmap_atomic(page, KM_USER0);
+	ret = crypto_comp_decompress(strm->tfm, cmem, clen, user_mem, &dlen);
+	kunmap_atomic(user_mem, KM_USER0);
 
-		/* Requested page is not present in compressed area */
-		if (unlikely(!zram->table[index].page)) {
-			pr_debug("Read before write: sector=%lu, size=%u",
-				(ulong)(bio->bi_sector), bio->bi_size);
-			handle_zero_page(page);
-			index++;
-			continue;
-		}
+	strm->stats.decomp_ns += local_clock() - start;
+	strm->stats.decomp_pages++;
+	put_cpu_ptr(zram->strm);
 
-		/* Page is stored uncompressed since it's incompressible */
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-			handle_uncompressed_page(zram, page, index);
-			index++;
-			continue;
-		}
+	if (!ret && dlen != PAGE_SIZE)
+		ret = -EINVAL;
+	return ret;
+}
 
-		user_mem = kmap_atomic(page, KM_USER0);
-		clen = PAGE_SIZE;
+/*
+ * Fill 'page' with the data of a slot kept in memory. Caller holds the
+ * table lock of 'index'.
+ */
+static int zram_read_obj(struct zram *zram, u32 index, struct page *page)
+{
+	int ret;
+	unsigned long handle;
+	unsigned char *cmem;
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		handle_same_page(page, zram->table[index].handle);
+		return 0;
+	}
 
-		ret = lzo1x_decompress_safe(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			user_mem, &clen);
+	/* Page is stored uncompressed since it's incompressible */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		handle_uncompressed_page(zram, page, index);
+		return 0;
+	}
 
-		kunmap_atomic(user_mem, KM_USER0);
-		kunmap_atomic(cmem, KM_USER1);
+	handle = zram_obj_handle(zram, index);
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+	ret = zram_decompress(zram, cmem, zram->table[index].size, page);
+	zs_unmap_object(zram->mem_pool, handle);
+
+	/* Should NEVER happen. Return bio error if it does. */
+	if (unlikely(ret)) {
+		pr_err("Decompression failed! err=%d, page=%u\n",
+			ret, index);
+		zram_stat64_inc(zram, &zram->stats.failed_reads);
+		return -EIO;
+	}
 
-		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != LZO_E_OK)) {
-			pr_err("Decompression failed! err=%d, page=%u\n",
-				ret, index);
-			zram_stat64_inc(zram, &zram->stats.failed_reads);
-			goto out;
-		}
+	flush_dcache_page(page);
+	return 0;
+}
 
-		flush_dcache_page(page);
-		index++;
+static int zram_bvec_read(struct zram *zram, struct page *page, u32 index,
+			  struct bio *bio, struct zram_read_ctx **ctx)
+{
+	int ret;
+	unsigned long blk;
+	spinlock_t *lock = zram_table_lock(zram, index);
+
+	spin_lock(lock);
+
+	/* Requested page is not present in compressed area */
+	if (unlikely(!zram->table[index].handle &&
+		     !zram_test_flag(zram, index, ZRAM_SAME))) {
+		spin_unlock(lock);
+		pr_debug("Read before write: sector=%lu, size=%u",
+			(ulong)(bio->bi_sector), bio->bi_size);
+		handle_same_page(page, 0);
+		return 0;
 	}
 
-	set_bit(BIO_UPTODATE, &bio->bi_flags);
-	bio_endio(bio, 0);
-	return;
+	zram->table[index].ac_time = zram_now();
 
-out:
-	bio_io_error(bio);
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		blk = zram->table[index].handle;
+		/* an overwrite must not free the block under the read */
+		zram_get_bdev_block(zram, blk);
+		spin_unlock(lock);
+		return zram_bdev_read(zram, page, blk, bio, ctx);
+	}
+
+	ret = zram_read_obj(zram, index, page);
+	spin_unlock(lock);
+
+	return ret;
 }
 
-static void zram_write(struct zram *zram, struct bio *bio)
+static void zram_read(struct zram *zram, struct bio *bio)
 {
+
 	int i;
 	u32 index;
 	struct bio_vec *bvec;
+	struct zram_read_ctx *ctx = NULL;
 
-	zram_stat64_inc(zram, &zram->stats.num_writes);
+	zram_stat64_inc(zram, &zram->stats.num_reads);
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
 	bio_for_each_segment(bvec, bio, i) {
-		int ret;
-		u32 offset;
-		size_t clen;
-		struct zobj_header *zheader;
-		struct page *page, *page_store;
-		unsigned char *user_mem, *cmem, *src;
-
-		page = bvec->bv_page;
-		src = zram->compress_buffer;
+		if (zram_bvec_read(zram, bvec->bv_page, index, bio, &ctx))
+			goto out;
+		index++;
+	}
 
-		/*
-		 * System overwrites unused sectors. Free memory associated
-		 * with this sector now.
-		 */
-		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
-			zram_free_page(zram, index);
+	/* pages read from the backing device complete the bio */
+	if (ctx) {
+		zram_read_ctx_put(ctx, 0);
+		return;
+	}
 
-		mutex_lock(&zram->lock);
+	set_bit(BIO_UPTODATE, &bio->bi_flags);
+	bio_endio(bio, 0);
+	return;
 
-		user_mem = kmap_atomic(page, KM_USER0);
-		if (page_zero_filled(user_mem)) {
-			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
-			zram_stat_inc(&zram->stats.pages_zero);
-			zram_set_flag(zram, index, ZRAM_ZERO);
-			index++;
-			continue;
-		}
+out:
+	if (ctx) {
+		zram_read_ctx_put(ctx, -EIO);
+		return;
+	}
+	bio_io_error(bio);
+}
 
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
+/*
+ * zram_bvec_write - compress and store one page
+ *
+ * Compression runs on this CPU's stream, so writers on different CPUs do not
+ * serialize. The object is allocated without sleeping while the stream is
+ * held; if that fails the stream is released for a blocking allocation and
+ * the page compressed again on whichever CPU we then run on. Only replacing
+ * the table entry happens under its table lock.
+ *
+ * Pages repeating a single word are recorded in the table without any
+ * allocation. With dedup enabled, a page identical to one already stored
+ * takes a reference to that object instead of storing its own.
+ */
+static int zram_bvec_write(struct zram *zram, struct page *page, u32 index)
+{
+	int ret;
+	size_t clen, alloc_len = 0;
+	u8 flags;
+	u32 checksum = 0;
+	struct zram_strm *strm;
+	struct zram_entry *entry;
+	unsigned long handle = 0, element;
+	unsigned char *user_mem, *cmem;
+	spinlock_t *lock = zram_table_lock(zram, index);
 
+	user_mem = kmap_atomic(page, KM_USER0);
+	if (page_same_filled(user_mem, &element)) {
 		kunmap_atomic(user_mem, KM_USER0);
+		spin_lock(lock);
+		zram_free_page(zram, index);
+		zram_set_flag(zram, index, ZRAM_SAME);
+		zram->table[index].handle = element;
+		zram->table[index].ac_time = zram_now();
+		spin_unlock(lock);
+		if (!element)
+			zram_stat_inc(&zram->stats.pages_zero);
+		zram_stat_inc(&zram->stats.pages_same);
+		return 0;
+	}
+	if (zram->dedup)
+		checksum = zram_dedup_checksum(user_mem);
+	kunmap_atomic(user_mem, KM_USER0);
 
-		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
+	strm = get_cpu_ptr(zram->strm);
+	for (;;) {
+		ret = zram_compress(strm, page, &clen);
+		if (unlikely(ret)) {
+			put_cpu_ptr(zram->strm);
 			pr_err("Compression failed! err=%d\n", ret);
-			zram_stat64_inc(zram, &zram->stats.failed_writes);
-			goto out;
+			ret = -EIO;
+			goto out_free;
 		}
 
 		/*
@@ -336,64 +755,135 @@ static void zram_write(struct zram *zram, struct bio *bio)
 		 * since we do not want to return too many disk write
 		 * errors which has side effect of hanging the system.
 		 */
+		flags = 0;
 		if (unlikely(clen > max_zpage_size)) {
 			clen = PAGE_SIZE;
-			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
-			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
-				pr_info("Error allocating memory for "
-					"incompressible page: %u\n", index);
-				zram_stat64_inc(zram,
-					&zram->stats.failed_writes);
-				goto out;
+			flags = BIT(ZRAM_UNCOMPRESSED);
+		}
+
+		if (zram->dedup && !handle) {
+			entry = zram_dedup_find(zram, strm, page, checksum,
+						clen, flags);
+			if (entry) {
+				put_cpu_ptr(zram->strm);
+				goto found_dup;
 			}
+		}
 
-			offset = 0;
-			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
-			src = kmap_atomic(page, KM_USER0);
-			goto memstore;
+		/* the page may have changed since a blocking allocation */
+		if (handle && clen <= alloc_len)
+			break;
+		if (handle) {
+			zs_free(zram->mem_pool, handle);
+			handle = 0;
 		}
 
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
-				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
+		handle = zs_malloc(zram->mem_pool, clen,
+				GFP_NOWAIT | __GFP_NOWARN | __GFP_HIGHMEM);
+		if (handle) {
+			alloc_len = clen;
+			break;
+		}
+
+		put_cpu_ptr(zram->strm);
+		handle = zs_malloc(zram->mem_pool, clen,
+				GFP_NOIO | __GFP_HIGHMEM);
+		if (!handle) {
 			pr_info("Error allocating memory for compressed "
 				"page: %u, size=%zu\n", index, clen);
-			zram_stat64_inc(zram, &zram->stats.failed_writes);
+			ret = -ENOMEM;
 			goto out;
 		}
+		alloc_len = clen;
+		strm = get_cpu_ptr(zram->strm);
+	}
 
-memstore:
-		zram->table[index].offset = offset;
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
+	if (unlikely(flags)) {
+		user_mem = kmap_atomic(page, KM_USER0);
+		memcpy(cmem, user_mem, PAGE_SIZE);
+		kunmap_atomic(user_mem, KM_USER0);
+	} else {
+		memcpy(cmem, strm->buffer, clen);
+	}
+	zs_unmap_object(zram->mem_pool, handle);
+	put_cpu_ptr(zram->strm);
+
+	/* Make the object shareable; without memory it just stays private */
+	if (zram->dedup) {
+		entry = kmem_cache_alloc(zram_entry_cache,
+					 GFP_NOIO | __GFP_NOWARN);
+		if (entry) {
+			entry->handle = handle;
+			entry->checksum = checksum;
+			entry->size = clen;
+			entry->flags = flags;
+			entry->refcount = 1;
+			zram_dedup_insert(zram, entry);
+
+			handle = (unsigned long)entry;
+			flags |= BIT(ZRAM_DEDUP);
+		}
+	}
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+	/*
+	 * System overwrites unused sectors. Free memory associated
+	 * with this sector now.
+	 */
+	spin_lock(lock);
+	zram_free_page(zram, index);
+	zram->table[index].handle = handle;
+	zram->table[index].size = clen;
+	zram->table[index].flags |= flags;
+	zram->table[index].ac_time = zram_now();
+	spin_unlock(lock);
+
+	flags &= ~BIT(ZRAM_DEDUP);
+
+	/* Update stats */
+	zram_stat64_add(zram, &zram->stats.compr_size, clen);
+	zram_stat_inc(&zram->stats.pages_stored);
+	if (flags)
+		zram_stat_inc(&zram->stats.pages_expand);
+	else if (clen <= PAGE_SIZE / 2)
+		zram_stat_inc(&zram->stats.good_compress);
 
-#if 0
-		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-			zheader = (struct zobj_header *)cmem;
-			zheader->table_idx = index;
-			cmem += sizeof(*zheader);
-		}
-#endif
+	return 0;
 
-		memcpy(cmem, src, clen);
+found_dup:
+	spin_lock(lock);
+	zram_free_page(zram, index);
+	zram->table[index].handle = (unsigned long)entry;
+	zram->table[index].size = clen;
+	zram->table[index].flags |= flags | BIT(ZRAM_DEDUP);
+	zram->table[index].ac_time = zram_now();
+	spin_unlock(lock);
 
-		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			kunmap_atomic(src, KM_USER0);
+	zram_stat64_add(zram, &zram->stats.dup_size, clen);
+	zram_stat_inc(&zram->stats.pages_stored);
+	zram_stat_inc(&zram->stats.pages_dup);
+
+	return 0;
+
+out_free:
+	zs_free(zram->mem_pool, handle);
+out:
+	zram_stat64_inc(zram, &zram->stats.failed_writes);
+	return ret;
+}
 
-		/* Update stats */
-		zram_stat64_add(zram, &zram->stats.compr_size, clen);
-		zram_stat_inc(&zram->stats.pages_stored);
-		if (clen <= PAGE_SIZE / 2)
-			zram_stat_inc(&zram->stats.good_compress);
+static void zram_write(struct zram *zram, struct bio *bio)
+{
+	int i;
+	u32 index;
+	struct bio_vec *bvec;
 
-		mutex_unlock(&zram->lock);
+	zram_stat64_inc(zram, &zram->stats.num_writes);
+	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+
+	bio_for_each_segment(bvec, bio, i) {
+		if (zram_bvec_write(zram, bvec->bv_page, index))
+			goto out;
 		index++;
 	}
 
@@ -405,6 +895,261 @@ out:
 	bio_io_error(bio);
 }
 
+/* Called with the table lock of 'index' held */
+static int zram_wb_candidate(struct zram *zram, u32 index, int mode, u32 age)
+{
+	if (!zram->table[index].handle ||
+	    zram_test_flag(zram, index, ZRAM_SAME) ||
+	    zram_test_flag(zram, index, ZRAM_DEDUP) ||
+	    zram_test_flag(zram, index, ZRAM_WB) ||
+	    zram_test_flag(zram, index, ZRAM_UNDER_WB))
+		return 0;
+
+	if ((mode & ZRAM_WB_HUGE) &&
+	    !zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))
+		return 0;
+
+	if ((mode & ZRAM_WB_IDLE) &&
+	    zram_now() - zram->table[index].ac_time < age)
+		return 0;
+
+	return 1;
+}
+
+/*
+ * Move one slot to the backing device. The data is copied out under the
+ * table lock and written with the lock dropped; if the slot is
+ * overwritten or freed meanwhile, the block is given back instead.
+ */
+static int zram_writeback_slot(struct zram *zram, u32 index,
+			       struct page *page, int mode, u32 age)
+{
+	int ret;
+	unsigned long blk;
+	spinlock_t *lock = zram_table_lock(zram, index);
+
+	spin_lock(lock);
+	if (!zram_wb_candidate(zram, index, mode, age)) {
+		spin_unlock(lock);
+		return 0;
+	}
+	spin_unlock(lock);
+
+	blk = zram_alloc_bdev_block(zram);
+	if (!blk)
+		return -ENOSPC;
+
+	spin_lock(lock);
+	if (!zram_wb_candidate(zram, index, mode, age)) {
+		spin_unlock(lock);
+		zram_put_bdev_block(zram, blk);
+		return 0;
+	}
+	ret = zram_read_obj(zram, index, page);
+	if (!ret)
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+	spin_unlock(lock);
+
+	if (!ret)
+		ret = zram_bdev_write(zram, page, blk);
+
+	spin_lock(lock);
+	if (ret || !zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+		zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+		spin_unlock(lock);
+		zram_put_bdev_block(zram, blk);
+		return ret;
+	}
+
+	zram_free_page(zram, index);
+	zram->table[index].handle = blk;
+	zram_set_flag(zram, index, ZRAM_WB);
+	spin_unlock(lock);
+
+	/* zram_free_page() dropped it, but the page is still stored */
+	zram_stat_inc(&zram->stats.pages_stored);
+	zram_stat_inc(&zram->stats.bd_count);
+	zram_stat64_inc(zram, &zram->stats.bd_writes);
+
+	return 0;
+}
+
+static void zram_writeback_work(struct work_struct *work)
+{
+	int ret = 0;
+	u32 index, age;
+	int mode;
+	size_t nr_pages;
+	struct page *page;
+	struct zram *zram = container_of(work, struct zram, wb_work);
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return;
+
+	/*
+	 * init_lock is only held to take the settings. A reset sets
+	 * wb_stop and waits for this work before it frees anything, so the
+	 * pass can do its I/O without holding off the sysfs stores.
+	 */
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done || !zram->bdev || zram->wb_stop) {
+		mutex_unlock(&zram->init_lock);
+		goto out;
+	}
+	mode = zram->wb_mode;
+	age = zram->wb_age;
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	mutex_unlock(&zram->init_lock);
+
+	for (index = 0; index < nr_pages; index++) {
+		if (ACCESS_ONCE(zram->wb_stop))
+			break;
+		ret = zram_writeback_slot(zram, index, page, mode, age);
+		if (ret == -ENOSPC)
+			break;
+		cond_resched();
+	}
+
+	if (ret)
+		pr_info("%s: writeback stopped early: err=%d\n",
+			zram->disk->disk_name, ret);
+out:
+	__free_page(page);
+}
+
+/*
+ * zram_writeback - start writing slots to the backing device
+ *
+ * ZRAM_WB_HUGE selects incompressible slots, ZRAM_WB_IDLE slots not
+ * accessed for 'age' seconds, and both together slots that are both.
+ * The work runs asynchronously; a request while one is queued updates it.
+ */
+int zram_writeback(struct zram *zram, int mode, u32 age)
+{
+	mutex_lock(&zram->init_lock);
+	if (!zram->bdev || !zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		return -EINVAL;
+	}
+	zram->wb_mode = mode;
+	zram->wb_age = age;
+	mutex_unlock(&zram->init_lock);
+
+	queue_work(system_long_wq, &zram->wb_work);
+	return 0;
+}
+
+/* Called with init_lock held */
+static void zram_close_backing_dev(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	zram->bdev = NULL;
+
+	vfree(zram->bd_bitmap);
+	zram->bd_bitmap = NULL;
+	vfree(zram->bd_refs);
+	zram->bd_refs = NULL;
+	zram->bd_nr_pages = 0;
+
+	kfree(zram->bd_path);
+	zram->bd_path = NULL;
+}
+
+/*
+ * zram_set_backing_dev - use the block device at 'path' for writeback,
+ * or none if 'path' is empty. Only possible before init.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	int ret = 0;
+	unsigned long nr_pages;
+	struct block_device *bdev;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	zram_close_backing_dev(zram);
+	if (!*path)
+		goto out;
+
+	bdev = blkdev_get_by_path(path, FMODE_READ | FMODE_WRITE | FMODE_EXCL,
+				  zram);
+	if (IS_ERR(bdev)) {
+		ret = PTR_ERR(bdev);
+		goto out;
+	}
+
+	nr_pages = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	zram->bd_path = kstrdup(path, GFP_KERNEL);
+	zram->bd_bitmap = vzalloc(BITS_TO_LONGS(nr_pages) * sizeof(long));
+	zram->bd_refs = vzalloc(nr_pages * sizeof(*zram->bd_refs));
+	if (nr_pages < 2 || !zram->bd_path || !zram->bd_bitmap ||
+	    !zram->bd_refs) {
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+		kfree(zram->bd_path);
+		zram->bd_path = NULL;
+		vfree(zram->bd_bitmap);
+		zram->bd_bitmap = NULL;
+		vfree(zram->bd_refs);
+		zram->bd_refs = NULL;
+		ret = nr_pages < 2 ? -EINVAL : -ENOMEM;
+		goto out;
+	}
+
+	/* block 0 means "none" */
+	__set_bit(0, zram->bd_bitmap);
+	zram->bd_cursor = 1;
+	zram->bd_nr_pages = nr_pages;
+	zram->bdev = bdev;
+
+	pr_info("%s: using %s for writeback, %lu pages\n",
+		zram->disk->disk_name, path, nr_pages);
+out:
+	mutex_unlock(&zram->init_lock);
+	return ret;
+}
+
+/*
+ * Count stored slots by how long ago they were last accessed: counts[i]
+ * gets the slots idle for less than ages[i] seconds, with one more
+ * element for the rest. Called with init_lock held.
+ */
+void zram_idle_stat(struct zram *zram, const u32 *ages, int nr_ages,
+		    unsigned long *counts)
+{
+	int i;
+	u32 index, idle, now = zram_now();
+	size_t nr_pages = zram->disksize >> PAGE_SHIFT;
+	spinlock_t *lock;
+
+	memset(counts, 0, (nr_ages + 1) * sizeof(*counts));
+	if (!zram->init_done)
+		return;
+
+	for (index = 0; index < nr_pages; index++) {
+		lock = zram_table_lock(zram, index);
+		spin_lock(lock);
+		if (!zram->table[index].handle &&
+		    !zram_test_flag(zram, index, ZRAM_SAME)) {
+			spin_unlock(lock);
+			continue;
+		}
+		idle = now - zram->table[index].ac_time;
+		spin_unlock(lock);
+
+		for (i = 0; i < nr_ages && idle >= ages[i]; i++)
+			;
+		counts[i]++;
+	}
+}
+
 /*
  * Check if request is within bounds and page aligned.
  */
@@ -440,44 +1185,151 @@ static void zram_make_request(struct request_queue *queue, struct bio *bio)
 		return;
 	}
 
-	__zram_make_request(zram, bio, bio_data_dir(bio));
+	switch (bio_data_dir(bio)) {
+	case READ:
+		zram_read(zram, bio);
+		break;
+
+	case WRITE:
+		zram_write(zram, bio);
+		break;
+	}
+}
+
+static void zram_comp_stats_add(struct zram_comp_stats *sum,
+				struct zram_comp_stats *stats)
+{
+	sum->comp_pages += stats->comp_pages;
+	sum->comp_bytes += stats->comp_bytes;
+	sum->comp_ns += stats->comp_ns;
+	sum->decomp_pages += stats->decomp_pages;
+	sum->decomp_ns += stats->decomp_ns;
+}
+
+/*
+ * Add the per-CPU compressor statistics of an initialized device to
+ * 'stats'. Counters are read without stopping the writers, so the result
+ * is only approximate while I/O is in flight.
+ */
+void zram_comp_stats(struct zram *zram, struct zram_comp_stats *stats)
+{
+	int cpu;
+
+	if (!zram->strm)
+		return;
+
+	for_each_possible_cpu(cpu)
+		zram_comp_stats_add(stats, &per_cpu_ptr(zram->strm, cpu)->stats);
+}
+
+/*
+ * Fold the statistics of the current compressor into the device history,
+ * so they survive the reset that is needed to switch algorithms.
+ * Called with init_lock held.
+ */
+static void zram_comp_history_save(struct zram *zram)
+{
+	int i;
+	struct zram_comp_stats stats;
+	struct zram_comp_history *h = NULL;
+
+	memset(&stats, 0, sizeof(stats));
+	zram_comp_stats(zram, &stats);
+	if (!stats.comp_pages && !stats.decomp_pages)
+		return;
+
+	for (i = 0; i < ZRAM_COMP_HISTORY; i++) {
+		h = &zram->comp_history[i];
+		if (!h->name[0] || !strcmp(h->name, zram->compressor))
+			break;
+	}
+
+	/* out of slots: reuse the last one */
+	if (strcmp(h->name, zram->compressor)) {
+		memset(h, 0, sizeof(*h));
+		strlcpy(h->name, zram->compressor, sizeof(h->name));
+	}
+	zram_comp_stats_add(&h->stats, &stats);
+}
+
+static void zram_free_streams(struct zram *zram)
+{
+	int cpu;
+
+	if (!zram->strm)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct zram_strm *strm = per_cpu_ptr(zram->strm, cpu);
+
+		if (strm->tfm)
+			crypto_free_comp(strm->tfm);
+		free_pages((unsigned long)strm->buffer, ZRAM_STRM_BUF_ORDER);
+	}
+
+	free_percpu(zram->strm);
+	zram->strm = NULL;
+}
+
+static int zram_alloc_streams(struct zram *zram)
+{
+	int cpu;
+
+	zram->strm = alloc_percpu(struct zram_strm);
+	if (!zram->strm)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct zram_strm *strm = per_cpu_ptr(zram->strm, cpu);
+		struct crypto_comp *tfm;
+
+		tfm = crypto_alloc_comp(zram->compressor, 0, 0);
+		if (IS_ERR(tfm))
+			return PTR_ERR(tfm);
+		strm->tfm = tfm;
+
+		strm->buffer = (void *)__get_free_pages(GFP_KERNEL |
+					__GFP_ZERO, ZRAM_STRM_BUF_ORDER);
+		if (!strm->buffer)
+			return -ENOMEM;
+	}
+
+	return 0;
 }
 
 void zram_reset_device(struct zram *zram)
 {
 	size_t index;
 
+	/*
+	 * A writeback pass runs without init_lock. Stop it before tearing
+	 * down; one queued meanwhile sees wb_stop or init_done cleared.
+	 */
+	zram->wb_stop = 1;
+	cancel_work_sync(&zram->wb_work);
+
 	mutex_lock(&zram->init_lock);
 	zram->init_done = 0;
+	zram->wb_stop = 0;
 
 	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	zram_comp_history_save(zram);
+	zram_free_streams(zram);
 
 	/* Free all pages that are still in this zram device */
-	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
-
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
-
-		if (!page)
-			continue;
-
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
-	}
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++)
+		zram_free_page(zram, index);
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	vfree(zram->dedup_hash);
+	zram->dedup_hash = NULL;
+
+	zram_close_backing_dev(zram);
+
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
@@ -501,17 +1353,10 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = zram_alloc_streams(zram);
+	if (ret) {
+		pr_err("Error allocating %s compression streams!\n",
+			zram->compressor);
 		goto fail;
 	}
 
@@ -525,12 +1370,25 @@ int zram_init_device(struct zram *zram)
 		goto fail;
 	}
 
+	if (zram->dedup) {
+		/* one bucket for every four pages */
+		zram->dedup_mask = roundup_pow_of_two(max_t(size_t,
+						num_pages / 4, 1)) - 1;
+		zram->dedup_hash = vzalloc((zram->dedup_mask + 1) *
+					sizeof(*zram->dedup_hash));
+		if (!zram->dedup_hash) {
+			pr_err("Error allocating dedup hash table\n");
+			ret = -ENOMEM;
+			goto fail;
+		}
+	}
+
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool(zram->disk->disk_name);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -556,7 +1414,9 @@ void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	spin_lock(zram_table_lock(zram, index));
 	zram_free_page(zram, index);
+	spin_unlock(zram_table_lock(zram, index));
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -567,11 +1427,18 @@ static const struct block_device_operations zram_devops = {
 
 static int create_device(struct zram *zram, int device_id)
 {
-	int ret = 0;
+	int i, ret = 0;
 
-	mutex_init(&zram->lock);
 	mutex_init(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	strlcpy(zram->compressor, ZRAM_DEFAULT_COMPRESSOR,
+		sizeof(zram->compressor));
+	spin_lock_init(&zram->wb_lock);
+	INIT_WORK(&zram->wb_work, zram_writeback_work);
+	for (i = 0; i < ZRAM_TABLE_LOCKS; i++) {
+		spin_lock_init(&zram->table_lock[i]);
+		spin_lock_init(&zram->dedup_lock[i]);
+	}
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -666,12 +1533,18 @@ static int __init zram_init(void)
 		num_devices = 1;
 	}
 
+	zram_entry_cache = KMEM_CACHE(zram_entry, 0);
+	if (!zram_entry_cache) {
+		ret = -ENOMEM;
+		goto unregister;
+	}
+
 	/* Allocate the device array and initialize each one */
 	pr_info("Creating %u devices ...\n", num_devices);
 	devices = kzalloc(num_devices * sizeof(struct zram), GFP_KERNEL);
 	if (!devices) {
 		ret = -ENOMEM;
-		goto unregister;
+		goto free_cache;
 	}
 
 	for (dev_id = 0; dev_id < num_devices; dev_id++) {
@@ -686,6 +1559,8 @@ free_devices:
 	while (dev_id)
 		destroy_device(&devices[--dev_id]);
 	kfree(devices);
+free_cache:
+	kmem_cache_destroy(zram_entry_cache);
 unregister:
 	unregister_blkdev(zram_major, "zram");
 out:
@@ -700,14 +1575,17 @@ static void __exit zram_exit(void)
 	for (i = 0; i < num_devices; i++) {
 		zram = &devices[i];
 
+		cancel_work_sync(&zram->wb_work);
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+		zram_set_backing_dev(zram, "");
 	}
 
 	unregister_blkdev(zram_major, "zram");
 
 	kfree(devices);
+	kmem_cache_destroy(zram_entry_cache);
 	pr_debug("Cleanup done!\n");
 }
 
@@ -15,10 +15,14 @@
 #ifndef _ZRAM_DRV_H_
 #define _ZRAM_DRV_H_
 
+#include <linux/crypto.h>
+#include <linux/list.h>
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
 
-#include "xvmalloc.h"
+#include "zsmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -26,18 +30,6 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
 /* Default zram disk size: 25% of total RAM */
@@ -47,13 +39,7 @@ static const unsigned default_disksize_perc_ram = 25;
  * Pages that compress to size greater than this are stored
  * uncompressed in memory.
  */
-static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
-
-/*
- * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
- */
+static const unsigned max_zpage_size = PAGE_SIZE / 8 * 7;
 
 /*-- End of configurable params */
 
@@ -63,13 +49,35 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 #define SECTORS_PER_PAGE	(1 << SECTORS_PER_PAGE_SHIFT)
 #define ZRAM_LOGICAL_BLOCK_SIZE	4096
 
+/* Default compressor, any crypto API "compress" algorithm can be used */
+#define ZRAM_DEFAULT_COMPRESSOR	"lzo"
+
+/* Compressors whose statistics are kept across device resets */
+#define ZRAM_COMP_HISTORY	4
+
+/* Compression streams write into two pages; some algorithms expand */
+#define ZRAM_STRM_BUF_ORDER	1
+#define ZRAM_STRM_BUF_SIZE	(PAGE_SIZE << ZRAM_STRM_BUF_ORDER)
+
+/* Number of locks the table entries are hashed onto, a power of two */
+#define ZRAM_TABLE_LOCKS	64
+
 /* Flags for zram pages (table[page_no].flags) */
 enum zram_pageflags {
 	/* Page is stored uncompressed */
 	ZRAM_UNCOMPRESSED,
 
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	/* Page repeats one word, kept in table[page_no].handle */
+	ZRAM_SAME,
+
+	/* table[page_no].handle points to a shared struct zram_entry */
+	ZRAM_DEDUP,
+
+	/* Page was written to the backing device, handle is the block */
+	ZRAM_WB,
+
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
 
 	__NR_ZRAM_PAGEFLAGS,
 };
@@ -78,12 +86,31 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
+	unsigned long handle;	/* zsmalloc object, see also zram_pageflags */
+	u16 size;		/* object size, PAGE_SIZE if uncompressed */
 	u8 count;	/* object ref count (not yet used) */
 	u8 flags;
+	u32 ac_time;		/* last access, seconds since boot */
 } __attribute__((aligned(4)));
 
+/* Slots selected by zram_writeback() */
+#define ZRAM_WB_HUGE	(1 << 0)	/* stored uncompressed */
+#define ZRAM_WB_IDLE	(1 << 1)	/* not accessed for wb_age seconds */
+
+/*
+ * A stored object that can be shared by identical pages, hashed by the
+ * checksum of the uncompressed page. refcount and the hash chain are
+ * protected by the dedup lock of the entry's bucket.
+ */
+struct zram_entry {
+	struct hlist_node node;
+	unsigned long handle;	/* zsmalloc object */
+	u32 checksum;
+	u16 size;		/* object size */
+	u8 flags;		/* BIT(ZRAM_UNCOMPRESSED) or 0 */
+	unsigned int refcount;	/* table entries using the object */
+};
+
 struct zram_stats {
 	u64 compr_size;		/* compressed size of pages stored */
 	u64 num_reads;		/* failed + successful */
@@ -92,20 +119,49 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 pages_expand;	/* % of incompressible pages */
+	u64 pages_compacted;	/* pages freed by compaction */
+	u64 bd_reads;		/* pages read from the backing device */
+	u64 bd_writes;		/* pages written to the backing device */
+	u64 dup_size;		/* compressed bytes not stored due to dedup */
+	atomic_t pages_zero;	/* no. of zero filled pages */
+	atomic_t pages_same;	/* no. of same filled pages, incl. zero */
+	atomic_t pages_dup;	/* no. of pages sharing another's object */
+	atomic_t dedup_entries;	/* no. of struct zram_entry allocated */
+	atomic_t bd_count;	/* no. of pages on the backing device */
+	atomic_t pages_stored;	/* no. of pages currently stored */
+	atomic_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic_t pages_expand;	/* % of incompressible pages */
+};
+
+/* Compressor cost, accumulated per CPU without locking */
+struct zram_comp_stats {
+	u64 comp_pages;		/* pages compressed, incl. retries */
+	u64 comp_bytes;		/* compressed bytes produced */
+	u64 comp_ns;		/* time spent compressing */
+	u64 decomp_pages;	/* pages decompressed */
+	u64 decomp_ns;		/* time spent decompressing */
+};
+
+/* Per-CPU compression stream */
+struct zram_strm {
+	struct crypto_comp *tfm;
+	void *buffer;		/* compressed output, ZRAM_STRM_BUF_SIZE */
+	struct zram_comp_stats stats;
+};
+
+/* Totals of a compressor used before the last reset(s) */
+struct zram_comp_history {
+	char name[CRYPTO_MAX_ALG_NAME];
+	struct zram_comp_stats stats;
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	struct zram_strm __percpu *strm;
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+	/* protect table entries, hashed by page index */
+	spinlock_t table_lock[ZRAM_TABLE_LOCKS];
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -117,6 +173,30 @@ struct zram {
 	 */
 	u64 disksize;	/* bytes */
 
+	/* compressor used from the next init, protected by init_lock */
+	char compressor[CRYPTO_MAX_ALG_NAME];
+	struct zram_comp_history comp_history[ZRAM_COMP_HISTORY];
+
+	/* share identical objects, set before init */
+	int dedup;
+	struct hlist_head *dedup_hash;
+	unsigned long dedup_mask;	/* no. of hash buckets - 1 */
+	spinlock_t dedup_lock[ZRAM_TABLE_LOCKS];
+
+	/* backing device, set before init, closed on reset */
+	struct block_device *bdev;
+	char *bd_path;
+	unsigned long *bd_bitmap;	/* blocks in use */
+	u16 *bd_refs;			/* owning slot plus reads in flight */
+	unsigned long bd_nr_pages;
+	unsigned long bd_cursor;	/* next block to try */
+	/* protect bd_bitmap, bd_refs and bd_cursor, taken from irq context */
+	spinlock_t wb_lock;
+	struct work_struct wb_work;
+	int wb_mode;			/* ZRAM_WB_* */
+	u32 wb_age;			/* seconds, for ZRAM_WB_IDLE */
+	int wb_stop;			/* tells a writeback pass to give up */
+
 	struct zram_stats stats;
 };
 
@@ -127,6 +207,11 @@ extern struct attribute_group zram_disk_attr_group;
 #endif
 
 extern int zram_init_device(struct zram *zram);
+extern void zram_comp_stats(struct zram *zram, struct zram_comp_stats *stats);
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern int zram_writeback(struct zram *zram, int mode, u32 age);
+extern void zram_idle_stat(struct zram *zram, const u32 *ages, int nr_ages,
+			unsigned long *counts);
 extern void zram_reset_device(struct zram *zram);
 
 #endif
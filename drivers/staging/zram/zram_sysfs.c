@@ -12,12 +12,24 @@
  * Project home: http://compcache.googlecode.com/
  */
 
+#include <linux/crypto.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
+#include <linux/math64.h>
+#include <linux/limits.h>
 #include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/string.h>
 
 #include "zram_drv.h"
 
+/* Compressors offered by comp_algorithm, when built into the crypto API */
+static const char * const zram_compressors[] = {
+	"lzo",
+	"deflate",
+	NULL
+};
+
 static u64 zram_stat64_read(struct zram *zram, u64 *v)
 {
 	u64 val;
@@ -153,7 +165,73 @@ static ssize_t zero_pages_show(struct device *dev,
 {
 	struct zram *zram = dev_to_zram(dev);
 
-	return sprintf(buf, "%u\n", zram->stats.pages_zero);
+	return sprintf(buf, "%u\n", atomic_read(&zram->stats.pages_zero));
+}
+
+static ssize_t same_pages_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%u\n", atomic_read(&zram->stats.pages_same));
+}
+
+static ssize_t dedup_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%d\n", zram->dedup);
+}
+
+static ssize_t dedup_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long val;
+	struct zram *zram = dev_to_zram(dev);
+
+	ret = strict_strtoul(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		pr_info("Cannot change dedup for initialized device\n");
+		return -EBUSY;
+	}
+	zram->dedup = !!val;
+	mutex_unlock(&zram->init_lock);
+
+	return len;
+}
+
+static ssize_t dup_pages_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%u\n", atomic_read(&zram->stats.pages_dup));
+}
+
+static ssize_t dup_data_size_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		zram_stat64_read(zram, &zram->stats.dup_size));
+}
+
+static ssize_t dedup_meta_size_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		(u64)atomic_read(&zram->stats.dedup_entries) *
+		sizeof(struct zram_entry));
 }
 
 static ssize_t orig_data_size_show(struct device *dev,
@@ -162,7 +240,7 @@ static ssize_t orig_data_size_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	return sprintf(buf, "%llu\n",
-		(u64)(zram->stats.pages_stored) << PAGE_SHIFT);
+		(u64)atomic_read(&zram->stats.pages_stored) << PAGE_SHIFT);
 }
 
 static ssize_t compr_data_size_show(struct device *dev,
@@ -181,13 +259,265 @@ static ssize_t mem_used_total_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	if (zram->init_done) {
-		val = xv_get_total_size_bytes(zram->mem_pool) +
-			((u64)(zram->stats.pages_expand) << PAGE_SHIFT);
+		val = zs_get_total_size_bytes(zram->mem_pool);
 	}
 
 	return sprintf(buf, "%llu\n", val);
 }
 
+static ssize_t compact_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	unsigned long freed;
+	struct zram *zram = dev_to_zram(dev);
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		return -EINVAL;
+	}
+
+	freed = zs_compact(zram->mem_pool);
+	spin_lock(&zram->stat64_lock);
+	zram->stats.pages_compacted += freed;
+	spin_unlock(&zram->stat64_lock);
+	mutex_unlock(&zram->init_lock);
+
+	return len;
+}
+
+static ssize_t pages_compacted_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		zram_stat64_read(zram, &zram->stats.pages_compacted));
+}
+
+static ssize_t backing_dev_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	ssize_t len;
+	struct zram *zram = dev_to_zram(dev);
+
+	mutex_lock(&zram->init_lock);
+	len = sprintf(buf, "%s\n", zram->bd_path ? zram->bd_path : "none");
+	mutex_unlock(&zram->init_lock);
+
+	return len;
+}
+
+static ssize_t backing_dev_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	char *path;
+	struct zram *zram = dev_to_zram(dev);
+
+	path = kstrndup(buf, PATH_MAX, GFP_KERNEL);
+	if (!path)
+		return -ENOMEM;
+
+	strim(path);
+	if (!strcmp(path, "none"))
+		path[0] = '\0';
+
+	ret = zram_set_backing_dev(zram, path);
+	kfree(path);
+
+	return ret ? ret : len;
+}
+
+/*
+ * Start writeback of "huge" (incompressible) slots, of slots "idle" for
+ * at least the given number of seconds, or of "huge_idle" slots that are
+ * both.
+ */
+static ssize_t writeback_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret, mode;
+	unsigned int age = 0;
+	char cmd[16];
+	struct zram *zram = dev_to_zram(dev);
+
+	ret = sscanf(buf, "%15s %u", cmd, &age);
+	if (ret < 1)
+		return -EINVAL;
+
+	if (!strcmp(cmd, "huge"))
+		mode = ZRAM_WB_HUGE;
+	else if (!strcmp(cmd, "idle"))
+		mode = ZRAM_WB_IDLE;
+	else if (!strcmp(cmd, "huge_idle"))
+		mode = ZRAM_WB_HUGE | ZRAM_WB_IDLE;
+	else
+		return -EINVAL;
+
+	if ((mode & ZRAM_WB_IDLE) && ret < 2)
+		return -EINVAL;
+
+	ret = zram_writeback(zram, mode, age);
+
+	return ret ? ret : len;
+}
+
+static ssize_t bd_stat_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%8u %8llu %8llu\n",
+		atomic_read(&zram->stats.bd_count),
+		zram_stat64_read(zram, &zram->stats.bd_reads),
+		zram_stat64_read(zram, &zram->stats.bd_writes));
+}
+
+/* Age limits of the idle_stat rows, in seconds */
+static const u32 zram_idle_ages[] = { 60, 600, 3600, 86400 };
+
+/*
+ * Number of stored slots by time since last access: one line for each
+ * limit with the slots idle for less than that many seconds (but not less
+ * than the previous limit), and a last line for the rest.
+ */
+static ssize_t idle_stat_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	int i;
+	ssize_t len = 0;
+	unsigned long counts[ARRAY_SIZE(zram_idle_ages) + 1];
+	struct zram *zram = dev_to_zram(dev);
+
+	mutex_lock(&zram->init_lock);
+	zram_idle_stat(zram, zram_idle_ages, ARRAY_SIZE(zram_idle_ages),
+			counts);
+	mutex_unlock(&zram->init_lock);
+
+	for (i = 0; i < ARRAY_SIZE(zram_idle_ages); i++)
+		len += sprintf(buf + len, "<%-8u %10lu\n",
+				zram_idle_ages[i], counts[i]);
+	len += sprintf(buf + len, ">=%-7u %10lu\n",
+			zram_idle_ages[i - 1], counts[i]);
+
+	return len;
+}
+
+static ssize_t comp_algorithm_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	int i, found = 0;
+	ssize_t len = 0;
+	struct zram *zram = dev_to_zram(dev);
+
+	mutex_lock(&zram->init_lock);
+	for (i = 0; zram_compressors[i]; i++) {
+		const char *name = zram_compressors[i];
+
+		if (!strcmp(name, zram->compressor)) {
+			len += sprintf(buf + len, "[%s] ", name);
+			found = 1;
+		} else if (crypto_has_comp(name, 0, 0)) {
+			len += sprintf(buf + len, "%s ", name);
+		}
+	}
+	if (!found)
+		len += sprintf(buf + len, "[%s] ", zram->compressor);
+	mutex_unlock(&zram->init_lock);
+
+	buf[len - 1] = '\n';
+	return len;
+}
+
+static ssize_t comp_algorithm_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	char name[CRYPTO_MAX_ALG_NAME];
+	struct zram *zram = dev_to_zram(dev);
+
+	strlcpy(name, buf, sizeof(name));
+	strim(name);
+	if (!name[0])
+		return -EINVAL;
+
+	/* also loads the module of a modular algorithm */
+	if (!crypto_has_comp(name, 0, 0))
+		return -EINVAL;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		pr_info("Cannot change compressor for initialized device\n");
+		return -EBUSY;
+	}
+	strlcpy(zram->compressor, name, sizeof(zram->compressor));
+	mutex_unlock(&zram->init_lock);
+
+	return len;
+}
+
+static int comp_stats_line(char *buf, const char *name,
+		struct zram_comp_stats *st)
+{
+	u64 ratio = 0, comp_ns = 0, decomp_ns = 0;
+
+	if (st->comp_pages) {
+		/* compressed size in percent of the original */
+		ratio = div64_u64(st->comp_bytes * 100,
+				  st->comp_pages << PAGE_SHIFT);
+		comp_ns = div64_u64(st->comp_ns, st->comp_pages);
+	}
+	if (st->decomp_pages)
+		decomp_ns = div64_u64(st->decomp_ns, st->decomp_pages);
+
+	return sprintf(buf, "%-16s %12llu %6llu %10llu %12llu %10llu\n",
+		name, st->comp_pages, ratio, comp_ns,
+		st->decomp_pages, decomp_ns);
+}
+
+/*
+ * One line per compressor used on this device since it was created: pages
+ * compressed, compressed size in percent, average ns per compressed page,
+ * pages decompressed and average ns per decompressed page. The current
+ * compressor's line is included while the device is initialized.
+ */
+static ssize_t comp_stats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	int i, cur_done = 0;
+	ssize_t len;
+	struct zram_comp_stats st;
+	struct zram_comp_history *h;
+	struct zram *zram = dev_to_zram(dev);
+
+	len = sprintf(buf, "%-16s %12s %6s %10s %12s %10s\n", "algorithm",
+		"comp_pages", "ratio", "comp_ns", "decomp_pages",
+		"decomp_ns");
+
+	mutex_lock(&zram->init_lock);
+	for (i = 0; i < ZRAM_COMP_HISTORY; i++) {
+		h = &zram->comp_history[i];
+		if (!h->name[0])
+			break;
+
+		st = h->stats;
+		if (zram->init_done && !strcmp(h->name, zram->compressor)) {
+			zram_comp_stats(zram, &st);
+			cur_done = 1;
+		}
+		len += comp_stats_line(buf + len, h->name, &st);
+	}
+	if (zram->init_done && !cur_done) {
+		memset(&st, 0, sizeof(st));
+		zram_comp_stats(zram, &st);
+		len += comp_stats_line(buf + len, zram->compressor, &st);
+	}
+	mutex_unlock(&zram->init_lock);
+
+	return len;
+}
+
 static DEVICE_ATTR(disksize, S_IRUGO | S_IWUSR,
 		disksize_show, disksize_store);
 static DEVICE_ATTR(initstate, S_IRUGO, initstate_show, NULL);
@@ -197,9 +527,24 @@ static DEVICE_ATTR(num_writes, S_IRUGO, num_writes_show, NULL);
 static DEVICE_ATTR(invalid_io, S_IRUGO, invalid_io_show, NULL);
 static DEVICE_ATTR(notify_free, S_IRUGO, notify_free_show, NULL);
 static DEVICE_ATTR(zero_pages, S_IRUGO, zero_pages_show, NULL);
+static DEVICE_ATTR(same_pages, S_IRUGO, same_pages_show, NULL);
+static DEVICE_ATTR(dedup, S_IRUGO | S_IWUSR, dedup_show, dedup_store);
+static DEVICE_ATTR(dup_pages, S_IRUGO, dup_pages_show, NULL);
+static DEVICE_ATTR(dup_data_size, S_IRUGO, dup_data_size_show, NULL);
+static DEVICE_ATTR(dedup_meta_size, S_IRUGO, dedup_meta_size_show, NULL);
 static DEVICE_ATTR(orig_data_size, S_IRUGO, orig_data_size_show, NULL);
 static DEVICE_ATTR(compr_data_size, S_IRUGO, compr_data_size_show, NULL);
 static DEVICE_ATTR(mem_used_total, S_IRUGO, mem_used_total_show, NULL);
+static DEVICE_ATTR(compact, S_IWUSR, NULL, compact_store);
+static DEVICE_ATTR(pages_compacted, S_IRUGO, pages_compacted_show, NULL);
+static DEVICE_ATTR(backing_dev, S_IRUGO | S_IWUSR,
+		backing_dev_show, backing_dev_store);
+static DEVICE_ATTR(writeback, S_IWUSR, NULL, writeback_store);
+static DEVICE_ATTR(bd_stat, S_IRUGO, bd_stat_show, NULL);
+static DEVICE_ATTR(idle_stat, S_IRUGO, idle_stat_show, NULL);
+static DEVICE_ATTR(comp_algorithm, S_IRUGO | S_IWUSR,
+		comp_algorithm_show, comp_algorithm_store);
+static DEVICE_ATTR(comp_stats, S_IRUGO, comp_stats_show, NULL);
 
 static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_disksize.attr,
@@ -210,9 +555,22 @@ static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_invalid_io.attr,
 	&dev_attr_notify_free.attr,
 	&dev_attr_zero_pages.attr,
+	&dev_attr_same_pages.attr,
+	&dev_attr_dedup.attr,
+	&dev_attr_dup_pages.attr,
+	&dev_attr_dup_data_size.attr,
+	&dev_attr_dedup_meta_size.attr,
 	&dev_attr_orig_data_size.attr,
 	&dev_attr_compr_data_size.attr,
 	&dev_attr_mem_used_total.attr,
+	&dev_attr_compact.attr,
+	&dev_attr_pages_compacted.attr,
+	&dev_attr_backing_dev.attr,
+	&dev_attr_writeback.attr,
+	&dev_attr_bd_stat.attr,
+	&dev_attr_idle_stat.attr,
+	&dev_attr_comp_algorithm.attr,
+	&dev_attr_comp_stats.attr,
 	NULL,
 };
 
@@ -0,0 +1,643 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * zsmalloc groups objects by size class. Each class carves "zspages",
+ * runs of up to ZS_MAX_PAGES_PER_ZSPAGE 0-order (possibly highmem) pages,
+ * into equal slots laid out back to back across page boundaries. Unlike
+ * xvmalloc it stores objects up to PAGE_SIZE and keeps no headers in the
+ * pages, so a class wastes at most its rounding and the tail of the last
+ * page of each zspage.
+ *
+ * Objects are referenced through opaque handles which stay valid while
+ * compaction moves objects to fill up partially used zspages. Each class
+ * has its own lock; objects are accessed without it, between
+ * zs_map_object() and zs_unmap_object().
+ */
+
+#ifdef CONFIG_ZRAM_DEBUG
+#define DEBUG
+#endif
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bit_spinlock.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+/* Handle words of all pools, created with the first pool */
+static struct kmem_cache *zs_handle_cache;
+static int zs_handle_cache_users;
+static DEFINE_MUTEX(zs_handle_cache_lock);
+
+static void pin_handle(unsigned long handle)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static int trypin_handle(unsigned long handle)
+{
+	return bit_spin_trylock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static void unpin_handle(unsigned long handle)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static unsigned long location_to_obj(struct zspage *zspage, unsigned int idx)
+{
+	unsigned long obj;
+
+	obj = page_to_pfn(zspage->pages[0]) << OBJ_INDEX_BITS;
+	obj |= idx & OBJ_INDEX_MASK;
+
+	return obj << OBJ_TAG_BITS;
+}
+
+static struct zspage *obj_to_location(unsigned long obj, unsigned int *idx)
+{
+	obj >>= OBJ_TAG_BITS;
+	*idx = obj & OBJ_INDEX_MASK;
+
+	return (struct zspage *)page_private(pfn_to_page(obj >> OBJ_INDEX_BITS));
+}
+
+/* Location of the object behind a pinned handle */
+static struct zspage *handle_to_location(unsigned long handle,
+					unsigned int *idx)
+{
+	return obj_to_location(*(unsigned long *)handle, idx);
+}
+
+static int get_size_class_index(size_t size)
+{
+	if (likely(size > ZS_MIN_ALLOC_SIZE))
+		return DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE,
+					ZS_SIZE_CLASS_DELTA);
+	return 0;
+}
+
+/*
+ * Choose the number of pages per zspage that wastes the least space at
+ * the end of the last page, preferring fewer pages on ties.
+ */
+static unsigned int get_pages_per_zspage(unsigned int size)
+{
+	unsigned int i, best = 1, best_used = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		unsigned int bytes = i * PAGE_SIZE;
+		unsigned int used = (bytes - bytes % size) * 100 / bytes;
+
+		if (used > best_used) {
+			best_used = used;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static enum fullness_group get_fullness_group(struct size_class *class,
+						struct zspage *zspage)
+{
+	if (zspage->inuse == class->objs_per_zspage)
+		return ZS_FULL;
+	if (zspage->inuse * 4 >= class->objs_per_zspage * 3)
+		return ZS_ALMOST_FULL;
+	return ZS_ALMOST_EMPTY;
+}
+
+/* Called with class->lock held */
+static struct zspage *first_zspage(struct size_class *class,
+				enum fullness_group fg)
+{
+	struct list_head *head = &class->fullness_list[fg];
+
+	return list_empty(head) ? NULL :
+		list_first_entry(head, struct zspage, list);
+}
+
+/* Called with class->lock held */
+static void fix_fullness_group(struct size_class *class, struct zspage *zspage)
+{
+	enum fullness_group fg = get_fullness_group(class, zspage);
+
+	if (fg == zspage->fullness)
+		return;
+
+	list_move(&zspage->list, &class->fullness_list[fg]);
+	zspage->fullness = fg;
+}
+
+/* Called with class->lock held */
+static unsigned int obj_alloc(struct zspage *zspage, unsigned long handle)
+{
+	unsigned int idx = zspage->freeobj;
+
+	zspage->freeobj = zspage->handles[idx] >> OBJ_TAG_BITS;
+	zspage->handles[idx] = handle;
+	zspage->inuse++;
+
+	return idx;
+}
+
+/* Called with class->lock held */
+static void obj_free(struct zspage *zspage, unsigned int idx)
+{
+	zspage->handles[idx] = ((unsigned long)zspage->freeobj << OBJ_TAG_BITS) |
+				OBJ_FREE_TAG;
+	zspage->freeobj = idx;
+	zspage->inuse--;
+}
+
+static struct zspage *alloc_zspage(struct size_class *class, gfp_t flags)
+{
+	unsigned int i;
+	struct zspage *zspage;
+
+	zspage = kzalloc(sizeof(*zspage) +
+			class->objs_per_zspage * sizeof(zspage->handles[0]),
+			flags & ~(__GFP_HIGHMEM | __GFP_MOVABLE));
+	if (!zspage)
+		return NULL;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(flags);
+		if (!zspage->pages[i])
+			goto fail;
+	}
+	set_page_private(zspage->pages[0], (unsigned long)zspage);
+
+	for (i = 0; i < class->objs_per_zspage; i++)
+		zspage->handles[i] = ((unsigned long)(i + 1) << OBJ_TAG_BITS) |
+					OBJ_FREE_TAG;
+
+	INIT_LIST_HEAD(&zspage->list);
+	zspage->class = class;
+	zspage->fullness = ZS_ALMOST_EMPTY;
+
+	return zspage;
+
+fail:
+	while (i--)
+		__free_page(zspage->pages[i]);
+	kfree(zspage);
+	return NULL;
+}
+
+static void free_zspage(struct zs_pool *pool, struct zspage *zspage)
+{
+	unsigned int i, nr_pages = zspage->class->pages_per_zspage;
+
+	set_page_private(zspage->pages[0], 0);
+	for (i = 0; i < nr_pages; i++)
+		__free_page(zspage->pages[i]);
+	kfree(zspage);
+
+	atomic_long_sub(nr_pages, &pool->pages_allocated);
+}
+
+/*
+ * Copy 'size' bytes between 'buf' and the object at byte 'offset' of a
+ * zspage, which may span two pages.
+ */
+static void zs_copy_object(struct zspage *zspage, unsigned int offset,
+			unsigned int size, char *buf, int to_obj)
+{
+	while (size) {
+		struct page *page = zspage->pages[offset >> PAGE_SHIFT];
+		unsigned int off = offset & ~PAGE_MASK;
+		unsigned int len = min_t(unsigned int, size, PAGE_SIZE - off);
+		char *addr;
+
+		addr = kmap_atomic(page, KM_USER0);
+		if (to_obj)
+			memcpy(addr + off, buf, len);
+		else
+			memcpy(buf, addr + off, len);
+		kunmap_atomic(addr, KM_USER0);
+
+		buf += len;
+		offset += len;
+		size -= len;
+	}
+}
+
+static int zs_handle_cache_get(void)
+{
+	int ret = 0;
+
+	mutex_lock(&zs_handle_cache_lock);
+	if (!zs_handle_cache_users) {
+		zs_handle_cache = kmem_cache_create("zs_handle",
+					sizeof(unsigned long), 0, 0, NULL);
+		if (!zs_handle_cache)
+			ret = -ENOMEM;
+	}
+	if (!ret)
+		zs_handle_cache_users++;
+	mutex_unlock(&zs_handle_cache_lock);
+
+	return ret;
+}
+
+static void zs_handle_cache_put(void)
+{
+	mutex_lock(&zs_handle_cache_lock);
+	if (!--zs_handle_cache_users) {
+		kmem_cache_destroy(zs_handle_cache);
+		zs_handle_cache = NULL;
+	}
+	mutex_unlock(&zs_handle_cache_lock);
+}
+
+static void zs_free_map_areas(struct zs_pool *pool)
+{
+	int cpu;
+
+	if (!pool->map_area)
+		return;
+
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu_ptr(pool->map_area, cpu)->buf);
+	free_percpu(pool->map_area);
+}
+
+/**
+ * zs_create_pool - create a memory pool
+ * @name: name of the pool, for messages
+ *
+ * Returns the new pool or NULL on failure.
+ */
+struct zs_pool *zs_create_pool(const char *name)
+{
+	int i, cpu;
+	struct zs_pool *pool;
+
+	BUILD_BUG_ON(ZS_MAX_PAGES_PER_ZSPAGE * PAGE_SIZE / ZS_MIN_ALLOC_SIZE
+			> OBJ_INDEX_MASK);
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	pool->name = name;
+	atomic_long_set(&pool->pages_allocated, 0);
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+		int fg;
+
+		spin_lock_init(&class->lock);
+		for (fg = 0; fg < NR_ZS_FULLNESS; fg++)
+			INIT_LIST_HEAD(&class->fullness_list[fg]);
+
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage * PAGE_SIZE /
+						class->size;
+	}
+
+	pool->map_area = alloc_percpu(struct zs_map_area);
+	if (!pool->map_area)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		struct zs_map_area *area = per_cpu_ptr(pool->map_area, cpu);
+
+		area->buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+		if (!area->buf)
+			goto fail;
+	}
+
+	if (zs_handle_cache_get())
+		goto fail;
+
+	return pool;
+
+fail:
+	zs_free_map_areas(pool);
+	kfree(pool);
+	return NULL;
+}
+EXPORT_SYMBOL_GPL(zs_create_pool);
+
+/**
+ * zs_destroy_pool - destroy a memory pool
+ * @pool: pool to destroy
+ *
+ * All objects should have been freed; zspages still in use are released
+ * without their handles.
+ */
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i, fg;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		for (fg = 0; fg < NR_ZS_FULLNESS; fg++) {
+			struct zspage *zspage, *tmp;
+
+			list_for_each_entry_safe(zspage, tmp,
+					&class->fullness_list[fg], list) {
+				pr_info("%s: freeing non-empty zspage of "
+					"class %u\n", pool->name, class->size);
+				list_del(&zspage->list);
+				free_zspage(pool, zspage);
+			}
+		}
+	}
+
+	zs_handle_cache_put();
+	zs_free_map_areas(pool);
+	kfree(pool);
+}
+EXPORT_SYMBOL_GPL(zs_destroy_pool);
+
+/**
+ * zs_malloc - allocate a block of given size from the pool
+ * @pool: pool to allocate from
+ * @size: size of the block, at most PAGE_SIZE
+ * @flags: flags for allocating the handle and any new zspage
+ *
+ * Returns an opaque handle to the object, or 0 on failure. The object is
+ * accessed through zs_map_object().
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags)
+{
+	unsigned int idx;
+	unsigned long handle;
+	struct size_class *class;
+	struct zspage *zspage;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	handle = (unsigned long)kmem_cache_alloc(zs_handle_cache,
+				flags & ~(__GFP_HIGHMEM | __GFP_MOVABLE));
+	if (!handle)
+		return 0;
+
+	class = &pool->size_class[get_size_class_index(size)];
+
+	spin_lock(&class->lock);
+	zspage = first_zspage(class, ZS_ALMOST_FULL);
+	if (!zspage)
+		zspage = first_zspage(class, ZS_ALMOST_EMPTY);
+
+	if (!zspage) {
+		spin_unlock(&class->lock);
+
+		zspage = alloc_zspage(class, flags);
+		if (!zspage) {
+			kmem_cache_free(zs_handle_cache, (void *)handle);
+			return 0;
+		}
+		atomic_long_add(class->pages_per_zspage,
+				&pool->pages_allocated);
+
+		spin_lock(&class->lock);
+		list_add(&zspage->list,
+			&class->fullness_list[ZS_ALMOST_EMPTY]);
+	}
+
+	idx = obj_alloc(zspage, handle);
+	*(unsigned long *)handle = location_to_obj(zspage, idx);
+	fix_fullness_group(class, zspage);
+	spin_unlock(&class->lock);
+
+	return handle;
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
+
+/**
+ * zs_free - free an object
+ * @pool: pool the object was allocated from
+ * @handle: handle returned by zs_malloc()
+ */
+void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+	unsigned int idx;
+	struct size_class *class;
+	struct zspage *zspage;
+	int empty;
+
+	if (unlikely(!handle))
+		return;
+
+	/* keeps compaction from moving the object under us */
+	pin_handle(handle);
+	zspage = handle_to_location(handle, &idx);
+	class = zspage->class;
+
+	spin_lock(&class->lock);
+	obj_free(zspage, idx);
+	empty = !zspage->inuse;
+	if (empty)
+		list_del(&zspage->list);
+	else
+		fix_fullness_group(class, zspage);
+	spin_unlock(&class->lock);
+	unpin_handle(handle);
+
+	if (empty)
+		free_zspage(pool, zspage);
+	kmem_cache_free(zs_handle_cache, (void *)handle);
+}
+EXPORT_SYMBOL_GPL(zs_free);
+
+/**
+ * zs_map_object - get a pointer to an object
+ * @pool: pool the object was allocated from
+ * @handle: handle returned by zs_malloc()
+ * @mm: how the object is going to be accessed
+ *
+ * The object can be accessed until zs_unmap_object(). This runs with
+ * preemption disabled, and a CPU can map only one object at a time.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm)
+{
+	unsigned int idx, offset, off;
+	struct size_class *class;
+	struct zs_map_area *area;
+	struct zspage *zspage;
+
+	pin_handle(handle);
+	zspage = handle_to_location(handle, &idx);
+	class = zspage->class;
+	offset = idx * class->size;
+	off = offset & ~PAGE_MASK;
+
+	area = get_cpu_ptr(pool->map_area);
+	area->mm = mm;
+
+	if (off + class->size <= PAGE_SIZE) {
+		area->kaddr = kmap_atomic(zspage->pages[offset >> PAGE_SHIFT],
+					  KM_USER0);
+		return area->kaddr + off;
+	}
+
+	/* the object straddles two pages */
+	area->kaddr = NULL;
+	if (mm != ZS_MM_WO)
+		zs_copy_object(zspage, offset, class->size, area->buf, 0);
+
+	return area->buf;
+}
+EXPORT_SYMBOL_GPL(zs_map_object);
+
+/**
+ * zs_unmap_object - release an object mapped by zs_map_object()
+ * @pool: pool the object was allocated from
+ * @handle: handle of the mapped object
+ */
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
+{
+	unsigned int idx;
+	struct zs_map_area *area;
+	struct zspage *zspage;
+
+	area = this_cpu_ptr(pool->map_area);
+	if (area->kaddr) {
+		kunmap_atomic(area->kaddr, KM_USER0);
+	} else if (area->mm != ZS_MM_RO) {
+		zspage = handle_to_location(handle, &idx);
+		zs_copy_object(zspage, idx * zspage->class->size,
+				zspage->class->size, area->buf, 1);
+	}
+	put_cpu_ptr(pool->map_area);
+
+	unpin_handle(handle);
+}
+EXPORT_SYMBOL_GPL(zs_unmap_object);
+
+/* Called with class->lock held */
+static struct zspage *compact_target(struct size_class *class,
+					struct zspage *src)
+{
+	struct zspage *zspage;
+
+	zspage = first_zspage(class, ZS_ALMOST_FULL);
+	if (zspage)
+		return zspage;
+
+	zspage = first_zspage(class, ZS_ALMOST_EMPTY);
+	return zspage != src ? zspage : NULL;
+}
+
+/*
+ * Move objects out of the least recently filled, sparsely used zspages of
+ * a class into other partially used ones, and free the zspages this
+ * empties. Objects that are pinned, being mapped or freed, are skipped,
+ * which ends compaction of the class.
+ */
+static unsigned long zs_compact_class(struct zs_pool *pool,
+					struct size_class *class)
+{
+	unsigned int idx, nidx;
+	unsigned long freed = 0;
+	struct zspage *src, *dst;
+	char *buf;
+
+	spin_lock(&class->lock);
+	while (!list_empty(&class->fullness_list[ZS_ALMOST_EMPTY])) {
+		src = list_entry(class->fullness_list[ZS_ALMOST_EMPTY].prev,
+				 struct zspage, list);
+
+		/* the class lock keeps us on this CPU */
+		buf = this_cpu_ptr(pool->map_area)->buf;
+
+		for (idx = 0; idx < class->objs_per_zspage && src->inuse;
+		     idx++) {
+			unsigned long handle = src->handles[idx];
+			unsigned long *obj = (unsigned long *)handle;
+
+			if (handle & OBJ_FREE_TAG)
+				continue;
+
+			dst = compact_target(class, src);
+			if (!dst)
+				goto out;
+
+			if (!trypin_handle(handle))
+				continue;
+
+			nidx = obj_alloc(dst, handle);
+			zs_copy_object(src, idx * class->size, class->size,
+					buf, 0);
+			zs_copy_object(dst, nidx * class->size, class->size,
+					buf, 1);
+			*obj = location_to_obj(dst, nidx) |
+				(*obj & BIT(HANDLE_PIN_BIT));
+			obj_free(src, idx);
+			fix_fullness_group(class, dst);
+			unpin_handle(handle);
+		}
+
+		if (src->inuse)
+			break;
+
+		list_del(&src->list);
+		spin_unlock(&class->lock);
+
+		free_zspage(pool, src);
+		freed += class->pages_per_zspage;
+		cond_resched();
+
+		spin_lock(&class->lock);
+	}
+out:
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+/**
+ * zs_compact - compact all size classes of a pool
+ * @pool: pool to compact
+ *
+ * Returns the number of pages freed. May sleep.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long freed = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		freed += zs_compact_class(pool, &pool->size_class[i]);
+		cond_resched();
+	}
+
+	if (freed)
+		pr_debug("%s: compaction freed %lu pages\n", pool->name, freed);
+
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->pages_allocated) << PAGE_SHIFT;
+}
+EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
@@ -0,0 +1,108 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/* User configurable params */
+
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+
+/*
+ * Size classes are ZS_SIZE_CLASS_DELTA bytes apart: 16 bytes for 4k
+ * pages, which keeps the rounding loss of an object under 16 bytes.
+ */
+#define ZS_SIZE_CLASS_DELTA	(PAGE_SIZE >> 8)
+#define ZS_SIZE_CLASSES		((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) \
+					/ ZS_SIZE_CLASS_DELTA + 1)
+
+/*
+ * A zspage is a group of up to this many 0-order pages that objects of
+ * one size class are laid out across, back to back, so that objects may
+ * straddle page boundaries and little is lost at the end of each page.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+/* End of user params */
+
+/*
+ * A handle is the address of a word, allocated from zs_handle_cache,
+ * holding the current location of the object:
+ *
+ *	<pfn of the zspage's first page><object index><pin bit>
+ *
+ * The pin bit is a bit spinlock held while the object is mapped or
+ * freed, and by compaction while it moves the object. On 32-bit with
+ * 4k pages this leaves 20 bits of pfn, i.e. 4GB of physical memory.
+ */
+#define HANDLE_PIN_BIT		0
+#define OBJ_TAG_BITS		1
+#define OBJ_INDEX_BITS		(PAGE_SHIFT - OBJ_TAG_BITS)
+#define OBJ_INDEX_MASK		((1UL << OBJ_INDEX_BITS) - 1)
+
+/*
+ * zspage->handles[] holds the handle of each allocated object, which is
+ * what lets compaction update it, or for free objects the index of the
+ * next free object shifted left by one, tagged with OBJ_FREE_TAG.
+ * Handles are word aligned so their low bit is clear.
+ */
+#define OBJ_FREE_TAG		1UL
+
+enum fullness_group {
+	ZS_ALMOST_FULL,		/* at least 3/4 of the objects in use */
+	ZS_ALMOST_EMPTY,
+	ZS_FULL,
+	NR_ZS_FULLNESS,
+};
+
+struct size_class;
+
+struct zspage {
+	struct list_head list;		/* in class->fullness_list[] */
+	struct size_class *class;
+	unsigned int inuse;		/* objects allocated */
+	unsigned int freeobj;		/* first free object */
+	enum fullness_group fullness;
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+	unsigned long handles[0];	/* objs_per_zspage entries */
+};
+
+struct size_class {
+	spinlock_t lock;
+	struct list_head fullness_list[NR_ZS_FULLNESS];
+	unsigned int size;		/* object size */
+	unsigned int pages_per_zspage;
+	unsigned int objs_per_zspage;
+};
+
+/* Per-CPU state of the object mapped by zs_map_object() */
+struct zs_map_area {
+	char *buf;			/* bounce buffer for split objects */
+	void *kaddr;			/* kmap of an unsplit object */
+	enum zs_mapmode mm;
+};
+
+struct zs_pool {
+	const char *name;
+	struct zs_map_area __percpu *map_area;
+	atomic_long_t pages_allocated;
+	struct size_class size_class[ZS_SIZE_CLASSES];
+};
+
+#endif
@@ -387,7 +387,7 @@ static int nvmap_reloc_pin_array(struct nvmap_client *client,
 
 		/* all of the handles are validated and get'ted prior to
 		 * calling this function, so casting is safe here */
-		pin = (struct nvmap_handle *)arr[i].pin_mem;
+		pin = (struct nvmap_handle *)(unsigned long)arr[i].pin_mem;
 
 		if (arr[i].patch_mem == (unsigned long)last_patch) {
 			patch = last_patch;
@@ -416,7 +416,7 @@ static int nvmap_reloc_pin_array(struct nvmap_client *client,
 		pfn = __phys_to_pfn(phys);
 		if (pfn != last_pfn) {
 			pgprot_t prot = nvmap_pgprot(patch, pgprot_kernel);
-			phys_addr_t kaddr = (phys_addr_t)addr;
+			unsigned long kaddr = (unsigned long)addr;
 			set_pte_at(&init_mm, kaddr, *pte, pfn_pte(pfn, prot));
 			flush_tlb_kernel_page(kaddr);
 			last_pfn = pfn;
@@ -600,7 +600,7 @@ phys_addr_t nvmap_pin(struct nvmap_client *client,
 		phys = handle_phys(h);
 	}
 
-	return ret ?: phys;
+	return ret ? (phys_addr_t)ret : phys;
 }
 
 phys_addr_t nvmap_handle_address(struct nvmap_client *c, unsigned long id)
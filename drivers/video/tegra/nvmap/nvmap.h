@@ -50,6 +50,12 @@
 
 #define nvmap_ref_to_id(_ref)		((unsigned long)(_ref)->handle)
 
+#ifdef CONFIG_NVMAP_HIGHMEM_ONLY
+#define GFP_NVMAP		(__GFP_HIGHMEM | __GFP_NOWARN)
+#else
+#define GFP_NVMAP		(GFP_KERNEL | __GFP_HIGHMEM | __GFP_NOWARN)
+#endif
+
 struct nvmap_device;
 struct page;
 struct tegra_iovmm_area;
@@ -88,6 +94,27 @@ struct nvmap_handle {
 	struct mutex lock;
 };
 
+#ifdef CONFIG_NVMAP_PAGE_POOLS
+#define NVMAP_POOL_WC		0
+#define NVMAP_POOL_UC		1
+#define NVMAP_POOL_IWB		2
+#define NVMAP_NUM_POOLS		3
+
+/* pages with a non-default kernel mapping attribute, kept around so that
+ * sysmem handle allocation can skip both the page allocator and the TLB
+ * flush which set_pages_array_* implies; pages are linked through page->lru */
+struct nvmap_page_pool {
+	spinlock_t lock;
+	struct list_head zero_list;	/* zeroed, ready to hand out */
+	struct list_head dirty_list;	/* released, not yet zeroed */
+	unsigned int nr_zero;
+	unsigned int nr_dirty;
+	unsigned int max_pages;
+	unsigned long hits;
+	unsigned long misses;
+};
+#endif
+
 struct nvmap_share {
 	struct tegra_iovmm_client *iovmm;
 	wait_queue_head_t pin_wait;
@@ -97,6 +124,13 @@ struct nvmap_share {
 	struct list_head *mru_lists;
 	int nr_mru;
 #endif
+#ifdef CONFIG_NVMAP_PAGE_POOLS
+	struct nvmap_page_pool pools[NVMAP_NUM_POOLS];
+	struct task_struct *pool_thread;
+	wait_queue_head_t pool_wait;
+	unsigned long pool_work;
+	struct shrinker pool_shrinker;
+#endif
 };
 
 struct nvmap_carveout_commit {
@@ -137,12 +171,24 @@ static inline void nvmap_ref_unlock(struct nvmap_client *priv)
 
 struct device *nvmap_client_to_device(struct nvmap_client *client);
 
+/* longest run of PTEs handed out by nvmap_alloc_pte_run */
+#define NVMAP_PTE_RUN_MAX	16
+
 pte_t **nvmap_alloc_pte(struct nvmap_device *dev, void **vaddr);
 
 pte_t **nvmap_alloc_pte_irq(struct nvmap_device *dev, void **vaddr);
 
+pte_t **nvmap_alloc_pte_run(struct nvmap_device *dev, unsigned int *nr,
+			    void **vaddr);
+
+void nvmap_map_pte_run(pte_t **pte, void *vaddr, const unsigned long *pfn,
+		       unsigned int nr, pgprot_t prot);
+
 void nvmap_free_pte(struct nvmap_device *dev, pte_t **pte);
 
+void nvmap_free_pte_run(struct nvmap_device *dev, pte_t **pte,
+			unsigned int nr);
+
 void nvmap_usecount_inc(struct nvmap_handle *h);
 void nvmap_usecount_dec(struct nvmap_handle *h);
 
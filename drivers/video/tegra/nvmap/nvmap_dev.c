@@ -45,8 +45,9 @@
 #include "nvmap_ioctl.h"
 #include "nvmap_mru.h"
 #include "nvmap_common.h"
+#include "nvmap_pp.h"
 
-#define NVMAP_NUM_PTES		64
+#define NVMAP_PTES_PER_CPU	64
 #define NVMAP_CARVEOUT_KILLER_RETRY_TIME 100 /* msecs */
 
 #ifdef CONFIG_NVMAP_CARVEOUT_KILLER
@@ -64,12 +65,21 @@ struct nvmap_carveout_node {
 	spinlock_t		clients_lock;
 };
 
+/* each CPU hands out kernel mapping slots from its own window of the
+ * remapping region, so that mappings made concurrently on different CPUs
+ * don't contend on one lock; a CPU whose window is full borrows a slot
+ * from the other windows */
+struct nvmap_pte_window {
+	spinlock_t	lock;
+	unsigned long	bits[BITS_TO_LONGS(NVMAP_PTES_PER_CPU)];
+	unsigned int	last;
+} ____cacheline_aligned_in_smp;
+
 struct nvmap_device {
 	struct vm_struct *vm_rgn;
-	pte_t		*ptes[NVMAP_NUM_PTES];
-	unsigned long	ptebits[NVMAP_NUM_PTES / BITS_PER_LONG];
-	unsigned int	lastpte;
-	spinlock_t	ptelock;
+	pte_t		**ptes;
+	struct nvmap_pte_window *pte_windows;
+	unsigned int	nr_pte_windows;
 
 	struct rb_root	handles;
 	spinlock_t	handle_lock;
@@ -139,66 +149,147 @@ struct nvmap_share *nvmap_get_share_from_dev(struct nvmap_device *dev)
 	return &dev->iovmm_master;
 }
 
-/* allocates a PTE for the caller's use; returns the PTE pointer or
- * a negative errno. may be called from IRQs */
-pte_t **nvmap_alloc_pte_irq(struct nvmap_device *dev, void **vaddr)
+static pte_t **pte_window_alloc(struct nvmap_device *dev, unsigned int w,
+				unsigned int nr, void **vaddr)
 {
+	struct nvmap_pte_window *win = &dev->pte_windows[w];
 	unsigned long flags;
 	unsigned long bit;
 
-	spin_lock_irqsave(&dev->ptelock, flags);
-	bit = find_next_zero_bit(dev->ptebits, NVMAP_NUM_PTES, dev->lastpte);
-	if (bit == NVMAP_NUM_PTES) {
-		bit = find_first_zero_bit(dev->ptebits, dev->lastpte);
-		if (bit == dev->lastpte)
-			bit = NVMAP_NUM_PTES;
-	}
-
-	if (bit == NVMAP_NUM_PTES) {
-		spin_unlock_irqrestore(&dev->ptelock, flags);
-		return ERR_PTR(-ENOMEM);
+	spin_lock_irqsave(&win->lock, flags);
+	bit = bitmap_find_next_zero_area(win->bits, NVMAP_PTES_PER_CPU,
+					 win->last, nr, 0);
+	if (bit + nr > NVMAP_PTES_PER_CPU && win->last)
+		bit = bitmap_find_next_zero_area(win->bits, NVMAP_PTES_PER_CPU,
+						 0, nr, 0);
+	if (bit + nr > NVMAP_PTES_PER_CPU) {
+		spin_unlock_irqrestore(&win->lock, flags);
+		return NULL;
 	}
 
-	dev->lastpte = bit;
-	set_bit(bit, dev->ptebits);
-	spin_unlock_irqrestore(&dev->ptelock, flags);
+	bitmap_set(win->bits, bit, nr);
+	win->last = (bit + nr) % NVMAP_PTES_PER_CPU;
+	spin_unlock_irqrestore(&win->lock, flags);
 
+	bit += w * NVMAP_PTES_PER_CPU;
 	*vaddr = dev->vm_rgn->addr + bit * PAGE_SIZE;
-	return &(dev->ptes[bit]);
+	return &dev->ptes[bit];
+}
+
+static pte_t **nvmap_try_alloc_ptes(struct nvmap_device *dev,
+				    unsigned int nr, void **vaddr)
+{
+	unsigned int first = raw_smp_processor_id() % dev->nr_pte_windows;
+	unsigned int w = first;
+	pte_t **pte;
+
+	do {
+		pte = pte_window_alloc(dev, w, nr, vaddr);
+		if (pte)
+			return pte;
+		w = (w + 1) % dev->nr_pte_windows;
+	} while (w != first);
+
+	return NULL;
 }
 
 /* allocates a PTE for the caller's use; returns the PTE pointer or
- * a negative errno. must be called from sleepable contexts */
-pte_t **nvmap_alloc_pte(struct nvmap_device *dev, void **vaddr)
+ * a negative errno. may be called from IRQs */
+pte_t **nvmap_alloc_pte_irq(struct nvmap_device *dev, void **vaddr)
 {
-	int ret;
+	pte_t **pte = nvmap_try_alloc_ptes(dev, 1, vaddr);
+
+	return pte ? pte : ERR_PTR(-ENOMEM);
+}
+
+/* allocates a run of up to *nr consecutive PTEs (at most
+ * NVMAP_PTE_RUN_MAX), which map consecutive kernel addresses starting at
+ * *vaddr. settles for a shorter run, returned in *nr, rather than waiting;
+ * only blocks when no PTE is free at all. must be called from sleepable
+ * contexts */
+pte_t **nvmap_alloc_pte_run(struct nvmap_device *dev, unsigned int *nr,
+			    void **vaddr)
+{
+	unsigned int want = clamp_t(unsigned int, *nr, 1, NVMAP_PTE_RUN_MAX);
 	pte_t **pte;
+	int ret;
+
+	for (; want > 1; want >>= 1) {
+		pte = nvmap_try_alloc_ptes(dev, want, vaddr);
+		if (pte) {
+			*nr = want;
+			return pte;
+		}
+	}
+
 	ret = wait_event_interruptible(dev->pte_wait,
-			!IS_ERR(pte = nvmap_alloc_pte_irq(dev, vaddr)));
+			(pte = nvmap_try_alloc_ptes(dev, 1, vaddr)) != NULL);
 
 	if (ret == -ERESTARTSYS)
 		return ERR_PTR(-EINTR);
 
+	*nr = 1;
 	return pte;
 }
 
-/* frees a PTE */
-void nvmap_free_pte(struct nvmap_device *dev, pte_t **pte)
+/* allocates a PTE for the caller's use; returns the PTE pointer or
+ * a negative errno. must be called from sleepable contexts */
+pte_t **nvmap_alloc_pte(struct nvmap_device *dev, void **vaddr)
+{
+	unsigned int nr = 1;
+
+	return nvmap_alloc_pte_run(dev, &nr, vaddr);
+}
+
+/* points a run of PTEs at the given page frames and flushes the stale
+ * translations for the whole run at once */
+void nvmap_map_pte_run(pte_t **pte, void *vaddr, const unsigned long *pfn,
+		       unsigned int nr, pgprot_t prot)
 {
+	unsigned long kaddr = (unsigned long)vaddr;
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+		set_pte_at(&init_mm, kaddr + i * PAGE_SIZE, pte[i],
+			   pfn_pte(pfn[i], prot));
+
+	if (nr == 1)
+		flush_tlb_kernel_page(kaddr);
+	else
+		flush_tlb_kernel_range(kaddr, kaddr + nr * PAGE_SIZE);
+}
+
+/* frees a run of PTEs */
+void nvmap_free_pte_run(struct nvmap_device *dev, pte_t **pte,
+			unsigned int nr)
+{
+	struct nvmap_pte_window *win;
 	unsigned long addr;
 	unsigned int bit = pte - dev->ptes;
 	unsigned long flags;
+	unsigned int i;
 
-	if (WARN_ON(bit >= NVMAP_NUM_PTES))
+	if (WARN_ON(bit + nr > dev->nr_pte_windows * NVMAP_PTES_PER_CPU))
 		return;
 
 	addr = (unsigned long)dev->vm_rgn->addr + bit * PAGE_SIZE;
-	set_pte_at(&init_mm, addr, *pte, 0);
+	for (i = 0; i < nr; i++)
+		set_pte_at(&init_mm, addr + i * PAGE_SIZE, pte[i], 0);
+
+	win = &dev->pte_windows[bit / NVMAP_PTES_PER_CPU];
+	spin_lock_irqsave(&win->lock, flags);
+	bitmap_clear(win->bits, bit % NVMAP_PTES_PER_CPU, nr);
+	spin_unlock_irqrestore(&win->lock, flags);
 
-	spin_lock_irqsave(&dev->ptelock, flags);
-	clear_bit(bit, dev->ptebits);
-	spin_unlock_irqrestore(&dev->ptelock, flags);
-	wake_up(&dev->pte_wait);
+	smp_mb();
+	if (waitqueue_active(&dev->pte_wait))
+		wake_up(&dev->pte_wait);
+}
+
+/* frees a PTE */
+void nvmap_free_pte(struct nvmap_device *dev, pte_t **pte)
+{
+	nvmap_free_pte_run(dev, pte, 1);
 }
 
 /* verifies that the handle ref value "ref" is a valid handle ref for the
@@ -278,9 +369,10 @@ unsigned long nvmap_carveout_usage(struct nvmap_client *c,
 int nvmap_flush_heap_block(struct nvmap_client *client,
 	struct nvmap_heap_block *block, size_t len, unsigned int prot)
 {
+	unsigned long pfn[NVMAP_PTE_RUN_MAX];
+	unsigned int nr_pte;
 	pte_t **pte;
 	void *addr;
-	phys_addr_t kaddr;
 	phys_addr_t phys = block->base;
 	phys_addr_t end = block->base + len;
 
@@ -294,28 +386,29 @@ int nvmap_flush_heap_block(struct nvmap_client *client,
 		goto out;
 	}
 
-	pte = nvmap_alloc_pte((client ? client->dev : nvmap_dev), &addr);
+	nr_pte = PAGE_ALIGN((phys & ~PAGE_MASK) + len) >> PAGE_SHIFT;
+	pte = nvmap_alloc_pte_run((client ? client->dev : nvmap_dev),
+				  &nr_pte, &addr);
 	if (IS_ERR(pte))
 		return PTR_ERR(pte);
 
-	kaddr = (phys_addr_t)addr;
-
 	while (phys < end) {
-		phys_addr_t next = (phys + PAGE_SIZE) & PAGE_MASK;
-		unsigned long pfn = __phys_to_pfn(phys);
-		void *base = (void *)kaddr + (phys & ~PAGE_MASK);
-
-		next = min(next, end);
-		set_pte_at(&init_mm, kaddr, *pte, pfn_pte(pfn, pgprot_kernel));
-		flush_tlb_kernel_page(kaddr);
-		__cpuc_flush_dcache_area(base, next - phys);
-		phys = next;
+		unsigned long off = phys & ~PAGE_MASK;
+		size_t size = min_t(size_t, end - phys,
+				    nr_pte * PAGE_SIZE - off);
+		unsigned int i, n = PAGE_ALIGN(off + size) >> PAGE_SHIFT;
+
+		for (i = 0; i < n; i++)
+			pfn[i] = __phys_to_pfn(phys) + i;
+		nvmap_map_pte_run(pte, addr, pfn, n, pgprot_kernel);
+		__cpuc_flush_dcache_area(addr + off, size);
+		phys += size;
 	}
 
 	if (prot != NVMAP_HANDLE_INNER_CACHEABLE)
 		outer_flush_range(block->base, block->base + len);
 
-	nvmap_free_pte((client ? client->dev : nvmap_dev), pte);
+	nvmap_free_pte_run((client ? client->dev : nvmap_dev), pte, nr_pte);
 out:
 	wmb();
 	return 0;
@@ -429,7 +522,7 @@ end:
 			goto out;
 		}
 		pr_info("carveout_killer: killing process %d with oom_adj %d "
-			"to reclaim %d (for process with oom_adj %d)\n",
+			"to reclaim %zu (for process with oom_adj %d)\n",
 			selected_task->pid, selected_oom_adj,
 			selected_size, current_oom_adj);
 		force_sig(SIGKILL, selected_task);
@@ -494,12 +587,12 @@ struct nvmap_heap_block *nvmap_carveout_alloc(struct nvmap_client *client,
 				get_task_comm(task_comm, client->task);
 			else
 				task_comm[0] = 0;
-			pr_info("%s: failed to allocate %u bytes for "
+			pr_info("%s: failed to allocate %zu bytes for "
 				"process %s, firing carveout "
 				"killer!\n", __func__, handle->size, task_comm);
 
 		} else {
-			pr_info("%s: still can't allocate %u bytes, "
+			pr_info("%s: still can't allocate %zu bytes, "
 				"attempt %d!\n", __func__, handle->size, count);
 		}
 
@@ -865,6 +958,10 @@ static long nvmap_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		err = nvmap_ioctl_cache_maint(filp, uarg);
 		break;
 
+	case NVMAP_IOC_CACHE_LIST:
+		err = nvmap_ioctl_cache_maint_list(filp, uarg);
+		break;
+
 	default:
 		return -ENOTTY;
 	}
@@ -893,8 +990,8 @@ static void nvmap_vma_close(struct vm_area_struct *vma)
 
 	if (priv) {
 		if (priv->handle) {
+			BUG_ON(!priv->handle->usecount);
 			nvmap_usecount_dec(priv->handle);
-			BUG_ON(priv->handle->usecount < 0);
 		}
 		if (!atomic_dec_return(&priv->count)) {
 			if (priv->handle)
@@ -983,11 +1080,11 @@ static void allocations_stringify(struct nvmap_client *client,
 			rb_entry(n, struct nvmap_handle_ref, node);
 		struct nvmap_handle *handle = ref->handle;
 		if (handle->alloc && !handle->heap_pgalloc) {
-			seq_printf(s, "%-18s %-18s %8lx %10u %8x\n", "", "",
+			seq_printf(s, "%-18s %-18s %8lx %10zu %8x\n", "", "",
 					(unsigned long)(handle->carveout->base),
 					handle->size, handle->userflags);
 		} else if (handle->alloc && handle->heap_pgalloc) {
-			seq_printf(s, "%-18s %-18s %8lx %10u %8x\n", "", "",
+			seq_printf(s, "%-18s %-18s %8lx %10zu %8x\n", "", "",
 					base, handle->size, handle->userflags);
 		}
 	}
@@ -1009,7 +1106,7 @@ static int nvmap_debug_allocations_show(struct seq_file *s, void *unused)
 		struct nvmap_client *client =
 			get_client_from_carveout_commit(node, commit);
 		client_stringify(client, s);
-		seq_printf(s, " %10u\n", commit->commit);
+		seq_printf(s, " %10zu\n", commit->commit);
 		allocations_stringify(client, s);
 		seq_printf(s, "\n");
 		total += commit->commit;
@@ -1047,7 +1144,7 @@ static int nvmap_debug_clients_show(struct seq_file *s, void *unused)
 		struct nvmap_client *client =
 			get_client_from_carveout_commit(node, commit);
 		client_stringify(client, s);
-		seq_printf(s, " %10u\n", commit->commit);
+		seq_printf(s, " %10zu\n", commit->commit);
 		total += commit->commit;
 	}
 	seq_printf(s, "%-18s %18s %8u %10u\n", "total", "", 0, total);
@@ -1192,7 +1289,18 @@ static int nvmap_probe(struct platform_device *pdev)
 		goto fail;
 	}
 #endif
-	dev->vm_rgn = alloc_vm_area(NVMAP_NUM_PTES * PAGE_SIZE);
+	dev->nr_pte_windows = nr_cpu_ids;
+	dev->pte_windows = kcalloc(dev->nr_pte_windows,
+				   sizeof(*dev->pte_windows), GFP_KERNEL);
+	dev->ptes = kcalloc(dev->nr_pte_windows * NVMAP_PTES_PER_CPU,
+			    sizeof(*dev->ptes), GFP_KERNEL);
+	if (!dev->pte_windows || !dev->ptes) {
+		e = -ENOMEM;
+		dev_err(&pdev->dev, "out of memory for remapping PTEs\n");
+		goto fail;
+	}
+	dev->vm_rgn = alloc_vm_area(dev->nr_pte_windows *
+				    NVMAP_PTES_PER_CPU * PAGE_SIZE);
 	if (!dev->vm_rgn) {
 		e = -ENOMEM;
 		dev_err(&pdev->dev, "couldn't allocate remapping region\n");
@@ -1203,13 +1311,19 @@ static int nvmap_probe(struct platform_device *pdev)
 		dev_err(&pdev->dev, "couldn't initialize MRU lists\n");
 		goto fail;
 	}
+	e = nvmap_page_pool_init(&dev->iovmm_master);
+	if (e) {
+		dev_err(&pdev->dev, "couldn't initialize page pools\n");
+		goto fail;
+	}
 
-	spin_lock_init(&dev->ptelock);
+	for (i = 0; i < dev->nr_pte_windows; i++)
+		spin_lock_init(&dev->pte_windows[i].lock);
 	spin_lock_init(&dev->handle_lock);
 	INIT_LIST_HEAD(&dev->clients);
 	spin_lock_init(&dev->clients_lock);
 
-	for (i = 0; i < NVMAP_NUM_PTES; i++) {
+	for (i = 0; i < dev->nr_pte_windows * NVMAP_PTES_PER_CPU; i++) {
 		unsigned long addr;
 		pgd_t *pgd;
 		pud_t *pud;
@@ -1286,7 +1400,7 @@ static int nvmap_probe(struct platform_device *pdev)
 					    &heap_extra_attr_group))
 			dev_warn(&pdev->dev, "couldn't add extra attributes\n");
 
-		dev_info(&pdev->dev, "created carveout %s (%uKiB)\n",
+		dev_info(&pdev->dev, "created carveout %s (%zuKiB)\n",
 			 co->name, co->size / 1024);
 
 		if (!IS_ERR_OR_NULL(nvmap_debug_root)) {
@@ -1297,6 +1411,8 @@ static int nvmap_probe(struct platform_device *pdev)
 				    node, &debug_clients_fops);
 				debugfs_create_file("allocations", 0664,
 				    heap_root, node, &debug_allocations_fops);
+				nvmap_heap_debugfs_init(node->carveout,
+							heap_root);
 			}
 		}
 	}
@@ -1309,20 +1425,25 @@ static int nvmap_probe(struct platform_device *pdev)
 			debugfs_create_file("allocations", 0664, iovmm_root,
 				dev, &debug_iovmm_allocations_fops);
 		}
+		nvmap_cache_maint_debugfs_init(nvmap_debug_root);
 	}
 
 	platform_set_drvdata(pdev, dev);
 	nvmap_dev = dev;
 
+	if (nvmap_page_pool_create_group(dev->dev_user.this_device))
+		dev_warn(&pdev->dev, "couldn't add page pool attributes\n");
+
 	return 0;
 fail_heaps:
-	for (i = 0; i < dev->nr_carveouts; i++) {
+	for (i = 0; i < (unsigned int)dev->nr_carveouts; i++) {
 		struct nvmap_carveout_node *node = &dev->heaps[i];
 		nvmap_heap_remove_group(node->carveout, &heap_extra_attr_group);
 		nvmap_heap_destroy(node->carveout);
 	}
 fail:
 	kfree(dev->heaps);
+	nvmap_page_pool_destroy(&dev->iovmm_master);
 	nvmap_mru_destroy(&dev->iovmm_master);
 	if (dev->dev_super.minor != MISC_DYNAMIC_MINOR)
 		misc_deregister(&dev->dev_super);
@@ -1332,6 +1453,8 @@ fail:
 		tegra_iovmm_free_client(dev->iovmm_master.iovmm);
 	if (dev->vm_rgn)
 		free_vm_area(dev->vm_rgn);
+	kfree(dev->ptes);
+	kfree(dev->pte_windows);
 	kfree(dev);
 	nvmap_dev = NULL;
 	return e;
@@ -1344,6 +1467,7 @@ static int nvmap_remove(struct platform_device *pdev)
 	struct nvmap_handle *h;
 	int i;
 
+	nvmap_page_pool_remove_group(dev->dev_user.this_device);
 	misc_deregister(&dev->dev_super);
 	misc_deregister(&dev->dev_user);
 
@@ -1356,6 +1480,7 @@ static int nvmap_remove(struct platform_device *pdev)
 	if (!IS_ERR_OR_NULL(dev->iovmm_master.iovmm))
 		tegra_iovmm_free_client(dev->iovmm_master.iovmm);
 
+	nvmap_page_pool_destroy(&dev->iovmm_master);
 	nvmap_mru_destroy(&dev->iovmm_master);
 
 	for (i = 0; i < dev->nr_carveouts; i++) {
@@ -1366,6 +1491,8 @@ static int nvmap_remove(struct platform_device *pdev)
 	kfree(dev->heaps);
 
 	free_vm_area(dev->vm_rgn);
+	kfree(dev->ptes);
+	kfree(dev->pte_windows);
 	kfree(dev);
 	nvmap_dev = NULL;
 	return 0;
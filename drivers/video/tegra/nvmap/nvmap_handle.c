@@ -42,6 +42,7 @@
 #include "nvmap.h"
 #include "nvmap_mru.h"
 #include "nvmap_common.h"
+#include "nvmap_pp.h"
 
 #define PRINT_CARVEOUT_CONVERSION 0
 #if PRINT_CARVEOUT_CONVERSION
@@ -52,11 +53,6 @@
 
 #define NVMAP_SECURE_HEAPS	(NVMAP_HEAP_CARVEOUT_IRAM | NVMAP_HEAP_IOVMM | \
 				 NVMAP_HEAP_CARVEOUT_VPR)
-#ifdef CONFIG_NVMAP_HIGHMEM_ONLY
-#define GFP_NVMAP		(__GFP_HIGHMEM | __GFP_NOWARN)
-#else
-#define GFP_NVMAP		(GFP_KERNEL | __GFP_HIGHMEM | __GFP_NOWARN)
-#endif
 /* handles may be arbitrarily large (16+MiB), and any handle allocated from
  * the kernel (i.e., not a carveout handle) includes its array of pages. to
  * preserve kmalloc space, if the array of pages exceeds PAGELIST_VMALLOC_MIN,
@@ -82,10 +78,31 @@ static inline void altfree(void *ptr, size_t len)
 		kfree(ptr);
 }
 
+/* returns pages to the page pool, restoring the attributes of (and
+ * freeing) whatever the pool has no room for */
+static void handle_pages_free(struct nvmap_share *share, unsigned long flags,
+			      struct page **pages, unsigned int nr_page)
+{
+	unsigned int i;
+
+	nr_page = nvmap_page_pool_release(share, flags, pages, nr_page);
+	if (!nr_page)
+		return;
+
+	if (flags == NVMAP_HANDLE_WRITE_COMBINE ||
+	    flags == NVMAP_HANDLE_UNCACHEABLE ||
+	    flags == NVMAP_HANDLE_INNER_CACHEABLE)
+		set_pages_array_wb(pages, nr_page);
+
+	for (i = 0; i < nr_page; i++)
+		__free_page(pages[i]);
+}
+
 void _nvmap_handle_free(struct nvmap_handle *h)
 {
 	struct nvmap_device *dev = h->dev;
-	unsigned int i, nr_page;
+	struct nvmap_share *share = nvmap_get_share_from_dev(dev);
+	unsigned int nr_page;
 
 	if (nvmap_handle_remove(dev, h) != 0)
 		return;
@@ -104,19 +121,12 @@ void _nvmap_handle_free(struct nvmap_handle *h)
 	BUG_ON(h->size & ~PAGE_MASK);
 	BUG_ON(!h->pgalloc.pages);
 
-	nvmap_mru_remove(nvmap_get_share_from_dev(dev), h);
-
-	/* Restore page attributes. */
-	if (h->flags == NVMAP_HANDLE_WRITE_COMBINE ||
-	    h->flags == NVMAP_HANDLE_UNCACHEABLE ||
-	    h->flags == NVMAP_HANDLE_INNER_CACHEABLE)
-		set_pages_array_wb(h->pgalloc.pages, nr_page);
+	nvmap_mru_remove(share, h);
 
 	if (h->pgalloc.area)
 		tegra_iovmm_free_vm(h->pgalloc.area);
 
-	for (i = 0; i < nr_page; i++)
-		__free_page(h->pgalloc.pages[i]);
+	handle_pages_free(share, h->flags, h->pgalloc.pages, nr_page);
 
 	altfree(h->pgalloc.pages, nr_page * sizeof(struct page *));
 
@@ -149,8 +159,7 @@ static int handle_page_alloc(struct nvmap_client *client,
 {
 	size_t size = PAGE_ALIGN(h->size);
 	unsigned int nr_page = size >> PAGE_SHIFT;
-	pgprot_t prot;
-	unsigned int i = 0;
+	unsigned int i = 0, got = 0;
 	struct page **pages;
 	unsigned long base;
 
@@ -158,25 +167,30 @@ static int handle_page_alloc(struct nvmap_client *client,
 	if (!pages)
 		return -ENOMEM;
 
-	prot = nvmap_pgprot(h, pgprot_kernel);
-
 #ifdef CONFIG_NVMAP_ALLOW_SYSMEM
 	if (nr_page == 1)
 		contiguous = true;
 #endif
 
 	h->pgalloc.area = NULL;
+	if (!contiguous || nr_page == 1)
+		got = nvmap_page_pool_alloc(client->share, h->flags,
+					    pages, nr_page);
+
 	if (contiguous) {
 		struct page *page;
-		page = nvmap_alloc_pages_exact(GFP_NVMAP, size);
-		if (!page)
-			goto fail;
 
-		for (i = 0; i < nr_page; i++)
-			pages[i] = nth_page(page, i);
+		if (!got) {
+			page = nvmap_alloc_pages_exact(GFP_NVMAP, size);
+			if (!page)
+				goto fail;
+
+			for (i = 0; i < nr_page; i++)
+				pages[i] = nth_page(page, i);
+		}
 
 	} else {
-		for (i = 0; i < nr_page; i++) {
+		for (i = got; i < nr_page; i++) {
 			pages[i] = nvmap_alloc_pages_exact(GFP_NVMAP,
 				PAGE_SIZE);
 			if (!pages[i])
@@ -185,7 +199,8 @@ static int handle_page_alloc(struct nvmap_client *client,
 
 #ifndef CONFIG_NVMAP_RECLAIM_UNPINNED_VM
 		h->pgalloc.area = tegra_iovmm_create_vm(client->share->iovmm,
-					NULL, size, h->align, prot,
+					NULL, size, h->align,
+					nvmap_pgprot(h, pgprot_kernel),
 					h->pgalloc.iovm_addr);
 		if (!h->pgalloc.area)
 			goto fail;
@@ -194,18 +209,21 @@ static int handle_page_alloc(struct nvmap_client *client,
 #endif
 	}
 
-	/* Update the pages mapping in kernel page table. */
-	if (h->flags == NVMAP_HANDLE_WRITE_COMBINE)
-		set_pages_array_wc(pages, nr_page);
+	/* Update the pages mapping in kernel page table; pages taken from
+	 * the page pool already have the right attributes and are zeroed. */
+	if (got == nr_page)
+		goto skip_cache_flush;
+	else if (h->flags == NVMAP_HANDLE_WRITE_COMBINE)
+		set_pages_array_wc(pages + got, nr_page - got);
 	else if (h->flags == NVMAP_HANDLE_UNCACHEABLE)
-		set_pages_array_uc(pages, nr_page);
+		set_pages_array_uc(pages + got, nr_page - got);
 	else if (h->flags == NVMAP_HANDLE_INNER_CACHEABLE)
-		set_pages_array_iwb(pages, nr_page);
+		set_pages_array_iwb(pages + got, nr_page - got);
 	else
 		goto skip_cache_flush;
 
 	/* Flush the cache for allocated high mem pages only */
-	for (i = 0; i < nr_page; i++) {
+	for (i = got; i < nr_page; i++) {
 		if (PageHighMem(pages[i])) {
 			__flush_dcache_page(page_mapping(pages[i]), pages[i]);
 			base = page_to_phys(pages[i]);
@@ -221,8 +239,10 @@ skip_cache_flush:
 	return 0;
 
 fail:
-	while (i--)
+	while (i-- > got)
 		__free_page(pages[i]);
+	if (got)
+		handle_pages_free(client->share, h->flags, pages, got);
 	altfree(pages, nr_page * sizeof(*pages));
 	wmb();
 	return -ENOMEM;
@@ -276,7 +296,7 @@ static void alloc_handle(struct nvmap_client *client,
 
 	} else if (type & __NVMAP_HEAP_IOVMM) {
 		size_t reserved = PAGE_ALIGN(h->size);
-		int commit = 0;
+		size_t commit = 0;
 		int ret;
 
 		/* increment the committed IOVM space prior to allocation
@@ -592,7 +612,7 @@ struct nvmap_handle_ref *nvmap_duplicate_handle_id(struct nvmap_client *client,
 	/* verify that adding this handle to the process' access list
 	 * won't exceed the IOVM limit */
 	if (h->heap_pgalloc && !h->pgalloc.contig) {
-		int oc;
+		size_t oc;
 		oc = atomic_add_return(h->size, &client->iovm_commit);
 		if (oc > client->iovm_limit && !client->super) {
 			atomic_sub(h->size, &client->iovm_commit);
@@ -20,13 +20,17 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#include <linux/debugfs.h>
 #include <linux/device.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
 #include <linux/mm.h>
 #include <linux/mutex.h>
+#include <linux/rbtree.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/err.h>
+#include <linux/workqueue.h>
 
 #include <mach/nvmap.h>
 #include "nvmap.h"
@@ -68,10 +72,32 @@
  * and to ensure that the minimum free block size in the carveout (i.e., the
  * "small" threshold) is still a meaningful size.
  *
+ * free blocks are kept in size classes of power-of-two pages, each of which
+ * is an rbtree sorted by size and then address. allocations take the
+ * smallest free block that fits (lowest address first among equal sizes),
+ * so finding a block is O(log n) in the number of free blocks rather than a
+ * walk of the whole free list. all_list stays sorted by address and is used
+ * to merge a freed block with its neighbours.
+ *
+ * with CONFIG_NVMAP_CARVEOUT_COMPACTOR, frees which leave the heap
+ * fragmented also schedule a background compactor. it moves unpinned,
+ * unmapped blocks down into the hole below them, a few at a time, and drops
+ * the heap lock between steps so allocations are not held up by long copies.
  */
 
 #define MAX_BUDDY_NR	128	/* maximum buddies in a buddy allocator */
 
+/* free blocks are binned by fls(size in pages); the last class also holds
+ * everything larger */
+#define NVMAP_HEAP_SIZE_CLASSES	16
+
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+#define COMPACT_STEP_BLOCKS	8		/* blocks moved per step */
+#define COMPACT_STEP_BYTES	(2 << 20)	/* bytes copied per step */
+#define COMPACT_START_DELAY	(HZ / 2)	/* let bursts of frees settle */
+#define COMPACT_STEP_DELAY	(HZ / 50)
+#endif
+
 enum direction {
 	TOP_DOWN,
 	BOTTOM_UP
@@ -111,7 +137,7 @@ struct list_block {
 	size_t size;
 	size_t align;
 	struct nvmap_heap *heap;
-	struct list_head free_list;
+	struct rb_node free_node;
 };
 
 struct combo_block {
@@ -133,9 +159,19 @@ struct buddy_heap {
 	struct buddy_bits bitmap[MAX_BUDDY_NR];
 };
 
+struct heap_size_class {
+	struct rb_root free;		/* free blocks, by size then address */
+	unsigned int free_count;
+	size_t free_size;
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long fails;
+};
+
 struct nvmap_heap {
 	struct list_head all_list;
-	struct list_head free_list;
+	struct heap_size_class classes[NVMAP_HEAP_SIZE_CLASSES];
+	unsigned long free_classes;	/* classes with free blocks */
 	struct mutex lock;
 	struct list_head buddy_list;
 	unsigned int min_buddy_shift;
@@ -144,6 +180,16 @@ struct nvmap_heap {
 	const char *name;
 	void *arg;
 	struct device dev;
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+	struct delayed_work compact_work;
+	phys_addr_t compact_cursor;	/* where the next step resumes */
+	unsigned int compact_fast;	/* synchronous compactions */
+	unsigned int compact_full;
+	unsigned int compact_steps;	/* background compaction */
+	unsigned int compact_passes;
+	unsigned long compact_moved;
+	unsigned long long compact_bytes;
+#endif
 };
 
 static struct kmem_cache *buddy_heap_cache;
@@ -160,6 +206,142 @@ static inline unsigned int order_of(size_t len, size_t min_shift)
 	return fls(len)-1;
 }
 
+static inline unsigned int size_class(size_t len)
+{
+	return min_t(unsigned int, fls(len >> PAGE_SHIFT),
+		     NVMAP_HEAP_SIZE_CLASSES - 1);
+}
+
+/* returns the allocated size of a block; must be called while holding the
+ * heap's lock. */
+static size_t block_len(struct nvmap_heap_block *b)
+{
+	if (b->type == BLOCK_BUDDY) {
+		struct buddy_block *bb;
+		struct buddy_heap *bh;
+		unsigned int shift, index;
+
+		bb = container_of(b, struct buddy_block, block);
+		bh = bb->heap;
+		shift = parent_of(bh)->min_buddy_shift;
+		index = (b->base - bh->heap_base->block.base) >> shift;
+		return 1 << (bh->bitmap[index].order + shift);
+	}
+	return container_of(b, struct list_block, block)->size;
+}
+
+static void free_block_insert(struct nvmap_heap *heap, struct list_block *b)
+{
+	unsigned int class = size_class(b->size);
+	struct heap_size_class *c = &heap->classes[class];
+	struct rb_node **p = &c->free.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*p) {
+		struct list_block *n;
+
+		parent = *p;
+		n = rb_entry(parent, struct list_block, free_node);
+		if (b->size < n->size ||
+		    (b->size == n->size && b->block.base < n->block.base))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&b->free_node, parent, p);
+	rb_insert_color(&b->free_node, &c->free);
+
+	c->free_count++;
+	c->free_size += b->size;
+	__set_bit(class, &heap->free_classes);
+}
+
+static void free_block_remove(struct nvmap_heap *heap, struct list_block *b)
+{
+	unsigned int class = size_class(b->size);
+	struct heap_size_class *c = &heap->classes[class];
+
+	rb_erase(&b->free_node, &c->free);
+	c->free_count--;
+	c->free_size -= b->size;
+	if (RB_EMPTY_ROOT(&c->free))
+		__clear_bit(class, &heap->free_classes);
+}
+
+static size_t free_block_largest(struct nvmap_heap *heap)
+{
+	struct rb_node *n;
+
+	if (!heap->free_classes)
+		return 0;
+	n = rb_last(&heap->classes[__fls(heap->free_classes)].free);
+	return rb_entry(n, struct list_block, free_node)->size;
+}
+
+static bool free_block_fits(struct list_block *b, size_t len, size_t align,
+			    enum direction dir, unsigned long *fix_base)
+{
+	unsigned long base;
+
+	if (b->size < len)
+		return false;
+
+	if (dir == BOTTOM_UP) {
+		base = ALIGN(b->block.base, align);
+		if (base - b->block.base > b->size - len)
+			return false;
+	} else {
+		base = (b->block.base + b->size - len) & ~(align - 1);
+		if (base < b->block.base)
+			return false;
+	}
+	*fix_base = base;
+	return true;
+}
+
+/* best fit: the smallest free block which can hold len bytes at the
+ * requested alignment. */
+static struct list_block *free_block_find(struct nvmap_heap *heap,
+					  size_t len, size_t align,
+					  enum direction dir,
+					  unsigned long *fix_base)
+{
+	unsigned int class = size_class(len);
+
+	for (class = find_next_bit(&heap->free_classes,
+				   NVMAP_HEAP_SIZE_CLASSES, class);
+	     class < NVMAP_HEAP_SIZE_CLASSES;
+	     class = find_next_bit(&heap->free_classes,
+				   NVMAP_HEAP_SIZE_CLASSES, class + 1)) {
+		struct rb_node *n = heap->classes[class].free.rb_node;
+		struct rb_node *first = NULL;
+
+		/* leftmost block of at least len bytes */
+		while (n) {
+			struct list_block *b;
+
+			b = rb_entry(n, struct list_block, free_node);
+			if (b->size >= len) {
+				first = n;
+				n = n->rb_left;
+			} else {
+				n = n->rb_right;
+			}
+		}
+
+		/* only an alignment larger than the spare space in a block
+		 * can make it unsuitable, so this rarely goes past one */
+		for (n = first; n; n = rb_next(n)) {
+			struct list_block *b;
+
+			b = rb_entry(n, struct list_block, free_node);
+			if (free_block_fits(b, len, align, dir, fix_base))
+				return b;
+		}
+	}
+	return NULL;
+}
+
 /* returns the free size in bytes of the buddy heap; must be called while
  * holding the parent heap's lock. */
 static void buddy_stat(struct buddy_heap *heap, struct heap_stat *stat)
@@ -191,6 +373,7 @@ static unsigned long heap_stat(struct nvmap_heap *heap, struct heap_stat *stat)
 	struct buddy_heap *bh;
 	struct list_block *l = NULL;
 	unsigned long base = -1ul;
+	unsigned int class;
 
 	memset(stat, 0, sizeof(*stat));
 	mutex_lock(&heap->lock);
@@ -210,11 +393,11 @@ static unsigned long heap_stat(struct nvmap_heap *heap, struct heap_stat *stat)
 		stat->count--;
 	}
 
-	list_for_each_entry(l, &heap->free_list, free_list) {
-		stat->free += l->size;
-		stat->free_count++;
-		stat->free_largest = max(l->size, stat->free_largest);
+	for (class = 0; class < NVMAP_HEAP_SIZE_CLASSES; class++) {
+		stat->free += heap->classes[class].free_size;
+		stat->free_count += heap->classes[class].free_count;
 	}
+	stat->free_largest = max(free_block_largest(heap), stat->free_largest);
 	mutex_unlock(&heap->lock);
 
 	return base;
@@ -284,17 +467,17 @@ static ssize_t heap_stat_show(struct device *dev,
 	base = heap_stat(heap, &stat);
 
 	if (attr == &heap_stat_total_max)
-		return sprintf(buf, "%u\n", stat.largest);
+		return sprintf(buf, "%zu\n", stat.largest);
 	else if (attr == &heap_stat_total_count)
-		return sprintf(buf, "%u\n", stat.count);
+		return sprintf(buf, "%zu\n", stat.count);
 	else if (attr == &heap_stat_total_size)
-		return sprintf(buf, "%u\n", stat.total);
+		return sprintf(buf, "%zu\n", stat.total);
 	else if (attr == &heap_stat_free_max)
-		return sprintf(buf, "%u\n", stat.free_largest);
+		return sprintf(buf, "%zu\n", stat.free_largest);
 	else if (attr == &heap_stat_free_count)
-		return sprintf(buf, "%u\n", stat.free_count);
+		return sprintf(buf, "%zu\n", stat.free_count);
 	else if (attr == &heap_stat_free_size)
-		return sprintf(buf, "%u\n", stat.free);
+		return sprintf(buf, "%zu\n", stat.free);
 	else if (attr == &heap_stat_base)
 		return sprintf(buf, "%08lx\n", base);
 	else
@@ -377,7 +560,7 @@ static struct buddy_heap *do_buddy_free(struct nvmap_heap_block *block)
 	}
 
 	kmem_cache_free(block_cache, b);
-	if ((1 << h->bitmap[0].order) == h->nr_buddies)
+	if ((1U << h->bitmap[0].order) == h->nr_buddies)
 		return h;
 
 	return NULL;
@@ -416,40 +599,28 @@ static struct nvmap_heap_block *do_heap_alloc(struct nvmap_heap *heap,
 	dir = (len <= heap->small_alloc) ? BOTTOM_UP : TOP_DOWN;
 #endif
 
-	if (dir == BOTTOM_UP) {
-		list_for_each_entry(i, &heap->free_list, free_list) {
-			size_t fix_size;
-			fix_base = ALIGN(i->block.base, align);
-			fix_size = i->size - (fix_base - i->block.base);
-
-			/* needed for compaction. relocated chunk
-			 * should never go up */
-			if (base_max && fix_base > base_max)
+	if (base_max) {
+		/* needed for compaction. relocated chunk should never go
+		 * up, so take the lowest hole below it which fits */
+		list_for_each_entry(i, &heap->all_list, all_list) {
+			if (i->block.type != BLOCK_EMPTY)
+				continue;
+			if (ALIGN(i->block.base, align) > base_max)
 				break;
-
-			if (fix_size >= len) {
+			if (free_block_fits(i, len, align, dir, &fix_base)) {
 				b = i;
 				break;
 			}
 		}
 	} else {
-		list_for_each_entry_reverse(i, &heap->free_list, free_list) {
-			if (i->size >= len) {
-				fix_base = i->block.base + i->size - len;
-				fix_base &= ~(align-1);
-				if (fix_base >= i->block.base) {
-					b = i;
-					break;
-				}
-			}
-		}
+		b = free_block_find(heap, len, align, dir, &fix_base);
 	}
 
 	if (!b)
 		return NULL;
 
-	if (dir == BOTTOM_UP)
-		b->block.type = BLOCK_FIRST_FIT;
+	free_block_remove(heap, b);
+	b->block.type = BLOCK_FIRST_FIT;
 
 	/* split free block */
 	if (b->block.base != fix_base) {
@@ -469,8 +640,8 @@ static struct nvmap_heap_block *do_heap_alloc(struct nvmap_heap *heap,
 		b->block.base = fix_base;
 		b->orig_addr = fix_base;
 		b->size -= rem->size;
-		list_add_tail(&rem->all_list,  &b->all_list);
-		list_add_tail(&rem->free_list, &b->free_list);
+		list_add_tail(&rem->all_list, &b->all_list);
+		free_block_insert(heap, rem);
 	}
 
 	b->orig_addr = b->block.base;
@@ -487,12 +658,11 @@ static struct nvmap_heap_block *do_heap_alloc(struct nvmap_heap *heap,
 		BUG_ON(rem->size > b->size);
 		rem->orig_addr = rem->block.base;
 		b->size = len;
-		list_add(&rem->all_list,  &b->all_list);
-		list_add(&rem->free_list, &b->free_list);
+		list_add(&rem->all_list, &b->all_list);
+		free_block_insert(heap, rem);
 	}
 
 out:
-	list_del(&b->free_list);
 	b->heap = heap;
 	b->mem_prot = mem_prot;
 	b->align = align;
@@ -506,12 +676,14 @@ static void freelist_debug(struct nvmap_heap *heap, const char *title,
 	int i;
 	struct list_block *n;
 
-	dev_debug(&heap->dev, "%s\n", title);
+	dev_dbg(&heap->dev, "%s\n", title);
 	i = 0;
-	list_for_each_entry(n, &heap->free_list, free_list) {
-		dev_debug(&heap->dev, "\t%d [%p..%p]%s\n", i, (void *)n->orig_addr,
-			  (void *)(n->orig_addr + n->size),
-			  (n == token) ? "<--" : "");
+	list_for_each_entry(n, &heap->all_list, all_list) {
+		if (n->block.type != BLOCK_EMPTY && n != token)
+			continue;
+		dev_dbg(&heap->dev, "\t%d [%p..%p]%s\n", i, (void *)n->orig_addr,
+			(void *)(n->orig_addr + n->size),
+			(n == token) ? "<--" : "");
 		i++;
 	}
 }
@@ -528,28 +700,21 @@ static struct list_block *do_heap_free(struct nvmap_heap_block *block)
 	BUG_ON(b->block.base > b->orig_addr);
 	b->size += (b->block.base - b->orig_addr);
 	b->block.base = b->orig_addr;
+	b->block.type = BLOCK_EMPTY;
 
 	freelist_debug(heap, "free list before", b);
 
-	/* Find position of first free block to the right of freed one */
-	list_for_each_entry(n, &heap->free_list, free_list) {
-		if (n->block.base > b->block.base)
-			break;
-	}
-
-	/* Add freed block before found free one */
-	list_add_tail(&b->free_list, &n->free_list);
-	BUG_ON(list_empty(&b->all_list));
-
-	freelist_debug(heap, "free list pre-merge", b);
+	/* all_list is sorted by address, so the only free blocks the freed
+	 * one can merge with are its immediate neighbours there */
 
 	/* merge freed block with next if they connect
 	 * freed block becomes bigger, next one is destroyed */
-	if (!list_is_last(&b->free_list, &heap->free_list)) {
-		n = list_first_entry(&b->free_list, struct list_block, free_list);
-		if (n->block.base == b->block.base + b->size) {
+	if (!list_is_last(&b->all_list, &heap->all_list)) {
+		n = list_first_entry(&b->all_list, struct list_block, all_list);
+		if (n->block.type == BLOCK_EMPTY &&
+		    n->block.base == b->block.base + b->size) {
+			free_block_remove(heap, n);
 			list_del(&n->all_list);
-			list_del(&n->free_list);
 			BUG_ON(b->orig_addr >= n->orig_addr);
 			b->size += n->size;
 			kmem_cache_free(block_cache, n);
@@ -558,11 +723,12 @@ static struct list_block *do_heap_free(struct nvmap_heap_block *block)
 
 	/* merge freed block with prev if they connect
 	 * previous free block becomes bigger, freed one is destroyed */
-	if (b->free_list.prev != &heap->free_list) {
-		n = list_entry(b->free_list.prev, struct list_block, free_list);
-		if (n->block.base + n->size == b->block.base) {
+	if (b->all_list.prev != &heap->all_list) {
+		n = list_entry(b->all_list.prev, struct list_block, all_list);
+		if (n->block.type == BLOCK_EMPTY &&
+		    n->block.base + n->size == b->block.base) {
+			free_block_remove(heap, n);
 			list_del(&b->all_list);
-			list_del(&b->free_list);
 			BUG_ON(n->orig_addr >= b->orig_addr);
 			n->size += b->size;
 			kmem_cache_free(block_cache, b);
@@ -570,8 +736,8 @@ static struct list_block *do_heap_free(struct nvmap_heap_block *block)
 		}
 	}
 
+	free_block_insert(heap, b);
 	freelist_debug(heap, "free list after", b);
-	b->block.type = BLOCK_EMPTY;
 	return b;
 }
 
@@ -622,19 +788,19 @@ static int do_heap_copy_listblock(struct nvmap_device *dev,
 	pte_t **pte_dst = NULL;
 	void *addr_src = NULL;
 	void *addr_dst = NULL;
-	unsigned long kaddr_src;
-	unsigned long kaddr_dst;
+	unsigned int nr_src = NVMAP_PTE_RUN_MAX;
+	unsigned int nr_dst = NVMAP_PTE_RUN_MAX;
+	unsigned long pfn_src[NVMAP_PTE_RUN_MAX];
+	unsigned long pfn_dst[NVMAP_PTE_RUN_MAX];
 	unsigned long phys_src = src_base;
 	unsigned long phys_dst = dst_base;
-	unsigned long pfn_src;
-	unsigned long pfn_dst;
+	unsigned int nr_page = len >> PAGE_SHIFT;
+	unsigned int page, run, max_run, i;
 	int error = 0;
 
 	pgprot_t prot = pgprot_writecombine(pgprot_kernel);
 
-	int page;
-
-	pte_src = nvmap_alloc_pte(dev, &addr_src);
+	pte_src = nvmap_alloc_pte_run(dev, &nr_src, &addr_src);
 	if (IS_ERR(pte_src)) {
 		pr_err("Error when allocating pte_src\n");
 		pte_src = NULL;
@@ -642,7 +808,7 @@ static int do_heap_copy_listblock(struct nvmap_device *dev,
 		goto fail;
 	}
 
-	pte_dst = nvmap_alloc_pte(dev, &addr_dst);
+	pte_dst = nvmap_alloc_pte_run(dev, &nr_dst, &addr_dst);
 	if (IS_ERR(pte_dst)) {
 		pr_err("Error while allocating pte_dst\n");
 		pte_dst = NULL;
@@ -650,35 +816,39 @@ static int do_heap_copy_listblock(struct nvmap_device *dev,
 		goto fail;
 	}
 
-	kaddr_src = (unsigned long)addr_src;
-	kaddr_dst = (unsigned long)addr_dst;
-
 	BUG_ON(phys_dst > phys_src);
 	BUG_ON((phys_src & PAGE_MASK) != phys_src);
 	BUG_ON((phys_dst & PAGE_MASK) != phys_dst);
 	BUG_ON((len & PAGE_MASK) != len);
 
-	for (page = 0; page < (len >> PAGE_SHIFT) ; page++) {
+	if (phys_src == phys_dst)
+		goto fail;
+
+	/* a block moved into the hole right below it overlaps its old
+	 * location, so a run may not be longer than the distance moved or
+	 * its memcpy would read pages it has already overwritten */
+	max_run = min_t(unsigned int, min(nr_src, nr_dst),
+			(phys_src - phys_dst) >> PAGE_SHIFT);
 
-		pfn_src = __phys_to_pfn(phys_src) + page;
-		pfn_dst = __phys_to_pfn(phys_dst) + page;
+	for (page = 0; page < nr_page; page += run) {
+		run = min(max_run, nr_page - page);
 
-		set_pte_at(&init_mm, kaddr_src, *pte_src,
-				pfn_pte(pfn_src, prot));
-		flush_tlb_kernel_page(kaddr_src);
+		for (i = 0; i < run; i++) {
+			pfn_src[i] = __phys_to_pfn(phys_src) + page + i;
+			pfn_dst[i] = __phys_to_pfn(phys_dst) + page + i;
+		}
 
-		set_pte_at(&init_mm, kaddr_dst, *pte_dst,
-				pfn_pte(pfn_dst, prot));
-		flush_tlb_kernel_page(kaddr_dst);
+		nvmap_map_pte_run(pte_src, addr_src, pfn_src, run, prot);
+		nvmap_map_pte_run(pte_dst, addr_dst, pfn_dst, run, prot);
 
-		memcpy(addr_dst, addr_src, PAGE_SIZE);
+		memcpy(addr_dst, addr_src, run << PAGE_SHIFT);
 	}
 
 fail:
 	if (pte_src)
-		nvmap_free_pte(dev, pte_src);
+		nvmap_free_pte_run(dev, pte_src, nr_src);
 	if (pte_dst)
-		nvmap_free_pte(dev, pte_dst);
+		nvmap_free_pte_run(dev, pte_dst, nr_dst);
 	return error;
 }
 
@@ -822,6 +992,87 @@ static void nvmap_heap_compact(struct nvmap_heap *heap,
 	}
 	pr_err("Relocated %d chunks\n", relocation_count);
 }
+
+/* the heap is worth compacting once less than 3/4 of its free space is in
+ * the largest free block */
+static bool heap_fragmented(struct nvmap_heap *heap)
+{
+	size_t free = 0;
+	unsigned int class;
+
+	for (class = 0; class < NVMAP_HEAP_SIZE_CLASSES; class++)
+		free += heap->classes[class].free_size;
+
+	return free_block_largest(heap) < free / 4 * 3;
+}
+
+/* moves at most COMPACT_STEP_BLOCKS blocks, or COMPACT_STEP_BYTES of data,
+ * down into the free space directly below them, starting from the first
+ * hole at or above heap->compact_cursor. blocks which are pinned or mapped
+ * are stepped over. returns true if the pass has not reached the top of the
+ * heap yet; must be called while holding the heap's lock. */
+static bool heap_compact_step(struct nvmap_heap *heap)
+{
+	unsigned int moved = 0;
+	size_t copied = 0;
+
+	heap->compact_steps++;
+
+	while (moved < COMPACT_STEP_BLOCKS && copied < COMPACT_STEP_BYTES) {
+		struct list_block *hole = NULL;
+		struct list_block *next;
+		struct list_block *i;
+		size_t size;
+
+		list_for_each_entry(i, &heap->all_list, all_list) {
+			if (i->block.type == BLOCK_EMPTY &&
+			    i->block.base >= heap->compact_cursor) {
+				hole = i;
+				break;
+			}
+		}
+
+		if (!hole || list_is_last(&hole->all_list, &heap->all_list)) {
+			heap->compact_cursor = 0;
+			heap->compact_passes++;
+			return false;
+		}
+
+		next = list_first_entry(&hole->all_list, struct list_block,
+					all_list);
+		size = next->size;
+
+		/* the hole must be able to take the block at its alignment,
+		 * otherwise it would not move down */
+		if (ALIGN(hole->block.base, next->align) < next->block.base &&
+		    next->block.handle &&
+		    do_heap_relocate_listblock(next, false)) {
+			moved++;
+			copied += size;
+		} else {
+			heap->compact_cursor = next->block.base + next->size;
+		}
+	}
+
+	heap->compact_moved += moved;
+	heap->compact_bytes += copied;
+	return true;
+}
+
+static void heap_compact_work(struct work_struct *work)
+{
+	struct nvmap_heap *heap = container_of(to_delayed_work(work),
+					       struct nvmap_heap, compact_work);
+	bool more;
+
+	mutex_lock(&heap->lock);
+	more = heap_compact_step(heap);
+	mutex_unlock(&heap->lock);
+
+	if (more)
+		queue_delayed_work(system_long_wq, &heap->compact_work,
+				   COMPACT_STEP_DELAY);
+}
 #endif
 
 void nvmap_usecount_inc(struct nvmap_handle *h)
@@ -860,10 +1111,12 @@ struct nvmap_heap_block *nvmap_heap_alloc(struct nvmap_heap *h,
 	b = do_heap_alloc(h, len, align, prot, 0);
 	if (!b) {
 		pr_err("Compaction triggered!\n");
+		h->compact_fast++;
 		nvmap_heap_compact(h, len, true);
 		b = do_heap_alloc(h, len, align, prot, 0);
 		if (!b) {
 			pr_err("Full compaction triggered!\n");
+			h->compact_full++;
 			nvmap_heap_compact(h, len, false);
 			b = do_heap_alloc(h, len, align, prot, 0);
 		}
@@ -882,6 +1135,9 @@ struct nvmap_heap_block *nvmap_heap_alloc(struct nvmap_heap *h,
 	if (b) {
 		b->handle = handle;
 		handle->carveout = b;
+		h->classes[size_class(block_len(b))].allocs++;
+	} else {
+		h->classes[size_class(len)].fails++;
 	}
 	mutex_unlock(&h->lock);
 	return b;
@@ -908,6 +1164,8 @@ void nvmap_heap_free(struct nvmap_heap_block *b)
 	struct list_block *lb;
 
 	mutex_lock(&h->lock);
+	h->classes[size_class(block_len(b))].frees++;
+
 	if (b->type == BLOCK_BUDDY)
 		bh = do_buddy_free(b);
 	else {
@@ -916,13 +1174,24 @@ void nvmap_heap_free(struct nvmap_heap_block *b)
 		do_heap_free(b);
 	}
 
+	/* the last buddy went away: release the buddy heap's own block */
 	if (bh) {
 		list_del(&bh->buddy_list);
-		mutex_unlock(&h->lock);
-		nvmap_heap_free(&bh->heap_base->block);
+		lb = bh->heap_base;
+		nvmap_flush_heap_block(NULL, &lb->block, lb->size,
+				       lb->mem_prot);
+		do_heap_free(&lb->block);
+	}
+
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+	if (heap_fragmented(h))
+		queue_delayed_work(system_long_wq, &h->compact_work,
+				   COMPACT_START_DELAY);
+#endif
+	mutex_unlock(&h->lock);
+
+	if (bh)
 		kmem_cache_free(buddy_heap_cache, bh);
-	} else
-		mutex_unlock(&h->lock);
 }
 
 
@@ -944,17 +1213,18 @@ struct nvmap_heap *nvmap_heap_create(struct device *parent, const char *name,
 {
 	struct nvmap_heap *h = NULL;
 	struct list_block *l = NULL;
+	unsigned int i;
 
 	if (WARN_ON(buddy_size && buddy_size < NVMAP_HEAP_MIN_BUDDY_SIZE)) {
-		dev_warn(parent, "%s: buddy_size %u too small\n", __func__,
+		dev_warn(parent, "%s: buddy_size %zu too small\n", __func__,
 			buddy_size);
 		buddy_size = 0;
 	} else if (WARN_ON(buddy_size >= len)) {
-		dev_warn(parent, "%s: buddy_size %u too large\n", __func__,
+		dev_warn(parent, "%s: buddy_size %zu too large\n", __func__,
 			buddy_size);
 		buddy_size = 0;
 	} else if (WARN_ON(buddy_size & (buddy_size - 1))) {
-		dev_warn(parent, "%s: buddy_size %u not a power of 2\n",
+		dev_warn(parent, "%s: buddy_size %zu not a power of 2\n",
 			 __func__, buddy_size);
 		buddy_size = 1 << (ilog2(buddy_size) + 1);
 	}
@@ -962,14 +1232,15 @@ struct nvmap_heap *nvmap_heap_create(struct device *parent, const char *name,
 	if (WARN_ON(buddy_size && (base & (buddy_size - 1)))) {
 		unsigned long orig = base;
 		dev_warn(parent, "%s: base address %p not aligned to "
-			 "buddy_size %u\n", __func__, (void *)base, buddy_size);
+			 "buddy_size %zu\n", __func__, (void *)(unsigned long)base,
+			 buddy_size);
 		base = ALIGN(base, buddy_size);
 		len -= (base - orig);
 	}
 
 	if (WARN_ON(buddy_size && (len & (buddy_size - 1)))) {
-		dev_warn(parent, "%s: length %u not aligned to "
-			 "buddy_size %u\n", __func__, len, buddy_size);
+		dev_warn(parent, "%s: length %zu not aligned to "
+			 "buddy_size %zu\n", __func__, len, buddy_size);
 		len &= ~(buddy_size - 1);
 	}
 
@@ -1004,16 +1275,20 @@ struct nvmap_heap *nvmap_heap_create(struct device *parent, const char *name,
 	h->buddy_heap_size = buddy_size;
 	if (buddy_size)
 		h->min_buddy_shift = ilog2(buddy_size / MAX_BUDDY_NR);
-	INIT_LIST_HEAD(&h->free_list);
+	for (i = 0; i < NVMAP_HEAP_SIZE_CLASSES; i++)
+		h->classes[i].free = RB_ROOT;
 	INIT_LIST_HEAD(&h->buddy_list);
 	INIT_LIST_HEAD(&h->all_list);
 	mutex_init(&h->lock);
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+	INIT_DELAYED_WORK(&h->compact_work, heap_compact_work);
+#endif
 	l->block.base = base;
 	l->block.type = BLOCK_EMPTY;
 	l->size = len;
 	l->orig_addr = base;
-	list_add_tail(&l->free_list, &h->free_list);
 	list_add_tail(&l->all_list, &h->all_list);
+	free_block_insert(h, l);
 
 	inner_flush_cache_all();
 	outer_flush_range(base, base + len);
@@ -1045,6 +1320,9 @@ void nvmap_heap_destroy(struct nvmap_heap *heap)
 {
 	WARN_ON(!list_empty(&heap->buddy_list));
 
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+	cancel_delayed_work_sync(&heap->compact_work);
+#endif
 	sysfs_remove_group(&heap->dev.kobj, &heap_stat_attr_group);
 	device_unregister(&heap->dev);
 
@@ -1069,6 +1347,54 @@ void nvmap_heap_destroy(struct nvmap_heap *heap)
 	kfree(heap);
 }
 
+static int heap_debug_stats_show(struct seq_file *s, void *unused)
+{
+	struct nvmap_heap *heap = s->private;
+	unsigned int class;
+
+	mutex_lock(&heap->lock);
+	seq_printf(s, "%-10s %10s %12s %10s %10s %10s\n", "size(KiB)",
+		   "free", "free(KiB)", "allocs", "frees", "fails");
+	for (class = 0; class < NVMAP_HEAP_SIZE_CLASSES; class++) {
+		struct heap_size_class *c = &heap->classes[class];
+		size_t min = class ? PAGE_SIZE << (class - 1) : 0;
+
+		seq_printf(s, "%c%-9zu %10u %12zu %10lu %10lu %10lu\n",
+			   class == NVMAP_HEAP_SIZE_CLASSES - 1 ? '>' : ' ',
+			   min >> 10, c->free_count, c->free_size >> 10,
+			   c->allocs, c->frees, c->fails);
+	}
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+	seq_printf(s, "\ncompaction: fast %u, full %u, background steps %u, "
+		   "passes %u, moved %lu blocks (%llu KiB)\n",
+		   heap->compact_fast, heap->compact_full,
+		   heap->compact_steps, heap->compact_passes,
+		   heap->compact_moved, heap->compact_bytes >> 10);
+#endif
+	mutex_unlock(&heap->lock);
+	return 0;
+}
+
+static int heap_debug_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, heap_debug_stats_show, inode->i_private);
+}
+
+static const struct file_operations heap_debug_stats_fops = {
+	.open = heap_debug_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* nvmap_heap_debugfs_init: adds per size class and compaction statistics
+ * for the heap to the debugfs directory root */
+void nvmap_heap_debugfs_init(struct nvmap_heap *heap, struct dentry *root)
+{
+	debugfs_create_file("stats", S_IRUGO, root, heap,
+			    &heap_debug_stats_fops);
+}
+
 /* nvmap_heap_create_group: adds the attribute_group grp to the heap kobject */
 int nvmap_heap_create_group(struct nvmap_heap *heap,
 			    const struct attribute_group *grp)
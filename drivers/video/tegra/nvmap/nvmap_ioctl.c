@@ -20,10 +20,16 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#include <linux/debugfs.h>
 #include <linux/dma-mapping.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/spinlock.h>
 #include <linux/uaccess.h>
 
 #include <asm/cacheflush.h>
@@ -147,7 +153,7 @@ int nvmap_ioctl_getid(struct file *filp, void __user *arg)
 	if (!h)
 		return -EPERM;
 
-	op.id = (__u32)h;
+	op.id = (__u32)(unsigned long)h;
 	if (client == h->owner)
 		h->global = true;
 
@@ -428,44 +434,51 @@ int nvmap_ioctl_rw_handle(struct file *filp, int is_read, void __user* arg)
 	return err;
 }
 
+/* resolves the handle and handle offset a cache maintenance request
+ * refers to through the caller's mapping of it. the caller must hold
+ * mmap_sem for reading */
+static int cache_op_lookup(const struct nvmap_cache_op *op,
+			   struct nvmap_handle **h, unsigned long *start)
+{
+	struct vm_area_struct *vma;
+	struct nvmap_vma_priv *vpriv;
+
+	if (!op->handle || !op->addr || op->op < NVMAP_CACHE_OP_WB ||
+	    op->op > NVMAP_CACHE_OP_WB_INV)
+		return -EINVAL;
+
+	vma = find_vma(current->active_mm, (unsigned long)op->addr);
+	if (!vma || !is_nvmap_vma(vma) ||
+	    (unsigned long)op->addr + op->len > vma->vm_end)
+		return -EADDRNOTAVAIL;
+
+	vpriv = (struct nvmap_vma_priv *)vma->vm_private_data;
+
+	if ((unsigned long)vpriv->handle != op->handle)
+		return -EFAULT;
+
+	*h = vpriv->handle;
+	*start = (unsigned long)op->addr - vma->vm_start;
+	return 0;
+}
+
 int nvmap_ioctl_cache_maint(struct file *filp, void __user *arg)
 {
 	struct nvmap_client *client = filp->private_data;
 	struct nvmap_cache_op op;
-	struct vm_area_struct *vma;
-	struct nvmap_vma_priv *vpriv;
+	struct nvmap_handle *h;
 	unsigned long start;
-	unsigned long end;
 	int err = 0;
 
 	if (copy_from_user(&op, arg, sizeof(op)))
 		return -EFAULT;
 
-	if (!op.handle || !op.addr || op.op < NVMAP_CACHE_OP_WB ||
-	    op.op > NVMAP_CACHE_OP_WB_INV)
-		return -EINVAL;
-
 	down_read(&current->mm->mmap_sem);
 
-	vma = find_vma(current->active_mm, (unsigned long)op.addr);
-	if (!vma || !is_nvmap_vma(vma) ||
-	    (unsigned long)op.addr + op.len > vma->vm_end) {
-		err = -EADDRNOTAVAIL;
-		goto out;
-	}
-
-	vpriv = (struct nvmap_vma_priv *)vma->vm_private_data;
-
-	if ((unsigned long)vpriv->handle != op.handle) {
-		err = -EFAULT;
-		goto out;
-	}
-
-	start = (unsigned long)op.addr - vma->vm_start;
-	end = start + op.len;
+	err = cache_op_lookup(&op, &h, &start);
+	if (!err)
+		err = cache_maint(client, h, start, start + op.len, op.op);
 
-	err = cache_maint(client, vpriv->handle, start, end, op.op);
-out:
 	up_read(&current->mm->mmap_sem);
 	return err;
 }
@@ -501,37 +514,47 @@ static void outer_cache_maint(unsigned int op, unsigned long paddr, size_t size)
 		outer_clean_range(paddr, paddr + size);
 }
 
+/* works through the handle a run of pages at a time: the inner cache is
+ * maintained through one mapping of the whole run, and the outer cache
+ * once per physically contiguous stretch of it */
 static void heap_page_cache_maint(struct nvmap_client *client,
 	struct nvmap_handle *h, unsigned long start, unsigned long end,
 	unsigned int op, bool inner, bool outer, pte_t **pte,
-	unsigned long kaddr, pgprot_t prot)
+	unsigned long kaddr, unsigned int nr_pte, pgprot_t prot)
 {
-	struct page *page;
-	unsigned long paddr;
-	unsigned long next;
+	unsigned long pfn[NVMAP_PTE_RUN_MAX];
 	unsigned long off;
+	unsigned int i, j, n;
 	size_t size;
 
+	BUG_ON(inner && (!pte || !kaddr || !nr_pte));
+
 	while (start < end) {
-		page = h->pgalloc.pages[start >> PAGE_SHIFT];
-		next = min(((start + PAGE_SIZE) & PAGE_MASK), end);
 		off = start & ~PAGE_MASK;
-		size = next - start;
-		paddr = page_to_phys(page) + off;
+		n = inner ? nr_pte : NVMAP_PTE_RUN_MAX;
+		size = min_t(size_t, end - start, n * PAGE_SIZE - off);
+		n = PAGE_ALIGN(off + size) >> PAGE_SHIFT;
+
+		for (i = 0; i < n; i++)
+			pfn[i] = page_to_pfn(
+				h->pgalloc.pages[(start >> PAGE_SHIFT) + i]);
 
 		if (inner) {
-			void *vaddr = (void *)kaddr + off;
-			BUG_ON(!pte);
-			BUG_ON(!kaddr);
-			set_pte_at(&init_mm, kaddr, *pte,
-				pfn_pte(__phys_to_pfn(paddr), prot));
-			flush_tlb_kernel_page(kaddr);
-			inner_cache_maint(op, vaddr, size);
+			nvmap_map_pte_run(pte, (void *)kaddr, pfn, n, prot);
+			inner_cache_maint(op, (void *)kaddr + off, size);
 		}
 
-		if (outer)
-			outer_cache_maint(op, paddr, size);
-		start = next;
+		for (i = 0; outer && i < n; i = j) {
+			unsigned long s = max(off, i * PAGE_SIZE);
+			unsigned long e;
+
+			for (j = i + 1; j < n && pfn[j] == pfn[j - 1] + 1; j++)
+				;
+			e = min(off + size, j * PAGE_SIZE);
+			outer_cache_maint(op, __pfn_to_phys(pfn[i]) +
+					  s - i * PAGE_SIZE, e - s);
+		}
+		start += size;
 	}
 }
 
@@ -551,7 +574,7 @@ static bool fast_cache_maint(struct nvmap_client *client, struct nvmap_handle *h
 
 	if (h->heap_pgalloc && (h->flags != NVMAP_HANDLE_INNER_CACHEABLE)) {
 		heap_page_cache_maint(client, h, start, end, op,
-				false, true, NULL, 0, 0);
+				false, true, NULL, 0, 0, __pgprot(0));
 	} else if (h->flags != NVMAP_HANDLE_INNER_CACHEABLE) {
 		start += h->carveout->base;
 		end += h->carveout->base;
@@ -562,13 +585,37 @@ out:
 	return ret;
 }
 
-static int cache_maint(struct nvmap_client *client, struct nvmap_handle *h,
-		       unsigned long start, unsigned long end, unsigned int op)
+/* maintains the inner cache for a physically contiguous range through a
+ * run of nr_pte PTEs */
+static void carveout_inner_cache_maint(unsigned long start, unsigned long end,
+	unsigned int op, pte_t **pte, unsigned long kaddr,
+	unsigned int nr_pte, pgprot_t prot)
+{
+	unsigned long pfn[NVMAP_PTE_RUN_MAX];
+
+	while (start < end) {
+		unsigned long off = start & ~PAGE_MASK;
+		size_t size = min_t(size_t, end - start,
+				    nr_pte * PAGE_SIZE - off);
+		unsigned int i, n = PAGE_ALIGN(off + size) >> PAGE_SHIFT;
+
+		for (i = 0; i < n; i++)
+			pfn[i] = __phys_to_pfn(start) + i;
+		nvmap_map_pte_run(pte, (void *)kaddr, pfn, n, prot);
+
+		inner_cache_maint(op, (void *)kaddr + off, size);
+		start += size;
+	}
+}
+
+static int do_cache_maint(struct nvmap_client *client, struct nvmap_handle *h,
+			  unsigned long start, unsigned long end,
+			  unsigned int op)
 {
+	unsigned int nr_pte = 0;
 	pgprot_t prot;
 	pte_t **pte = NULL;
 	unsigned long kaddr;
-	unsigned long loop;
 	int err = 0;
 
 	h = nvmap_handle_get(h);
@@ -589,7 +636,8 @@ static int cache_maint(struct nvmap_client *client, struct nvmap_handle *h,
 		goto out;
 
 	prot = nvmap_pgprot(h, pgprot_kernel);
-	pte = nvmap_alloc_pte(client->dev, (void **)&kaddr);
+	nr_pte = PAGE_ALIGN((start & ~PAGE_MASK) + end - start) >> PAGE_SHIFT;
+	pte = nvmap_alloc_pte_run(client->dev, &nr_pte, (void **)&kaddr);
 	if (IS_ERR(pte)) {
 		err = PTR_ERR(pte);
 		pte = NULL;
@@ -599,13 +647,14 @@ static int cache_maint(struct nvmap_client *client, struct nvmap_handle *h,
 	if (h->heap_pgalloc) {
 		heap_page_cache_maint(client, h, start, end, op, true,
 			(h->flags == NVMAP_HANDLE_INNER_CACHEABLE) ? false : true,
-			pte, kaddr, prot);
+			pte, kaddr, nr_pte, prot);
 		goto out;
 	}
 
 	if (start > h->size || end > h->size) {
 		nvmap_warn(client, "cache maintenance outside handle\n");
-		return -EINVAL;
+		err = -EINVAL;
+		goto out;
 	}
 
 	/* lock carveout from relocation by mapcount */
@@ -614,20 +663,7 @@ static int cache_maint(struct nvmap_client *client, struct nvmap_handle *h,
 	start += h->carveout->base;
 	end += h->carveout->base;
 
-	loop = start;
-
-	while (loop < end) {
-		unsigned long next = (loop + PAGE_SIZE) & PAGE_MASK;
-		void *base = (void *)kaddr + (loop & ~PAGE_MASK);
-		next = min(next, end);
-
-		set_pte_at(&init_mm, kaddr, *pte,
-			   pfn_pte(__phys_to_pfn(loop), prot));
-		flush_tlb_kernel_page(kaddr);
-
-		inner_cache_maint(op, base, next - loop);
-		loop = next;
-	}
+	carveout_inner_cache_maint(start, end, op, pte, kaddr, nr_pte, prot);
 
 	if (h->flags != NVMAP_HANDLE_INNER_CACHEABLE)
 		outer_cache_maint(op, start, end - start);
@@ -637,46 +673,429 @@ static int cache_maint(struct nvmap_client *client, struct nvmap_handle *h,
 
 out:
 	if (pte)
-		nvmap_free_pte(client->dev, pte);
+		nvmap_free_pte_run(client->dev, pte, nr_pte);
 	nvmap_handle_put(h);
 	return err;
 }
 
+/* per-operation latency of cache maintenance, shown in debugfs as
+ * nvmap/cache_maint; the first three entries are indexed by
+ * NVMAP_CACHE_OP_* and the last covers whole NVMAP_IOC_CACHE_LIST calls */
+#define CACHE_STAT_LIST		3
+#define NR_CACHE_STATS		4
+
+struct cache_maint_stat {
+	u64 count;
+	u64 bytes;
+	u64 total_ns;
+	u64 max_ns;
+};
+
+static struct cache_maint_stat cache_stats[NR_CACHE_STATS];
+static DEFINE_SPINLOCK(cache_stats_lock);
+
+static void cache_maint_account(unsigned int idx, ktime_t start, size_t bytes)
+{
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	struct cache_maint_stat *st = &cache_stats[idx];
+
+	spin_lock(&cache_stats_lock);
+	st->count++;
+	st->bytes += bytes;
+	st->total_ns += ns;
+	if (ns > st->max_ns)
+		st->max_ns = ns;
+	spin_unlock(&cache_stats_lock);
+}
+
+static int cache_maint(struct nvmap_client *client, struct nvmap_handle *h,
+		       unsigned long start, unsigned long end, unsigned int op)
+{
+	ktime_t t = ktime_get();
+	int err;
+
+	err = do_cache_maint(client, h, start, end, op);
+	if (!err)
+		cache_maint_account(op, t, end - start);
+	return err;
+}
+
+static int cache_stats_show(struct seq_file *s, void *unused)
+{
+	static const char *names[NR_CACHE_STATS] = {
+		"wb", "inv", "wb_inv", "list"
+	};
+	struct cache_maint_stat st;
+	unsigned int i;
+
+	seq_printf(s, "%-8s %10s %12s %10s %10s\n",
+		   "op", "count", "bytes", "avg_ns", "max_ns");
+	for (i = 0; i < NR_CACHE_STATS; i++) {
+		spin_lock(&cache_stats_lock);
+		st = cache_stats[i];
+		spin_unlock(&cache_stats_lock);
+
+		seq_printf(s, "%-8s %10llu %12llu %10llu %10llu\n", names[i],
+			   st.count, st.bytes,
+			   st.count ? div64_u64(st.total_ns, st.count) : 0,
+			   st.max_ns);
+	}
+	return 0;
+}
+
+static int cache_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, cache_stats_show, inode->i_private);
+}
+
+static const struct file_operations cache_stats_fops = {
+	.open = cache_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+void nvmap_cache_maint_debugfs_init(struct dentry *root)
+{
+	debugfs_create_file("cache_maint", 0444, root, NULL,
+			    &cache_stats_fops);
+}
+
+/* NVMAP_IOC_CACHE_LIST: the requests are sorted and merged per handle and
+ * operation, the inner cache is cleaned or flushed as a whole once the
+ * write-backs add up past FLUSH_CLEAN_BY_SET_WAY_THRESHOLD (invalidates
+ * are always done by range), and the outer cache operations of all
+ * requests are collected, merged by physical address and issued at the
+ * end rather than after every page */
+#define NVMAP_CACHE_LIST_MAX	512
+#define OUTER_BATCH		64
+
+struct cache_list_range {
+	struct nvmap_handle *h;
+	unsigned long start;
+	unsigned long end;
+	unsigned int op;
+};
+
+struct outer_range {
+	unsigned long start;
+	unsigned long end;
+	unsigned int op;
+};
+
+struct outer_batch {
+	struct outer_range r[OUTER_BATCH];
+	unsigned int nr;
+};
+
+/* write-backs first, invalidates last */
+static inline int cache_op_rank(unsigned int op)
+{
+	if (op == NVMAP_CACHE_OP_WB)
+		return 0;
+	return (op == NVMAP_CACHE_OP_WB_INV) ? 1 : 2;
+}
+
+static int cache_list_cmp(const void *a, const void *b)
+{
+	const struct cache_list_range *x = a, *y = b;
+
+	if (x->op != y->op)
+		return cache_op_rank(x->op) - cache_op_rank(y->op);
+	if (x->h != y->h)
+		return (x->h < y->h) ? -1 : 1;
+	if (x->start != y->start)
+		return (x->start < y->start) ? -1 : 1;
+	return 0;
+}
+
+static int outer_range_cmp(const void *a, const void *b)
+{
+	const struct outer_range *x = a, *y = b;
+
+	if (x->op != y->op)
+		return cache_op_rank(x->op) - cache_op_rank(y->op);
+	if (x->start != y->start)
+		return (x->start < y->start) ? -1 : 1;
+	return 0;
+}
+
+static void outer_batch_flush(struct outer_batch *ob)
+{
+	unsigned int i, j;
+
+	sort(ob->r, ob->nr, sizeof(ob->r[0]), outer_range_cmp, NULL);
+
+	for (i = 0; i < ob->nr; i = j) {
+		unsigned long end = ob->r[i].end;
+
+		for (j = i + 1; j < ob->nr && ob->r[j].op == ob->r[i].op &&
+		     ob->r[j].start <= end; j++)
+			end = max(end, ob->r[j].end);
+		outer_cache_maint(ob->r[i].op, ob->r[i].start,
+				  end - ob->r[i].start);
+	}
+	ob->nr = 0;
+}
+
+static void outer_batch_add(struct outer_batch *ob, unsigned int op,
+			    unsigned long start, unsigned long end)
+{
+	struct outer_range *last = ob->nr ? &ob->r[ob->nr - 1] : NULL;
+
+	if (last && last->op == op && start >= last->start &&
+	    start <= last->end) {
+		last->end = max(last->end, end);
+		return;
+	}
+
+	if (ob->nr == OUTER_BATCH)
+		outer_batch_flush(ob);
+
+	ob->r[ob->nr].start = start;
+	ob->r[ob->nr].end = end;
+	ob->r[ob->nr].op = op;
+	ob->nr++;
+}
+
+static void cache_list_outer(struct outer_batch *ob,
+			     const struct cache_list_range *r)
+{
+	struct nvmap_handle *h = r->h;
+	unsigned long start = r->start;
+
+	if (!h->heap_pgalloc) {
+		outer_batch_add(ob, r->op, h->carveout->base + r->start,
+				h->carveout->base + r->end);
+		return;
+	}
+
+	while (start < r->end) {
+		struct page *page = h->pgalloc.pages[start >> PAGE_SHIFT];
+		unsigned long next = min((start + PAGE_SIZE) & PAGE_MASK,
+					 r->end);
+		unsigned long paddr = page_to_phys(page) + (start & ~PAGE_MASK);
+
+		outer_batch_add(ob, r->op, paddr, paddr + next - start);
+		start = next;
+	}
+}
+
+static void cache_list_release(struct cache_list_range *r)
+{
+	if (!r->h->heap_pgalloc)
+		nvmap_usecount_dec(r->h);
+	nvmap_handle_put(r->h);
+}
+
+int nvmap_ioctl_cache_maint_list(struct file *filp, void __user *arg)
+{
+	struct nvmap_client *client = filp->private_data;
+	struct nvmap_cache_op_list list;
+	struct nvmap_cache_op *ops;
+	struct cache_list_range *ranges;
+	struct outer_batch *ob;
+	unsigned int i, j, nr = 0, nr_pte = 0;
+	size_t wb_bytes = 0, bytes = 0;
+	bool wb_inv = false, whole = false;
+	unsigned long kaddr = 0;
+	pte_t **pte = NULL;
+	ktime_t t = ktime_get();
+	int err = 0;
+
+	if (copy_from_user(&list, arg, sizeof(list)))
+		return -EFAULT;
+
+	if (!list.nr)
+		return 0;
+	if (list.nr > NVMAP_CACHE_LIST_MAX)
+		return -EINVAL;
+
+	ranges = kmalloc(list.nr * (sizeof(*ranges) + sizeof(*ops)) +
+			 sizeof(*ob), GFP_KERNEL);
+	if (!ranges)
+		return -ENOMEM;
+	ops = (struct nvmap_cache_op *)(ranges + list.nr);
+	ob = (struct outer_batch *)(ops + list.nr);
+	ob->nr = 0;
+
+	/* a fault in copy_from_user takes mmap_sem itself, so the whole
+	 * list is copied in before it is held */
+	if (copy_from_user(ops, (void __user *)list.ops,
+			   list.nr * sizeof(*ops))) {
+		kfree(ranges);
+		return -EFAULT;
+	}
+
+	down_read(&current->mm->mmap_sem);
+
+	for (i = 0; i < list.nr; i++) {
+		struct cache_list_range *r = &ranges[nr];
+		struct nvmap_cache_op op = ops[i];
+		struct nvmap_handle *h;
+		unsigned long start;
+
+		err = cache_op_lookup(&op, &h, &start);
+		if (err)
+			goto out;
+
+		h = nvmap_handle_get(h);
+		if (!h) {
+			err = -EFAULT;
+			goto out;
+		}
+
+		if (!h->alloc || start + op.len > h->size) {
+			err = h->alloc ? -EINVAL : -EFAULT;
+			nvmap_handle_put(h);
+			goto out;
+		}
+
+		if (h->flags == NVMAP_HANDLE_UNCACHEABLE ||
+		    h->flags == NVMAP_HANDLE_WRITE_COMBINE || !op.len) {
+			nvmap_handle_put(h);
+			continue;
+		}
+
+		/* lock carveout from relocation by mapcount */
+		if (!h->heap_pgalloc)
+			nvmap_usecount_inc(h);
+
+		r->h = h;
+		r->start = start;
+		r->end = start + op.len;
+		r->op = op.op;
+		nr++;
+	}
+
+	wmb();
+
+	sort(ranges, nr, sizeof(*ranges), cache_list_cmp, NULL);
+	for (i = 0, j = 0; i < nr; i++) {
+		struct cache_list_range *prev = j ? &ranges[j - 1] : NULL;
+
+		if (prev && prev->h == ranges[i].h &&
+		    prev->op == ranges[i].op &&
+		    ranges[i].start <= prev->end) {
+			prev->end = max(prev->end, ranges[i].end);
+			cache_list_release(&ranges[i]);
+			continue;
+		}
+		ranges[j++] = ranges[i];
+	}
+	nr = j;
+
+	for (i = 0; i < nr; i++) {
+		bytes += ranges[i].end - ranges[i].start;
+		if (ranges[i].op == NVMAP_CACHE_OP_INV)
+			continue;
+		wb_bytes += ranges[i].end - ranges[i].start;
+		if (ranges[i].op == NVMAP_CACHE_OP_WB_INV)
+			wb_inv = true;
+	}
+
+	if (wb_bytes >= FLUSH_CLEAN_BY_SET_WAY_THRESHOLD) {
+		if (wb_inv)
+			inner_flush_cache_all();
+		else
+			inner_clean_cache_all();
+		whole = true;
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct cache_list_range *r = &ranges[i];
+		pgprot_t prot = nvmap_pgprot(r->h, pgprot_kernel);
+
+		if (!whole || r->op == NVMAP_CACHE_OP_INV) {
+			if (!pte) {
+				nr_pte = NVMAP_PTE_RUN_MAX;
+				pte = nvmap_alloc_pte_run(client->dev, &nr_pte,
+							  (void **)&kaddr);
+				if (IS_ERR(pte)) {
+					err = PTR_ERR(pte);
+					pte = NULL;
+					break;
+				}
+			}
+
+			if (r->h->heap_pgalloc)
+				heap_page_cache_maint(client, r->h, r->start,
+					r->end, r->op, true, false,
+					pte, kaddr, nr_pte, prot);
+			else
+				carveout_inner_cache_maint(
+					r->h->carveout->base + r->start,
+					r->h->carveout->base + r->end,
+					r->op, pte, kaddr, nr_pte, prot);
+		}
+
+		if (r->h->flags != NVMAP_HANDLE_INNER_CACHEABLE)
+			cache_list_outer(ob, r);
+	}
+	outer_batch_flush(ob);
+
+	if (pte)
+		nvmap_free_pte_run(client->dev, pte, nr_pte);
+
+out:
+	up_read(&current->mm->mmap_sem);
+
+	for (i = 0; i < nr; i++)
+		cache_list_release(&ranges[i]);
+	kfree(ranges);
+
+	if (!err)
+		cache_maint_account(CACHE_STAT_LIST, t, bytes);
+	return err;
+}
+
+/* copies through a mapping of up to nr_pte pages at a time; handle pages
+ * need not be physically contiguous, as the run maps them at consecutive
+ * kernel addresses */
 static int rw_handle_page(struct nvmap_handle *h, int is_read,
-			  phys_addr_t start, unsigned long rw_addr,
-			  unsigned long bytes, unsigned long kaddr, pte_t *pte)
+			  unsigned long start, unsigned long rw_addr,
+			  unsigned long bytes, void *vaddr, pte_t **pte,
+			  unsigned int nr_pte)
 {
 	pgprot_t prot = nvmap_pgprot(h, pgprot_kernel);
 	unsigned long end = start + bytes;
+	unsigned long pfn[NVMAP_PTE_RUN_MAX];
+	struct page *pages[NVMAP_PTE_RUN_MAX];
 	int err = 0;
 
 	while (!err && start < end) {
-		struct page *page = NULL;
-		phys_addr_t phys;
+		unsigned long off;
+		unsigned int i, n;
 		size_t count;
-		void *src;
 
-		if (!h->heap_pgalloc) {
-			phys = h->carveout->base + start;
-		} else {
-			page = h->pgalloc.pages[start >> PAGE_SHIFT];
-			BUG_ON(!page);
-			get_page(page);
-			phys = page_to_phys(page) + (start & ~PAGE_MASK);
+		if (!h->heap_pgalloc)
+			off = (h->carveout->base + start) & ~PAGE_MASK;
+		else
+			off = start & ~PAGE_MASK;
+
+		count = min_t(size_t, end - start, nr_pte * PAGE_SIZE - off);
+		n = PAGE_ALIGN(off + count) >> PAGE_SHIFT;
+
+		for (i = 0; i < n; i++) {
+			if (!h->heap_pgalloc) {
+				pages[i] = NULL;
+				pfn[i] = __phys_to_pfn(h->carveout->base +
+						       start) + i;
+			} else {
+				pages[i] = h->pgalloc.pages[
+						(start >> PAGE_SHIFT) + i];
+				BUG_ON(!pages[i]);
+				get_page(pages[i]);
+				pfn[i] = page_to_pfn(pages[i]);
+			}
 		}
 
-		set_pte_at(&init_mm, kaddr, pte,
-			   pfn_pte(__phys_to_pfn(phys), prot));
-		flush_tlb_kernel_page(kaddr);
-
-		src = (void *)kaddr + (phys & ~PAGE_MASK);
-		phys = PAGE_SIZE - (phys & ~PAGE_MASK);
-		count = min_t(size_t, end - start, phys);
+		nvmap_map_pte_run(pte, vaddr, pfn, n, prot);
 
 		if (is_read)
-			err = copy_to_user((void *)rw_addr, src, count);
+			err = copy_to_user((void *)rw_addr, vaddr + off, count);
 		else
-			err = copy_from_user(src, (void *)rw_addr, count);
+			err = copy_from_user(vaddr + off, (void *)rw_addr, count);
 
 		if (err)
 			err = -EFAULT;
@@ -684,8 +1103,9 @@ static int rw_handle_page(struct nvmap_handle *h, int is_read,
 		rw_addr += count;
 		start += count;
 
-		if (page)
-			put_page(page);
+		for (i = 0; i < n; i++)
+			if (pages[i])
+				put_page(pages[i]);
 	}
 
 	return err;
@@ -698,6 +1118,7 @@ static ssize_t rw_handle(struct nvmap_client *client, struct nvmap_handle *h,
 			 unsigned long count)
 {
 	ssize_t copied = 0;
+	unsigned int nr_pte;
 	pte_t **pte;
 	void *addr;
 	int ret = 0;
@@ -715,7 +1136,8 @@ static ssize_t rw_handle(struct nvmap_client *client, struct nvmap_handle *h,
 		count = 1;
 	}
 
-	pte = nvmap_alloc_pte(client->dev, &addr);
+	nr_pte = (PAGE_ALIGN(elem_size) >> PAGE_SHIFT) + 1;
+	pte = nvmap_alloc_pte_run(client->dev, &nr_pte, &addr);
 	if (IS_ERR(pte))
 		return PTR_ERR(pte);
 
@@ -730,7 +1152,7 @@ static ssize_t rw_handle(struct nvmap_client *client, struct nvmap_handle *h,
 				h_offs + elem_size, NVMAP_CACHE_OP_INV);
 
 		ret = rw_handle_page(h, is_read, h_offs, sys_addr,
-				     elem_size, (unsigned long)addr, *pte);
+				     elem_size, addr, pte, nr_pte);
 
 		if (ret)
 			break;
@@ -744,6 +1166,6 @@ static ssize_t rw_handle(struct nvmap_client *client, struct nvmap_handle *h,
 		h_offs += h_stride;
 	}
 
-	nvmap_free_pte(client->dev, pte);
+	nvmap_free_pte_run(client->dev, pte, nr_pte);
 	return ret ?: copied;
 }
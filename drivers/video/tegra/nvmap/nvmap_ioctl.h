@@ -28,6 +28,8 @@
 
 #include <mach/nvmap.h>
 
+struct dentry;
+
 enum {
 	NVMAP_HANDLE_PARAM_SIZE = 1,
 	NVMAP_HANDLE_PARAM_ALIGNMENT,
@@ -95,6 +97,14 @@ struct nvmap_cache_op {
 	__s32 op;
 };
 
+/* applied by NVMAP_IOC_CACHE_LIST as one batch: overlapping ranges of a
+ * handle with the same operation are merged, and all write-backs are done
+ * before any invalidate */
+struct nvmap_cache_op_list {
+	unsigned long ops;	/* array of struct nvmap_cache_op */
+	__u32 nr;		/* number of entries in ops */
+};
+
 #define NVMAP_IOC_MAGIC 'N'
 
 /* Creates a new memory handle. On input, the argument is the size of the new
@@ -134,7 +144,10 @@ struct nvmap_cache_op {
  * reference to the same handle */
 #define NVMAP_IOC_GET_ID  _IOWR(NVMAP_IOC_MAGIC, 13, struct nvmap_create_handle)
 
-#define NVMAP_IOC_MAXNR (_IOC_NR(NVMAP_IOC_GET_ID))
+/* Performs cache maintenance on a list of handle ranges at once */
+#define NVMAP_IOC_CACHE_LIST _IOW(NVMAP_IOC_MAGIC, 14, struct nvmap_cache_op_list)
+
+#define NVMAP_IOC_MAXNR (_IOC_NR(NVMAP_IOC_CACHE_LIST))
 
 int nvmap_ioctl_pinop(struct file *filp, bool is_pin, void __user *arg);
 
@@ -152,6 +165,10 @@ int nvmap_map_into_caller_ptr(struct file *filp, void __user *arg);
 
 int nvmap_ioctl_cache_maint(struct file *filp, void __user *arg);
 
+int nvmap_ioctl_cache_maint_list(struct file *filp, void __user *arg);
+
+void nvmap_cache_maint_debugfs_init(struct dentry *root);
+
 int nvmap_ioctl_rw_handle(struct file *filp, int is_read, void __user* arg);
 
 
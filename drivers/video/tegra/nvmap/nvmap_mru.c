@@ -96,7 +96,7 @@ struct tegra_iovmm_area *nvmap_handle_iovmm_locked(struct nvmap_client *c,
 	struct list_head *mru;
 	struct nvmap_handle *evict = NULL;
 	struct tegra_iovmm_area *vm = NULL;
-	unsigned int i, idx;
+	int i, idx;
 	pgprot_t prot;
 
 	BUG_ON(!h || !c || !c->share);
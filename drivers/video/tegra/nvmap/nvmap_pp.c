@@ -0,0 +1,501 @@
+/*
+ * drivers/video/tegra/nvmap/nvmap_pp.c
+ *
+ * Page pools for nvmap sysmem handles
+ *
+ * Copyright (c) 2011, NVIDIA Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <linux/bitops.h>
+#include <linux/device.h>
+#include <linux/err.h>
+#include <linux/highmem.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/spinlock.h>
+#include <linux/swap.h>
+
+#include <asm/cacheflush.h>
+#include <asm/outercache.h>
+
+#include <mach/nvmap.h>
+
+#include "nvmap.h"
+#include "nvmap_pp.h"
+
+/* every sysmem handle which is not write-back cacheable has its pages'
+ * kernel mapping changed with set_pages_array_*, which costs a TLB flush
+ * per call, and restored again when the handle is freed. to take that off
+ * the allocation path, released pages are kept in one pool per mapping
+ * attribute with the attribute still applied.
+ *
+ * released pages go onto the pool's dirty list; a kernel thread zeroes
+ * them in the background and moves them to the zero list, from which
+ * handle_page_alloc takes them. when a pool runs low the thread also
+ * refills it from the page allocator, changing the attributes once per
+ * batch. pool pages are handed back to the system through a shrinker.
+ */
+
+#define NVMAP_POOL_BATCH	32
+#define GFP_NVMAP_POOL		(GFP_NVMAP | __GFP_NORETRY | __GFP_NOMEMALLOC)
+
+/* bits in nvmap_share.pool_work */
+#define POOL_ZERO(_i)		(_i)
+#define POOL_FILL(_i)		(NVMAP_NUM_POOLS + (_i))
+
+static int pool_index(unsigned long flags)
+{
+	switch (flags) {
+	case NVMAP_HANDLE_WRITE_COMBINE:
+		return NVMAP_POOL_WC;
+	case NVMAP_HANDLE_UNCACHEABLE:
+		return NVMAP_POOL_UC;
+	case NVMAP_HANDLE_INNER_CACHEABLE:
+		return NVMAP_POOL_IWB;
+	default:
+		return -1;
+	}
+}
+
+static void pool_set_attr(int idx, struct page **pages, unsigned int nr)
+{
+	if (idx == NVMAP_POOL_WC)
+		set_pages_array_wc(pages, nr);
+	else if (idx == NVMAP_POOL_UC)
+		set_pages_array_uc(pages, nr);
+	else
+		set_pages_array_iwb(pages, nr);
+}
+
+static void pool_free_pages(struct page **pages, unsigned int nr)
+{
+	unsigned int i;
+
+	set_pages_array_wb(pages, nr);
+	for (i = 0; i < nr; i++)
+		__free_page(pages[i]);
+}
+
+/* lowmem pages are written through their (already changed) kernel
+ * mapping, so only the inner-cacheable pool has lines to write back;
+ * highmem pages go through a cacheable kmap and are flushed by hand */
+static void pool_zero_page(struct page *page, int idx)
+{
+	void *va;
+
+	if (PageHighMem(page)) {
+		unsigned long base = page_to_phys(page);
+
+		va = kmap(page);
+		memset(va, 0, PAGE_SIZE);
+		__cpuc_flush_dcache_area(va, PAGE_SIZE);
+		kunmap(page);
+		outer_flush_range(base, base + PAGE_SIZE);
+		return;
+	}
+
+	va = page_address(page);
+	memset(va, 0, PAGE_SIZE);
+	if (idx == NVMAP_POOL_IWB)
+		__cpuc_flush_dcache_area(va, PAGE_SIZE);
+}
+
+static void pool_kick(struct nvmap_share *share, int bit)
+{
+	set_bit(bit, &share->pool_work);
+	wake_up(&share->pool_wait);
+}
+
+/* pages being zeroed stay counted in nr_dirty until they are moved, so
+ * that the pool never grows past max_pages while the lock is dropped */
+static bool pool_zero_batch(struct nvmap_page_pool *pool, int idx)
+{
+	LIST_HEAD(batch);
+	struct page *page;
+	unsigned int n = 0;
+
+	spin_lock(&pool->lock);
+	while (n < NVMAP_POOL_BATCH && !list_empty(&pool->dirty_list)) {
+		page = list_first_entry(&pool->dirty_list, struct page, lru);
+		list_move_tail(&page->lru, &batch);
+		n++;
+	}
+	spin_unlock(&pool->lock);
+
+	if (!n)
+		return false;
+
+	list_for_each_entry(page, &batch, lru)
+		pool_zero_page(page, idx);
+	wmb();
+
+	spin_lock(&pool->lock);
+	list_splice_tail(&batch, &pool->zero_list);
+	pool->nr_dirty -= n;
+	pool->nr_zero += n;
+	spin_unlock(&pool->lock);
+	return true;
+}
+
+/* returns true if the batch was filled and the pool may still have room */
+static bool pool_fill_batch(struct nvmap_page_pool *pool, int idx)
+{
+	struct page *pages[NVMAP_POOL_BATCH];
+	unsigned int want, n, i;
+
+	spin_lock(&pool->lock);
+	want = pool->nr_zero + pool->nr_dirty;
+	want = (want < pool->max_pages) ? pool->max_pages - want : 0;
+	spin_unlock(&pool->lock);
+
+	want = min_t(unsigned int, want, NVMAP_POOL_BATCH);
+	for (n = 0; n < want; n++) {
+		pages[n] = alloc_page(GFP_NVMAP_POOL);
+		if (!pages[n])
+			break;
+	}
+
+	if (!n)
+		return false;
+
+	pool_set_attr(idx, pages, n);
+
+	spin_lock(&pool->lock);
+	for (i = 0; i < n; i++)
+		list_add_tail(&pages[i]->lru, &pool->dirty_list);
+	pool->nr_dirty += n;
+	spin_unlock(&pool->lock);
+	return n == NVMAP_POOL_BATCH;
+}
+
+/* gives up to nr pages back to the system, unzeroed pages first */
+static unsigned int pool_shrink(struct nvmap_page_pool *pool, unsigned int nr)
+{
+	struct page *pages[NVMAP_POOL_BATCH];
+	struct page *page;
+	unsigned int freed = 0;
+
+	while (freed < nr) {
+		unsigned int n = 0;
+
+		spin_lock(&pool->lock);
+		while (n < NVMAP_POOL_BATCH && freed + n < nr) {
+			if (!list_empty(&pool->dirty_list)) {
+				page = list_first_entry(&pool->dirty_list,
+							struct page, lru);
+				pool->nr_dirty--;
+			} else if (!list_empty(&pool->zero_list)) {
+				page = list_first_entry(&pool->zero_list,
+							struct page, lru);
+				pool->nr_zero--;
+			} else
+				break;
+			list_del(&page->lru);
+			pages[n++] = page;
+		}
+		spin_unlock(&pool->lock);
+
+		if (!n)
+			break;
+		pool_free_pages(pages, n);
+		freed += n;
+	}
+	return freed;
+}
+
+static int nvmap_page_pool_thread(void *arg)
+{
+	struct nvmap_share *share = arg;
+	int i;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(share->pool_wait,
+					 share->pool_work ||
+					 kthread_should_stop());
+
+		for (i = 0; i < NVMAP_NUM_POOLS; i++) {
+			struct nvmap_page_pool *pool = &share->pools[i];
+
+			if (test_and_clear_bit(POOL_FILL(i), &share->pool_work))
+				while (!kthread_should_stop() &&
+				       pool_fill_batch(pool, i))
+					cond_resched();
+
+			clear_bit(POOL_ZERO(i), &share->pool_work);
+			while (!kthread_should_stop() &&
+			       pool_zero_batch(pool, i))
+				cond_resched();
+		}
+	}
+	return 0;
+}
+
+static int nvmap_page_pool_shrink(struct shrinker *shrinker,
+				  int nr_to_scan, gfp_t gfp_mask)
+{
+	struct nvmap_share *share;
+	int i, total = 0;
+
+	share = container_of(shrinker, struct nvmap_share, pool_shrinker);
+
+	for (i = 0; i < NVMAP_NUM_POOLS && nr_to_scan > 0; i++)
+		nr_to_scan -= pool_shrink(&share->pools[i], nr_to_scan);
+
+	for (i = 0; i < NVMAP_NUM_POOLS; i++)
+		total += share->pools[i].nr_zero + share->pools[i].nr_dirty;
+
+	return total;
+}
+
+unsigned int nvmap_page_pool_alloc(struct nvmap_share *share,
+				   unsigned long flags,
+				   struct page **pages, unsigned int nr)
+{
+	struct nvmap_page_pool *pool;
+	struct page *page;
+	unsigned int got = 0, zeroed, i;
+	int idx = pool_index(flags);
+	bool low;
+
+	if (idx < 0)
+		return 0;
+
+	pool = &share->pools[idx];
+	spin_lock(&pool->lock);
+	while (got < nr && !list_empty(&pool->zero_list)) {
+		page = list_first_entry(&pool->zero_list, struct page, lru);
+		list_del(&page->lru);
+		pages[got++] = page;
+	}
+	pool->nr_zero -= got;
+	zeroed = got;
+
+	/* zeroing a page here is still far cheaper than allocating one and
+	 * changing its attributes, so don't leave dirty pages behind */
+	while (got < nr && !list_empty(&pool->dirty_list)) {
+		page = list_first_entry(&pool->dirty_list, struct page, lru);
+		list_del(&page->lru);
+		pages[got++] = page;
+	}
+	pool->nr_dirty -= got - zeroed;
+
+	pool->hits += got;
+	pool->misses += nr - got;
+	low = pool->nr_zero + pool->nr_dirty < pool->max_pages / 2;
+	spin_unlock(&pool->lock);
+
+	for (i = zeroed; i < got; i++)
+		pool_zero_page(pages[i], idx);
+	if (got > zeroed)
+		wmb();
+
+	if (low)
+		pool_kick(share, POOL_FILL(idx));
+
+	return got;
+}
+
+/* takes as many of the pages as the pool has room for; the remainder is
+ * compacted to the start of the array and its length returned, and the
+ * caller must restore and free those pages itself */
+unsigned int nvmap_page_pool_release(struct nvmap_share *share,
+				     unsigned long flags,
+				     struct page **pages, unsigned int nr)
+{
+	struct nvmap_page_pool *pool;
+	unsigned int i, left = 0;
+	int idx = pool_index(flags);
+
+	if (idx < 0)
+		return nr;
+
+	pool = &share->pools[idx];
+	spin_lock(&pool->lock);
+	for (i = 0; i < nr; i++) {
+		/* a page still referenced elsewhere (e.g., by a user mapping
+		 * which has not been torn down yet) must not be recycled */
+		if (pool->nr_zero + pool->nr_dirty < pool->max_pages &&
+		    page_count(pages[i]) == 1) {
+			list_add_tail(&pages[i]->lru, &pool->dirty_list);
+			pool->nr_dirty++;
+		} else
+			pages[left++] = pages[i];
+	}
+	spin_unlock(&pool->lock);
+
+	if (left < nr)
+		pool_kick(share, POOL_ZERO(idx));
+
+	return left;
+}
+
+struct nvmap_pool_attr {
+	struct device_attribute attr;
+	int pool;
+};
+
+static struct nvmap_page_pool *attr_to_pool(struct device_attribute *attr)
+{
+	struct nvmap_pool_attr *pa;
+
+	pa = container_of(attr, struct nvmap_pool_attr, attr);
+	return &nvmap_get_share_from_dev(nvmap_dev)->pools[pa->pool];
+}
+
+static ssize_t pool_size_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", attr_to_pool(attr)->max_pages);
+}
+
+static ssize_t pool_size_store(struct device *dev,
+			       struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+	struct nvmap_page_pool *pool = attr_to_pool(attr);
+	unsigned int excess = 0;
+	unsigned long val;
+
+	if (strict_strtoul(buf, 10, &val) || val > totalram_pages / 2)
+		return -EINVAL;
+
+	spin_lock(&pool->lock);
+	pool->max_pages = val;
+	if (pool->nr_zero + pool->nr_dirty > val)
+		excess = pool->nr_zero + pool->nr_dirty - val;
+	spin_unlock(&pool->lock);
+
+	if (excess)
+		pool_shrink(pool, excess);
+
+	return count;
+}
+
+static ssize_t pool_pages_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct nvmap_page_pool *pool = attr_to_pool(attr);
+
+	return sprintf(buf, "%u\n", pool->nr_zero + pool->nr_dirty);
+}
+
+static ssize_t pool_hits_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", attr_to_pool(attr)->hits);
+}
+
+static ssize_t pool_misses_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", attr_to_pool(attr)->misses);
+}
+
+#define NVMAP_POOL_ATTRS(_name, _pool)					\
+static struct nvmap_pool_attr pool_attr_##_name##_size = {		\
+	__ATTR(_name##_size, S_IRUGO | S_IWUSR,				\
+	       pool_size_show, pool_size_store), _pool };		\
+static struct nvmap_pool_attr pool_attr_##_name##_pages = {		\
+	__ATTR(_name##_pages, S_IRUGO, pool_pages_show, NULL), _pool };	\
+static struct nvmap_pool_attr pool_attr_##_name##_hits = {		\
+	__ATTR(_name##_hits, S_IRUGO, pool_hits_show, NULL), _pool };	\
+static struct nvmap_pool_attr pool_attr_##_name##_misses = {		\
+	__ATTR(_name##_misses, S_IRUGO, pool_misses_show, NULL), _pool }
+
+NVMAP_POOL_ATTRS(wc, NVMAP_POOL_WC);
+NVMAP_POOL_ATTRS(uc, NVMAP_POOL_UC);
+NVMAP_POOL_ATTRS(iwb, NVMAP_POOL_IWB);
+
+static struct attribute *pool_attrs[] = {
+	&pool_attr_wc_size.attr.attr,
+	&pool_attr_wc_pages.attr.attr,
+	&pool_attr_wc_hits.attr.attr,
+	&pool_attr_wc_misses.attr.attr,
+	&pool_attr_uc_size.attr.attr,
+	&pool_attr_uc_pages.attr.attr,
+	&pool_attr_uc_hits.attr.attr,
+	&pool_attr_uc_misses.attr.attr,
+	&pool_attr_iwb_size.attr.attr,
+	&pool_attr_iwb_pages.attr.attr,
+	&pool_attr_iwb_hits.attr.attr,
+	&pool_attr_iwb_misses.attr.attr,
+	NULL,
+};
+
+static struct attribute_group pool_attr_group = {
+	.name = "pagepool",
+	.attrs = pool_attrs,
+};
+
+int nvmap_page_pool_create_group(struct device *dev)
+{
+	return sysfs_create_group(&dev->kobj, &pool_attr_group);
+}
+
+void nvmap_page_pool_remove_group(struct device *dev)
+{
+	sysfs_remove_group(&dev->kobj, &pool_attr_group);
+}
+
+int nvmap_page_pool_init(struct nvmap_share *share)
+{
+	struct task_struct *thread;
+	int i;
+
+	for (i = 0; i < NVMAP_NUM_POOLS; i++) {
+		struct nvmap_page_pool *pool = &share->pools[i];
+
+		spin_lock_init(&pool->lock);
+		INIT_LIST_HEAD(&pool->zero_list);
+		INIT_LIST_HEAD(&pool->dirty_list);
+		pool->nr_zero = 0;
+		pool->nr_dirty = 0;
+		pool->max_pages = CONFIG_NVMAP_PAGE_POOL_SIZE;
+		pool->hits = 0;
+		pool->misses = 0;
+	}
+
+	share->pool_work = 0;
+	init_waitqueue_head(&share->pool_wait);
+
+	thread = kthread_run(nvmap_page_pool_thread, share, "nvmap-pool");
+	if (IS_ERR(thread))
+		return PTR_ERR(thread);
+	share->pool_thread = thread;
+
+	share->pool_shrinker.shrink = nvmap_page_pool_shrink;
+	share->pool_shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&share->pool_shrinker);
+	return 0;
+}
+
+void nvmap_page_pool_destroy(struct nvmap_share *share)
+{
+	int i;
+
+	if (!share->pool_thread)
+		return;
+
+	unregister_shrinker(&share->pool_shrinker);
+	kthread_stop(share->pool_thread);
+	share->pool_thread = NULL;
+
+	for (i = 0; i < NVMAP_NUM_POOLS; i++)
+		pool_shrink(&share->pools[i], UINT_MAX);
+}
@@ -0,0 +1,74 @@
+/*
+ * drivers/video/tegra/nvmap/nvmap_pp.h
+ *
+ * Page pools for nvmap sysmem handles
+ *
+ * Copyright (c) 2011, NVIDIA Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __VIDEO_TEGRA_NVMAP_PP_H
+#define __VIDEO_TEGRA_NVMAP_PP_H
+
+#include "nvmap.h"
+
+struct device;
+struct page;
+
+#ifdef CONFIG_NVMAP_PAGE_POOLS
+
+int nvmap_page_pool_init(struct nvmap_share *share);
+
+void nvmap_page_pool_destroy(struct nvmap_share *share);
+
+int nvmap_page_pool_create_group(struct device *dev);
+
+void nvmap_page_pool_remove_group(struct device *dev);
+
+unsigned int nvmap_page_pool_alloc(struct nvmap_share *share,
+				   unsigned long flags,
+				   struct page **pages, unsigned int nr);
+
+unsigned int nvmap_page_pool_release(struct nvmap_share *share,
+				     unsigned long flags,
+				     struct page **pages, unsigned int nr);
+
+#else
+
+#define nvmap_page_pool_init(_s)		0
+#define nvmap_page_pool_destroy(_s)		do { } while (0)
+#define nvmap_page_pool_create_group(_d)	0
+#define nvmap_page_pool_remove_group(_d)	do { } while (0)
+
+static inline unsigned int nvmap_page_pool_alloc(struct nvmap_share *share,
+						 unsigned long flags,
+						 struct page **pages,
+						 unsigned int nr)
+{
+	return 0;
+}
+
+static inline unsigned int nvmap_page_pool_release(struct nvmap_share *share,
+						   unsigned long flags,
+						   struct page **pages,
+						   unsigned int nr)
+{
+	return nr;
+}
+
+#endif
+
+#endif
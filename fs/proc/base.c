@@ -1138,6 +1138,8 @@ err_sighand:
 	unlock_task_sighand(task, &flags);
 err_task_lock:
 	task_unlock(task);
+	if (!err)
+		oom_adj_notify(OOM_ADJ_NOTIFY_CHANGE, task);
 	put_task_struct(task);
 out:
 	return err < 0 ? err : count;
@@ -1273,6 +1275,8 @@ err_sighand:
 	unlock_task_sighand(task, &flags);
 err_task_lock:
 	task_unlock(task);
+	if (!err)
+		oom_adj_notify(OOM_ADJ_NOTIFY_CHANGE, task);
 	put_task_struct(task);
 out:
 	return err < 0 ? err : count;
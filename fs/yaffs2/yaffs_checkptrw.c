@@ -57,6 +57,8 @@ static int yaffs_checkpt_erase(struct yaffs_dev *dev)
 	}
 
 	dev->blocks_in_checkpt = 0;
+	dev->checkpt_tail_chunk = -1;
+	dev->checkpt_stale = 0;
 
 	return 1;
 }
@@ -360,12 +362,84 @@ int yaffs2_checkpt_rd(struct yaffs_dev *dev, void *data, int n_bytes)
 	return i;
 }
 
+/* The first page after the end of the checkpoint, if it is in a checkpoint
+ * block. Only valid once all of the checkpoint has been written or read.
+ */
+static int yaffs2_checkpt_tail(struct yaffs_dev *dev)
+{
+	if (dev->checkpt_cur_block < 0)
+		return -1;
+	return dev->checkpt_cur_block * dev->param.chunks_per_block +
+	    dev->checkpt_cur_chunk;
+}
+
+int yaffs2_checkpt_rd_tail(struct yaffs_dev *dev)
+{
+	struct yaffs_ext_tags tags;
+	int chunk = yaffs2_checkpt_tail(dev);
+
+	dev->checkpt_tail_chunk = -1;
+	dev->checkpt_stale = 0;
+
+	if (chunk < 0)
+		return 0;
+
+	dev->n_page_reads++;
+	dev->param.read_chunk_tags_fn(dev, chunk - dev->chunk_offset,
+				      NULL, &tags);
+
+	/* Anything at all written there means the checkpoint is stale */
+	if (tags.chunk_used || tags.ecc_result == YAFFS_ECC_RESULT_UNFIXED) {
+		yaffs_trace(YAFFS_TRACE_CHECKPOINT,
+			"checkpoint marked stale at chunk %d", chunk);
+		dev->checkpt_stale = 1;
+	} else {
+		dev->checkpt_tail_chunk = chunk;
+		dev->checkpt_tail_seq = dev->checkpt_page_seq + 1;
+	}
+	return dev->checkpt_stale;
+}
+
+int yaffs2_checkpt_mark_stale(struct yaffs_dev *dev)
+{
+	struct yaffs_ext_tags tags;
+	u8 *buffer;
+	int chunk = dev->checkpt_tail_chunk;
+	int result;
+
+	if (chunk < 0 || !dev->param.write_chunk_tags_fn)
+		return 0;
+
+	memset(&tags, 0, sizeof(tags));
+	tags.chunk_id = dev->checkpt_tail_seq;
+	tags.seq_number = YAFFS_SEQUENCE_CHECKPOINT_DATA;
+
+	buffer = yaffs_get_temp_buffer(dev, __LINE__);
+	memset(buffer, 0xff, dev->data_bytes_per_chunk);
+
+	yaffs_trace(YAFFS_TRACE_CHECKPOINT,
+		"marking checkpoint stale at chunk %d", chunk);
+
+	dev->n_page_writes++;
+	result = dev->param.write_chunk_tags_fn(dev, chunk - dev->chunk_offset,
+						buffer, &tags);
+	yaffs_release_temp_buffer(dev, buffer, __LINE__);
+
+	/* Only ever one marker, whether or not this one made it */
+	dev->checkpt_tail_chunk = -1;
+	dev->checkpt_stale = (result == YAFFS_OK);
+
+	return dev->checkpt_stale;
+}
+
 int yaffs_checkpt_close(struct yaffs_dev *dev)
 {
 
 	if (dev->checkpt_open_write) {
 		if (dev->checkpt_byte_offs != 0)
 			yaffs2_checkpt_flush_buffer(dev);
+		dev->checkpt_tail_chunk = yaffs2_checkpt_tail(dev);
+		dev->checkpt_tail_seq = dev->checkpt_page_seq + 1;
 	} else if (dev->checkpt_block_list) {
 		int i;
 		for (i = 0;
@@ -30,4 +30,8 @@ int yaffs_checkpt_close(struct yaffs_dev *dev);
 
 int yaffs2_checkpt_invalidate_stream(struct yaffs_dev *dev);
 
+/* Stale checkpoint marking, see yaffs_dev.checkpt_tail_chunk */
+int yaffs2_checkpt_rd_tail(struct yaffs_dev *dev);
+int yaffs2_checkpt_mark_stale(struct yaffs_dev *dev);
+
 #endif
@@ -46,6 +46,8 @@
 static int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
 			     const u8 * buffer, int n_bytes, int use_reserve);
 
+static void yaffs_check_obj_details_loaded(struct yaffs_obj *in);
+
 
 
 /* Function to calculate chunk and offset */
@@ -440,16 +442,160 @@ static int yaffs_find_alloc_block(struct yaffs_dev *dev)
 	return -1;
 }
 
-static int yaffs_alloc_chunk(struct yaffs_dev *dev, int use_reserver,
+/*
+ * Allocation streams.
+ *
+ * Files that keep being rewritten are written to a hot allocation block of
+ * their own and everything else to the usual, cold, one. Short lived data
+ * then shares blocks that go dirty together and are cheap to gc, rather
+ * than being mixed in with data that gc has to keep copying.
+ *
+ * The yaffs2 scan takes the copy of a chunk in the block with the higher
+ * sequence number to be the newer one, so nothing may be written to a
+ * block older than one holding an earlier version of it. An object is
+ * only written to one stream at a time, and only moves to the other one
+ * once that stream's block is the newer. A move that can't wait, or a
+ * header shadowing an object of the other stream, closes the older block
+ * early instead.
+ */
+
+/* An object's heat counts its chunks rewritten or truncated away, halving
+ * each time another quarter of the blocks has been allocated.
+ */
+#define YAFFS_HEAT_HOT		8	/* Hot from this much heat */
+#define YAFFS_HEAT_COLD		4	/* and cold again below this */
+#define YAFFS_STREAM_LAG	4	/* Blocks to wait for the hot stream */
+
+static u8 yaffs_heat_epoch(struct yaffs_dev *dev)
+{
+	u32 period =
+	    (dev->internal_end_block - dev->internal_start_block + 1) / 4;
+
+	return (u8) (dev->seq_number / (period ? period : 1));
+}
+
+static void yaffs_heat_obj(struct yaffs_obj *obj, int n_chunks)
+{
+	u8 epoch = yaffs_heat_epoch(obj->my_dev);
+	u8 age = epoch - obj->heat_epoch;
+	int heat = obj->heat;
+
+	if (age) {
+		heat = (age < 8) ? (heat >> age) : 0;
+		obj->heat_epoch = epoch;
+	}
+
+	heat += n_chunks;
+	obj->heat = (heat > 255) ? 255 : heat;
+}
+
+static int yaffs_stream_block(struct yaffs_dev *dev, int stream)
+{
+	return (stream == YAFFS_STREAM_HOT) ?
+	    dev->hot_alloc_block : dev->alloc_block;
+}
+
+static void yaffs_close_stream(struct yaffs_dev *dev, int stream)
+{
+	int *block = (stream == YAFFS_STREAM_HOT) ?
+	    &dev->hot_alloc_block : &dev->alloc_block;
+
+	if (*block > 0) {
+		struct yaffs_block_info *bi = yaffs_get_block_info(dev, *block);
+		if (bi->block_state == YAFFS_BLOCK_STATE_ALLOCATING) {
+			bi->block_state = YAFFS_BLOCK_STATE_FULL;
+			*block = -1;
+		}
+	}
+}
+
+/* Make sure the next chunk written to a stream goes to a block newer than
+ * any the other stream has written to.
+ */
+static void yaffs_order_stream(struct yaffs_dev *dev, int stream)
+{
+	int other = (stream == YAFFS_STREAM_HOT) ?
+	    YAFFS_STREAM_COLD : YAFFS_STREAM_HOT;
+	int block = yaffs_stream_block(dev, stream);
+
+	if (block > 0 &&
+	    yaffs_get_block_info(dev, block)->seq_number <
+	    dev->stream_seq[other]) {
+		yaffs_close_stream(dev, stream);
+		dev->n_stream_retires++;
+	}
+}
+
+static int yaffs_obj_stream(struct yaffs_dev *dev, struct yaffs_obj *obj)
+{
+	int stream = YAFFS_STREAM_COLD;
+	int forced = 1;
+	int min_erased;
+
+	/* Files on their way out go back to cold, so that the header that
+	 * deletes them is newer than anything written for them. Their id may
+	 * be reused by an object that starts out cold.
+	 */
+	if (dev->param.hot_cold &&
+	    obj->variant_type == YAFFS_OBJECT_TYPE_FILE &&
+	    obj->parent != dev->unlinked_dir && obj->parent != dev->del_dir) {
+		forced = 0;
+		yaffs_heat_obj(obj, 0);
+		if (obj->heat >= ((obj->stream == YAFFS_STREAM_HOT) ?
+				  YAFFS_HEAT_COLD : YAFFS_HEAT_HOT))
+			stream = YAFFS_STREAM_HOT;
+	}
+
+	/* Don't tie up another block once gc is getting short of them */
+	min_erased = dev->param.n_reserved_blocks +
+	    yaffs_calc_checkpt_blocks_required(dev) + 1;
+	if (stream == YAFFS_STREAM_HOT && dev->hot_alloc_block < 0 &&
+	    dev->n_erased_blocks <= min_erased) {
+		stream = YAFFS_STREAM_COLD;
+		forced = 1;
+	}
+
+	if (stream == obj->stream)
+		return stream;
+
+	/* A change of heat waits until the stream it goes to has moved on to
+	 * a newer block, rather than close that block early. The hot stream
+	 * can sit on an old block once nothing is hot, so that one is only
+	 * waited for a few blocks.
+	 */
+	if (!forced && yaffs_stream_block(dev, stream) > 0 &&
+	    dev->stream_seq[stream] < dev->stream_seq[obj->stream] &&
+	    (stream == YAFFS_STREAM_COLD ||
+	     dev->stream_seq[obj->stream] - dev->stream_seq[stream] <
+	     YAFFS_STREAM_LAG))
+		return obj->stream;
+
+	yaffs_order_stream(dev, stream);
+	obj->stream = stream;
+
+	return stream;
+}
+
+static int yaffs_alloc_chunk(struct yaffs_dev *dev, int stream,
+			     int use_reserver,
 			     struct yaffs_block_info **block_ptr)
 {
 	int ret_val;
 	struct yaffs_block_info *bi;
+	int *block = &dev->alloc_block;
+	u32 *page = &dev->alloc_page;
+
+	if (stream == YAFFS_STREAM_HOT) {
+		block = &dev->hot_alloc_block;
+		page = &dev->hot_alloc_page;
+	}
 
-	if (dev->alloc_block < 0) {
+	if (*block < 0) {
 		/* Get next block to allocate off */
-		dev->alloc_block = yaffs_find_alloc_block(dev);
-		dev->alloc_page = 0;
+		*block = yaffs_find_alloc_block(dev);
+		*page = 0;
+		if (*block >= 0)
+			dev->stream_seq[stream] = dev->seq_number;
 	}
 
 	if (!use_reserver && !yaffs_check_alloc_available(dev, 1)) {
@@ -458,26 +604,25 @@ static int yaffs_alloc_chunk(struct yaffs_dev *dev, int use_reserver,
 	}
 
 	if (dev->n_erased_blocks < dev->param.n_reserved_blocks
-	    && dev->alloc_page == 0)
+	    && *page == 0)
 		yaffs_trace(YAFFS_TRACE_ALLOCATE, "Allocating reserve");
 
 	/* Next page please.... */
-	if (dev->alloc_block >= 0) {
-		bi = yaffs_get_block_info(dev, dev->alloc_block);
+	if (*block >= 0) {
+		bi = yaffs_get_block_info(dev, *block);
 
-		ret_val = (dev->alloc_block * dev->param.chunks_per_block) +
-		    dev->alloc_page;
+		ret_val = (*block * dev->param.chunks_per_block) + *page;
 		bi->pages_in_use++;
-		yaffs_set_chunk_bit(dev, dev->alloc_block, dev->alloc_page);
+		yaffs_set_chunk_bit(dev, *block, *page);
 
-		dev->alloc_page++;
+		(*page)++;
 
 		dev->n_free_chunks--;
 
 		/* If the block is full set the state to full */
-		if (dev->alloc_page >= dev->param.chunks_per_block) {
+		if (*page >= dev->param.chunks_per_block) {
 			bi->block_state = YAFFS_BLOCK_STATE_FULL;
-			dev->alloc_block = -1;
+			*block = -1;
 		}
 
 		if (block_ptr)
@@ -500,33 +645,31 @@ static int yaffs_get_erased_chunks(struct yaffs_dev *dev)
 	if (dev->alloc_block > 0)
 		n += (dev->param.chunks_per_block - dev->alloc_page);
 
+	if (dev->hot_alloc_block > 0)
+		n += (dev->param.chunks_per_block - dev->hot_alloc_page);
+
 	return n;
 
 }
 
 /*
- * yaffs_skip_rest_of_block() skips over the rest of the allocation block
- * if we don't want to write to it.
+ * yaffs_skip_rest_of_block() skips over the rest of the allocation blocks
+ * if we don't want to write to them.
  */
 void yaffs_skip_rest_of_block(struct yaffs_dev *dev)
 {
-	if (dev->alloc_block > 0) {
-		struct yaffs_block_info *bi =
-		    yaffs_get_block_info(dev, dev->alloc_block);
-		if (bi->block_state == YAFFS_BLOCK_STATE_ALLOCATING) {
-			bi->block_state = YAFFS_BLOCK_STATE_FULL;
-			dev->alloc_block = -1;
-		}
-	}
+	yaffs_close_stream(dev, YAFFS_STREAM_COLD);
+	yaffs_close_stream(dev, YAFFS_STREAM_HOT);
 }
 
 static int yaffs_write_new_chunk(struct yaffs_dev *dev,
-				 const u8 * data,
+				 struct yaffs_obj *obj, const u8 * data,
 				 struct yaffs_ext_tags *tags, int use_reserver)
 {
 	int attempts = 0;
 	int write_ok = 0;
 	int chunk;
+	int stream = YAFFS_STREAM_COLD;
 
 	yaffs2_checkpt_invalidate(dev);
 
@@ -534,7 +677,8 @@ static int yaffs_write_new_chunk(struct yaffs_dev *dev,
 		struct yaffs_block_info *bi = 0;
 		int erased_ok = 0;
 
-		chunk = yaffs_alloc_chunk(dev, use_reserver, &bi);
+		stream = yaffs_obj_stream(dev, obj);
+		chunk = yaffs_alloc_chunk(dev, stream, use_reserver, &bi);
 		if (chunk < 0) {
 			/* no space */
 			break;
@@ -609,6 +753,10 @@ static int yaffs_write_new_chunk(struct yaffs_dev *dev,
 
 	if (!write_ok)
 		chunk = -1;
+	else if (stream == YAFFS_STREAM_HOT)
+		dev->n_hot_writes++;
+	else
+		dev->n_cold_writes++;
 
 	if (attempts > 1) {
 		yaffs_trace(YAFFS_TRACE_ERROR,
@@ -686,6 +834,131 @@ static u16 yaffs_calc_name_sum(const YCHAR * name)
 	return sum;
 }
 
+/*
+ * Directory name index.
+ *
+ * Large directories get a hash table of their children keyed on the
+ * name sum, so that lookups do not have to walk the whole children list.
+ * The index is built by yaffs_find_by_name() once a list walk gets long
+ * and is then kept up to date as children come and go or are renamed.
+ * Every child of an indexed directory is in the index, except for the
+ * brief time yaffs_new_obj() parks a new object in the root directory.
+ */
+
+static inline unsigned yaffs_name_bucket(const struct yaffs_name_index *ni,
+					 u16 sum)
+{
+	return ((u32) sum * 0x9e370001UL) >> (32 - ni->bits);
+}
+
+static void yaffs_name_index_free(struct yaffs_obj *dir)
+{
+	struct yaffs_name_index *ni = dir->variant.dir_variant.name_index;
+	struct hlist_node *pos;
+	struct hlist_node *n;
+	unsigned i;
+
+	if (!ni)
+		return;
+
+	for (i = 0; i < (1U << ni->bits); i++)
+		hlist_for_each_safe(pos, n, &ni->bucket[i])
+			INIT_HLIST_NODE(pos);
+
+	kfree(ni);
+	dir->variant.dir_variant.name_index = NULL;
+}
+
+static void yaffs_name_index_add(struct yaffs_obj *obj)
+{
+	struct yaffs_name_index *ni;
+
+	if (!obj->parent ||
+	    obj->parent->variant_type != YAFFS_OBJECT_TYPE_DIRECTORY ||
+	    !obj->parent->variant.dir_variant.name_index)
+		return;
+
+	/* A lazy loaded object does not know its name sum yet. Loading it
+	 * sets the name, which calls back in here.
+	 */
+	yaffs_check_obj_details_loaded(obj);
+	if (!hlist_unhashed(&obj->name_link))
+		return;
+
+	ni = obj->parent->variant.dir_variant.name_index;
+	hlist_add_head(&obj->name_link,
+		       &ni->bucket[yaffs_name_bucket(ni, obj->sum)]);
+	ni->n_entries++;
+}
+
+static void yaffs_name_index_del(struct yaffs_obj *obj)
+{
+	struct yaffs_name_index *ni;
+
+	if (hlist_unhashed(&obj->name_link))
+		return;
+
+	ni = obj->parent->variant.dir_variant.name_index;
+	hlist_del_init(&obj->name_link);
+	ni->n_entries--;
+
+	/* Don't hang on to the memory if the directory has shrunk */
+	if (ni->n_entries < YAFFS_NAME_INDEX_MIN / 2)
+		yaffs_name_index_free(obj->parent);
+}
+
+static void yaffs_name_index_build(struct yaffs_obj *dir, int n_children)
+{
+	struct yaffs_name_index *ni;
+	struct list_head *i;
+	int bits = 0;
+
+	while (bits < YAFFS_NAME_INDEX_MAX_BITS &&
+	       (YAFFS_NAME_INDEX_LOAD << bits) < n_children)
+		bits++;
+
+	ni = kmalloc(sizeof(*ni) + (sizeof(struct hlist_head) << bits),
+		     GFP_NOFS);
+	if (!ni)
+		return;		/* Not fatal, lookups walk the list instead */
+
+	ni->n_entries = 0;
+	ni->bits = bits;
+	for (n_children = 0; n_children < (1 << bits); n_children++)
+		INIT_HLIST_HEAD(&ni->bucket[n_children]);
+
+	dir->variant.dir_variant.name_index = ni;
+
+	list_for_each(i, &dir->variant.dir_variant.children)
+		yaffs_name_index_add(list_entry(i, struct yaffs_obj, siblings));
+
+	yaffs_trace(YAFFS_TRACE_OS,
+		"yaffs: built name index for dir %d: %d entries, %d buckets",
+		dir->obj_id, ni->n_entries, 1 << bits);
+}
+
+/* Objects without a name header are only known as obj<id>, whatever their
+ * name sum, so such names have to be looked up the slow way.
+ */
+static int yaffs_name_is_indexable(const YCHAR * name)
+{
+	const YCHAR *p;
+
+	if (!strcmp(name, YAFFS_LOSTNFOUND_NAME))
+		return 0;
+
+	if (strncmp(name, YAFFS_LOSTNFOUND_PREFIX,
+		    strlen(YAFFS_LOSTNFOUND_PREFIX)))
+		return 1;
+
+	p = name + strlen(YAFFS_LOSTNFOUND_PREFIX);
+	if (!*p)
+		return 1;
+	while (*p >= '0' && *p <= '9')
+		p++;
+	return *p != 0;
+}
+
 void yaffs_set_obj_name(struct yaffs_obj *obj, const YCHAR * name)
 {
 #ifndef CONFIG_YAFFS_NO_SHORT_NAMES
@@ -697,7 +970,9 @@ void yaffs_set_obj_name(struct yaffs_obj *obj, const YCHAR * name)
 	else
 		obj->short_name[0] = _Y('\0');
 #endif
+	yaffs_name_index_del(obj);
 	obj->sum = yaffs_calc_name_sum(name);
+	yaffs_name_index_add(obj);
 }
 
 void yaffs_set_obj_name_from_oh(struct yaffs_obj *obj,
@@ -744,6 +1019,19 @@ static void yaffs_free_tnode(struct yaffs_dev *dev, struct yaffs_tnode *tn)
 
 static void yaffs_deinit_tnodes_and_objs(struct yaffs_dev *dev)
 {
+	struct list_head *i;
+	struct yaffs_obj *obj;
+	int b;
+
+	/* Name indexes are the only per-object allocations left to free */
+	for (b = 0; b < YAFFS_NOBJECT_BUCKETS; b++) {
+		list_for_each(i, &dev->obj_bucket[b].list) {
+			obj = list_entry(i, struct yaffs_obj, hash_link);
+			if (obj->variant_type == YAFFS_OBJECT_TYPE_DIRECTORY)
+				yaffs_name_index_free(obj);
+		}
+	}
+
 	yaffs_deinit_raw_tnodes_and_objs(dev);
 	dev->n_obj = 0;
 	dev->n_tnodes = 0;
@@ -1281,6 +1569,7 @@ static void yaffs_remove_obj_from_dir(struct yaffs_obj *obj)
 	if (dev && dev->param.remove_obj_fn)
 		dev->param.remove_obj_fn(obj);
 
+	yaffs_name_index_del(obj);
 	list_del_init(&obj->siblings);
 	obj->parent = NULL;
 
@@ -1315,6 +1604,7 @@ void yaffs_add_obj_to_dir(struct yaffs_obj *directory, struct yaffs_obj *obj)
 	/* Now add it */
 	list_add(&obj->siblings, &directory->variant.dir_variant.children);
 	obj->parent = directory;
+	yaffs_name_index_add(obj);
 
 	if (directory == obj->my_dev->unlinked_dir
 	    || directory == obj->my_dev->del_dir) {
@@ -1394,10 +1684,38 @@ static int yaffs_change_obj_name(struct yaffs_obj *obj,
  *   In Linux, the page cache provides read buffering and the short op cache 
  *   provides write buffering.
  *
- *   There are a limited number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   The cache can be large, so chunks are found through a hash on object and
+ *   chunk id, and kept on a list in order of use so that the least recently
+ *   used one is the one that gets pushed out. Dirty chunks are written back
+ *   sorted by object and chunk id so each file's chunks go out together.
  */
 
+static struct list_head *yaffs_cache_bucket(struct yaffs_dev *dev,
+					    const struct yaffs_obj *obj,
+					    int chunk_id)
+{
+	u32 h = obj->obj_id * 0x9e370001UL + chunk_id;
+
+	return &dev->cache_hash[(h ^ (h >> 16)) & dev->cache_hash_mask];
+}
+
+static void yaffs_clean_cache(struct yaffs_dev *dev, struct yaffs_cache *cache)
+{
+	if (cache->dirty) {
+		cache->dirty = 0;
+		dev->n_dirty_caches--;
+	}
+}
+
+/* Throw away what the cache holds and make it the first to be reused */
+static void yaffs_drop_cache(struct yaffs_dev *dev, struct yaffs_cache *cache)
+{
+	yaffs_clean_cache(dev, cache);
+	cache->object = NULL;
+	list_del_init(&cache->hash_link);
+	list_move(&cache->lru, &dev->cache_lru);
+}
+
 static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
@@ -1405,6 +1723,9 @@ static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 	struct yaffs_cache *cache;
 	int n_caches = obj->my_dev->param.n_caches;
 
+	if (!dev->n_dirty_caches)
+		return 0;
+
 	for (i = 0; i < n_caches; i++) {
 		cache = &dev->cache[i];
 		if (cache->object == obj && cache->dirty)
@@ -1414,53 +1735,64 @@ static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 	return 0;
 }
 
-static void yaffs_flush_file_cache(struct yaffs_obj *obj)
+static int yaffs_cache_cmp(const void *a, const void *b)
 {
-	struct yaffs_dev *dev = obj->my_dev;
-	int lowest = -99;	/* Stop compiler whining. */
-	int i;
-	struct yaffs_cache *cache;
-	int chunk_written = 0;
-	int n_caches = obj->my_dev->param.n_caches;
+	const struct yaffs_cache *ca = *(struct yaffs_cache * const *)a;
+	const struct yaffs_cache *cb = *(struct yaffs_cache * const *)b;
 
-	if (n_caches > 0) {
-		do {
-			cache = NULL;
-
-			/* Find the dirty cache for this object with the lowest chunk id. */
-			for (i = 0; i < n_caches; i++) {
-				if (dev->cache[i].object == obj &&
-				    dev->cache[i].dirty) {
-					if (!cache
-					    || dev->cache[i].chunk_id <
-					    lowest) {
-						cache = &dev->cache[i];
-						lowest = cache->chunk_id;
-					}
-				}
-			}
+	if (ca->object->obj_id != cb->object->obj_id)
+		return ca->object->obj_id < cb->object->obj_id ? -1 : 1;
+	return ca->chunk_id - cb->chunk_id;
+}
 
-			if (cache && !cache->locked) {
-				/* Write it out and free it up */
+/* Write back the dirty chunks of obj, or of all objects if obj is NULL,
+ * in object and chunk order. The chunks stay cached, now clean.
+ */
+static void yaffs_flush_cache(struct yaffs_dev *dev, struct yaffs_obj *obj)
+{
+	struct yaffs_cache *cache;
+	int chunk_written = 1;
+	int n = 0;
+	int i;
 
-				chunk_written =
-				    yaffs_wr_data_obj(cache->object,
-						      cache->chunk_id,
-						      cache->data,
-						      cache->n_bytes, 1);
-				cache->dirty = 0;
-				cache->object = NULL;
-			}
+	if (!dev->n_dirty_caches)
+		return;
 
-		} while (cache && chunk_written > 0);
+	for (i = 0; i < dev->param.n_caches; i++) {
+		cache = &dev->cache[i];
+		if (cache->dirty && (!obj || cache->object == obj))
+			dev->cache_sort[n++] = cache;
+	}
 
-		if (cache)
-			/* Hoosterman, disk full while writing cache out. */
-			yaffs_trace(YAFFS_TRACE_ERROR,
-				"yaffs tragedy: no space during cache write");
+	if (n > 1)
+		sort(dev->cache_sort, n, sizeof(struct yaffs_cache *),
+		     yaffs_cache_cmp, NULL);
+
+	for (i = 0; i < n && chunk_written > 0; i++) {
+		cache = dev->cache_sort[i];
+		if (cache->locked)
+			break;
 
+		chunk_written = yaffs_wr_data_obj(cache->object,
+						  cache->chunk_id,
+						  cache->data,
+						  cache->n_bytes, 1);
+		if (chunk_written > 0)
+			yaffs_clean_cache(dev, cache);
+		else
+			yaffs_drop_cache(dev, cache);
 	}
 
+	if (i < n || chunk_written <= 0)
+		/* Hoosterman, disk full while writing cache out. */
+		yaffs_trace(YAFFS_TRACE_ERROR,
+			"yaffs tragedy: no space during cache write");
+}
+
+static void yaffs_flush_file_cache(struct yaffs_obj *obj)
+{
+	if (obj->my_dev->param.n_caches > 0)
+		yaffs_flush_cache(obj->my_dev, obj);
 }
 
 /*yaffs_flush_whole_cache(dev)
@@ -1470,96 +1802,54 @@ static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 
 void yaffs_flush_whole_cache(struct yaffs_dev *dev)
 {
-	struct yaffs_obj *obj;
-	int n_caches = dev->param.n_caches;
-	int i;
-
-	/* Find a dirty object in the cache and flush it...
-	 * until there are no further dirty objects.
-	 */
-	do {
-		obj = NULL;
-		for (i = 0; i < n_caches && !obj; i++) {
-			if (dev->cache[i].object && dev->cache[i].dirty)
-				obj = dev->cache[i].object;
-
-		}
-		if (obj)
-			yaffs_flush_file_cache(obj);
-
-	} while (obj);
-
+	if (dev->param.n_caches > 0)
+		yaffs_flush_cache(dev, NULL);
 }
 
-/* Grab us a cache chunk for use.
- * First look for an empty one.
- * Then look for the least recently used non-dirty one.
- * Then look for the least recently used dirty one...., flush and look again.
- */
-static struct yaffs_cache *yaffs_grab_chunk_worker(struct yaffs_dev *dev)
+/* The least recently used unlocked cache, or clean one if clean is set */
+static struct yaffs_cache *yaffs_lru_cache(struct yaffs_dev *dev, int clean)
 {
-	int i;
+	struct yaffs_cache *cache;
 
-	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (!dev->cache[i].object)
-				return &dev->cache[i];
-		}
+	list_for_each_entry(cache, &dev->cache_lru, lru) {
+		if (!cache->locked && (!clean || !cache->dirty))
+			return cache;
 	}
-
 	return NULL;
 }
 
-static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev)
+/* Grab us a cache chunk for obj's chunk_id, which is not cached yet.
+ * Take the least recently used one, unused ones being first in line. If it
+ * is dirty, write back its object's dirty chunks first. Should that stop
+ * short (eg. disk full) settle for any clean or dropped one, or NULL.
+ */
+static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev,
+						  struct yaffs_obj *obj,
+						  int chunk_id)
 {
 	struct yaffs_cache *cache;
-	struct yaffs_obj *the_obj;
-	int usage;
-	int i;
-	int pushout;
-
-	if (dev->param.n_caches > 0) {
-		/* Try find a non-dirty one... */
-
-		cache = yaffs_grab_chunk_worker(dev);
 
-		if (!cache) {
-			/* They were all dirty, find the last recently used object and flush
-			 * its cache, then  find again.
-			 * NB what's here is not very accurate, we actually flush the object
-			 * the last recently used page.
-			 */
+	if (dev->param.n_caches <= 0)
+		return NULL;
 
-			/* With locking we can't assume we can use entry zero */
+	cache = yaffs_lru_cache(dev, 0);
+	if (cache && cache->dirty) {
+		yaffs_flush_cache(dev, cache->object);
+		if (cache->dirty)
+			cache = yaffs_lru_cache(dev, 1);
+	}
+	if (!cache)
+		return NULL;
 
-			the_obj = NULL;
-			usage = -1;
-			cache = NULL;
-			pushout = -1;
+	yaffs_drop_cache(dev, cache);
 
-			for (i = 0; i < dev->param.n_caches; i++) {
-				if (dev->cache[i].object &&
-				    !dev->cache[i].locked &&
-				    (dev->cache[i].last_use < usage
-				     || !cache)) {
-					usage = dev->cache[i].last_use;
-					the_obj = dev->cache[i].object;
-					cache = &dev->cache[i];
-					pushout = i;
-				}
-			}
-
-			if (!cache || cache->dirty) {
-				/* Flush and try again */
-				yaffs_flush_file_cache(the_obj);
-				cache = yaffs_grab_chunk_worker(dev);
-			}
+	cache->object = obj;
+	cache->chunk_id = chunk_id;
+	cache->locked = 0;
+	cache->n_bytes = 0;
+	list_add(&cache->hash_link, yaffs_cache_bucket(dev, obj, chunk_id));
 
-		}
-		return cache;
-	} else {
-		return NULL;
-        }
+	return cache;
 }
 
 /* Find a cached chunk */
@@ -1567,14 +1857,17 @@ static struct yaffs_cache *yaffs_find_chunk_cache(const struct yaffs_obj *obj,
 						  int chunk_id)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
+	struct yaffs_cache *cache;
+
 	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object == obj &&
-			    dev->cache[i].chunk_id == chunk_id) {
+		list_for_each_entry(cache,
+				    yaffs_cache_bucket(dev, obj, chunk_id),
+				    hash_link) {
+			if (cache->object == obj &&
+			    cache->chunk_id == chunk_id) {
 				dev->cache_hits++;
 
-				return &dev->cache[i];
+				return cache;
 			}
 		}
 	}
@@ -1587,21 +1880,12 @@ static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
 {
 
 	if (dev->param.n_caches > 0) {
-		if (dev->cache_last_use < 0 || dev->cache_last_use > 100000000) {
-			/* Reset the cache usages */
-			int i;
-			for (i = 1; i < dev->param.n_caches; i++)
-				dev->cache[i].last_use = 0;
-
-			dev->cache_last_use = 0;
-		}
+		list_move_tail(&cache->lru, &dev->cache_lru);
 
-		dev->cache_last_use++;
-
-		cache->last_use = dev->cache_last_use;
-
-		if (is_write)
+		if (is_write && !cache->dirty) {
 			cache->dirty = 1;
+			dev->n_dirty_caches++;
+		}
 	}
 }
 
@@ -1616,7 +1900,7 @@ static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
 		    yaffs_find_chunk_cache(object, chunk_id);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_drop_cache(object->my_dev, cache);
 	}
 }
 
@@ -1632,7 +1916,7 @@ static void yaffs_invalidate_whole_cache(struct yaffs_obj *in)
 		/* Invalidate it. */
 		for (i = 0; i < dev->param.n_caches; i++) {
 			if (dev->cache[i].object == in)
-				dev->cache[i].object = NULL;
+				yaffs_drop_cache(dev, &dev->cache[i]);
 		}
 	}
 }
@@ -1673,6 +1957,9 @@ static void yaffs_free_obj(struct yaffs_obj *obj)
 		return;
 	}
 
+	if (obj->variant_type == YAFFS_OBJECT_TYPE_DIRECTORY)
+		yaffs_name_index_free(obj);
+
 	yaffs_unhash_obj(obj);
 
 	yaffs_free_raw_obj(dev, obj);
@@ -2306,6 +2593,8 @@ static int yaffs_init_blocks(struct yaffs_dev *dev)
 	dev->chunk_bits = NULL;
 
 	dev->alloc_block = -1;	/* force it to get a new one */
+	dev->hot_alloc_block = -1;
+	memset(dev->stream_seq, 0, sizeof(dev->stream_seq));
 
 	/* If the first allocation strategy fails, thry the alternate one */
 	dev->block_info =
@@ -2628,6 +2917,7 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 								&tags, 1);
 						new_chunk =
 						    yaffs_write_new_chunk(dev,
+									  object,
 									  (u8 *)
 									  oh,
 									  &tags,
@@ -2635,6 +2925,7 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 					} else {
 						new_chunk =
 						    yaffs_write_new_chunk(dev,
+									  object,
 									  buffer,
 									  &tags,
 									  1);
@@ -2715,9 +3006,27 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 	return ret_val;
 }
 
+/*
+ * Cost-benefit of collecting a block: the space it gives back, weighted by
+ * how long its data has gone without being rewritten (so is likely to stay
+ * put once copied), over the cost of reading and copying the rest.
+ */
+static unsigned yaffs_gc_score(struct yaffs_dev *dev,
+			       struct yaffs_block_info *bi, int pages_used)
+{
+	unsigned age = dev->seq_number - bi->seq_number + 1;
+
+	if (age > 0xffff)
+		age = 0xffff;
+
+	return (dev->param.chunks_per_block - pages_used) * age /
+	    (dev->param.chunks_per_block + pages_used);
+}
+
 /*
  * FindBlockForgarbageCollection is used to select the dirtiest block (or close enough)
- * for garbage collection.
+ * for garbage collection, or with gc_cost_benefit set, the one with the best
+ * yaffs_gc_score() of those dirty enough.
  */
 
 static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
@@ -2771,6 +3080,7 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 
 	if (!selected) {
 		int pages_used;
+		unsigned score;
 		int n_blocks =
 		    dev->internal_end_block - dev->internal_start_block + 1;
 		if (aggressive) {
@@ -2798,6 +3108,11 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 				iterations = 100;
 		}
 
+		/* Scores only compare between blocks under the threshold */
+		if (dev->param.gc_cost_benefit &&
+		    dev->gc_pages_in_use > threshold)
+			dev->gc_dirtiest = 0;
+
 		for (i = 0;
 		     i < iterations &&
 		     (dev->gc_dirtiest < 1 ||
@@ -2812,13 +3127,27 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 
 			pages_used = bi->pages_in_use - bi->soft_del_pages;
 
-			if (bi->block_state == YAFFS_BLOCK_STATE_FULL &&
-			    pages_used < dev->param.chunks_per_block &&
-			    (dev->gc_dirtiest < 1
-			     || pages_used < dev->gc_pages_in_use)
-			    && yaffs_block_ok_for_gc(dev, bi)) {
+			if (bi->block_state != YAFFS_BLOCK_STATE_FULL ||
+			    pages_used >= dev->param.chunks_per_block)
+				continue;
+
+			if (dev->param.gc_cost_benefit) {
+				if (pages_used > threshold)
+					continue;
+				score = yaffs_gc_score(dev, bi, pages_used);
+				if (dev->gc_dirtiest > 0 && score <= dev->gc_score)
+					continue;
+			} else {
+				score = 0;
+				if (dev->gc_dirtiest > 0 &&
+				    pages_used >= dev->gc_pages_in_use)
+					continue;
+			}
+
+			if (yaffs_block_ok_for_gc(dev, bi)) {
 				dev->gc_dirtiest = dev->gc_block_finder;
 				dev->gc_pages_in_use = pages_used;
+				dev->gc_score = score;
 			}
 		}
 
@@ -2915,9 +3244,10 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 		    dev->n_erased_blocks * dev->param.chunks_per_block;
 
 		/* If we need a block soon then do aggressive gc. */
-		if (dev->n_erased_blocks < min_erased)
+		if (dev->n_erased_blocks < min_erased) {
 			aggressive = 1;
-		else {
+			yaffs2_checkpt_release_stale(dev);
+		} else {
 			if (!background
 			    && erased_chunks > (dev->n_free_chunks / 4))
 				break;
@@ -2991,6 +3321,22 @@ int yaffs_bg_gc(struct yaffs_dev *dev, unsigned urgency)
 
 /*-------------------- Data file manipulation -----------------*/
 
+/*
+ * Called between chunks of a long file read or write to let other users
+ * of the device at it. The caller's object stays locked by the OS layer.
+ */
+static void yaffs_alloc_lock_break(struct yaffs_dev *dev)
+{
+	yaffs_unlock_alloc(dev);
+	yaffs_lock_alloc(dev);
+}
+
+static void yaffs_alloc_lock_break_shared(struct yaffs_dev *dev)
+{
+	yaffs_unlock_alloc_shared(dev);
+	yaffs_lock_alloc_shared(dev);
+}
+
 static int yaffs_rd_data_obj(struct yaffs_obj *in, int inode_chunk, u8 * buffer)
 {
 	int nand_chunk = yaffs_find_chunk_in_file(in, inode_chunk, NULL);
@@ -3117,13 +3463,16 @@ static int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
 	}
 
 	new_chunk_id =
-	    yaffs_write_new_chunk(dev, buffer, &new_tags, use_reserve);
+	    yaffs_write_new_chunk(dev, in, buffer, &new_tags, use_reserve);
 
 	if (new_chunk_id > 0) {
 		yaffs_put_chunk_in_file(in, inode_chunk, new_chunk_id, 0);
+		dev->n_host_writes++;
 
-		if (prev_chunk_id > 0)
+		if (prev_chunk_id > 0) {
 			yaffs_chunk_del(dev, prev_chunk_id, 1, __LINE__);
+			yaffs_heat_obj(in, 1);
+		}
 
 		yaffs_verify_file_sane(in);
 	}
@@ -3490,14 +3839,23 @@ int yaffs_update_oh(struct yaffs_obj *in, const YCHAR * name, int force,
 
 		yaffs_verify_oh(in, oh, &new_tags, 1);
 
+		/* The shadowing header has to land after the shadowed one */
+		if (shadows > 0) {
+			struct yaffs_obj *shadowed =
+			    yaffs_find_by_number(dev, shadows);
+			if (shadowed && shadowed->stream != in->stream)
+				yaffs_order_stream(dev, in->stream);
+		}
+
 		/* Create new chunk in NAND */
 		new_chunk_id =
-		    yaffs_write_new_chunk(dev, buffer, &new_tags,
+		    yaffs_write_new_chunk(dev, in, buffer, &new_tags,
 					  (prev_chunk_id > 0) ? 1 : 0);
 
 		if (new_chunk_id >= 0) {
 
 			in->hdr_chunk = new_chunk_id;
+			dev->n_host_writes++;
 
 			if (prev_chunk_id > 0) {
 				yaffs_chunk_del(dev, prev_chunk_id, 1,
@@ -3536,6 +3894,8 @@ int yaffs_update_oh(struct yaffs_obj *in, const YCHAR * name, int force,
  * An incomplete chunk to end off with
  *
  * Curve-balls: the first chunk might also be the last chunk.
+ *
+ * Called with dev->alloc_lock held shared.
  */
 
 int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
@@ -3553,6 +3913,9 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 	dev = in->my_dev;
 
 	while (n > 0) {
+		if (n_done)
+			yaffs_alloc_lock_break_shared(dev);
+
 		/* chunk = offset / dev->data_bytes_per_chunk + 1; */
 		/* start = offset % dev->data_bytes_per_chunk; */
 		yaffs_addr_to_chunk(dev, offset, &chunk, &start);
@@ -3574,22 +3937,25 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 		 */
 		if (cache || n_copy != dev->data_bytes_per_chunk
 		    || dev->param.inband_tags) {
-			if (dev->param.n_caches > 0) {
 
-				/* If we can't find the data in the cache, then load it up. */
+			/* The cache and temp buffers need the lock to
+			 * ourselves. Look again once we have it, as other
+			 * files may have taken cache entries meanwhile.
+			 */
+			yaffs_unlock_alloc_shared(dev);
+			yaffs_lock_alloc(dev);
+			cache = yaffs_find_chunk_cache(in, chunk);
 
-				if (!cache) {
-					cache =
-					    yaffs_grab_chunk_cache(in->my_dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+			/* If we can't find the data in the cache, then load it up. */
+
+			if (!cache && dev->param.n_caches > 0) {
+				cache = yaffs_grab_chunk_cache(dev, in, chunk);
+				if (cache)
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
-					cache->n_bytes = 0;
-				}
+			}
 
+			if (cache) {
 				yaffs_use_cache(dev, cache, 0);
 
 				cache->locked = 1;
@@ -3598,7 +3964,9 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 
 				cache->locked = 0;
 			} else {
-				/* Read into the local buffer then copy.. */
+				/* No cache to be had, so read into the local
+				 * buffer then copy..
+				 */
 
 				u8 *local_buffer =
 				    yaffs_get_temp_buffer(dev, __LINE__);
@@ -3610,6 +3978,8 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 							  __LINE__);
 			}
 
+			yaffs_downgrade_alloc(dev);
+
 		} else {
 
 			/* A full chunk. Read directly into the supplied buffer. */
@@ -3638,6 +4008,7 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 	int n_done = 0;
 	int n_writeback;
 	int start_write = offset;
+	int old_size = in->variant.file_variant.file_size;
 	int chunk_written = 0;
 	u32 n_bytes_read;
 	u32 chunk_start;
@@ -3647,6 +4018,9 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 	dev = in->my_dev;
 
 	while (n > 0 && chunk_written >= 0) {
+		if (n_done)
+			yaffs_alloc_lock_break(dev);
+
 		yaffs_addr_to_chunk(dev, offset, &chunk, &start);
 
 		if (chunk * dev->data_bytes_per_chunk + start != offset ||
@@ -3694,6 +4068,13 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 			n_writeback = dev->data_bytes_per_chunk;
 		}
 
+		/* Gc can copy the object header before we are done. It must
+		 * not record a size short of the chunk going out now, or the
+		 * scan takes the header as having truncated the chunk away.
+		 */
+		if (offset + n_copy > in->variant.file_variant.file_size)
+			in->variant.file_variant.file_size = offset + n_copy;
+
 		if (n_copy != dev->data_bytes_per_chunk
 		    || dev->param.inband_tags) {
 			/* An incomplete start or end chunk (or maybe both start and end chunk),
@@ -3706,13 +4087,11 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 
 				if (!cache
 				    && yaffs_check_alloc_available(dev, 1)) {
-					cache = yaffs_grab_chunk_cache(dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
-					yaffs_rd_data_obj(in, chunk,
-							  cache->data);
+					cache = yaffs_grab_chunk_cache(dev, in,
+								       chunk);
+					if (cache)
+						yaffs_rd_data_obj(in, chunk,
+								  cache->data);
 				} else if (cache &&
 					   !cache->dirty &&
 					   !yaffs_check_alloc_available(dev,
@@ -3740,7 +4119,7 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 						     cache->chunk_id,
 						     cache->data,
 						     cache->n_bytes, 1);
-						cache->dirty = 0;
+						yaffs_clean_cache(dev, cache);
 					}
 
 				} else {
@@ -3788,8 +4167,9 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 
 	}
 
-	/* Update file object */
+	/* Update file object, dropping what a failed chunk added above */
 
+	in->variant.file_variant.file_size = old_size;
 	if ((start_write + n_done) > in->variant.file_variant.file_size)
 		in->variant.file_variant.file_size = (start_write + n_done);
 
@@ -3819,6 +4199,7 @@ static void yaffs_prune_chunks(struct yaffs_obj *in, int new_size)
 	    dev->data_bytes_per_chunk;
 	int i;
 	int chunk_id;
+	int n_pruned = 0;
 
 	/* Delete backwards so that we don't end up with holes if
 	 * power is lost part-way through the operation.
@@ -3843,10 +4224,12 @@ static void yaffs_prune_chunks(struct yaffs_obj *in, int new_size)
 			} else {
 				in->n_data_chunks--;
 				yaffs_chunk_del(dev, chunk_id, 1, __LINE__);
+				n_pruned++;
 			}
 		}
 	}
 
+	yaffs_heat_obj(in, n_pruned);
 }
 
 void yaffs_resize_file_down(struct yaffs_obj *obj, loff_t new_size)
@@ -4470,11 +4853,15 @@ struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 				     const YCHAR * name)
 {
 	int sum;
+	int n_walked = 0;
 
 	struct list_head *i;
+	struct hlist_node *pos;
+	struct yaffs_name_index *ni;
 	YCHAR buffer[YAFFS_MAX_NAME_LENGTH + 1];
 
 	struct yaffs_obj *l;
+	struct yaffs_obj *found = NULL;
 
 	if (!name)
 		return NULL;
@@ -4495,9 +4882,39 @@ struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 
 	sum = yaffs_calc_name_sum(name);
 
+	/* Grow the index if the directory has outgrown it */
+	ni = directory->variant.dir_variant.name_index;
+	if (ni && ni->bits < YAFFS_NAME_INDEX_MAX_BITS &&
+	    ni->n_entries > (YAFFS_NAME_INDEX_LOAD << ni->bits)) {
+		n_walked = ni->n_entries;
+		yaffs_name_index_free(directory);
+		yaffs_name_index_build(directory, n_walked);
+		ni = directory->variant.dir_variant.name_index;
+	}
+
+	if (ni && yaffs_name_is_indexable(name)) {
+		hlist_for_each_entry(l, pos,
+				     &ni->bucket[yaffs_name_bucket(ni, sum)],
+				     name_link) {
+			if (l->parent != directory)
+				YBUG();
+
+			if (l->sum == sum) {
+				yaffs_get_obj_name(l, buffer,
+						   YAFFS_MAX_NAME_LENGTH + 1);
+				if (strncmp
+				    (name, buffer, YAFFS_MAX_NAME_LENGTH) == 0)
+					return l;
+			}
+		}
+		return NULL;
+	}
+
+	n_walked = 0;
 	list_for_each(i, &directory->variant.dir_variant.children) {
 		if (i) {
 			l = list_entry(i, struct yaffs_obj, siblings);
+			n_walked++;
 
 			if (l->parent != directory)
 				YBUG();
@@ -4506,8 +4923,10 @@ struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 
 			/* Special case for lost-n-found */
 			if (l->obj_id == YAFFS_OBJECTID_LOSTNFOUND) {
-				if (!strcmp(name, YAFFS_LOSTNFOUND_NAME))
-					return l;
+				if (!strcmp(name, YAFFS_LOSTNFOUND_NAME)) {
+					found = l;
+					break;
+				}
 			} else if (l->sum == sum
 				   || l->hdr_chunk <= 0) {
 				/* LostnFound chunk called Objxxx
@@ -4516,13 +4935,18 @@ struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 				yaffs_get_obj_name(l, buffer,
 						   YAFFS_MAX_NAME_LENGTH + 1);
 				if (strncmp
-				    (name, buffer, YAFFS_MAX_NAME_LENGTH) == 0)
-					return l;
+				    (name, buffer, YAFFS_MAX_NAME_LENGTH) == 0) {
+					found = l;
+					break;
+				}
 			}
 		}
 	}
 
-	return NULL;
+	if (!ni && n_walked >= YAFFS_NAME_INDEX_MIN)
+		yaffs_name_index_build(directory, n_walked);
+
+	return found;
 }
 
 /* GetEquivalentObject dereferences any hard links to get to the
@@ -4759,6 +5183,37 @@ static int yaffs_create_initial_dir(struct yaffs_dev *dev)
 	return YAFFS_FAIL;
 }
 
+/* Throw away what an aborted checkpoint load or scan left, and scan */
+static int yaffs_reinit_and_scan(struct yaffs_dev *dev)
+{
+	int ok;
+
+	yaffs_deinit_blocks(dev);
+
+	yaffs_deinit_tnodes_and_objs(dev);
+
+	dev->n_erased_blocks = 0;
+	dev->n_free_chunks = 0;
+	dev->alloc_block = -1;
+	dev->alloc_page = -1;
+	dev->n_deleted_files = 0;
+	dev->n_unlinked_files = 0;
+	dev->n_bg_deletions = 0;
+	dev->mount_checkpt = YAFFS_MOUNT_SCANNED;
+
+	ok = yaffs_init_blocks(dev);
+
+	yaffs_init_tnodes_and_objs(dev);
+
+	if (ok)
+		ok = yaffs_create_initial_dir(dev);
+
+	if (ok)
+		ok = yaffs2_scan_backwards(dev);
+
+	return ok;
+}
+
 int yaffs_guts_initialise(struct yaffs_dev *dev)
 {
 	int init_failed = 0;
@@ -4933,6 +5388,12 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	INIT_LIST_HEAD(&dev->dirty_dirs);
 	dev->oldest_dirty_seq = 0;
 	dev->oldest_dirty_block = 0;
+	dev->checkpt_tail_chunk = -1;
+	dev->checkpt_stale = 0;
+	dev->rollfwd = NULL;
+	dev->mount_checkpt = YAFFS_MOUNT_SCANNED;
+	dev->mount_blocks_scanned = 0;
+	dev->mount_chunks_scanned = 0;
 
 	/* Initialise temporary buffers and caches. */
 	if (!yaffs_init_tmp_buffers(dev))
@@ -4944,30 +5405,50 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	if (!init_failed && dev->param.n_caches > 0) {
 		int i;
 		void *buf;
-		int cache_bytes =
-		    dev->param.n_caches * sizeof(struct yaffs_cache);
+		int cache_bytes;
+		u32 n_buckets = 1;
 
 		if (dev->param.n_caches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->param.n_caches = YAFFS_MAX_SHORT_OP_CACHES;
 
+		while (n_buckets < dev->param.n_caches)
+			n_buckets <<= 1;
+
+		/* The entries, then the hash buckets, then the sort array */
+		cache_bytes =
+		    dev->param.n_caches * (sizeof(struct yaffs_cache) +
+					   sizeof(struct yaffs_cache *)) +
+		    n_buckets * sizeof(struct list_head);
+
 		dev->cache = kmalloc(cache_bytes, GFP_NOFS);
 
 		buf = (u8 *) dev->cache;
 
-		if (dev->cache)
+		INIT_LIST_HEAD(&dev->cache_lru);
+		dev->n_dirty_caches = 0;
+
+		if (dev->cache) {
 			memset(dev->cache, 0, cache_bytes);
 
+			dev->cache_hash = (struct list_head *)
+			    (dev->cache + dev->param.n_caches);
+			dev->cache_hash_mask = n_buckets - 1;
+			for (i = 0; i < n_buckets; i++)
+				INIT_LIST_HEAD(&dev->cache_hash[i]);
+			dev->cache_sort = (struct yaffs_cache **)
+			    (dev->cache_hash + n_buckets);
+		}
+
 		for (i = 0; i < dev->param.n_caches && buf; i++) {
 			dev->cache[i].object = NULL;
-			dev->cache[i].last_use = 0;
 			dev->cache[i].dirty = 0;
+			INIT_LIST_HEAD(&dev->cache[i].hash_link);
+			list_add_tail(&dev->cache[i].lru, &dev->cache_lru);
 			dev->cache[i].data = buf =
 			    kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
 		}
 		if (!buf)
 			init_failed = 1;
-
-		dev->cache_last_use = 0;
 	}
 
 	dev->cache_hits = 0;
@@ -4996,37 +5477,23 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		if (dev->param.is_yaffs2) {
 			if (yaffs2_checkpt_restore(dev)) {
 				yaffs_check_obj_details_loaded(dev->root_dir);
+				dev->mount_checkpt = YAFFS_MOUNT_CHECKPT;
 				yaffs_trace(YAFFS_TRACE_CHECKPOINT | YAFFS_TRACE_MOUNT,
 					"yaffs: restored from checkpoint"
 					);
 			} else {
 
 				/* Clean up the mess caused by an aborted checkpoint load
-				 * and scan backwards.
+				 * and scan backwards, rolling the checkpoint forward if
+				 * it was only stale. If that fails, scan everything.
 				 */
-				yaffs_deinit_blocks(dev);
-
-				yaffs_deinit_tnodes_and_objs(dev);
-
-				dev->n_erased_blocks = 0;
-				dev->n_free_chunks = 0;
-				dev->alloc_block = -1;
-				dev->alloc_page = -1;
-				dev->n_deleted_files = 0;
-				dev->n_unlinked_files = 0;
-				dev->n_bg_deletions = 0;
-
-				if (!init_failed && !yaffs_init_blocks(dev))
-					init_failed = 1;
-
-				yaffs_init_tnodes_and_objs(dev);
+				init_failed = !yaffs_reinit_and_scan(dev);
+				if (init_failed && yaffs2_rollfwd_abandon(dev))
+					init_failed = !yaffs_reinit_and_scan(dev);
 
-				if (!init_failed
-				    && !yaffs_create_initial_dir(dev))
-					init_failed = 1;
-
-				if (!init_failed && !yaffs2_scan_backwards(dev))
-					init_failed = 1;
+				if (dev->mount_checkpt == YAFFS_MOUNT_ROLLFWD)
+					yaffs_check_obj_details_loaded(dev->
+								       root_dir);
 			}
 		} else if (!yaffs1_scan(dev)) {
 			init_failed = 1;
@@ -5053,6 +5520,10 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	dev->n_erasures = 0;
 	dev->n_gc_copies = 0;
 	dev->n_retired_writes = 0;
+	dev->n_host_writes = 0;
+	dev->n_hot_writes = 0;
+	dev->n_cold_writes = 0;
+	dev->n_stream_retires = 0;
 
 	dev->n_retired_blocks = 0;
 
@@ -5132,21 +5603,14 @@ int yaffs_get_n_free_chunks(struct yaffs_dev *dev)
 	/* This is what we report to the outside world */
 
 	int n_free;
-	int n_dirty_caches;
 	int blocks_for_checkpt;
-	int i;
 
 	n_free = dev->n_free_chunks;
 	n_free += dev->n_deleted_files;
 
 	/* Now count the number of dirty chunks in the cache and subtract those */
 
-	for (n_dirty_caches = 0, i = 0; i < dev->param.n_caches; i++) {
-		if (dev->cache[i].dirty)
-			n_dirty_caches++;
-	}
-
-	n_free -= n_dirty_caches;
+	n_free -= dev->n_dirty_caches;
 
 	n_free -=
 	    ((dev->param.n_reserved_blocks + 1) * dev->param.chunks_per_block);
@@ -57,10 +57,18 @@
 
 #define YAFFS_NOBJECT_BUCKETS		256
 
+/* A directory gets a name index once a lookup walks this many children.
+ * The index is dropped again when the directory shrinks below half that,
+ * and never has more than 1 << YAFFS_NAME_INDEX_MAX_BITS buckets.
+ */
+#define YAFFS_NAME_INDEX_MIN		32
+#define YAFFS_NAME_INDEX_LOAD		4
+#define YAFFS_NAME_INDEX_MAX_BITS	8
+
 #define YAFFS_OBJECT_SPACE		0x40000
 #define YAFFS_MAX_OBJECT_ID		(YAFFS_OBJECT_SPACE -1)
 
-#define YAFFS_CHECKPOINT_VERSION 	4
+#define YAFFS_CHECKPOINT_VERSION 	5
 
 #ifdef CONFIG_YAFFS_UNICODE
 #define YAFFS_MAX_NAME_LENGTH		127
@@ -83,10 +91,17 @@
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA  0x21
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	1024
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
+/* Allocation streams: data that keeps being rewritten goes to blocks of
+ * its own, apart from the rest.
+ */
+#define YAFFS_STREAM_COLD		0
+#define YAFFS_STREAM_HOT		1
+#define YAFFS_N_STREAMS			2
+
 /* We limit the number attempts at sucessfully saving a chunk of data.
  * Small-page devices have 32 pages per block; large-page devices have 64.
  * Default to something in the order of 5 to 10 blocks worth of chunks.
@@ -108,9 +123,10 @@
 
 /* ChunkCache is used for short read/write operations.*/
 struct yaffs_cache {
+	struct list_head lru;	/* In dev->cache_lru, least recently used first */
+	struct list_head hash_link;	/* In dev->cache_hash[] while in use */
 	struct yaffs_obj *object;
 	int chunk_id;
-	int last_use;
 	int dirty;
 	int n_bytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
@@ -354,9 +370,16 @@ struct yaffs_file_var {
 	struct yaffs_tnode *top;
 };
 
+struct yaffs_name_index {
+	u32 n_entries;
+	u8 bits;
+	struct hlist_head bucket[0];	/* hashed on the child's name sum */
+};
+
 struct yaffs_dir_var {
 	struct list_head children;	/* list of child links */
 	struct list_head dirty;	/* Entry for list of dirty directories */
+	struct yaffs_name_index *name_index;	/* NULL until built */
 };
 
 struct yaffs_symlink_var {
@@ -400,7 +423,10 @@ struct yaffs_obj {
 	u8 has_xattr:1;		/* This object has xattribs. Valid if xattr_known. */
 
 	u8 serial;		/* serial number of chunk in NAND. Cached here */
+	u8 heat;		/* Recent rewrites, decaying. See yaffs_obj_stream() */
 	u16 sum;		/* sum of the name to speed searching */
+	u8 heat_epoch;		/* When heat was last decayed */
+	u8 stream;		/* YAFFS_STREAM_xxx this object is written to */
 
 	struct yaffs_dev *my_dev;	/* The device I'm on */
 
@@ -412,6 +438,7 @@ struct yaffs_obj {
 	/* also used for linking up the free list */
 	struct yaffs_obj *parent;
 	struct list_head siblings;
+	struct hlist_node name_link;	/* in parent's name_index, if any */
 
 	/* Where's my object header in NAND? */
 	int hdr_chunk;
@@ -524,6 +551,15 @@ struct yaffs_param {
 
 	int enable_xattr;	/* Enable xattribs */
 
+	int scan_batch;		/* Blocks read ahead at a time by the mount scan
+				 * through read_blocks_tags_fn. 0 to not read ahead.
+				 */
+
+	int hot_cold;		/* Write often rewritten files to their own blocks */
+	int gc_cost_benefit;	/* Pick gc victims by free space and age, not
+				 * free space alone.
+				 */
+
 	/* NAND access functions (Must be set before calling YAFFS) */
 
 	int (*write_chunk_fn) (struct yaffs_dev * dev,
@@ -547,6 +583,14 @@ struct yaffs_param {
 	int (*query_block_fn) (struct yaffs_dev * dev, int block_no,
 			       enum yaffs_block_state * state,
 			       u32 * seq_number);
+	/* Optional, for the mount scan: read the tags of the first n_chunks
+	 * chunks of each of n_blocks blocks into tags[], n_chunks per block,
+	 * with block_bad set for bad blocks. Blocks may be read in parallel.
+	 */
+	int (*read_blocks_tags_fn) (struct yaffs_dev * dev,
+				    const int *blocks, int n_blocks,
+				    int n_chunks,
+				    struct yaffs_ext_tags * tags);
 #endif
 
 	/* The remove_obj_fn function must be supplied by OS flavours that
@@ -630,6 +674,15 @@ struct yaffs_dev {
 	u32 checkpt_sum;
 	u32 checkpt_xor;
 
+	/* A checkpoint that has gone out of date is kept, marked stale by
+	 * writing one more page after its tail, so that mount can roll it
+	 * forward by scanning only the blocks written since.
+	 */
+	int checkpt_tail_chunk;	/* Where the stale marker goes, or -1 */
+	int checkpt_tail_seq;	/* Page sequence number for the marker */
+	int checkpt_stale;	/* Checkpoint on flash is marked stale */
+	struct yaffs_rollfwd *rollfwd;	/* Stale checkpoint being rolled forward */
+
 	int checkpoint_blocks_required;	/* Number of blocks needed to store current checkpoint set */
 
 	/* Block Info */
@@ -645,6 +698,9 @@ struct yaffs_dev {
 	int alloc_block;	/* Current block being allocated off */
 	u32 alloc_page;
 	int alloc_block_finder;	/* Used to search for next allocation block */
+	int hot_alloc_block;	/* Same again for the hot stream */
+	u32 hot_alloc_page;
+	unsigned stream_seq[YAFFS_N_STREAMS];	/* Newest block of each stream */
 
 	/* Object and Tnode memory management */
 	void *allocator;
@@ -667,6 +723,7 @@ struct yaffs_dev {
 	unsigned gc_block_finder;
 	unsigned gc_dirtiest;
 	unsigned gc_pages_in_use;
+	unsigned gc_score;	/* Cost-benefit of gc_dirtiest */
 	unsigned gc_not_done;
 	unsigned gc_block;
 	unsigned gc_chunk;
@@ -685,7 +742,11 @@ struct yaffs_dev {
 	int doing_buffered_block_rewrite;
 
 	struct yaffs_cache *cache;
-	int cache_last_use;
+	struct list_head cache_lru;	/* Unused entries first, then by use */
+	struct list_head *cache_hash;	/* By object and chunk id */
+	u32 cache_hash_mask;
+	struct yaffs_cache **cache_sort;	/* For writing back in order */
+	int n_dirty_caches;
 
 	/* Stuff for background deletion and unlinked files. */
 	struct yaffs_obj *unlinked_dir;	/* Directory where unlinked and deleted files live. */
@@ -713,6 +774,19 @@ struct yaffs_dev {
 	/* Dirty directory handling */
 	struct list_head dirty_dirs;	/* List of dirty directories */
 
+	/* Serialises everything below the object level: block and chunk
+	 * state, allocation, gc, the short op cache, tnode trees, temp
+	 * buffers and NAND access. File reads hold it shared for whole
+	 * chunks that bypass the short op cache: those only look at the
+	 * tnode tree and chunk bitmaps, leave the NAND to the MTD layer's
+	 * own locking, and otherwise only bump statistics and set the
+	 * sticky per-block error flags, where a race can at worst lose a
+	 * count. Everything else takes it exclusively. As an rw_semaphore
+	 * it is handed to the longest waiter on release, so the per-chunk
+	 * breaks in long file reads and writes really let other users in.
+	 */
+	struct rw_semaphore alloc_lock;
+
 	/* Statistcs */
 	u32 n_page_writes;
 	u32 n_page_reads;
@@ -734,9 +808,24 @@ struct yaffs_dev {
 	u32 n_unmarked_deletions;
 	u32 refresh_count;
 	u32 cache_hits;
+	u32 n_host_writes;	/* Chunks written other than by gc */
+	u32 n_hot_writes;
+	u32 n_cold_writes;
+	u32 n_stream_retires;	/* Blocks closed early to keep streams in order */
+
+	/* How the last mount went: not zeroed with the statistics above */
+	int mount_checkpt;	/* YAFFS_MOUNT_xxx */
+	u32 mount_blocks_scanned;
+	u32 mount_chunks_scanned;
+	u32 n_checkpt_writes;
 
 };
 
+/* Values for yaffs_dev.mount_checkpt */
+#define YAFFS_MOUNT_SCANNED	0	/* full scan */
+#define YAFFS_MOUNT_CHECKPT	1	/* restored from checkpoint */
+#define YAFFS_MOUNT_ROLLFWD	2	/* stale checkpoint rolled forward */
+
 /* The CheckpointDevice structure holds the device information that changes at runtime and
  * must be preserved over unmount/mount cycles.
  */
@@ -781,6 +870,33 @@ struct yaffs_xattr_mod {
 
 /*----------------------- YAFFS Functions -----------------------*/
 
+/* All of the functions below must be called with dev->alloc_lock held. */
+static inline void yaffs_lock_alloc(struct yaffs_dev *dev)
+{
+	down_write(&dev->alloc_lock);
+}
+
+static inline void yaffs_unlock_alloc(struct yaffs_dev *dev)
+{
+	up_write(&dev->alloc_lock);
+}
+
+/* Only yaffs_file_rd() may be called with the lock held shared */
+static inline void yaffs_lock_alloc_shared(struct yaffs_dev *dev)
+{
+	down_read(&dev->alloc_lock);
+}
+
+static inline void yaffs_unlock_alloc_shared(struct yaffs_dev *dev)
+{
+	up_read(&dev->alloc_lock);
+}
+
+static inline void yaffs_downgrade_alloc(struct yaffs_dev *dev)
+{
+	downgrade_write(&dev->alloc_lock);
+}
+
 int yaffs_guts_initialise(struct yaffs_dev *dev);
 void yaffs_deinitialise(struct yaffs_dev *dev);
 
@@ -910,6 +1026,8 @@ struct yaffs_tnode *yaffs_find_tnode_0(struct yaffs_dev *dev,
 
 u32 yaffs_get_group_base(struct yaffs_dev *dev, struct yaffs_tnode *tn,
 			 unsigned pos);
+void yaffs_load_tnode_0(struct yaffs_dev *dev, struct yaffs_tnode *tn,
+			unsigned pos, unsigned val);
 
 int yaffs_is_non_empty_dir(struct yaffs_obj *obj);
 #endif
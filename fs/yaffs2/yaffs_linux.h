@@ -18,21 +18,28 @@
 
 #include "yportenv.h"
 
+/* Hashed per-object locks for file data I/O, see yaffs_data_lock() */
+#define YAFFS_N_OBJ_LOCKS	32
+
 struct yaffs_linux_context {
 	struct list_head context_list;	/* List of these we have mounted */
 	struct yaffs_dev *dev;
 	struct super_block *super;
 	struct task_struct *bg_thread;	/* Background thread for this device */
 	int bg_running;
-	struct mutex gross_lock;	/* Gross locking mutex*/
+	struct rw_semaphore gross_lock;	/* Gross locking, shared for data I/O */
+	struct mutex obj_lock[YAFFS_N_OBJ_LOCKS];
 	u8 *spare_buffer;	/* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
 				 */
+	int scan_threads;	/* Workers reading tags for the mount scan */
+	int oob_single_page;	/* MTD can't read oob across pages in one go */
 	struct list_head search_contexts;
 	void (*put_super_fn) (struct super_block * sb);
 
 	struct task_struct *readdir_process;
 	unsigned mount_id;
+	unsigned mount_ms;	/* How long yaffs_guts_initialise() took */
 };
 
 #define yaffs_dev_to_lc(dev) ((struct yaffs_linux_context *)((dev)->os_context))
@@ -21,6 +21,7 @@
 #include "linux/mtd/mtd.h"
 #include "linux/types.h"
 #include "linux/time.h"
+#include "linux/workqueue.h"
 
 #include "yaffs_packedtags2.h"
 
@@ -84,6 +85,20 @@ int nandmtd2_write_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 		return YAFFS_FAIL;
 }
 
+static void nandmtd2_unpack_tags(struct yaffs_dev *dev, const u8 * oob,
+				 struct yaffs_ext_tags *tags)
+{
+	struct yaffs_packed_tags2 pt;
+
+	int packed_tags_size =
+	    dev->param.no_tags_ecc ? sizeof(pt.t) : sizeof(pt);
+	void *packed_tags_ptr =
+	    dev->param.no_tags_ecc ? (void *)&pt.t : (void *)&pt;
+
+	memcpy(packed_tags_ptr, oob, packed_tags_size);
+	yaffs_unpack_tags2(tags, &pt, !dev->param.no_tags_ecc);
+}
+
 int nandmtd2_read_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 			     u8 * data, struct yaffs_ext_tags *tags)
 {
@@ -96,12 +111,9 @@ int nandmtd2_read_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 
 	loff_t addr = ((loff_t) nand_chunk) * dev->param.total_bytes_per_chunk;
 
-	struct yaffs_packed_tags2 pt;
-
-	int packed_tags_size =
-	    dev->param.no_tags_ecc ? sizeof(pt.t) : sizeof(pt);
-	void *packed_tags_ptr =
-	    dev->param.no_tags_ecc ? (void *)&pt.t : (void *)&pt;
+	int packed_tags_size = dev->param.no_tags_ecc ?
+	    sizeof(struct yaffs_packed_tags2_tags_only) :
+	    sizeof(struct yaffs_packed_tags2);
 
 	yaffs_trace(YAFFS_TRACE_MTD,
 		"nandmtd2_read_chunk_tags chunk %d data %p tags %p",
@@ -138,12 +150,10 @@ int nandmtd2_read_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 			yaffs_unpack_tags2_tags_only(tags, pt2tp);
 		}
 	} else {
-		if (tags) {
-			memcpy(packed_tags_ptr,
-			       yaffs_dev_to_lc(dev)->spare_buffer,
-			       packed_tags_size);
-			yaffs_unpack_tags2(tags, &pt, !dev->param.no_tags_ecc);
-		}
+		if (tags)
+			nandmtd2_unpack_tags(dev,
+					     yaffs_dev_to_lc(dev)->spare_buffer,
+					     tags);
 	}
 
 	if (local_data)
@@ -223,3 +233,157 @@ int nandmtd2_query_block(struct yaffs_dev *dev, int block_no,
 		return YAFFS_FAIL;
 }
 
+
+/* Reads the tags of the first n_chunks chunks of a block into tags[],
+ * using oob rather than the shared spare buffer so that several blocks can
+ * be read at once. The tags come in one read_oob call where the driver
+ * can read the oob of several pages together, else a page at a time.
+ */
+static int nandmtd2_read_block_tags(struct yaffs_dev *dev, int block_no,
+				    int n_chunks, struct yaffs_ext_tags *tags,
+				    u8 * oob, unsigned *ecc_fixed,
+				    unsigned *ecc_unfixed)
+{
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+	struct mtd_info *mtd = yaffs_dev_to_mtd(dev);
+	struct mtd_oob_ops ops;
+	loff_t addr = ((loff_t) block_no) * dev->param.chunks_per_block *
+	    dev->param.total_bytes_per_chunk;
+	int packed_tags_size = dev->param.no_tags_ecc ?
+	    sizeof(struct yaffs_packed_tags2_tags_only) :
+	    sizeof(struct yaffs_packed_tags2);
+	int retval;
+	int i;
+
+	if (mtd->block_isbad(mtd, addr)) {
+		memset(tags, 0, n_chunks * sizeof(*tags));
+		for (i = 0; i < n_chunks; i++)
+			tags[i].block_bad = 1;
+		return YAFFS_OK;
+	}
+
+	ops.mode = MTD_OOB_AUTO;
+	ops.ooboffs = 0;
+	ops.datbuf = NULL;
+	ops.oobbuf = oob;
+
+	if (n_chunks > 1 && !lc->oob_single_page) {
+		ops.ooblen = n_chunks * mtd->oobavail;
+		ops.len = ops.ooblen;
+		retval = mtd->read_oob(mtd, addr, &ops);
+		if (retval == 0) {
+			for (i = 0; i < n_chunks; i++)
+				nandmtd2_unpack_tags(dev, oob + i * mtd->oobavail,
+						     &tags[i]);
+			return YAFFS_OK;
+		}
+		if (retval == -EINVAL)
+			lc->oob_single_page = 1;
+		/* Else go a page at a time to see which page was at fault */
+	}
+
+	for (i = 0; i < n_chunks; i++) {
+		ops.ooblen = packed_tags_size;
+		ops.len = packed_tags_size;
+		retval = mtd->read_oob(mtd, addr, &ops);
+		nandmtd2_unpack_tags(dev, oob, &tags[i]);
+
+		if (retval == -EBADMSG &&
+		    tags[i].ecc_result == YAFFS_ECC_RESULT_NO_ERROR) {
+			tags[i].ecc_result = YAFFS_ECC_RESULT_UNFIXED;
+			(*ecc_unfixed)++;
+		}
+		if (retval == -EUCLEAN &&
+		    tags[i].ecc_result == YAFFS_ECC_RESULT_NO_ERROR) {
+			tags[i].ecc_result = YAFFS_ECC_RESULT_FIXED;
+			(*ecc_fixed)++;
+		}
+		addr += dev->param.total_bytes_per_chunk;
+	}
+	return YAFFS_OK;
+}
+
+struct nandmtd2_scan_work {
+	struct work_struct work;
+	struct yaffs_dev *dev;
+	const int *blocks;
+	int n_blocks;
+	int n_chunks;
+	struct yaffs_ext_tags *tags;
+	atomic_t *next;
+	u8 *oob;
+	unsigned ecc_fixed;
+	unsigned ecc_unfixed;
+};
+
+static void nandmtd2_scan_worker(struct work_struct *work)
+{
+	struct nandmtd2_scan_work *w =
+	    container_of(work, struct nandmtd2_scan_work, work);
+	int i;
+
+	while ((i = atomic_inc_return(w->next) - 1) < w->n_blocks)
+		nandmtd2_read_block_tags(w->dev, w->blocks[i], w->n_chunks,
+					 w->tags + i * w->n_chunks, w->oob,
+					 &w->ecc_fixed, &w->ecc_unfixed);
+}
+
+/* Spreads the blocks over up to scan_threads workers, the caller being one
+ * of them. Each takes the next block not yet claimed until none are left.
+ */
+int nandmtd2_read_blocks_tags(struct yaffs_dev *dev, const int *blocks,
+			      int n_blocks, int n_chunks,
+			      struct yaffs_ext_tags *tags)
+{
+	struct mtd_info *mtd = yaffs_dev_to_mtd(dev);
+	struct nandmtd2_scan_work *w;
+	atomic_t next = ATOMIC_INIT(0);
+	int n_workers = yaffs_dev_to_lc(dev)->scan_threads;
+	int packed_tags_size = dev->param.no_tags_ecc ?
+	    sizeof(struct yaffs_packed_tags2_tags_only) :
+	    sizeof(struct yaffs_packed_tags2);
+	int i;
+
+	/* Without a known oob stride the tags can't be found in the buffer */
+	if (mtd->oobavail < packed_tags_size)
+		return YAFFS_FAIL;
+
+	if (n_workers > n_blocks)
+		n_workers = n_blocks;
+	if (n_workers < 1)
+		n_workers = 1;
+
+	w = kcalloc(n_workers, sizeof(*w), GFP_NOFS);
+	if (!w)
+		return YAFFS_FAIL;
+
+	for (i = 0; i < n_workers; i++) {
+		w[i].oob = kmalloc(n_chunks * mtd->oobavail, GFP_NOFS);
+		if (!w[i].oob)
+			break;
+		w[i].dev = dev;
+		w[i].blocks = blocks;
+		w[i].n_blocks = n_blocks;
+		w[i].n_chunks = n_chunks;
+		w[i].tags = tags;
+		w[i].next = &next;
+		INIT_WORK(&w[i].work, nandmtd2_scan_worker);
+	}
+	n_workers = i;
+
+	for (i = 1; i < n_workers; i++)
+		queue_work(system_unbound_wq, &w[i].work);
+	if (n_workers > 0)
+		nandmtd2_scan_worker(&w[0].work);
+
+	for (i = 0; i < n_workers; i++) {
+		if (i > 0)
+			flush_work(&w[i].work);
+		dev->n_ecc_fixed += w[i].ecc_fixed;
+		dev->n_ecc_unfixed += w[i].ecc_unfixed;
+		kfree(w[i].oob);
+	}
+	kfree(w);
+
+	return n_workers > 0 ? YAFFS_OK : YAFFS_FAIL;
+}
@@ -25,5 +25,8 @@ int nandmtd2_read_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 int nandmtd2_mark_block_bad(struct yaffs_dev *dev, int block_no);
 int nandmtd2_query_block(struct yaffs_dev *dev, int block_no,
 			 enum yaffs_block_state *state, u32 * seq_number);
+int nandmtd2_read_blocks_tags(struct yaffs_dev *dev, const int *blocks,
+			      int n_blocks, int n_chunks,
+			      struct yaffs_ext_tags *tags);
 
 #endif
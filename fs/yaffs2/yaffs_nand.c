@@ -50,6 +50,22 @@ int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 	return result;
 }
 
+/* Note that this rebases blocks[] in place for the flash layer */
+int yaffs_rd_blocks_tags_nand(struct yaffs_dev *dev, int *blocks,
+			      int n_blocks, int n_chunks,
+			      struct yaffs_ext_tags *tags)
+{
+	int i;
+
+	for (i = 0; i < n_blocks; i++)
+		blocks[i] -= dev->block_offset;
+
+	dev->n_page_reads += n_blocks * n_chunks;
+
+	return dev->param.read_blocks_tags_fn(dev, blocks, n_blocks,
+					      n_chunks, tags);
+}
+
 int yaffs_wr_chunk_tags_nand(struct yaffs_dev *dev,
 			     int nand_chunk,
 			     const u8 * buffer, struct yaffs_ext_tags *tags)
@@ -57,10 +73,14 @@ int yaffs_wr_chunk_tags_nand(struct yaffs_dev *dev,
 
 	dev->n_page_writes++;
 
+	if (tags)
+		/* Not always dev->seq_number, with more than one stream open */
+		tags->seq_number = yaffs_get_block_info(dev,
+				nand_chunk / dev->param.chunks_per_block)->seq_number;
+
 	nand_chunk -= dev->chunk_offset;
 
 	if (tags) {
-		tags->seq_number = dev->seq_number;
 		tags->chunk_used = 1;
 		if (!yaffs_validate_tags(tags)) {
 			yaffs_trace(YAFFS_TRACE_ERROR, "Writing uninitialised tags");
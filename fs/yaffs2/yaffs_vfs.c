@@ -96,6 +96,12 @@ unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
 unsigned int yaffs_gc_control = 1;
 unsigned int yaffs_bg_enable = 1;
+unsigned int yaffs_bg_checkpoint;	/* idle seconds, 0 for never */
+unsigned int yaffs_scan_batch = 32;	/* blocks, 0 to scan chunk by chunk */
+unsigned int yaffs_scan_threads;	/* 0 for one per online CPU */
+unsigned int yaffs_n_caches = 64;	/* short op cache chunks per mount */
+unsigned int yaffs_hot_cold = 1;	/* separate allocation for hot files */
+unsigned int yaffs_gc_cost_benefit = 1;	/* gc by free space and age */
 
 /* Module Parameters */
 module_param(yaffs_trace_mask, uint, 0644);
@@ -103,6 +109,12 @@ module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
 module_param(yaffs_gc_control, uint, 0644);
 module_param(yaffs_bg_enable, uint, 0644);
+module_param(yaffs_bg_checkpoint, uint, 0644);
+module_param(yaffs_scan_batch, uint, 0644);
+module_param(yaffs_scan_threads, uint, 0644);
+module_param(yaffs_n_caches, uint, 0644);
+module_param(yaffs_hot_cold, uint, 0644);
+module_param(yaffs_gc_cost_benefit, uint, 0644);
 
 
 #define yaffs_inode_to_obj_lv(iptr) ((iptr)->i_private)
@@ -120,17 +132,98 @@ static unsigned yaffs_gc_control_callback(struct yaffs_dev *dev)
 	return yaffs_gc_control;
 }
 
+/*
+ * Locking.
+ * The gross lock is taken exclusively by everything that changes the
+ * directory tree or object headers, and shared by file data I/O, lookups
+ * and the background gc. File data I/O additionally holds a hashed per
+ * object lock, and everyone holds dev->alloc_lock while inside yaffs_guts:
+ * file reads shared, everything else exclusively. Long reads and writes
+ * give it up between chunks. So reads of different files run side by
+ * side, writes interleave with them chunk by chunk, and background gc
+ * holds up readers for one short gc step rather than a whole pass.
+ * Lock order: gross_lock, obj_lock, alloc_lock.
+ */
 static void yaffs_gross_lock(struct yaffs_dev *dev)
 {
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locking %p", current);
-	mutex_lock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	down_write(&(yaffs_dev_to_lc(dev)->gross_lock));
+	yaffs_lock_alloc(dev);
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locked %p", current);
 }
 
 static void yaffs_gross_unlock(struct yaffs_dev *dev)
 {
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs unlocking %p", current);
-	mutex_unlock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	yaffs_unlock_alloc(dev);
+	up_write(&(yaffs_dev_to_lc(dev)->gross_lock));
+}
+
+static void yaffs_shared_lock(struct yaffs_dev *dev)
+{
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs shared locking %p", current);
+	down_read(&(yaffs_dev_to_lc(dev)->gross_lock));
+	yaffs_lock_alloc(dev);
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs shared locked %p", current);
+}
+
+static void yaffs_shared_unlock(struct yaffs_dev *dev)
+{
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs shared unlocking %p", current);
+	yaffs_unlock_alloc(dev);
+	up_read(&(yaffs_dev_to_lc(dev)->gross_lock));
+}
+
+static struct mutex *yaffs_obj_lock(struct yaffs_obj *obj)
+{
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(obj->my_dev);
+
+	return &lc->obj_lock[obj->obj_id & (YAFFS_N_OBJ_LOCKS - 1)];
+}
+
+static void yaffs_data_lock(struct yaffs_obj *obj)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs data locking %p obj %d",
+		current, obj->obj_id);
+	down_read(&(yaffs_dev_to_lc(dev)->gross_lock));
+	mutex_lock(yaffs_obj_lock(obj));
+	yaffs_lock_alloc(dev);
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs data locked %p", current);
+}
+
+static void yaffs_data_unlock(struct yaffs_obj *obj)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs data unlocking %p", current);
+	yaffs_unlock_alloc(dev);
+	mutex_unlock(yaffs_obj_lock(obj));
+	up_read(&(yaffs_dev_to_lc(dev)->gross_lock));
+}
+
+/* As yaffs_data_lock(), but for yaffs_file_rd(), which can share the guts */
+static void yaffs_data_read_lock(struct yaffs_obj *obj)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs data read locking %p obj %d",
+		current, obj->obj_id);
+	down_read(&(yaffs_dev_to_lc(dev)->gross_lock));
+	mutex_lock(yaffs_obj_lock(obj));
+	yaffs_lock_alloc_shared(dev);
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs data read locked %p", current);
+}
+
+static void yaffs_data_read_unlock(struct yaffs_obj *obj)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs data read unlocking %p", current);
+	yaffs_unlock_alloc_shared(dev);
+	mutex_unlock(yaffs_obj_lock(obj));
+	up_read(&(yaffs_dev_to_lc(dev)->gross_lock));
 }
 
 static void yaffs_fill_inode_from_obj(struct inode *inode,
@@ -155,13 +248,13 @@ static struct inode *yaffs_iget(struct super_block *sb, unsigned long ino)
 	 * need to lock again.
 	 */
 
-	yaffs_gross_lock(dev);
+	yaffs_shared_lock(dev);
 
 	obj = yaffs_find_by_number(dev, inode->i_ino);
 
 	yaffs_fill_inode_from_obj(inode, obj);
 
-	yaffs_gross_unlock(dev);
+	yaffs_shared_unlock(dev);
 
 	unlock_new_inode(inode);
 	return inode;
@@ -373,7 +466,7 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry,
 	struct yaffs_dev *dev = yaffs_inode_to_obj(dir)->my_dev;
 
 	if (current != yaffs_dev_to_lc(dev)->readdir_process)
-		yaffs_gross_lock(dev);
+		yaffs_shared_lock(dev);
 
 	yaffs_trace(YAFFS_TRACE_OS,
 		"yaffs_lookup for %d:%s",
@@ -385,7 +478,7 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry,
 
 	/* Can't hold gross lock when calling yaffs_get_inode() */
 	if (current != yaffs_dev_to_lc(dev)->readdir_process)
-		yaffs_gross_unlock(dev);
+		yaffs_shared_unlock(dev);
 
 	if (obj) {
 		yaffs_trace(YAFFS_TRACE_OS,
@@ -443,17 +536,14 @@ static int yaffs_sync_object(struct file *file, int datasync)
 {
 
 	struct yaffs_obj *obj;
-	struct yaffs_dev *dev;
 	struct dentry *dentry = file->f_path.dentry;
 
 	obj = yaffs_dentry_to_obj(dentry);
 
-	dev = obj->my_dev;
-
 	yaffs_trace(YAFFS_TRACE_OS | YAFFS_TRACE_SYNC, "yaffs_sync_object");
-	yaffs_gross_lock(dev);
+	yaffs_data_lock(obj);
 	yaffs_flush_file(obj, 1, datasync);
-	yaffs_gross_unlock(dev);
+	yaffs_data_unlock(obj);
 	return 0;
 }
 /*
@@ -599,9 +689,9 @@ static ssize_t yaffs_getxattr(struct dentry * dentry, const char *name, void *bu
 
 	if (error == 0) {
 		dev = obj->my_dev;
-		yaffs_gross_lock(dev);
+		yaffs_shared_lock(dev);
 		error = yaffs_get_xattrib(obj, name, buff, size);
-		yaffs_gross_unlock(dev);
+		yaffs_shared_unlock(dev);
 
 	}
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_getxattr done returning %d", error);
@@ -649,9 +739,9 @@ static ssize_t yaffs_listxattr(struct dentry * dentry, char *buff, size_t size)
 
 	if (error == 0) {
 		dev = obj->my_dev;
-		yaffs_gross_lock(dev);
+		yaffs_shared_lock(dev);
 		error = yaffs_list_xattrib(obj, buff, size);
-		yaffs_gross_unlock(dev);
+		yaffs_shared_unlock(dev);
 
 	}
 	yaffs_trace(YAFFS_TRACE_OS,
@@ -914,17 +1004,15 @@ static int yaffs_file_flush(struct file *file, fl_owner_t id)
 {
 	struct yaffs_obj *obj = yaffs_dentry_to_obj(file->f_dentry);
 
-	struct yaffs_dev *dev = obj->my_dev;
-
 	yaffs_trace(YAFFS_TRACE_OS,
 	  	"yaffs_file_flush object %d (%s)",
 		obj->obj_id, obj->dirty ? "dirty" : "clean");
 
-	yaffs_gross_lock(dev);
+	yaffs_data_lock(obj);
 
 	yaffs_flush_file(obj, 1, 0);
 
-	yaffs_gross_unlock(dev);
+	yaffs_data_unlock(obj);
 
 	return 0;
 }
@@ -1020,11 +1108,11 @@ static int yaffs_readlink(struct dentry *dentry, char __user * buffer,
 
 	struct yaffs_dev *dev = yaffs_dentry_to_obj(dentry)->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_shared_lock(dev);
 
 	alias = yaffs_get_symlink_alias(yaffs_dentry_to_obj(dentry));
 
-	yaffs_gross_unlock(dev);
+	yaffs_shared_unlock(dev);
 
 	if (!alias)
 		return -ENOMEM;
@@ -1040,10 +1128,10 @@ static void *yaffs_follow_link(struct dentry *dentry, struct nameidata *nd)
 	void *ret;
 	struct yaffs_dev *dev = yaffs_dentry_to_obj(dentry)->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_shared_lock(dev);
 
 	alias = yaffs_get_symlink_alias(yaffs_dentry_to_obj(dentry));
-	yaffs_gross_unlock(dev);
+	yaffs_shared_unlock(dev);
 
 	if (!alias) {
 		ret = ERR_PTR(-ENOMEM);
@@ -1132,8 +1220,6 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	unsigned char *pg_buf;
 	int ret;
 
-	struct yaffs_dev *dev;
-
 	yaffs_trace(YAFFS_TRACE_OS,
 		"yaffs_readpage_nolock at %08x, size %08x",
 		(unsigned)(pg->index << PAGE_CACHE_SHIFT),
@@ -1141,19 +1227,17 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 
 	obj = yaffs_dentry_to_obj(f->f_dentry);
 
-	dev = obj->my_dev;
-
 	BUG_ON(!PageLocked(pg));
 
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_gross_lock(dev);
+	yaffs_data_read_lock(obj);
 
 	ret = yaffs_file_rd(obj, pg_buf,
 			    pg->index << PAGE_CACHE_SHIFT, PAGE_CACHE_SIZE);
 
-	yaffs_gross_unlock(dev);
+	yaffs_data_read_unlock(obj);
 
 	if (ret >= 0)
 		ret = 0;
@@ -1243,7 +1327,7 @@ static int yaffs_writepage(struct page *page, struct writeback_control *wbc)
 
 	obj = yaffs_inode_to_obj(inode);
 	dev = obj->my_dev;
-	yaffs_gross_lock(dev);
+	yaffs_data_lock(obj);
 
 	yaffs_trace(YAFFS_TRACE_OS,
 		"yaffs_writepage at %08x, size %08x",
@@ -1261,7 +1345,7 @@ static int yaffs_writepage(struct page *page, struct writeback_control *wbc)
 		"writepag1: obj = %05x, ino = %05x",
 		(int)obj->variant.file_variant.file_size, (int)inode->i_size);
 
-	yaffs_gross_unlock(dev);
+	yaffs_data_unlock(obj);
 
 	kunmap(page);
 	set_page_writeback(page);
@@ -1290,11 +1374,11 @@ static ssize_t yaffs_hold_space(struct file *f)
 
 	dev = obj->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_shared_lock(dev);
 
 	n_free_chunks = yaffs_get_n_free_chunks(dev);
 
-	yaffs_gross_unlock(dev);
+	yaffs_shared_unlock(dev);
 
 	return (n_free_chunks > 20) ? 1 : 0;
 }
@@ -1308,9 +1392,9 @@ static void yaffs_release_space(struct file *f)
 
 	dev = obj->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_shared_lock(dev);
 
-	yaffs_gross_unlock(dev);
+	yaffs_shared_unlock(dev);
 }
 
 static int yaffs_write_begin(struct file *filp, struct address_space *mapping,
@@ -1380,7 +1464,7 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 
 	dev = obj->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_data_lock(obj);
 
 	inode = f->f_dentry->d_inode;
 
@@ -1418,7 +1502,7 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 		}
 
 	}
-	yaffs_gross_unlock(dev);
+	yaffs_data_unlock(obj);
 	return (n_written == 0) && (n > 0) ? -ENOSPC : n_written;
 }
 
@@ -1461,7 +1545,7 @@ static int yaffs_statfs(struct dentry *dentry, struct kstatfs *buf)
 
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_statfs");
 
-	yaffs_gross_lock(dev);
+	yaffs_shared_lock(dev);
 
 	buf->f_type = YAFFS_MAGIC;
 	buf->f_bsize = sb->s_blocksize;
@@ -1513,7 +1597,7 @@ static int yaffs_statfs(struct dentry *dentry, struct kstatfs *buf)
 	buf->f_ffree = 0;
 	buf->f_bavail = buf->f_bfree;
 
-	yaffs_gross_unlock(dev);
+	yaffs_shared_unlock(dev);
 	return 0;
 }
 
@@ -1545,6 +1629,7 @@ static void yaffs_flush_super(struct super_block *sb, int do_checkpoint)
 		yaffs_checkpoint_save(dev);
 }
 
+/* Called with dev->alloc_lock held, as the free counts move under it */
 static unsigned yaffs_bg_gc_urgency(struct yaffs_dev *dev)
 {
 	unsigned erased_chunks =
@@ -1572,9 +1657,12 @@ static int yaffs_do_sync_fs(struct super_block *sb, int request_checkpoint)
 
 	struct yaffs_dev *dev = yaffs_super_to_dev(sb);
 	unsigned int oneshot_checkpoint = (yaffs_auto_checkpoint & 4);
-	unsigned gc_urgent = yaffs_bg_gc_urgency(dev);
+	unsigned gc_urgent;
 	int do_checkpoint;
 
+	yaffs_gross_lock(dev);
+	gc_urgent = yaffs_bg_gc_urgency(dev);
+
 	yaffs_trace(YAFFS_TRACE_OS | YAFFS_TRACE_SYNC | YAFFS_TRACE_BACKGROUND,
 		"yaffs_do_sync_fs: gc-urgency %d %s %s%s",
 		gc_urgent,
@@ -1582,7 +1670,6 @@ static int yaffs_do_sync_fs(struct super_block *sb, int request_checkpoint)
 		request_checkpoint ? "checkpoint requested" : "no checkpoint",
 		oneshot_checkpoint ? " one-shot" : "");
 
-	yaffs_gross_lock(dev);
 	do_checkpoint = ((request_checkpoint && !gc_urgent) ||
 			 oneshot_checkpoint) && !dev->is_checkpointed;
 
@@ -1621,8 +1708,12 @@ static int yaffs_bg_thread_fn(void *data)
 	unsigned long now = jiffies;
 	unsigned long next_dir_update = now;
 	unsigned long next_gc = now;
+	unsigned long idle_since = now;
 	unsigned long expires;
-	unsigned int urgency;
+	unsigned int urgency = 0;
+	int is_checkpointed;
+	u32 writes;
+	u32 last_writes = 0;
 
 	int gc_result;
 	struct timer_list timer;
@@ -1640,19 +1731,32 @@ static int yaffs_bg_thread_fn(void *data)
 		if (try_to_freeze())
 			continue;
 
-		yaffs_gross_lock(dev);
-
 		now = jiffies;
 
 		if (time_after(now, next_dir_update) && yaffs_bg_enable) {
-			yaffs_update_dirty_dirs(dev);
+			/* writes directory headers, so needs the fs to itself.
+			 * Peeking at the list unlocked can only miss a
+			 * directory just dirtied, which waits for next time.
+			 */
+			if (!list_empty(&dev->dirty_dirs)) {
+				yaffs_gross_lock(dev);
+				yaffs_update_dirty_dirs(dev);
+				yaffs_gross_unlock(dev);
+			}
 			next_dir_update = now + HZ;
 		}
 
 		if (time_after(now, next_gc) && yaffs_bg_enable) {
-			if (!dev->is_checkpointed) {
+			/* gc only moves chunks, file I/O can carry on */
+			yaffs_shared_lock(dev);
+			is_checkpointed = dev->is_checkpointed;
+			if (!is_checkpointed) {
 				urgency = yaffs_bg_gc_urgency(dev);
 				gc_result = yaffs_bg_gc(dev, urgency);
+			}
+			yaffs_shared_unlock(dev);
+
+			if (!is_checkpointed) {
 				if (urgency > 1)
 					next_gc = now + HZ / 20 + 1;
 				else if (urgency > 0)
@@ -1667,7 +1771,35 @@ static int yaffs_bg_thread_fn(void *data)
 				next_gc = next_dir_update;
                         }
 		}
-		yaffs_gross_unlock(dev);
+
+		/* Checkpoint once things have gone quiet, so that a crash
+		 * before unmount does not cost a full scan. Each one erases
+		 * and rewrites the checkpoint blocks, so it is off unless
+		 * asked for.
+		 */
+		if (yaffs_bg_checkpoint && yaffs_bg_enable &&
+		    dev->param.is_yaffs2) {
+			writes = dev->n_page_writes + dev->n_erasures;
+			if (writes != last_writes) {
+				last_writes = writes;
+				idle_since = now;
+			} else if (!dev->is_checkpointed &&
+				   time_after(now, idle_since +
+					      yaffs_bg_checkpoint * HZ)) {
+				/* only a hint until we hold the lock */
+				yaffs_gross_lock(dev);
+				if (!dev->is_checkpointed) {
+					yaffs_flush_whole_cache(dev);
+					yaffs_update_dirty_dirs(dev);
+					yaffs_checkpoint_save(dev);
+				}
+				yaffs_gross_unlock(dev);
+				/* Don't retry straight away if it failed */
+				last_writes = dev->n_page_writes +
+				    dev->n_erasures;
+				idle_since = now;
+			}
+		}
 		expires = next_dir_update;
 		if (time_before(next_gc, expires))
 			expires = next_gc;
@@ -2010,6 +2142,7 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 						     void *data, int silent)
 {
 	int n_blocks;
+	int i;
 	struct inode *inode = NULL;
 	struct dentry *root;
 	struct yaffs_dev *dev = 0;
@@ -2025,6 +2158,7 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	struct yaffs_options options;
 
 	unsigned mount_id;
+	unsigned long mount_start;
 	int found;
 	struct yaffs_linux_context *context_iterator;
 	struct list_head *l;
@@ -2214,7 +2348,9 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	param->chunks_per_block = YAFFS_CHUNKS_PER_BLOCK;
 	param->total_bytes_per_chunk = YAFFS_BYTES_PER_CHUNK;
 	param->n_reserved_blocks = 5;
-	param->n_caches = (options.no_cache) ? 0 : 10;
+	param->n_caches = (options.no_cache) ? 0 : yaffs_n_caches;
+	param->hot_cold = yaffs_hot_cold;
+	param->gc_cost_benefit = yaffs_gc_cost_benefit;
 	param->inband_tags = options.inband_tags;
 
 #ifdef CONFIG_YAFFS_DISABLE_LAZY_LOAD
@@ -2261,6 +2397,11 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 		param->read_chunk_tags_fn = nandmtd2_read_chunk_tags;
 		param->bad_block_fn = nandmtd2_mark_block_bad;
 		param->query_block_fn = nandmtd2_query_block;
+		if (!options.inband_tags)
+			param->read_blocks_tags_fn = nandmtd2_read_blocks_tags;
+		param->scan_batch = yaffs_scan_batch;
+		context->scan_threads = yaffs_scan_threads ? :
+		    num_online_cpus();
 		yaffs_dev_to_lc(dev)->spare_buffer = 
 		                kmalloc(mtd->oobsize, GFP_NOFS);
 		param->is_yaffs2 = 1;
@@ -2319,15 +2460,27 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	INIT_LIST_HEAD(&(yaffs_dev_to_lc(dev)->search_contexts));
 	param->remove_obj_fn = yaffs_remove_obj_callback;
 
-	mutex_init(&(yaffs_dev_to_lc(dev)->gross_lock));
+	init_rwsem(&(yaffs_dev_to_lc(dev)->gross_lock));
+	for (i = 0; i < YAFFS_N_OBJ_LOCKS; i++)
+		mutex_init(&(yaffs_dev_to_lc(dev)->obj_lock[i]));
+	init_rwsem(&dev->alloc_lock);
 
 	yaffs_gross_lock(dev);
 
+	mount_start = jiffies;
 	err = yaffs_guts_initialise(dev);
+	context->mount_ms = jiffies_to_msecs(jiffies - mount_start);
 
 	yaffs_trace(YAFFS_TRACE_OS,
 		"yaffs_read_super: guts initialised %s",
 		(err == YAFFS_OK) ? "OK" : "FAILED");
+	yaffs_trace(YAFFS_TRACE_MOUNT,
+		"yaffs: mounted in %u ms, %s, %u blocks %u chunks scanned",
+		context->mount_ms,
+		dev->mount_checkpt == YAFFS_MOUNT_CHECKPT ? "checkpoint" :
+		dev->mount_checkpt == YAFFS_MOUNT_ROLLFWD ? "rolled forward" :
+		"full scan",
+		dev->mount_blocks_scanned, dev->mount_chunks_scanned);
 
 	if (err == YAFFS_OK)
 		yaffs_bg_start(dev);
@@ -2436,6 +2589,9 @@ static char *yaffs_dump_dev_part0(char *buf, struct yaffs_dev *dev)
 	buf += sprintf(buf, "refresh_period........ %d\n",
 			param->refresh_period);
 	buf += sprintf(buf, "n_caches.............. %d\n", param->n_caches);
+	buf += sprintf(buf, "hot_cold.............. %d\n", param->hot_cold);
+	buf += sprintf(buf, "gc_cost_benefit....... %d\n",
+			param->gc_cost_benefit);
 	buf += sprintf(buf, "n_reserved_blocks..... %d\n",
 			param->n_reserved_blocks);
 	buf += sprintf(buf, "always_check_erased... %d\n",
@@ -2446,6 +2602,14 @@ static char *yaffs_dump_dev_part0(char *buf, struct yaffs_dev *dev)
 
 static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 {
+	u64 write_amp = 0;
+
+	/* All chunks written, gc copies included, per chunk of host data */
+	if (dev->n_host_writes) {
+		write_amp = ((u64) dev->n_host_writes + dev->n_gc_copies) * 100;
+		do_div(write_amp, dev->n_host_writes);
+	}
+
 	buf +=
 	    sprintf(buf, "data_bytes_per_chunk.. %d\n",
 		    dev->data_bytes_per_chunk);
@@ -2484,6 +2648,21 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	    sprintf(buf, "n_tags_ecc_unfixed.... %u\n",
 		    dev->n_tags_ecc_unfixed);
 	buf += sprintf(buf, "cache_hits............ %u\n", dev->cache_hits);
+	buf += sprintf(buf, "n_host_writes......... %u\n", dev->n_host_writes);
+	buf += sprintf(buf, "n_hot_writes.......... %u\n", dev->n_hot_writes);
+	buf += sprintf(buf, "n_cold_writes......... %u\n", dev->n_cold_writes);
+	buf += sprintf(buf, "n_stream_retires...... %u\n",
+			dev->n_stream_retires);
+	buf += sprintf(buf, "write_amp_x100........ %u\n", (u32) write_amp);
+	buf += sprintf(buf, "n_checkpt_writes...... %u\n",
+			dev->n_checkpt_writes);
+	buf += sprintf(buf, "mount_checkpt......... %d\n", dev->mount_checkpt);
+	buf += sprintf(buf, "mount_ms.............. %u\n",
+			yaffs_dev_to_lc(dev)->mount_ms);
+	buf += sprintf(buf, "mount_blocks_scanned.. %u\n",
+			dev->mount_blocks_scanned);
+	buf += sprintf(buf, "mount_chunks_scanned.. %u\n",
+			dev->mount_chunks_scanned);
 	buf +=
 	    sprintf(buf, "n_deleted_files....... %u\n", dev->n_deleted_files);
 	buf +=
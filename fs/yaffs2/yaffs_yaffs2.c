@@ -732,14 +732,90 @@ static int yaffs2_wr_checkpt_data(struct yaffs_dev *dev)
 	if (!yaffs_checkpt_close(dev))
 		ok = 0;
 
-	if (ok)
+	if (ok) {
 		dev->is_checkpointed = 1;
-	else
+		dev->n_checkpt_writes++;
+	} else {
 		dev->is_checkpointed = 0;
+		dev->checkpt_tail_chunk = -1;
+	}
 
 	return dev->is_checkpointed;
 }
 
+/*------------------ Rolling a stale checkpoint forward -----------------*/
+
+/* What a stale checkpoint said about the blocks, kept from the checkpoint
+ * read at mount so that the scan can tell which blocks it need not read.
+ */
+struct yaffs_rollfwd {
+	unsigned seq_number;	/* Sequence number when checkpointed */
+	unsigned open_seq;	/* Oldest block still being written then */
+	struct yaffs_block_info *block_info;
+	u8 *chunk_bits;
+	u8 *trusted;		/* Per block: checkpoint still describes it */
+};
+
+static void yaffs2_rollfwd_prepare(struct yaffs_dev *dev)
+{
+	struct yaffs_rollfwd *rf = NULL;
+	u32 n_blocks = dev->internal_end_block - dev->internal_start_block + 1;
+	u32 i;
+
+	/* Chunk groups lose the exact chunks that the merge has to check */
+	if (!dev->chunk_grp_bits)
+		rf = vmalloc(sizeof(*rf) +
+			     n_blocks * (sizeof(struct yaffs_block_info) +
+					 dev->chunk_bit_stride + 1));
+	if (!rf) {
+		/* Just scan, and let the checkpoint go afterwards */
+		dev->checkpt_stale = 0;
+		return;
+	}
+
+	rf->seq_number = dev->seq_number;
+	rf->block_info = (struct yaffs_block_info *)(rf + 1);
+	rf->chunk_bits = (u8 *) (rf->block_info + n_blocks);
+	rf->trusted = rf->chunk_bits + n_blocks * dev->chunk_bit_stride;
+
+	memcpy(rf->block_info, dev->block_info,
+	       n_blocks * sizeof(struct yaffs_block_info));
+
+	/* With more than one allocation stream the blocks that were still
+	 * open need not be the newest, and whatever is newer than them has
+	 * to be scanned along with them.
+	 */
+	rf->open_seq = rf->seq_number + 1;
+	for (i = 0; i < n_blocks; i++)
+		if (rf->block_info[i].block_state ==
+		    YAFFS_BLOCK_STATE_ALLOCATING &&
+		    rf->block_info[i].seq_number < rf->open_seq)
+			rf->open_seq = rf->block_info[i].seq_number;
+	memcpy(rf->chunk_bits, dev->chunk_bits,
+	       n_blocks * dev->chunk_bit_stride);
+	memset(rf->trusted, 0, n_blocks);
+
+	dev->rollfwd = rf;
+
+	yaffs_trace(YAFFS_TRACE_CHECKPOINT | YAFFS_TRACE_MOUNT,
+		"yaffs: checkpoint is stale, rolling forward from seq %u",
+		rf->seq_number);
+}
+
+int yaffs2_rollfwd_abandon(struct yaffs_dev *dev)
+{
+	if (!dev->rollfwd)
+		return 0;
+
+	yaffs_trace(YAFFS_TRACE_CHECKPOINT | YAFFS_TRACE_MOUNT,
+		"yaffs: stale checkpoint abandoned");
+
+	vfree(dev->rollfwd);
+	dev->rollfwd = NULL;
+	dev->checkpt_stale = 0;
+	return 1;
+}
+
 static int yaffs2_rd_checkpt_data(struct yaffs_dev *dev)
 {
 	int ok = 1;
@@ -783,6 +859,12 @@ static int yaffs2_rd_checkpt_data(struct yaffs_dev *dev)
 			"read checkpoint checksum %d", ok);
 	}
 
+	/* Out of date, but it can still spare scanning most of the flash */
+	if (ok && yaffs2_checkpt_rd_tail(dev)) {
+		yaffs2_rollfwd_prepare(dev);
+		ok = 0;
+	}
+
 	if (!yaffs_checkpt_close(dev))
 		ok = 0;
 
@@ -797,14 +879,33 @@ static int yaffs2_rd_checkpt_data(struct yaffs_dev *dev)
 
 void yaffs2_checkpt_invalidate(struct yaffs_dev *dev)
 {
-	if (dev->is_checkpointed || dev->blocks_in_checkpt > 0) {
+	if (dev->is_checkpointed) {
 		dev->is_checkpointed = 0;
+		/* Keep it for mount to roll forward, if it can be marked */
+		if (dev->chunk_grp_bits || !yaffs2_checkpt_mark_stale(dev))
+			yaffs2_checkpt_invalidate_stream(dev);
+	} else if (dev->blocks_in_checkpt > 0 && !dev->checkpt_stale) {
 		yaffs2_checkpt_invalidate_stream(dev);
 	}
 	if (dev->param.sb_dirty_fn)
 		dev->param.sb_dirty_fn(dev);
 }
 
+/* A stale checkpoint normally sits in blocks that are held back for the
+ * next checkpoint anyway. Let it go if it has grown bigger than that and
+ * space is getting short.
+ */
+void yaffs2_checkpt_release_stale(struct yaffs_dev *dev)
+{
+	if (dev->checkpt_stale &&
+	    dev->blocks_in_checkpt > dev->checkpoint_blocks_required) {
+		yaffs_trace(YAFFS_TRACE_CHECKPOINT,
+			"releasing stale checkpoint of %d blocks",
+			dev->blocks_in_checkpt);
+		yaffs2_checkpt_invalidate_stream(dev);
+	}
+}
+
 int yaffs_checkpoint_save(struct yaffs_dev *dev)
 {
 
@@ -828,6 +929,30 @@ int yaffs_checkpoint_save(struct yaffs_dev *dev)
 	return dev->is_checkpointed;
 }
 
+/* Only the cold allocation block is checkpointed, and every object starts
+ * out cold again. Close the hot block, and the cold one as well unless it
+ * is the newest, so that nothing is written to a block older than the
+ * data it replaces.
+ */
+static void yaffs2_checkpt_close_streams(struct yaffs_dev *dev)
+{
+	struct yaffs_block_info *bi;
+	int blk;
+
+	for (blk = dev->internal_start_block; blk <= dev->internal_end_block;
+	     blk++) {
+		bi = yaffs_get_block_info(dev, blk);
+		if (bi->block_state == YAFFS_BLOCK_STATE_ALLOCATING &&
+		    blk != dev->alloc_block)
+			bi->block_state = YAFFS_BLOCK_STATE_FULL;
+	}
+
+	if (dev->alloc_block > 0 &&
+	    yaffs_get_block_info(dev, dev->alloc_block)->seq_number !=
+	    dev->seq_number)
+		yaffs_skip_rest_of_block(dev);
+}
+
 int yaffs2_checkpt_restore(struct yaffs_dev *dev)
 {
 	int retval;
@@ -838,6 +963,7 @@ int yaffs2_checkpt_restore(struct yaffs_dev *dev)
 	retval = yaffs2_rd_checkpt_data(dev);
 
 	if (dev->is_checkpointed) {
+		yaffs2_checkpt_close_streams(dev);
 		yaffs_verify_objects(dev);
 		yaffs_verify_blocks(dev);
 		yaffs_verify_free_chunks(dev);
@@ -903,13 +1029,19 @@ int yaffs2_handle_hole(struct yaffs_obj *obj, loff_t new_size)
 		memset(local_buffer, 0, dev->data_bytes_per_chunk);
 		small_increase_ok = 1;
 
+		/* The zeros go straight out. Held in the cache, they could be
+		 * lost to a power cut while data written past them is not,
+		 * and the scan would then find whatever was truncated off
+		 * there before.
+		 */
+
 		while (increase > 0 && small_increase_ok) {
 			this_write = increase;
 			if (this_write > dev->data_bytes_per_chunk)
 				this_write = dev->data_bytes_per_chunk;
 			written =
 			    yaffs_do_file_wr(obj, local_buffer, pos, this_write,
-					     0);
+					     1);
 			if (written == this_write) {
 				pos += this_write;
 				increase -= this_write;
@@ -954,6 +1086,448 @@ static int yaffs2_ybicmp(const void *a, const void *b)
 		return aseq - bseq;
 }
 
+/* Whether a chunk is in a block the stale checkpoint still describes */
+static int yaffs2_rollfwd_trusted(struct yaffs_dev *dev, int chunk)
+{
+	int blk = chunk / dev->param.chunks_per_block;
+
+	return chunk > 0 &&
+	    blk >= dev->internal_start_block &&
+	    blk <= dev->internal_end_block &&
+	    dev->rollfwd->trusted[blk - dev->internal_start_block];
+}
+
+/* Delete a checkpointed chunk that the scan has found something newer for */
+static int yaffs2_rollfwd_drop(struct yaffs_dev *dev, int chunk)
+{
+	if (!yaffs_check_chunk_bit(dev, chunk / dev->param.chunks_per_block,
+				   chunk % dev->param.chunks_per_block))
+		return 0;
+
+	yaffs_chunk_del(dev, chunk, 1, __LINE__);
+	return 1;
+}
+
+/* Pick the trusted blocks out of those the scan would otherwise read.
+ * Returns how many are left to scan, or -1 if the flash does not match
+ * the checkpoint and everything must be scanned.
+ */
+static int yaffs2_rollfwd_trust(struct yaffs_dev *dev,
+				struct yaffs_block_index *block_index,
+				int n_to_scan)
+{
+	struct yaffs_rollfwd *rf = dev->rollfwd;
+	struct yaffs_block_info *bi;
+	struct yaffs_block_info *cbi;
+	int i;
+	int n = 0;
+	int blk;
+	int offs;
+
+	for (i = 0; i < n_to_scan; i++) {
+		blk = block_index[i].block;
+		cbi = &rf->block_info[blk - dev->internal_start_block];
+
+		/* Written since, or still being written at the time */
+		if (block_index[i].seq > rf->seq_number ||
+		    block_index[i].seq >= rf->open_seq) {
+			block_index[n++] = block_index[i];
+			continue;
+		}
+
+		if (cbi->seq_number != block_index[i].seq ||
+		    (cbi->block_state != YAFFS_BLOCK_STATE_FULL &&
+		     cbi->block_state != YAFFS_BLOCK_STATE_COLLECTING)) {
+			yaffs_trace(YAFFS_TRACE_SCAN | YAFFS_TRACE_MOUNT,
+				"yaffs: block %d seq %d state %d does not match the checkpoint",
+				blk, block_index[i].seq, cbi->block_state);
+			return -1;
+		}
+		rf->trusted[blk - dev->internal_start_block] = 1;
+	}
+
+	/* All good, so take the trusted blocks over from the checkpoint */
+	for (blk = dev->internal_start_block; blk <= dev->internal_end_block;
+	     blk++) {
+		offs = blk - dev->internal_start_block;
+		if (!rf->trusted[offs])
+			continue;
+
+		bi = yaffs_get_block_info(dev, blk);
+		*bi = rf->block_info[offs];
+		/* Not FULL yet, so that deleting chunks does not erase it */
+		bi->block_state = YAFFS_BLOCK_STATE_NEEDS_SCANNING;
+		memcpy(dev->chunk_bits + offs * dev->chunk_bit_stride,
+		       rf->chunk_bits + offs * dev->chunk_bit_stride,
+		       dev->chunk_bit_stride);
+	}
+
+	if (dev->seq_number < rf->seq_number)
+		dev->seq_number = rf->seq_number;
+
+	yaffs_trace(YAFFS_TRACE_SCAN | YAFFS_TRACE_MOUNT,
+		"yaffs: %d of %d blocks trusted from checkpoint",
+		n_to_scan - n, n_to_scan);
+
+	return n;
+}
+
+/* Merge a file's checkpointed level 0 tnodes under what the scan found.
+ * keep is clear if the object has since become something else, in which
+ * case its old chunks are all deleted.
+ */
+static int yaffs2_rollfwd_tnodes(struct yaffs_dev *dev, struct yaffs_obj *obj,
+				 int keep)
+{
+	struct yaffs_file_var *fv = &obj->variant.file_variant;
+	union {
+		struct yaffs_tnode tn;
+		u32 map[YAFFS_NTNODES_LEVEL0];
+	} raw;
+	struct yaffs_tnode *tn;
+	u32 base_chunk;
+	u32 chunk_base;
+	u32 nand;
+	int i;
+	int ok;
+
+	if (dev->tnode_size > sizeof(raw))
+		return 0;
+
+	ok = (yaffs2_checkpt_rd(dev, &base_chunk, sizeof(base_chunk)) ==
+	      sizeof(base_chunk));
+
+	while (ok && (~base_chunk)) {
+		ok = (yaffs2_checkpt_rd(dev, &raw, dev->tnode_size) ==
+		      dev->tnode_size);
+
+		tn = (ok && keep) ? yaffs_find_tnode_0(dev, fv, base_chunk) :
+		    NULL;
+
+		for (i = 0; ok && i < YAFFS_NTNODES_LEVEL0; i++) {
+			nand = yaffs_get_group_base(dev, &raw.tn, i);
+
+			/* Outside the trusted blocks the scan has seen it, or
+			 * it has been erased since.
+			 */
+			if (!yaffs2_rollfwd_trusted(dev, nand))
+				continue;
+
+			chunk_base = (base_chunk + i - 1) *
+			    dev->data_bytes_per_chunk;
+
+			if (!keep || chunk_base >= fv->shrink_size ||
+			    (tn && yaffs_get_group_base(dev, tn, i))) {
+				ok = yaffs2_rollfwd_drop(dev, nand);
+				continue;
+			}
+
+			if (!tn)
+				tn = yaffs_add_find_tnode_0(dev, fv, base_chunk,
+							    NULL);
+			if (!tn ||
+			    !yaffs_check_chunk_bit(dev,
+					nand / dev->param.chunks_per_block,
+					nand % dev->param.chunks_per_block)) {
+				ok = 0;
+				break;
+			}
+
+			yaffs_load_tnode_0(dev, tn, i, nand);
+			obj->n_data_chunks++;
+		}
+
+		if (ok)
+			ok = (yaffs2_checkpt_rd
+			      (dev, &base_chunk,
+			       sizeof(base_chunk)) == sizeof(base_chunk));
+	}
+
+	return ok ? 1 : 0;
+}
+
+/* Merge the checkpointed objects with those found by the scan. Anything
+ * the scan found is newer than anything in the checkpoint.
+ */
+static int yaffs2_rollfwd_objs(struct yaffs_dev *dev,
+			       struct yaffs_obj **hard_list)
+{
+	struct yaffs_obj *obj;
+	struct yaffs_checkpt_obj cp;
+	struct yaffs_file_var *fv;
+	int n_data_chunks;
+	u32 scanned_size;
+	int keep;
+	int ok = 1;
+
+	while (ok) {
+		ok = (yaffs2_checkpt_rd(dev, &cp, sizeof(cp)) == sizeof(cp)) &&
+		    cp.struct_type == sizeof(cp);
+		if (!ok || cp.obj_id == ~0)
+			break;
+
+		yaffs_trace(YAFFS_TRACE_CHECKPOINT,
+			"Checkpoint merge object %d parent %d type %d chunk %d ",
+			cp.obj_id, cp.parent_id, cp.variant_type,
+			cp.hdr_chunk);
+
+		/* Soft deleted files are not kept track of on flash */
+		if (cp.soft_del) {
+			ok = 0;
+			break;
+		}
+
+		obj = yaffs_find_or_create_by_number(dev, cp.obj_id,
+						     cp.variant_type);
+		if (!obj) {
+			ok = 0;
+			break;
+		}
+		fv = &obj->variant.file_variant;
+
+		if (obj->valid) {
+			/* The scan found a newer header, so this one goes */
+			if (cp.hdr_chunk != obj->hdr_chunk &&
+			    yaffs2_rollfwd_trusted(dev, cp.hdr_chunk))
+				ok = yaffs2_rollfwd_drop(dev, cp.hdr_chunk);
+
+			keep = (obj->variant_type == YAFFS_OBJECT_TYPE_FILE);
+			if (keep && (cp.parent_id == YAFFS_OBJECTID_DELETED ||
+				     cp.parent_id == YAFFS_OBJECTID_UNLINKED))
+				fv->shrink_size = 0;
+		} else {
+			/* Nothing newer, so the checkpoint has it right */
+			if (cp.hdr_chunk > 0 &&
+			    (!yaffs2_rollfwd_trusted(dev, cp.hdr_chunk) ||
+			     !yaffs_check_chunk_bit(dev,
+				cp.hdr_chunk / dev->param.chunks_per_block,
+				cp.hdr_chunk % dev->param.chunks_per_block))) {
+				ok = 0;
+				break;
+			}
+
+			n_data_chunks = obj->n_data_chunks;
+			scanned_size =
+			    (obj->variant_type == YAFFS_OBJECT_TYPE_FILE) ?
+			    fv->scanned_size : 0;
+			ok = taffs2_checkpt_obj_to_obj(obj, &cp);
+			obj->n_data_chunks = n_data_chunks;
+			keep = 1;
+
+			if (!ok) {
+				break;
+			} else if (obj->variant_type == YAFFS_OBJECT_TYPE_FILE) {
+				/* Data written since may have extended it */
+				if (fv->file_size < scanned_size)
+					fv->file_size = scanned_size;
+				fv->scanned_size = fv->file_size;
+			} else if (obj->variant_type ==
+				   YAFFS_OBJECT_TYPE_HARDLINK) {
+				obj->hard_links.next =
+				    (struct list_head *)*hard_list;
+				*hard_list = obj;
+			}
+		}
+
+		if (ok && cp.variant_type == YAFFS_OBJECT_TYPE_FILE)
+			ok = yaffs2_rollfwd_tnodes(dev, obj, keep);
+	}
+
+	return ok ? 1 : 0;
+}
+
+/* Read the stale checkpoint again, now that the scan has run, and merge
+ * it in. buffer is scratch of at least data_bytes_per_chunk.
+ */
+static int yaffs2_rollfwd_merge(struct yaffs_dev *dev,
+				struct yaffs_obj **hard_list, u8 *buffer)
+{
+	struct yaffs_checkpt_dev cp;
+	int n_free_chunks = dev->n_free_chunks;
+	int n_erased_blocks = dev->n_erased_blocks;
+	int blocks_in_checkpt = dev->blocks_in_checkpt;
+	u32 n_blocks =
+	    (dev->internal_end_block - dev->internal_start_block + 1);
+	u32 n_bytes;
+	u32 n;
+	int ok;
+
+	ok = yaffs2_checkpt_open(dev, 0);
+
+	if (ok)
+		ok = yaffs2_rd_checkpt_validity_marker(dev, 1);
+	if (ok)
+		ok = (yaffs2_checkpt_rd(dev, &cp, sizeof(cp)) == sizeof(cp)) &&
+		    cp.struct_type == sizeof(cp);
+
+	/* The block state has been dealt with already */
+	n_bytes = n_blocks * (sizeof(struct yaffs_block_info) +
+			      dev->chunk_bit_stride);
+	while (ok && n_bytes > 0) {
+		n = (n_bytes < dev->data_bytes_per_chunk) ?
+		    n_bytes : dev->data_bytes_per_chunk;
+		ok = (yaffs2_checkpt_rd(dev, buffer, n) == n);
+		n_bytes -= n;
+	}
+
+	if (ok)
+		ok = yaffs2_rollfwd_objs(dev, hard_list);
+	if (ok)
+		ok = yaffs2_rd_checkpt_validity_marker(dev, 0);
+	if (ok)
+		ok = yaffs2_rd_checkpt_sum(dev);
+
+	if (!yaffs_checkpt_close(dev))
+		ok = 0;
+
+	/* Closing takes the checkpoint blocks off again */
+	dev->n_free_chunks = n_free_chunks;
+	dev->n_erased_blocks = n_erased_blocks;
+	dev->blocks_in_checkpt = blocks_in_checkpt;
+
+	yaffs_trace(YAFFS_TRACE_CHECKPOINT | YAFFS_TRACE_MOUNT,
+		"yaffs: checkpoint merge %s", ok ? "ok" : "failed");
+
+	return ok;
+}
+
+/* Hand the trusted blocks back to normal block management */
+static void yaffs2_rollfwd_finish(struct yaffs_dev *dev)
+{
+	struct yaffs_rollfwd *rf = dev->rollfwd;
+	struct yaffs_block_info *bi;
+	int blk;
+
+	for (blk = dev->internal_start_block; blk <= dev->internal_end_block;
+	     blk++) {
+		if (!rf->trusted[blk - dev->internal_start_block])
+			continue;
+
+		bi = yaffs_get_block_info(dev, blk);
+		bi->block_state = YAFFS_BLOCK_STATE_FULL;
+		if (bi->pages_in_use == 0 && !bi->has_shrink_hdr)
+			yaffs_block_became_dirty(dev, blk);
+	}
+
+	dev->n_free_chunks = yaffs_count_free_chunks(dev);
+
+	vfree(rf);
+	dev->rollfwd = NULL;
+	dev->mount_checkpt = YAFFS_MOUNT_ROLLFWD;
+}
+
+/*--------------------- Reading tags ahead of the scan ------------------
+ *
+ * When the flash layer can read the tags of many blocks at once, possibly
+ * on several CPUs, the scan asks for them a batch of blocks at a time and
+ * only the building of the object tree is left to do one chunk at a time.
+ */
+
+struct yaffs_scan_ahead {
+	struct yaffs_ext_tags *tags;
+	int *blocks;
+	int batch;		/* Whole blocks of tags that fit */
+	int first;		/* Key of the first block held */
+	int n;			/* Blocks held */
+};
+
+static void yaffs2_scan_ahead_init(struct yaffs_dev *dev,
+				   struct yaffs_scan_ahead *sa)
+{
+	int cpb = dev->param.chunks_per_block;
+	int n_tags = dev->param.scan_batch * cpb;
+
+	memset(sa, 0, sizeof(*sa));
+
+	if (!dev->param.read_blocks_tags_fn || dev->param.scan_batch <= 0)
+		return;
+
+	/* Querying the block states reads one chunk each of n_tags blocks */
+	sa->tags = vmalloc(n_tags * (sizeof(struct yaffs_ext_tags) +
+				     sizeof(int)));
+	if (!sa->tags)
+		return;
+
+	sa->blocks = (int *)(sa->tags + n_tags);
+	sa->batch = dev->param.scan_batch;
+}
+
+static void yaffs2_scan_ahead_deinit(struct yaffs_scan_ahead *sa)
+{
+	vfree(sa->tags);
+	sa->tags = NULL;
+}
+
+static int yaffs2_scan_ahead_rd(struct yaffs_dev *dev,
+				struct yaffs_scan_ahead *sa, int first,
+				int n_blocks, int n_chunks)
+{
+	if (!yaffs_rd_blocks_tags_nand(dev, sa->blocks, n_blocks, n_chunks,
+				       sa->tags)) {
+		/* Carry on a chunk at a time */
+		yaffs_trace(YAFFS_TRACE_SCAN, "scan read ahead failed");
+		yaffs2_scan_ahead_deinit(sa);
+		return 0;
+	}
+	sa->first = first;
+	sa->n = n_blocks;
+	return 1;
+}
+
+/* The first chunk's tags of block blk, or NULL if not reading ahead */
+static struct yaffs_ext_tags *yaffs2_scan_ahead_query(struct yaffs_dev *dev,
+						      struct yaffs_scan_ahead
+						      *sa, int blk)
+{
+	int n;
+	int i;
+
+	if (!sa->tags)
+		return NULL;
+
+	if (blk < sa->first || blk >= sa->first + sa->n) {
+		n = dev->internal_end_block - blk + 1;
+		if (n > sa->batch * dev->param.chunks_per_block)
+			n = sa->batch * dev->param.chunks_per_block;
+		for (i = 0; i < n; i++)
+			sa->blocks[i] = blk + i;
+		if (!yaffs2_scan_ahead_rd(dev, sa, blk, n, 1))
+			return NULL;
+	}
+	return &sa->tags[blk - sa->first];
+}
+
+/* The tags of all the chunks of the block at block_index[block_iter],
+ * reading ahead towards start_iter, or NULL if not reading ahead.
+ */
+static struct yaffs_ext_tags *yaffs2_scan_ahead_block(struct yaffs_dev *dev,
+						      struct yaffs_scan_ahead
+						      *sa,
+						      struct yaffs_block_index
+						      *block_index,
+						      int start_iter,
+						      int block_iter)
+{
+	int n;
+	int i;
+
+	if (!sa->tags)
+		return NULL;
+
+	if (block_iter > sa->first || block_iter <= sa->first - sa->n) {
+		n = block_iter - start_iter + 1;
+		if (n > sa->batch)
+			n = sa->batch;
+		for (i = 0; i < n; i++)
+			sa->blocks[i] = block_index[block_iter - i].block;
+		if (!yaffs2_scan_ahead_rd(dev, sa, block_iter, n,
+					  dev->param.chunks_per_block))
+			return NULL;
+	}
+	return &sa->tags[(sa->first - block_iter) *
+			 dev->param.chunks_per_block];
+}
+
 int yaffs2_scan_backwards(struct yaffs_dev *dev)
 {
 	struct yaffs_ext_tags tags;
@@ -983,9 +1557,12 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	int found_chunks;
 	int equiv_id;
 	int alloc_failed = 0;
+	int merge_failed = 0;
 
 	struct yaffs_block_index *block_index = NULL;
 	int alt_block_index = 0;
+	struct yaffs_scan_ahead ahead;
+	struct yaffs_ext_tags *ahead_tags;
 
 	yaffs_trace(YAFFS_TRACE_SCAN,
 		"yaffs2_scan_backwards starts  intstartblk %d intendblk %d...",
@@ -1013,6 +1590,8 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	chunk_data = yaffs_get_temp_buffer(dev, __LINE__);
 
+	yaffs2_scan_ahead_init(dev, &ahead);
+
 	/* Scan all the blocks to determine their state */
 	bi = dev->block_info;
 	for (blk = dev->internal_start_block; blk <= dev->internal_end_block;
@@ -1021,7 +1600,20 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 		bi->pages_in_use = 0;
 		bi->soft_del_pages = 0;
 
-		yaffs_query_init_block_state(dev, blk, &state, &seq_number);
+		ahead_tags = yaffs2_scan_ahead_query(dev, &ahead, blk);
+		if (!ahead_tags) {
+			yaffs_query_init_block_state(dev, blk, &state,
+						     &seq_number);
+		} else if (ahead_tags->block_bad) {
+			state = YAFFS_BLOCK_STATE_DEAD;
+			seq_number = 0;
+		} else if (ahead_tags->chunk_used) {
+			state = YAFFS_BLOCK_STATE_NEEDS_SCANNING;
+			seq_number = ahead_tags->seq_number;
+		} else {
+			state = YAFFS_BLOCK_STATE_EMPTY;
+			seq_number = 0;
+		}
 
 		bi->block_state = state;
 		bi->seq_number = seq_number;
@@ -1069,6 +1661,17 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 		bi++;
 	}
 
+	/* Leave out the blocks that a stale checkpoint can vouch for */
+	if (dev->rollfwd) {
+		c = yaffs2_rollfwd_trust(dev, block_index, n_to_scan);
+		if (c < 0)
+			yaffs2_rollfwd_abandon(dev);
+		else
+			n_to_scan = c;
+	}
+	dev->mount_blocks_scanned = n_to_scan;
+	dev->mount_chunks_scanned = 0;
+
 	yaffs_trace(YAFFS_TRACE_SCAN, "%d blocks to be sorted...", n_to_scan);
 
 	cond_resched();
@@ -1082,6 +1685,7 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	yaffs_trace(YAFFS_TRACE_SCAN, "...done");
 
 	/* Now scan the blocks looking at the data. */
+	ahead.n = 0;
 	start_iter = 0;
 	end_iter = n_to_scan - 1;
 	yaffs_trace(YAFFS_TRACE_SCAN_DEBUG, "%d blocks to scan", n_to_scan);
@@ -1102,6 +1706,9 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 		deleted = 0;
 
+		ahead_tags = yaffs2_scan_ahead_block(dev, &ahead, block_index,
+						     start_iter, block_iter);
+
 		/* For each chunk in each block that needs scanning.... */
 		found_chunks = 0;
 		for (c = dev->param.chunks_per_block - 1;
@@ -1114,8 +1721,15 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 			chunk = blk * dev->param.chunks_per_block + c;
 
-			result = yaffs_rd_chunk_tags_nand(dev, chunk, NULL,
-							  &tags);
+			if (ahead_tags) {
+				tags = ahead_tags[c];
+				if (tags.ecc_result > YAFFS_ECC_RESULT_NO_ERROR)
+					yaffs_handle_chunk_error(dev, bi);
+			} else {
+				result = yaffs_rd_chunk_tags_nand(dev, chunk,
+								  NULL, &tags);
+			}
+			dev->mount_chunks_scanned++;
 
 			/* Let's have a good look at this chunk... */
 
@@ -1573,6 +2187,16 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	}
 
+	yaffs2_scan_ahead_deinit(&ahead);
+
+	/* Everything else is in the checkpoint */
+	if (dev->rollfwd && !alloc_failed) {
+		if (yaffs2_rollfwd_merge(dev, &hard_list, chunk_data))
+			yaffs2_rollfwd_finish(dev);
+		else
+			merge_failed = 1;
+	}
+
 	yaffs_skip_rest_of_block(dev);
 
 	if (alt_block_index)
@@ -1589,7 +2213,7 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	yaffs_release_temp_buffer(dev, chunk_data, __LINE__);
 
-	if (alloc_failed)
+	if (alloc_failed || merge_failed)
 		return YAFFS_FAIL;
 
 	yaffs_trace(YAFFS_TRACE_SCAN, "yaffs2_scan_backwards ends");
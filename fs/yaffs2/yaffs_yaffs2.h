@@ -32,6 +32,8 @@ int yaffs_calc_checkpt_blocks_required(struct yaffs_dev *dev);
 void yaffs2_checkpt_invalidate(struct yaffs_dev *dev);
 int yaffs2_checkpt_save(struct yaffs_dev *dev);
 int yaffs2_checkpt_restore(struct yaffs_dev *dev);
+void yaffs2_checkpt_release_stale(struct yaffs_dev *dev);
+int yaffs2_rollfwd_abandon(struct yaffs_dev *dev);
 
 int yaffs2_handle_hole(struct yaffs_obj *obj, loff_t new_size);
 int yaffs2_scan_backwards(struct yaffs_dev *dev);
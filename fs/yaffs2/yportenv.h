@@ -30,6 +30,7 @@
 #include <linux/stat.h>
 #include <linux/sort.h>
 #include <linux/bitops.h>
+#include <linux/rwsem.h>
 
 #define YCHAR char
 #define YUCHAR unsigned char
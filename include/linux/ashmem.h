@@ -32,6 +32,18 @@ struct ashmem_pin {
 	__u32 len;	/* length forward from offset, in bytes, page-aligned */
 };
 
+/*
+ * struct ashmem_pin_ranges - argument of ASHMEM_PIN_RANGES/ASHMEM_UNPIN_RANGES,
+ * which pin or unpin up to ASHMEM_PIN_RANGES_MAX ranges in one call
+ */
+struct ashmem_pin_ranges {
+	__u64 ranges;	/* user pointer to an array of struct ashmem_pin */
+	__u32 nr;	/* number of entries in that array */
+	__u32 __pad;
+};
+
+#define ASHMEM_PIN_RANGES_MAX	512
+
 #define __ASHMEMIOC		0x77
 
 #define ASHMEM_SET_NAME		_IOW(__ASHMEMIOC, 1, char[ASHMEM_NAME_LEN])
@@ -44,5 +56,7 @@ struct ashmem_pin {
 #define ASHMEM_UNPIN		_IOW(__ASHMEMIOC, 8, struct ashmem_pin)
 #define ASHMEM_GET_PIN_STATUS	_IO(__ASHMEMIOC, 9)
 #define ASHMEM_PURGE_ALL_CACHES	_IO(__ASHMEMIOC, 10)
+#define ASHMEM_PIN_RANGES	_IOW(__ASHMEMIOC, 11, struct ashmem_pin_ranges)
+#define ASHMEM_UNPIN_RANGES	_IOW(__ASHMEMIOC, 12, struct ashmem_pin_ranges)
 
 #endif	/* _LINUX_ASHMEM_H */
@@ -22,6 +22,15 @@
 extern struct files_struct init_files;
 extern struct fs_struct init_fs;
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+#define INIT_LOWMEM_NODE(sig)						\
+	.lowmem_node	= {						\
+		.rb_parent_color = (unsigned long)&sig.lowmem_node,	\
+	},
+#else
+#define INIT_LOWMEM_NODE(sig)
+#endif
+
 #define INIT_SIGNALS(sig) {						\
 	.nr_threads	= 1,						\
 	.wait_chldexit	= __WAIT_QUEUE_HEAD_INITIALIZER(sig.wait_chldexit),\
@@ -38,6 +47,7 @@ extern struct fs_struct init_fs;
 	},								\
 	.cred_guard_mutex =						\
 		 __MUTEX_INITIALIZER(sig.cred_guard_mutex),		\
+	INIT_LOWMEM_NODE(sig)						\
 }
 
 extern struct nsproxy init_nsproxy;
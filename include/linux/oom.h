@@ -50,6 +50,21 @@ extern void out_of_memory(struct zonelist *zonelist, gfp_t gfp_mask,
 extern int register_oom_notifier(struct notifier_block *nb);
 extern int unregister_oom_notifier(struct notifier_block *nb);
 
+/*
+ * Events of the oom_adj notifier, which lets in-kernel killers keep an index
+ * of thread groups by oom_adj instead of walking the task list. The data is
+ * the task; the callbacks run in atomic context.
+ */
+enum oom_adj_event {
+	OOM_ADJ_NOTIFY_FORK,	/* a new thread group was created */
+	OOM_ADJ_NOTIFY_EXIT,	/* the last thread of a group is exiting */
+	OOM_ADJ_NOTIFY_CHANGE,	/* oom_adj/oom_score_adj was written */
+};
+
+extern int register_oom_adj_notifier(struct notifier_block *nb);
+extern int unregister_oom_adj_notifier(struct notifier_block *nb);
+extern void oom_adj_notify(enum oom_adj_event event, struct task_struct *p);
+
 extern bool oom_killer_disabled;
 
 static inline void oom_killer_disable(void)
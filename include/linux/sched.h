@@ -638,6 +638,11 @@ struct signal_struct {
 	int oom_score_adj;	/* OOM kill score adjustment */
 	int oom_score_adj_min;	/* OOM kill score adjustment minimum value.
 				 * Only settable by CAP_SYS_RESOURCE. */
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	struct rb_node lowmem_node;	/* lowmemorykiller candidate index */
+	unsigned long lowmem_rss;	/* RSS lowmem_node is sorted by */
+	int lowmem_adj;			/* oom_adj bucket of lowmem_node */
+#endif
 
 	struct mutex cred_guard_mutex;	/* guard against foreign influences on
 					 * credential calculations
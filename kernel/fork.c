@@ -946,6 +946,9 @@ static int copy_signal(unsigned long clone_flags, struct task_struct *tsk)
 	sig->oom_adj = current->signal->oom_adj;
 	sig->oom_score_adj = current->signal->oom_score_adj;
 	sig->oom_score_adj_min = current->signal->oom_score_adj_min;
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	RB_CLEAR_NODE(&sig->lowmem_node);
+#endif
 
 	mutex_init(&sig->cred_guard_mutex);
 
@@ -1328,6 +1331,8 @@ static struct task_struct *copy_process(unsigned long clone_flags,
 	spin_unlock(&current->sighand->siglock);
 	write_unlock_irq(&tasklist_lock);
 	proc_fork_connector(p);
+	if (thread_group_leader(p))
+		oom_adj_notify(OOM_ADJ_NOTIFY_FORK, p);
 	cgroup_post_fork(p);
 	perf_event_fork(p);
 	return p;
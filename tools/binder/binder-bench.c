@@ -0,0 +1,685 @@
+/*
+ * binder-bench.c -- binder IPC ping-pong and throughput benchmark
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * The benchmark forks a server that registers itself as the binder
+ * context manager, so it has to run on a system where no servicemanager
+ * is active (e.g. a QEMU initramfs).  The client then measures:
+ *
+ *   sync    round trip of BC_TRANSACTION / BR_REPLY, the reply echoes
+ *           the request payload back
+ *   oneway  time to BR_TRANSACTION_COMPLETE for TF_ONE_WAY transactions
+ *   fd      sync round trip carrying one file descriptor
+ *   sg      sync round trip with the payload sent as a BINDER_TYPE_PTR
+ *           buffer object (BC_TRANSACTION_SG)
+ *
+ * for payload sizes from 4 bytes up to the -s limit.  Per-transaction
+ * kernel side latency is available in /sys/kernel/debug/binder/latency.
+ *
+ * With -t N it instead measures contention: 1, 2, 4 .. N client threads
+ * each do -n sync round trips at once, against as many server looper
+ * threads, and the aggregate rate is printed per thread count and payload
+ * size.  On a kernel with CONFIG_LOCK_STAT the binder lock classes are
+ * reset before each step and their /proc/lock_stat lines printed after
+ * it, so runs on kernels before and after a locking change compare
+ * directly.
+ */
+
+/* $(CROSS_COMPILE)cc -Wall -O2 -o binder-bench binder-bench.c -lrt -lpthread */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "binder.h"
+
+#define BINDER_DEV		"/dev/binder"
+#define BINDER_MAP_SIZE		((1024 * 1024) - (4096 * 2))
+#define BUF_WORDS		128
+
+enum {
+	BENCH_GET_SERVICE = 1,
+	BENCH_PING,
+	BENCH_EXIT,
+};
+
+struct bench_binder {
+	int fd;
+	void *map;
+};
+
+struct bench_cmdbuf {
+	uint8_t data[BUF_WORDS * sizeof(uint32_t)];
+	size_t len;
+};
+
+static unsigned iterations = 10000;
+static size_t max_size = 64 * 1024;
+static unsigned max_threads;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void bench_open(struct bench_binder *b)
+{
+	struct binder_version vers;
+
+	b->fd = open(BINDER_DEV, O_RDWR);
+	if (b->fd < 0)
+		die("open " BINDER_DEV);
+	if (ioctl(b->fd, BINDER_VERSION, &vers) < 0)
+		die("BINDER_VERSION");
+	if (vers.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder protocol %ld, expected %d\n",
+			vers.protocol_version, BINDER_CURRENT_PROTOCOL_VERSION);
+		exit(1);
+	}
+	b->map = mmap(NULL, BINDER_MAP_SIZE, PROT_READ, MAP_PRIVATE, b->fd, 0);
+	if (b->map == MAP_FAILED)
+		die("mmap " BINDER_DEV);
+}
+
+static void cmd_put(struct bench_cmdbuf *cb, const void *data, size_t len)
+{
+	if (cb->len + len > sizeof(cb->data)) {
+		fprintf(stderr, "command buffer overflow\n");
+		exit(1);
+	}
+	memcpy(cb->data + cb->len, data, len);
+	cb->len += len;
+}
+
+static void cmd_put_u32(struct bench_cmdbuf *cb, uint32_t val)
+{
+	cmd_put(cb, &val, sizeof(val));
+}
+
+static void cmd_put_ptr(struct bench_cmdbuf *cb, const void *ptr)
+{
+	cmd_put(cb, &ptr, sizeof(ptr));
+}
+
+static void cmd_put_txn(struct bench_cmdbuf *cb, uint32_t cmd,
+			struct binder_transaction_data *tr)
+{
+	cmd_put_u32(cb, cmd);
+	cmd_put(cb, tr, sizeof(*tr));
+}
+
+static void cmd_put_txn_sg(struct bench_cmdbuf *cb, uint32_t cmd,
+			   struct binder_transaction_data *tr,
+			   size_t buffers_size)
+{
+	cmd_put_txn(cb, cmd, tr);
+	cmd_put(cb, &buffers_size, sizeof(buffers_size));
+}
+
+static int bench_write_read(struct bench_binder *b, struct bench_cmdbuf *cb,
+			    void *rbuf, size_t rsize, size_t *consumed)
+{
+	struct binder_write_read bwr;
+	int ret;
+
+	memset(&bwr, 0, sizeof(bwr));
+	if (cb) {
+		bwr.write_size = cb->len;
+		bwr.write_buffer = (unsigned long)cb->data;
+	}
+	bwr.read_size = rsize;
+	bwr.read_buffer = (unsigned long)rbuf;
+	do {
+		ret = ioctl(b->fd, BINDER_WRITE_READ, &bwr);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -errno;
+	if (cb)
+		cb->len = 0;
+	if (consumed)
+		*consumed = bwr.read_consumed;
+	return 0;
+}
+
+/*
+ * Send a transaction on handle and wait for its BR_REPLY, or for
+ * BR_TRANSACTION_COMPLETE if it is one way.  Returns the reply code
+ * (BR_REPLY, BR_TRANSACTION_COMPLETE, BR_FAILED_REPLY, BR_DEAD_REPLY)
+ * and the reply data in *reply.  The caller frees the reply buffer.
+ * A non-zero sg_size sends BC_TRANSACTION_SG with that buffers_size.
+ */
+static uint32_t bench_transact(struct bench_binder *b, uint32_t handle,
+			       uint32_t code, uint32_t flags,
+			       const void *data, size_t size,
+			       const size_t *offs, size_t offs_size,
+			       size_t sg_size,
+			       struct binder_transaction_data *reply)
+{
+	struct bench_cmdbuf cb;
+	struct binder_transaction_data tr;
+	uint32_t rbuf[BUF_WORDS];
+	int one_way = flags & TF_ONE_WAY;
+
+	memset(&tr, 0, sizeof(tr));
+	tr.target.handle = handle;
+	tr.code = code;
+	tr.flags = flags;
+	tr.data_size = size;
+	tr.offsets_size = offs_size;
+	tr.data.ptr.buffer = data;
+	tr.data.ptr.offsets = offs;
+	cb.len = 0;
+	if (sg_size)
+		cmd_put_txn_sg(&cb, BC_TRANSACTION_SG, &tr, sg_size);
+	else
+		cmd_put_txn(&cb, BC_TRANSACTION, &tr);
+
+	for (;;) {
+		size_t consumed;
+		uint8_t *ptr, *end;
+
+		if (bench_write_read(b, &cb, rbuf, sizeof(rbuf), &consumed))
+			die("BINDER_WRITE_READ");
+		ptr = (uint8_t *)rbuf;
+		end = ptr + consumed;
+		while (ptr + sizeof(uint32_t) <= end) {
+			uint32_t cmd;
+
+			memcpy(&cmd, ptr, sizeof(cmd));
+			ptr += sizeof(cmd);
+			switch (cmd) {
+			case BR_TRANSACTION_COMPLETE:
+				if (one_way)
+					return cmd;
+				break;
+			case BR_REPLY:
+				memcpy(reply, ptr, sizeof(*reply));
+				return cmd;
+			case BR_FAILED_REPLY:
+			case BR_DEAD_REPLY:
+				return cmd;
+			default:
+				break;
+			}
+			ptr += _IOC_SIZE(cmd);
+		}
+	}
+}
+
+static void bench_free_buffer(struct bench_binder *b, const void *buffer)
+{
+	struct bench_cmdbuf cb;
+
+	cb.len = 0;
+	cmd_put_u32(&cb, BC_FREE_BUFFER);
+	cmd_put_ptr(&cb, buffer);
+	if (bench_write_read(b, &cb, NULL, 0, NULL))
+		die("BC_FREE_BUFFER");
+}
+
+/* server side */
+
+static int bench_service_node;
+
+static void server_close_fds(struct binder_transaction_data *tr)
+{
+	const size_t *offs = tr->data.ptr.offsets;
+	size_t i;
+
+	for (i = 0; i < tr->offsets_size / sizeof(size_t); i++) {
+		const struct flat_binder_object *obj;
+
+		obj = (const void *)((const uint8_t *)tr->data.ptr.buffer +
+				     offs[i]);
+		if (obj->type == BINDER_TYPE_FD)
+			close(obj->handle);
+	}
+}
+
+static int server_handle(struct bench_binder *b, struct bench_cmdbuf *cb,
+			 struct binder_transaction_data *tr)
+{
+	struct binder_transaction_data reply;
+	struct flat_binder_object obj;
+	static size_t obj_off;
+	int done = 0;
+
+	server_close_fds(tr);
+	memset(&reply, 0, sizeof(reply));
+
+	switch (tr->code) {
+	case BENCH_GET_SERVICE:
+		memset(&obj, 0, sizeof(obj));
+		obj.type = BINDER_TYPE_BINDER;
+		obj.flags = 0x7f | FLAT_BINDER_FLAG_ACCEPTS_FDS;
+		obj.binder = &bench_service_node;
+		obj.cookie = NULL;
+		obj_off = 0;
+		reply.data_size = sizeof(obj);
+		reply.offsets_size = sizeof(obj_off);
+		reply.data.ptr.buffer = &obj;
+		reply.data.ptr.offsets = &obj_off;
+		break;
+	case BENCH_EXIT:
+		done = 1;
+		break;
+	default:
+		/* echo the payload back, without any objects */
+		reply.data_size = tr->data_size;
+		reply.data.ptr.buffer = tr->data.ptr.buffer;
+		break;
+	}
+
+	if (!(tr->flags & TF_ONE_WAY)) {
+		cmd_put_txn(cb, BC_REPLY, &reply);
+		cmd_put_u32(cb, BC_FREE_BUFFER);
+		cmd_put_ptr(cb, tr->data.ptr.buffer);
+		/* the reply data is read from the buffer before it is freed */
+		if (bench_write_read(b, cb, NULL, 0, NULL))
+			die("BC_REPLY");
+	} else {
+		cmd_put_u32(cb, BC_FREE_BUFFER);
+		cmd_put_ptr(cb, tr->data.ptr.buffer);
+	}
+	return done;
+}
+
+static void *server_looper(void *arg)
+{
+	struct bench_binder *b = arg;
+	struct bench_cmdbuf cb;
+	uint32_t rbuf[BUF_WORDS];
+	int done = 0;
+
+	cb.len = 0;
+	cmd_put_u32(&cb, BC_ENTER_LOOPER);
+	if (bench_write_read(b, &cb, NULL, 0, NULL))
+		die("BC_ENTER_LOOPER");
+
+	while (!done) {
+		size_t consumed;
+		uint8_t *ptr, *end;
+
+		if (bench_write_read(b, &cb, rbuf, sizeof(rbuf), &consumed))
+			die("BINDER_WRITE_READ");
+		ptr = (uint8_t *)rbuf;
+		end = ptr + consumed;
+		while (ptr + sizeof(uint32_t) <= end) {
+			struct binder_transaction_data tr;
+			struct binder_ptr_cookie pc;
+			uint32_t cmd;
+
+			memcpy(&cmd, ptr, sizeof(cmd));
+			ptr += sizeof(cmd);
+			switch (cmd) {
+			case BR_TRANSACTION:
+				memcpy(&tr, ptr, sizeof(tr));
+				done |= server_handle(b, &cb, &tr);
+				break;
+			case BR_INCREFS:
+			case BR_ACQUIRE:
+				memcpy(&pc, ptr, sizeof(pc));
+				cmd_put_u32(&cb, cmd == BR_INCREFS ?
+					    BC_INCREFS_DONE : BC_ACQUIRE_DONE);
+				cmd_put(&cb, &pc, sizeof(pc));
+				break;
+			default:
+				break;
+			}
+			ptr += _IOC_SIZE(cmd);
+		}
+	}
+	/* BENCH_EXIT ends all the loopers */
+	exit(0);
+}
+
+static void server_loop(int ready_fd)
+{
+	struct bench_binder b;
+	pthread_t thread;
+	unsigned i;
+
+	bench_open(&b);
+	if (ioctl(b.fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+		die("BINDER_SET_CONTEXT_MGR");
+	for (i = 1; i < max_threads; i++)
+		if (pthread_create(&thread, NULL, server_looper, &b))
+			die("pthread_create");
+	if (write(ready_fd, "r", 1) != 1)
+		die("write");
+	close(ready_fd);
+	server_looper(&b);
+}
+
+/* client side */
+
+static double ts_us(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1e6 + (b->tv_nsec - a->tv_nsec) / 1e3;
+}
+
+static uint32_t client_get_service(struct bench_binder *b)
+{
+	struct binder_transaction_data reply;
+	const struct flat_binder_object *obj;
+	struct bench_cmdbuf cb;
+	uint32_t handle;
+
+	if (bench_transact(b, 0, BENCH_GET_SERVICE, 0, NULL, 0, NULL, 0, 0,
+			   &reply) != BR_REPLY || reply.offsets_size == 0) {
+		fprintf(stderr, "service lookup failed\n");
+		exit(1);
+	}
+	obj = reply.data.ptr.buffer;
+	handle = obj->handle;
+
+	/* keep the handle alive once the reply buffer is gone */
+	cb.len = 0;
+	cmd_put_u32(&cb, BC_ACQUIRE);
+	cmd_put_u32(&cb, handle);
+	cmd_put_u32(&cb, BC_FREE_BUFFER);
+	cmd_put_ptr(&cb, reply.data.ptr.buffer);
+	if (bench_write_read(b, &cb, NULL, 0, NULL))
+		die("BC_ACQUIRE");
+	return handle;
+}
+
+enum bench_mode {
+	MODE_SYNC,
+	MODE_ONEWAY,
+	MODE_FD,
+	MODE_SG,
+};
+
+static const char *mode_names[] = { "sync", "oneway", "fd", "sg" };
+
+static void client_run(struct bench_binder *b, uint32_t handle,
+		       enum bench_mode mode, size_t size, uint8_t *payload)
+{
+	struct binder_transaction_data reply;
+	struct flat_binder_object *obj = (void *)payload;
+	struct binder_buffer_object bobj;
+	struct timespec start, t0, t1;
+	double lat, min = 1e30, max = 0, total;
+	size_t off = 0;
+	unsigned i, retries = 0;
+	int devnull = -1;
+
+	if (mode == MODE_FD) {
+		if (size < sizeof(*obj))
+			return;
+		devnull = open("/dev/null", O_RDONLY);
+		if (devnull < 0)
+			die("open /dev/null");
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iterations; i++) {
+		uint32_t ret;
+
+		if (mode == MODE_FD) {
+			memset(obj, 0, sizeof(*obj));
+			obj->type = BINDER_TYPE_FD;
+			obj->handle = devnull;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (mode == MODE_SG) {
+			memset(&bobj, 0, sizeof(bobj));
+			bobj.type = BINDER_TYPE_PTR;
+			bobj.buffer = payload;
+			bobj.length = size;
+			ret = bench_transact(b, handle, BENCH_PING, 0,
+					     &bobj, sizeof(bobj),
+					     &off, sizeof(off),
+					     (size + 7) & ~(size_t)7, &reply);
+		} else {
+			ret = bench_transact(b, handle, BENCH_PING,
+					     mode == MODE_ONEWAY ? TF_ONE_WAY : 0,
+					     payload, size,
+					     mode == MODE_FD ? &off : NULL,
+					     mode == MODE_FD ? sizeof(off) : 0,
+					     0, &reply);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		if (ret == BR_REPLY) {
+			bench_free_buffer(b, reply.data.ptr.buffer);
+		} else if (ret == BR_FAILED_REPLY && mode == MODE_ONEWAY) {
+			/* out of async space, let the server catch up */
+			retries++;
+			i--;
+			sched_yield();
+			continue;
+		} else if (ret != BR_TRANSACTION_COMPLETE) {
+			fprintf(stderr, "%s size %zu: transaction failed\n",
+				mode_names[mode], size);
+			exit(1);
+		}
+		lat = ts_us(&t0, &t1);
+		if (lat < min)
+			min = lat;
+		if (lat > max)
+			max = lat;
+	}
+	if (mode == MODE_ONEWAY &&
+	    bench_transact(b, handle, BENCH_PING, 0, NULL, 0, NULL, 0, 0,
+			   &reply) == BR_REPLY)
+		bench_free_buffer(b, reply.data.ptr.buffer);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	total = ts_us(&start, &t1);
+
+	printf("%-6s %7zu bytes: %u iters, avg %8.2f us, min %8.2f us, "
+	       "max %8.2f us, %9.0f txn/s, %8.2f MB/s",
+	       mode_names[mode], size, iterations, total / iterations,
+	       min, max, iterations * 1e6 / total,
+	       (double)iterations * size / total);
+	if (retries)
+		printf(", %u retries", retries);
+	printf("\n");
+
+	if (devnull >= 0)
+		close(devnull);
+}
+
+struct contend_arg {
+	struct bench_binder *b;
+	uint32_t handle;
+	size_t size;
+	pthread_barrier_t *start;
+	pthread_t thread;
+};
+
+static void *contend_thread(void *data)
+{
+	struct contend_arg *arg = data;
+	struct binder_transaction_data reply;
+	uint8_t *payload;
+	unsigned i;
+
+	payload = calloc(1, arg->size);
+	if (!payload)
+		die("calloc");
+	pthread_barrier_wait(arg->start);
+	for (i = 0; i < iterations; i++) {
+		if (bench_transact(arg->b, arg->handle, BENCH_PING, 0,
+				   payload, arg->size, NULL, 0, 0,
+				   &reply) != BR_REPLY) {
+			fprintf(stderr, "contend size %zu: transaction "
+				"failed\n", arg->size);
+			exit(1);
+		}
+		bench_free_buffer(arg->b, reply.data.ptr.buffer);
+	}
+	free(payload);
+	return NULL;
+}
+
+/* zeroes the lock statistics; returns 0 if CONFIG_LOCK_STAT is there */
+static int lock_stat_clear(void)
+{
+	int fd = open("/proc/lock_stat", O_WRONLY);
+	int ret;
+
+	if (fd < 0)
+		return -1;
+	ret = write(fd, "0", 1) == 1 ? 0 : -1;
+	close(fd);
+	return ret;
+}
+
+static void lock_stat_print(void)
+{
+	char line[512];
+	FILE *f = fopen("/proc/lock_stat", "r");
+
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f))
+		if (strstr(line, "binder") && strchr(line, ':'))
+			printf("    %s", line);
+	fclose(f);
+}
+
+static void client_contend(struct bench_binder *b, uint32_t handle,
+			   unsigned nr_threads, size_t size, int lock_stat)
+{
+	struct contend_arg *args;
+	pthread_barrier_t start;
+	struct timespec t0, t1;
+	double total;
+	unsigned i;
+
+	args = calloc(nr_threads, sizeof(*args));
+	if (!args)
+		die("calloc");
+	if (pthread_barrier_init(&start, NULL, nr_threads + 1))
+		die("pthread_barrier_init");
+	if (lock_stat)
+		lock_stat_clear();
+
+	for (i = 0; i < nr_threads; i++) {
+		args[i].b = b;
+		args[i].handle = handle;
+		args[i].size = size;
+		args[i].start = &start;
+		if (pthread_create(&args[i].thread, NULL, contend_thread,
+				   &args[i]))
+			die("pthread_create");
+	}
+	pthread_barrier_wait(&start);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(args[i].thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	total = ts_us(&t0, &t1);
+
+	printf("contend %2u threads %7zu bytes: %9.0f txn/s, "
+	       "%9.0f txn/s per thread, avg %8.2f us\n",
+	       nr_threads, size, nr_threads * iterations * 1e6 / total,
+	       iterations * 1e6 / total, total / iterations);
+	if (lock_stat)
+		lock_stat_print();
+
+	pthread_barrier_destroy(&start);
+	free(args);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n iterations] [-s max_size] "
+		"[-t max_threads]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_binder b;
+	struct binder_transaction_data reply;
+	uint8_t *payload;
+	uint32_t handle;
+	size_t size;
+	pid_t server;
+	int pipefd[2];
+	char c;
+	int opt, mode;
+
+	while ((opt = getopt(argc, argv, "n:s:t:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			max_size = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			max_threads = strtoul(optarg, NULL, 0);
+			if (!max_threads)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!iterations || max_size > BINDER_MAP_SIZE / 4)
+		usage(argv[0]);
+
+	if (pipe(pipefd))
+		die("pipe");
+	server = fork();
+	if (server < 0)
+		die("fork");
+	if (server == 0) {
+		close(pipefd[0]);
+		server_loop(pipefd[1]);
+	}
+	close(pipefd[1]);
+	if (read(pipefd[0], &c, 1) != 1) {
+		fprintf(stderr, "server failed to start\n");
+		return 1;
+	}
+	close(pipefd[0]);
+
+	bench_open(&b);
+	handle = client_get_service(&b);
+	payload = calloc(1, max_size);
+	if (!payload)
+		die("calloc");
+
+	if (max_threads) {
+		int lock_stat = !lock_stat_clear();
+		unsigned n;
+
+		/* every thread holds a buffer in each mapping at a time;
+		 * leave half of them for the allocator's slack */
+		for (size = 4; size <= max_size; size *= 16)
+			for (n = 1; n <= max_threads &&
+			     n * size <= BINDER_MAP_SIZE / 2; n *= 2)
+				client_contend(&b, handle, n, size,
+					       lock_stat);
+	} else {
+		for (mode = MODE_SYNC; mode <= MODE_SG; mode++)
+			for (size = 4; size <= max_size; size *= 4)
+				client_run(&b, handle, mode, size, payload);
+	}
+
+	bench_transact(&b, handle, BENCH_EXIT, 0, NULL, 0, NULL, 0, 0, &reply);
+	waitpid(server, NULL, 0);
+	return 0;
+}
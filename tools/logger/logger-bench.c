@@ -0,0 +1,360 @@
+/*
+ * logger-bench.c -- multi-threaded /dev/log write benchmark
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Starts -t writer threads that each log -n entries of -s bytes with
+ * writev(), formatted the way liblog does (priority, tag, message), while
+ * -r reader threads drain the same log like logcat.  Reports the aggregate
+ * write rate and the average and worst writev() latency seen by the
+ * writers, which is what application threads stall on.
+ *
+ * Readers read one entry per read() by default; -b switches them to
+ * LOGGER_READ_BATCH and -m to draining a read-only mmap() of the log.
+ */
+
+/* $(CROSS_COMPILE)cc -Wall -O2 -o logger-bench logger-bench.c -lpthread -lrt */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "logger.h"
+
+#define LOG_DEV		"/dev/log/main"
+#define LOG_TAG		"logger-bench"
+
+struct writer_stats {
+	pthread_t thread;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	unsigned errors;
+};
+
+struct reader_stats {
+	pthread_t thread;
+	uint64_t entries;
+	uint64_t bytes;
+	uint64_t reads;
+	uint64_t laps;
+};
+
+enum {
+	READ_ENTRY,
+	READ_BATCH,
+	READ_MMAP,
+};
+
+static const char *log_dev = LOG_DEV;
+static unsigned nr_writers = 64;
+static unsigned nr_readers = 2;
+static unsigned iterations = 10000;
+static size_t msg_size = 100;
+static int read_mode = READ_ENTRY;
+
+static pthread_barrier_t start_barrier;
+static volatile int writers_done;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static uint64_t ts_ns(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000000000ULL +
+	       b->tv_nsec - a->tv_nsec;
+}
+
+static void *writer_thread(void *arg)
+{
+	struct writer_stats *ws = arg;
+	struct timespec t0, t1;
+	struct iovec vec[3];
+	unsigned char prio = 4;	/* ANDROID_LOG_INFO */
+	char *msg;
+	unsigned i;
+	uint64_t ns;
+	int fd;
+
+	fd = open(log_dev, O_WRONLY);
+	if (fd < 0)
+		die("open " LOG_DEV);
+
+	msg = malloc(msg_size + 1);
+	if (!msg)
+		die("malloc");
+	memset(msg, 'x', msg_size);
+	msg[msg_size] = '\0';
+
+	vec[0].iov_base = &prio;
+	vec[0].iov_len = 1;
+	vec[1].iov_base = (void *) LOG_TAG;
+	vec[1].iov_len = sizeof(LOG_TAG);
+	vec[2].iov_base = msg;
+	vec[2].iov_len = msg_size + 1;
+
+	pthread_barrier_wait(&start_barrier);
+
+	for (i = 0; i < iterations; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (writev(fd, vec, 3) < 0)
+			ws->errors++;
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		ns = ts_ns(&t0, &t1);
+		ws->total_ns += ns;
+		if (ns > ws->max_ns)
+			ws->max_ns = ns;
+	}
+
+	free(msg);
+	close(fd);
+	return NULL;
+}
+
+static void count_entries(const unsigned char *ring, uint32_t size,
+			  uint32_t seq, uint32_t end, uint64_t *entries)
+{
+	struct logger_entry hdr;
+	uint32_t off, len;
+
+	while (seq != end) {
+		off = seq & (size - 1);
+		len = size - off < sizeof(hdr) ? size - off : sizeof(hdr);
+		memcpy(&hdr, ring + off, len);
+		memcpy((char *) &hdr + len, ring, sizeof(hdr) - len);
+		seq += sizeof(hdr) + hdr.len;
+		(*entries)++;
+	}
+}
+
+static void mmap_reader(struct reader_stats *rs, int fd, struct pollfd *pfd)
+{
+	volatile struct logger_mmap_header *hdr;
+	const unsigned char *ring;
+	uint64_t entries;
+	uint32_t r_seq, w_seq, size;
+	long map_size;
+
+	map_size = sysconf(_SC_PAGESIZE) + ioctl(fd, LOGGER_GET_LOG_BUF_SIZE);
+	hdr = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		die("mmap " LOG_DEV);
+	if (hdr->version != LOGGER_MMAP_VERSION) {
+		fprintf(stderr, "logger mmap version %u\n", hdr->version);
+		exit(1);
+	}
+	ring = (const unsigned char *) hdr + hdr->data_offset;
+	size = hdr->size;
+
+	pthread_barrier_wait(&start_barrier);
+
+	r_seq = hdr->w_seq;
+	for (;;) {
+		w_seq = hdr->w_seq;
+		__sync_synchronize();
+		if (r_seq == w_seq) {
+			if (writers_done)
+				break;
+			/* only wake up again for entries after r_seq */
+			if (ioctl(fd, LOGGER_SET_READ_SEQ, r_seq))
+				die("LOGGER_SET_READ_SEQ");
+			poll(pfd, 1, 100);
+			continue;
+		}
+
+		entries = 0;
+		count_entries(ring, size, r_seq, w_seq, &entries);
+		__sync_synchronize();
+		rs->reads++;
+		if ((int32_t) (r_seq - hdr->head) < 0) {
+			rs->laps++;
+			r_seq = hdr->head;
+			continue;
+		}
+		rs->entries += entries;
+		rs->bytes += w_seq - r_seq;
+		r_seq = w_seq;
+	}
+
+	munmap((void *) hdr, map_size);
+}
+
+static void *reader_thread(void *arg)
+{
+	struct reader_stats *rs = arg;
+	struct logger_entry *entry;
+	struct pollfd pfd;
+	size_t buf_size = LOGGER_ENTRY_MAX_LEN;
+	char *buf;
+	ssize_t ret, off;
+	int fd;
+
+	fd = open(log_dev, O_RDONLY | O_NONBLOCK);
+	if (fd < 0)
+		die("open " LOG_DEV);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	if (read_mode == READ_MMAP) {
+		mmap_reader(rs, fd, &pfd);
+		close(fd);
+		return NULL;
+	}
+
+	if (read_mode == READ_BATCH) {
+		if (ioctl(fd, LOGGER_SET_READ_MODE, LOGGER_READ_BATCH))
+			die("LOGGER_SET_READ_MODE");
+		buf_size = ioctl(fd, LOGGER_GET_LOG_BUF_SIZE);
+	}
+	buf = malloc(buf_size);
+	if (!buf)
+		die("malloc");
+
+	pthread_barrier_wait(&start_barrier);
+
+	for (;;) {
+		ret = read(fd, buf, buf_size);
+		if (ret > 0) {
+			rs->reads++;
+			rs->bytes += ret;
+			for (off = 0; off < ret; off += sizeof(*entry) + entry->len) {
+				entry = (struct logger_entry *) (buf + off);
+				rs->entries++;
+			}
+			continue;
+		}
+		if (ret < 0 && errno != EAGAIN && errno != EINTR)
+			die("read " LOG_DEV);
+		if (writers_done)
+			break;
+		poll(&pfd, 1, 100);
+	}
+
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d device] [-t writers] [-r readers] "
+		"[-n iterations] [-s msg_size] [-b | -m]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct writer_stats *ws;
+	struct reader_stats *rs;
+	struct timespec t0, t1;
+	uint64_t total_ns = 0, max_ns = 0, entries = 0, bytes = 0;
+	uint64_t reads = 0, laps = 0;
+	unsigned errors = 0, i;
+	double secs, writes;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:t:r:n:s:bm")) != -1) {
+		switch (opt) {
+		case 'b':
+			read_mode = READ_BATCH;
+			break;
+		case 'm':
+			read_mode = READ_MMAP;
+			break;
+		case 'd':
+			log_dev = optarg;
+			break;
+		case 't':
+			nr_writers = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			nr_readers = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			msg_size = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!nr_writers || !iterations ||
+	    msg_size + sizeof(LOG_TAG) + 2 > LOGGER_ENTRY_MAX_PAYLOAD)
+		usage(argv[0]);
+
+	ws = calloc(nr_writers, sizeof(*ws));
+	rs = calloc(nr_readers ? nr_readers : 1, sizeof(*rs));
+	if (!ws || !rs)
+		die("calloc");
+
+	pthread_barrier_init(&start_barrier, NULL, nr_writers + nr_readers + 1);
+
+	for (i = 0; i < nr_readers; i++)
+		if (pthread_create(&rs[i].thread, NULL, reader_thread, &rs[i]))
+			die("pthread_create");
+	for (i = 0; i < nr_writers; i++)
+		if (pthread_create(&ws[i].thread, NULL, writer_thread, &ws[i]))
+			die("pthread_create");
+
+	pthread_barrier_wait(&start_barrier);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	for (i = 0; i < nr_writers; i++) {
+		pthread_join(ws[i].thread, NULL);
+		total_ns += ws[i].total_ns;
+		if (ws[i].max_ns > max_ns)
+			max_ns = ws[i].max_ns;
+		errors += ws[i].errors;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	writers_done = 1;
+	for (i = 0; i < nr_readers; i++) {
+		pthread_join(rs[i].thread, NULL);
+		entries += rs[i].entries;
+		bytes += rs[i].bytes;
+		reads += rs[i].reads;
+		laps += rs[i].laps;
+	}
+
+	writes = (double) nr_writers * iterations;
+	secs = ts_ns(&t0, &t1) / 1e9;
+	printf("%u writers x %u entries of %zu bytes, %u readers\n",
+	       nr_writers, iterations, msg_size, nr_readers);
+	printf("  %.0f writes/s, writev avg %.2f us max %.2f us",
+	       writes / secs, total_ns / writes / 1000.0, max_ns / 1000.0);
+	if (errors)
+		printf(", %u errors", errors);
+	printf("\n");
+	if (nr_readers)
+		printf("  readers: %llu entries, %llu bytes in %llu reads, "
+		       "%llu laps (%.1f%% of writes per reader)\n",
+		       (unsigned long long) entries,
+		       (unsigned long long) bytes,
+		       (unsigned long long) reads,
+		       (unsigned long long) laps,
+		       100.0 * entries / nr_readers / writes);
+
+	return 0;
+}
@@ -0,0 +1,1031 @@
+/*
+ * fake_kernel.h -- just enough of the kernel API to run nvmap in userspace
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Every <linux/...>, <asm/...> header the nvmap sources include resolves to
+ * a one-line stub which pulls in this file, so the driver builds unchanged
+ * on the host.  Locks map onto pthreads, "physical memory" is a memfd that
+ * is mapped linearly once and again page by page wherever nvmap points one
+ * of its kernel PTEs, and kmalloc hands out memory below 4GiB so handle
+ * pointers survive the round trip through the 32-bit ioctl structures the
+ * way they do on Tegra.  Cache maintenance is a no-op.
+ *
+ * The runtime lives in kernel.c; the fake IOVMM in iovmm.c.
+ */
+
+#ifndef __NVMAP_FAKE_KERNEL_H
+#define __NVMAP_FAKE_KERNEL_H
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <asm-generic/ioctl.h>
+
+#define __KERNEL__			1
+
+/* configuration the driver is built with, matching the Acer defconfigs */
+#define CONFIG_TEGRA_NVMAP		1
+#define CONFIG_TEGRA_IOVMM		1
+#define CONFIG_NVMAP_ALLOW_SYSMEM	1
+#define CONFIG_NVMAP_RECLAIM_UNPINNED_VM 1
+#define CONFIG_NVMAP_CARVEOUT_COMPACTOR	1
+#define CONFIG_NVMAP_PAGE_POOLS		1
+#define CONFIG_NVMAP_PAGE_POOL_SIZE	256
+#define CONFIG_SMP			1
+
+/* types */
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef long long s64;
+typedef u8 __u8;
+typedef u16 __u16;
+typedef u32 __u32;
+typedef u64 __u64;
+typedef s8 __s8;
+typedef s16 __s16;
+typedef s32 __s32;
+typedef s64 __s64;
+typedef u32 phys_addr_t;
+typedef u32 dma_addr_t;
+typedef unsigned int gfp_t;
+typedef unsigned long pteval_t;
+typedef pteval_t pte_t;
+typedef unsigned long pmd_t;
+typedef unsigned long pud_t;
+typedef unsigned long pgd_t;
+typedef unsigned long pgprot_t;
+typedef s64 ktime_t;
+
+#define __user
+#define __iomem
+#define __init
+#define __exit
+#define __initdata
+#define __devinit
+#define __devexit
+#define __read_mostly
+#define __must_check
+#define __maybe_unused		__attribute__((unused))
+#define ____cacheline_aligned_in_smp __attribute__((aligned(64)))
+#define likely(x)		__builtin_expect(!!(x), 1)
+#define unlikely(x)		__builtin_expect(!!(x), 0)
+#define barrier()		__asm__ __volatile__("" : : : "memory")
+#define ACCESS_ONCE(x)		(*(volatile typeof(x) *)&(x))
+
+/* kernel.h */
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
+#define container_of(ptr, type, member) ({			\
+	const typeof(((type *)0)->member) *__mptr = (ptr);	\
+	(type *)((char *)__mptr - offsetof(type, member)); })
+#define min(x, y)		({ typeof(x) _x = (x); typeof(y) _y = (y); \
+				   (void)(&_x == &_y); _x < _y ? _x : _y; })
+#define max(x, y)		({ typeof(x) _x = (x); typeof(y) _y = (y); \
+				   (void)(&_x == &_y); _x > _y ? _x : _y; })
+#define min_t(t, x, y)		({ t _x = (x); t _y = (y); _x < _y ? _x : _y; })
+#define max_t(t, x, y)		({ t _x = (x); t _y = (y); _x > _y ? _x : _y; })
+#define clamp_t(t, v, lo, hi)	min_t(t, max_t(t, v, lo), hi)
+#define swap(a, b)		do { typeof(a) _t = (a); (a) = (b); (b) = _t; } while (0)
+#define ALIGN(x, a)		(((x) + ((typeof(x))(a) - 1)) & ~((typeof(x))(a) - 1))
+#define IS_ALIGNED(x, a)	(((x) & ((typeof(x))(a) - 1)) == 0)
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+#define roundup(x, y)		((((x) + ((y) - 1)) / (y)) * (y))
+#define BITS_PER_LONG		64
+#define BITS_TO_LONGS(n)	DIV_ROUND_UP(n, BITS_PER_LONG)
+#define BIT_WORD(n)		((n) / BITS_PER_LONG)
+#define BIT_MASK(n)		(1UL << ((n) % BITS_PER_LONG))
+#define DECLARE_BITMAP(name, bits) unsigned long name[BITS_TO_LONGS(bits)]
+#define EXPORT_SYMBOL(s)
+#define EXPORT_SYMBOL_GPL(s)
+#define THIS_MODULE		NULL
+#define MODULE_LICENSE(s)
+#define MODULE_AUTHOR(s)
+#define MODULE_DESCRIPTION(s)
+#define module_param(name, type, perm)
+#define module_param_named(name, value, type, perm)
+#define MODULE_PARM_DESC(name, desc)
+
+/* the driver's init and exit hooks are called by the harness */
+#define fs_initcall(fn)		int (*const fake_initcall)(void) = fn
+#define module_init(fn)		fs_initcall(fn)
+#define module_exit(fn)		void (*const fake_exitcall)(void) = fn
+
+#define KERN_EMERG		"<0>"
+#define KERN_ALERT		"<1>"
+#define KERN_CRIT		"<2>"
+#define KERN_ERR		"<3>"
+#define KERN_WARNING		"<4>"
+#define KERN_NOTICE		"<5>"
+#define KERN_INFO		"<6>"
+#define KERN_DEBUG		"<7>"
+
+extern int fake_loglevel;
+extern unsigned long fake_errors;
+extern unsigned long fake_warnings;
+int printk(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void fake_bug(const char *file, int line) __attribute__((noreturn));
+void fake_warn(const char *file, int line, const char *cond);
+
+#define pr_err(fmt, ...)	printk(KERN_ERR fmt, ##__VA_ARGS__)
+#define pr_warning(fmt, ...)	printk(KERN_WARNING fmt, ##__VA_ARGS__)
+#define pr_warn			pr_warning
+#define pr_info(fmt, ...)	printk(KERN_INFO fmt, ##__VA_ARGS__)
+#define pr_debug(fmt, ...)	do { } while (0)
+#define dev_err(d, fmt, ...)	printk(KERN_ERR fmt, ##__VA_ARGS__)
+#define dev_warn(d, fmt, ...)	printk(KERN_WARNING fmt, ##__VA_ARGS__)
+#define dev_info(d, fmt, ...)	printk(KERN_INFO fmt, ##__VA_ARGS__)
+#define dev_dbg(d, fmt, ...)	do { } while (0)
+
+#define BUG()			fake_bug(__FILE__, __LINE__)
+#define BUG_ON(c)		do { if (unlikely(c)) BUG(); } while (0)
+#define WARN_ON(c) ({						\
+	int __ret = !!(c);					\
+	if (unlikely(__ret))					\
+		fake_warn(__FILE__, __LINE__, #c);		\
+	unlikely(__ret); })
+#define WARN(c, fmt, ...) ({					\
+	int __ret = !!(c);					\
+	if (unlikely(__ret)) {					\
+		fake_warn(__FILE__, __LINE__, #c);		\
+		printk(KERN_EMERG fmt, ##__VA_ARGS__);		\
+	}							\
+	unlikely(__ret); })
+#define SZ_32K			0x00008000
+#define SZ_64K			0x00010000
+#define SZ_1M			0x00100000
+#define SZ_4M			0x00400000
+#define L1_CACHE_BYTES		32
+#define S_IRUGO			0444
+#define S_IWUSR			0200
+#define BUILD_BUG_ON(c)		((void)sizeof(char[1 - 2 * !!(c)]))
+
+/* err.h */
+#define MAX_ERRNO		4095
+#define ERESTARTSYS		512
+#define ENOTSUPP		524
+#define IS_ERR_VALUE(x)		unlikely((unsigned long)(x) >= (unsigned long)-MAX_ERRNO)
+static inline void *ERR_PTR(long error) { return (void *)error; }
+static inline long PTR_ERR(const void *ptr) { return (long)ptr; }
+static inline long IS_ERR(const void *ptr) { return IS_ERR_VALUE(ptr); }
+static inline long IS_ERR_OR_NULL(const void *ptr)
+{
+	return !ptr || IS_ERR_VALUE(ptr);
+}
+
+/* bitops */
+#define fls(x)			((x) ? 32 - __builtin_clz(x) : 0)
+#define __fls(x)		(BITS_PER_LONG - 1 - __builtin_clzl(x))
+#define __ffs(x)		__builtin_ctzl(x)
+#define ilog2(n)		(BITS_PER_LONG - 1 - __builtin_clzl(n))
+#define is_power_of_2(n)	((n) != 0 && (((n) & ((n) - 1)) == 0))
+#define roundup_pow_of_two(n)	(1UL << (ilog2((n) - 1) + 1))
+
+static inline void __set_bit(int nr, volatile unsigned long *addr)
+{
+	addr[BIT_WORD(nr)] |= BIT_MASK(nr);
+}
+
+static inline void __clear_bit(int nr, volatile unsigned long *addr)
+{
+	addr[BIT_WORD(nr)] &= ~BIT_MASK(nr);
+}
+
+static inline void set_bit(int nr, volatile unsigned long *addr)
+{
+	__atomic_fetch_or(&addr[BIT_WORD(nr)], BIT_MASK(nr), __ATOMIC_SEQ_CST);
+}
+
+static inline void clear_bit(int nr, volatile unsigned long *addr)
+{
+	__atomic_fetch_and(&addr[BIT_WORD(nr)], ~BIT_MASK(nr), __ATOMIC_SEQ_CST);
+}
+
+static inline int test_bit(int nr, const volatile unsigned long *addr)
+{
+	return !!(addr[BIT_WORD(nr)] & BIT_MASK(nr));
+}
+
+static inline int test_and_set_bit(int nr, volatile unsigned long *addr)
+{
+	return !!(__atomic_fetch_or(&addr[BIT_WORD(nr)], BIT_MASK(nr),
+				    __ATOMIC_SEQ_CST) & BIT_MASK(nr));
+}
+
+static inline int test_and_clear_bit(int nr, volatile unsigned long *addr)
+{
+	return !!(__atomic_fetch_and(&addr[BIT_WORD(nr)], ~BIT_MASK(nr),
+				     __ATOMIC_SEQ_CST) & BIT_MASK(nr));
+}
+
+unsigned long find_next_bit(const unsigned long *addr, unsigned long size,
+			    unsigned long offset);
+unsigned long find_next_zero_bit(const unsigned long *addr, unsigned long size,
+				 unsigned long offset);
+#define find_first_bit(addr, size)	find_next_bit((addr), (size), 0)
+#define for_each_set_bit(bit, addr, size)				\
+	for ((bit) = find_first_bit((addr), (size));			\
+	     (bit) < (size);						\
+	     (bit) = find_next_bit((addr), (size), (bit) + 1))
+
+void bitmap_set(unsigned long *map, int start, int nr);
+void bitmap_clear(unsigned long *map, int start, int nr);
+unsigned long bitmap_find_next_zero_area(unsigned long *map,
+					 unsigned long size,
+					 unsigned long start,
+					 unsigned int nr,
+					 unsigned long align_mask);
+
+/* barriers and atomics */
+#define mb()			__sync_synchronize()
+#define rmb()			__sync_synchronize()
+#define wmb()			__sync_synchronize()
+#define smp_mb()		__sync_synchronize()
+#define smp_rmb()		__sync_synchronize()
+#define smp_wmb()		__sync_synchronize()
+#define dsb()			__sync_synchronize()
+
+typedef struct {
+	volatile int counter;
+} atomic_t;
+
+#define ATOMIC_INIT(i)		{ (i) }
+#define atomic_read(v)		__atomic_load_n(&(v)->counter, __ATOMIC_SEQ_CST)
+#define atomic_set(v, i)	__atomic_store_n(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+#define atomic_add_return(i, v)	__atomic_add_fetch(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+#define atomic_sub_return(i, v)	__atomic_sub_fetch(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+#define atomic_inc_return(v)	atomic_add_return(1, v)
+#define atomic_dec_return(v)	atomic_sub_return(1, v)
+#define atomic_add(i, v)	((void)atomic_add_return(i, v))
+#define atomic_sub(i, v)	((void)atomic_sub_return(i, v))
+#define atomic_inc(v)		atomic_add(1, v)
+#define atomic_dec(v)		atomic_sub(1, v)
+#define atomic_dec_and_test(v)	(atomic_dec_return(v) == 0)
+#define atomic_inc_and_test(v)	(atomic_inc_return(v) == 0)
+#define atomic_sub_and_test(i, v) (atomic_sub_return(i, v) == 0)
+
+static inline int atomic_cmpxchg(atomic_t *v, int old, int new)
+{
+	__atomic_compare_exchange_n(&v->counter, &old, new, false,
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return old;
+}
+
+static inline int atomic_add_unless(atomic_t *v, int a, int u)
+{
+	int c = atomic_read(v);
+
+	while (c != u) {
+		if (__atomic_compare_exchange_n(&v->counter, &c, c + a, false,
+						__ATOMIC_SEQ_CST,
+						__ATOMIC_SEQ_CST))
+			return 1;
+	}
+	return 0;
+}
+#define atomic_inc_not_zero(v)	atomic_add_unless((v), 1, 0)
+
+/* locks */
+typedef struct {
+	pthread_mutex_t m;
+} spinlock_t;
+
+#define __SPIN_LOCK_UNLOCKED(name)	{ PTHREAD_MUTEX_INITIALIZER }
+#define DEFINE_SPINLOCK(name)	spinlock_t name = __SPIN_LOCK_UNLOCKED(name)
+#define spin_lock_init(l)	pthread_mutex_init(&(l)->m, NULL)
+#define spin_lock(l)		pthread_mutex_lock(&(l)->m)
+#define spin_unlock(l)		pthread_mutex_unlock(&(l)->m)
+#define spin_trylock(l)		(!pthread_mutex_trylock(&(l)->m))
+#define spin_lock_irqsave(l, f)	do { (f) = 0; spin_lock(l); } while (0)
+#define spin_unlock_irqrestore(l, f) do { (void)(f); spin_unlock(l); } while (0)
+#define spin_lock_irq(l)	spin_lock(l)
+#define spin_unlock_irq(l)	spin_unlock(l)
+#define spin_lock_bh(l)		spin_lock(l)
+#define spin_unlock_bh(l)	spin_unlock(l)
+
+struct mutex {
+	pthread_mutex_t m;
+};
+
+#define DEFINE_MUTEX(name)	struct mutex name = { PTHREAD_MUTEX_INITIALIZER }
+#define mutex_init(l)		pthread_mutex_init(&(l)->m, NULL)
+#define mutex_lock(l)		pthread_mutex_lock(&(l)->m)
+#define mutex_unlock(l)		pthread_mutex_unlock(&(l)->m)
+#define mutex_trylock(l)	(!pthread_mutex_trylock(&(l)->m))
+#define mutex_lock_interruptible(l) (mutex_lock(l), 0)
+#define mutex_destroy(l)	pthread_mutex_destroy(&(l)->m)
+
+struct rw_semaphore {
+	pthread_rwlock_t rw;
+};
+
+#define init_rwsem(s)		pthread_rwlock_init(&(s)->rw, NULL)
+#define down_read(s)		pthread_rwlock_rdlock(&(s)->rw)
+#define up_read(s)		pthread_rwlock_unlock(&(s)->rw)
+#define down_write(s)		pthread_rwlock_wrlock(&(s)->rw)
+#define up_write(s)		pthread_rwlock_unlock(&(s)->rw)
+
+/* lists and trees come straight from the kernel */
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+struct hlist_head {
+	struct hlist_node *first;
+};
+
+struct hlist_node {
+	struct hlist_node *next, **pprev;
+};
+
+#define LIST_POISON1		((void *)0x00100100)
+#define LIST_POISON2		((void *)0x00200200)
+#define prefetch(x)		__builtin_prefetch(x)
+
+#include "../../../include/linux/list.h"
+#include "../../../include/linux/rbtree.h"
+
+/* time */
+#define HZ			100
+#define jiffies			fake_jiffies()
+unsigned long fake_jiffies(void);
+#define time_after(a, b)	((long)((b) - (a)) < 0)
+#define time_before(a, b)	time_after(b, a)
+#define time_is_after_jiffies(a)  time_before(jiffies, a)
+#define time_is_before_jiffies(a) time_after(jiffies, a)
+#define msecs_to_jiffies(m)	(((m) * HZ + 999) / 1000)
+#define jiffies_to_msecs(j)	((j) * (1000 / HZ))
+void msleep(unsigned int msecs);
+void udelay(unsigned long usecs);
+#define mdelay(m)		udelay((m) * 1000)
+
+ktime_t ktime_get(void);
+#define ktime_sub(a, b)		((a) - (b))
+#define ktime_to_ns(t)		(t)
+#define ktime_to_us(t)		((t) / 1000)
+#define ktime_us_delta(a, b)	(((a) - (b)) / 1000)
+#define div_u64(n, d)		((u64)(n) / (d))
+#define div64_u64(n, d)		((u64)(n) / (d))
+
+void sort(void *base, size_t num, size_t size,
+	  int (*cmp)(const void *, const void *),
+	  void (*swap)(void *, void *, int));
+
+/* tasks */
+#define TASK_COMM_LEN		16
+#define PF_KTHREAD		0x00200000
+#define TASK_RUNNING		0
+#define TASK_INTERRUPTIBLE	1
+#define TASK_UNINTERRUPTIBLE	2
+
+struct signal_struct {
+	int oom_adj;
+};
+
+struct vm_area_struct;
+
+struct mm_struct {
+	struct vm_area_struct *mmap;	/* fake_mmap()s, under mmap_sem */
+	struct rw_semaphore mmap_sem;
+};
+
+struct task_struct {
+	pid_t pid;
+	unsigned int flags;
+	char comm[TASK_COMM_LEN];
+	struct task_struct *group_leader;
+	struct mm_struct *mm;
+	struct mm_struct *active_mm;
+	struct signal_struct *signal;
+	atomic_t usage;
+	/* kthreads */
+	pthread_t thread;
+	int (*threadfn)(void *data);
+	void *data;
+	volatile int should_stop;
+	int state;
+};
+
+struct task_struct *fake_current(void);
+#define current			fake_current()
+#define get_task_struct(t)	atomic_inc(&(t)->usage)
+#define put_task_struct(t)	atomic_dec(&(t)->usage)
+#define task_lock(t)		do { } while (0)
+#define task_unlock(t)		do { } while (0)
+#define task_pid_nr(t)		((t)->pid)
+#define get_task_comm(buf, t)	strncpy(buf, (t)->comm, TASK_COMM_LEN)
+#define for_each_process(p)	for ((p) = NULL; (p); )
+#define signal_pending(t)	0
+#define fatal_signal_pending(t)	0
+#define send_sig(sig, t, priv)	0
+#define force_sig(sig, t)	do { } while (0)
+#define SIGKILL			9
+#define raw_smp_processor_id()	fake_cpu()
+#define smp_processor_id()	fake_cpu()
+#define get_cpu()		fake_cpu()
+#define put_cpu()		do { } while (0)
+#define nr_cpu_ids		fake_nr_cpus()
+#define num_online_cpus()	fake_nr_cpus()
+unsigned int fake_cpu(void);
+unsigned int fake_nr_cpus(void);
+
+#define might_sleep()		do { } while (0)
+#define need_resched()		0
+static inline int cond_resched(void) { return 0; }
+void schedule(void);
+#define yield()			schedule()
+#define set_current_state(s)	(current->state = (s))
+#define __set_current_state(s)	(current->state = (s))
+int wake_up_process(struct task_struct *t);
+#define set_freezable()		do { } while (0)
+#define try_to_freeze()		0
+
+struct task_struct *kthread_create(int (*fn)(void *data), void *data,
+				   const char *namefmt, ...);
+#define kthread_run(fn, data, namefmt, ...) ({				\
+	struct task_struct *__k =					\
+		kthread_create(fn, data, namefmt, ##__VA_ARGS__);	\
+	if (!IS_ERR(__k))						\
+		wake_up_process(__k);					\
+	__k; })
+int kthread_stop(struct task_struct *t);
+int kthread_should_stop(void);
+
+/* wait queues; a waiter only sleeps if no wakeup was issued since it last
+ * looked at the condition, and never for longer than a few ticks, which is
+ * what lets kthread_stop() reach a thread sleeping on any queue */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int waiters;
+	unsigned int gen;
+} wait_queue_head_t;
+
+#define __WAIT_QUEUE_HEAD_INITIALIZER(name) \
+	{ PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 }
+#define DECLARE_WAIT_QUEUE_HEAD(name) \
+	wait_queue_head_t name = __WAIT_QUEUE_HEAD_INITIALIZER(name)
+void init_waitqueue_head(wait_queue_head_t *q);
+unsigned int fake_wait_begin(wait_queue_head_t *q);
+void fake_wait_sleep(wait_queue_head_t *q, unsigned int *gen);
+void fake_wait_end(wait_queue_head_t *q);
+void wake_up(wait_queue_head_t *q);
+#define wake_up_all(q)		wake_up(q)
+#define wake_up_interruptible(q) wake_up(q)
+#define wake_up_interruptible_all(q) wake_up(q)
+#define waitqueue_active(q)	(ACCESS_ONCE((q)->waiters) != 0)
+
+#define wait_event(wq, cond) do {					\
+	unsigned int __gen = fake_wait_begin(&(wq));			\
+	while (!(cond))							\
+		fake_wait_sleep(&(wq), &__gen);				\
+	fake_wait_end(&(wq));						\
+} while (0)
+#define wait_event_interruptible(wq, cond) ({ wait_event(wq, cond); 0; })
+#define wait_event_timeout(wq, cond, timeout) ({			\
+	unsigned long __end = jiffies + (timeout);			\
+	long __ret = 1;							\
+	unsigned int __gen = fake_wait_begin(&(wq));			\
+	while (!(cond)) {						\
+		if (time_after(jiffies, __end)) {			\
+			__ret = 0;					\
+			break;						\
+		}							\
+		fake_wait_sleep(&(wq), &__gen);				\
+	}								\
+	fake_wait_end(&(wq));						\
+	__ret; })
+#define wait_event_interruptible_timeout(wq, cond, timeout)		\
+	wait_event_timeout(wq, cond, timeout)
+
+/* workqueues */
+struct work_struct;
+typedef void (*work_func_t)(struct work_struct *work);
+
+struct work_struct {
+	work_func_t func;
+	struct list_head entry;
+	unsigned long when;
+	int pending;
+};
+
+struct delayed_work {
+	struct work_struct work;
+};
+
+struct workqueue_struct;
+extern struct workqueue_struct *system_wq;
+extern struct workqueue_struct *system_long_wq;
+
+#define INIT_WORK(w, f) do {						\
+	(w)->func = (f);						\
+	INIT_LIST_HEAD(&(w)->entry);					\
+	(w)->pending = 0;						\
+} while (0)
+#define INIT_DELAYED_WORK(w, f)	INIT_WORK(&(w)->work, f)
+static inline struct delayed_work *to_delayed_work(struct work_struct *work)
+{
+	return container_of(work, struct delayed_work, work);
+}
+int queue_delayed_work(struct workqueue_struct *wq, struct delayed_work *dw,
+		       unsigned long delay);
+#define queue_work(wq, w)	queue_delayed_work(wq, to_delayed_work(w), 0)
+#define schedule_work(w)	queue_work(system_wq, w)
+#define schedule_delayed_work(dw, d) queue_delayed_work(system_wq, dw, d)
+bool cancel_delayed_work_sync(struct delayed_work *dw);
+#define cancel_work_sync(w)	cancel_delayed_work_sync(to_delayed_work(w))
+void flush_scheduled_work(void);
+
+/* memory allocation; everything comes from below 4GiB, see kernel.c */
+#define GFP_ATOMIC		0x20u
+#define GFP_KERNEL		0xd0u
+#define GFP_USER		0xd0u
+#define __GFP_HIGHMEM		0x02u
+#define __GFP_NOWARN		0x200u
+#define __GFP_NOMEMALLOC	0x10000u
+#define __GFP_NORETRY		0x1000u
+#define __GFP_ZERO		0x8000u
+#define GFP_HIGHUSER		(GFP_USER | __GFP_HIGHMEM)
+#define SLAB_HWCACHE_ALIGN	0x2000u
+
+void *kmalloc(size_t size, gfp_t flags);
+void kfree(const void *p);
+#define kzalloc(s, f)		kmalloc((s), (f) | __GFP_ZERO)
+#define kcalloc(n, s, f)	kzalloc((n) * (s), (f))
+#define vmalloc(s)		kmalloc((s), GFP_KERNEL)
+#define vzalloc(s)		kzalloc((s), GFP_KERNEL)
+#define vfree(p)		kfree(p)
+char *kstrdup(const char *s, gfp_t gfp);
+#define strict_strtoul(s, base, res)	fake_strtoul(s, base, res)
+int fake_strtoul(const char *s, unsigned int base, unsigned long *res);
+
+struct kmem_cache {
+	const char *name;
+	size_t size;
+};
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, unsigned long flags,
+				     void (*ctor)(void *));
+void kmem_cache_destroy(struct kmem_cache *c);
+#define KMEM_CACHE(s, f)	kmem_cache_create(#s, sizeof(struct s), 0, (f), NULL)
+#define kmem_cache_alloc(c, f)	kmalloc((c)->size, (f))
+#define kmem_cache_zalloc(c, f)	kzalloc((c)->size, (f))
+#define kmem_cache_free(c, p)	kfree(p)
+
+/* pages; fake physical memory starts at PHYS_OFFSET */
+#define PAGE_SHIFT		12
+#define PAGE_SIZE		(1UL << PAGE_SHIFT)
+#define PAGE_MASK		(~(PAGE_SIZE - 1))
+#define PAGE_ALIGN(x)		ALIGN(x, PAGE_SIZE)
+#define PHYS_OFFSET		0x80000000UL
+#define PHYS_PFN_OFFSET		(PHYS_OFFSET >> PAGE_SHIFT)
+
+struct address_space;
+
+struct page {
+	unsigned long flags;
+	atomic_t _count;
+	struct list_head lru;
+	unsigned long private;
+	atomic_t _iomap;	/* mappings held by the fake IOVMM */
+};
+
+extern struct page *mem_map;
+extern char *fake_linear_map;
+
+#define __phys_to_pfn(p)	((unsigned long)(p) >> PAGE_SHIFT)
+#define __pfn_to_phys(p)	((phys_addr_t)(p) << PAGE_SHIFT)
+#define pfn_to_page(pfn)	(mem_map + ((pfn) - PHYS_PFN_OFFSET))
+#define page_to_pfn(pg)		((unsigned long)((pg) - mem_map) + PHYS_PFN_OFFSET)
+#define page_to_phys(pg)	__pfn_to_phys(page_to_pfn(pg))
+#define phys_to_page(p)		pfn_to_page(__phys_to_pfn(p))
+#define __va(p)			((void *)(fake_linear_map + ((unsigned long)(p) - PHYS_OFFSET)))
+#define __pa(v)			((phys_addr_t)((char *)(v) - fake_linear_map + PHYS_OFFSET))
+#define virt_to_phys(v)		__pa(v)
+#define phys_to_virt(p)		__va(p)
+#define virt_to_page(v)		phys_to_page(__pa(v))
+#define page_address(pg)	__va(page_to_phys(pg))
+#define page_mapping(pg)	((struct address_space *)NULL)
+
+static inline int PageHighMem(struct page *page)
+{
+	return 0;
+}
+
+#define pfn_valid(pfn)		fake_pfn_valid(pfn)
+#define nth_page(pg, n)		((pg) + (n))
+#define page_count(pg)		atomic_read(&(pg)->_count)
+#define get_page(pg)		atomic_inc(&(pg)->_count)
+#define set_page_private(pg, v)	((pg)->private = (v))
+#define page_private(pg)	((pg)->private)
+#define kmap(pg)		page_address(pg)
+#define kunmap(pg)		do { } while (0)
+#define kmap_atomic(pg, t)	page_address(pg)
+#define kunmap_atomic(a, t)	do { } while (0)
+
+static inline int get_order(unsigned long size)
+{
+	int order = 0;
+
+	size = (size - 1) >> PAGE_SHIFT;
+	while (size) {
+		order++;
+		size >>= 1;
+	}
+	return order;
+}
+
+struct page *alloc_pages(gfp_t gfp, unsigned int order);
+#define alloc_page(gfp)		alloc_pages(gfp, 0)
+void __free_pages(struct page *page, unsigned int order);
+#define __free_page(pg)		__free_pages(pg, 0)
+void put_page(struct page *page);
+void split_page(struct page *page, unsigned int order);
+int fake_pfn_valid(unsigned long pfn);
+
+static inline int set_pages_array_uc(struct page **pages, int addrinarray)
+{
+	return 0;
+}
+
+static inline int set_pages_array_wc(struct page **pages, int addrinarray)
+{
+	return 0;
+}
+
+static inline int set_pages_array_wb(struct page **pages, int addrinarray)
+{
+	return 0;
+}
+
+static inline int set_pages_array_iwb(struct page **pages, int addrinarray)
+{
+	return 0;
+}
+extern unsigned long totalram_pages;
+
+enum zone_stat_item {
+	NR_FREE_PAGES,
+	NR_FILE_PAGES,
+};
+
+unsigned long global_page_state(enum zone_stat_item item);
+#define total_swapcache_pages	0UL
+
+/* kernel page tables, backed by mmap()s of the fake physical memory */
+struct vm_struct {
+	void *addr;
+	unsigned long size;
+};
+
+extern struct mm_struct init_mm;
+
+#define L_PTE_PRESENT		1UL
+#define pgprot_kernel		((pgprot_t)0x1)
+#define PAGE_KERNEL		pgprot_kernel
+#define pgprot_noncached(p)	((p) | 0x10)
+#define pgprot_writecombine(p)	((p) | 0x20)
+#define pgprot_dmacoherent(p)	((p) | 0x20)
+#define pgprot_inner_writeback(p) ((p) | 0x40)
+#define __pgprot(x)		((pgprot_t)(x))
+#define pgprot_val(x)		(x)
+
+static inline pte_t pfn_pte(unsigned long pfn, pgprot_t prot)
+{
+	return ((pte_t)pfn << PAGE_SHIFT) | L_PTE_PRESENT;
+}
+
+#define pte_pfn(pte)		((pte) >> PAGE_SHIFT)
+#define pgd_offset_k(addr)	((pgd_t *)&init_mm)
+#define pud_alloc(mm, pgd, a)	((pud_t *)(pgd))
+#define pmd_alloc(mm, pud, a)	((pmd_t *)(pud))
+pte_t *pte_alloc_kernel(pmd_t *pmd, unsigned long addr);
+void set_pte_at(struct mm_struct *mm, unsigned long addr, pte_t *ptep,
+		pte_t pte);
+#define flush_tlb_kernel_page(a)	do { } while (0)
+#define flush_tlb_kernel_range(s, e)	do { } while (0)
+struct vm_struct *alloc_vm_area(size_t size);
+struct vm_struct *remove_vm_area(const void *addr);
+void free_vm_area(struct vm_struct *area);
+void *vm_map_ram(struct page **pages, unsigned int count, int node,
+		 pgprot_t prot);
+void vm_unmap_ram(const void *mem, unsigned int count);
+
+static inline void __raw_writel(u32 val, volatile void __iomem *addr)
+{
+	*(volatile u32 *)addr = val;
+}
+
+/* caches: nothing to maintain on the host */
+#define on_each_cpu(fn, info, wait)	({ (fn)(info); 0; })
+#define __cpuc_flush_dcache_area(a, s)	do { (void)(a); } while (0)
+#define dmac_map_area(a, s, d)		do { } while (0)
+#define dmac_unmap_area(a, s, d)	do { } while (0)
+#define dmac_flush_range(s, e)		do { } while (0)
+#define dmac_clean_range(s, e)		do { } while (0)
+#define dmac_inv_range(s, e)		do { } while (0)
+#define outer_flush_range(s, e)		do { (void)(s); (void)(e); } while (0)
+#define outer_clean_range(s, e)		do { (void)(s); (void)(e); } while (0)
+#define outer_inv_range(s, e)		do { (void)(s); (void)(e); } while (0)
+#define outer_flush_all()		do { } while (0)
+#define outer_clean_all()		do { } while (0)
+#define outer_sync()			do { } while (0)
+#define flush_cache_all()		do { } while (0)
+#define DMA_TO_DEVICE			1
+#define DMA_FROM_DEVICE			2
+#define DMA_BIDIRECTIONAL		0
+
+/* user memory: the harness passes ordinary pointers */
+#define VERIFY_READ			0
+#define VERIFY_WRITE			1
+#define access_ok(type, p, n)		1
+#define get_user(x, p)			({ (x) = *(p); 0; })
+#define put_user(x, p)			({ *(p) = (x); 0; })
+#define __get_user(x, p)		get_user(x, p)
+#define __put_user(x, p)		put_user(x, p)
+
+static inline unsigned long copy_from_user(void *to, const void __user *from,
+					   unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+static inline unsigned long copy_to_user(void __user *to, const void *from,
+					 unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+/* mappings of handles into user space are not emulated */
+#define VM_READ			0x00000001
+#define VM_WRITE		0x00000002
+#define VM_SHARED		0x00000008
+#define VM_IO			0x00004000
+#define VM_DONTEXPAND		0x00040000
+#define VM_RESERVED		0x00080000
+#define VM_MIXEDMAP		0x10000000
+#define VM_FAULT_SIGBUS		0x0002
+#define VM_FAULT_NOPAGE		0x0100
+
+struct vm_area_struct;
+struct vm_fault;
+
+struct vm_operations_struct {
+	void (*open)(struct vm_area_struct *vma);
+	void (*close)(struct vm_area_struct *vma);
+	int (*fault)(struct vm_area_struct *vma, struct vm_fault *vmf);
+};
+
+struct vm_area_struct {
+	unsigned long vm_start;
+	unsigned long vm_end;
+	unsigned long vm_pgoff;
+	unsigned long vm_flags;
+	pgprot_t vm_page_prot;
+	struct file *vm_file;
+	const struct vm_operations_struct *vm_ops;
+	void *vm_private_data;
+	struct mm_struct *vm_mm;
+	struct vm_area_struct *vm_next;
+};
+
+struct vm_fault {
+	void *virtual_address;
+	struct page *page;
+};
+
+struct vm_area_struct *find_vma(struct mm_struct *mm, unsigned long addr);
+#define zap_page_range(vma, addr, size, d) do { } while (0)
+
+static inline int vm_insert_pfn(struct vm_area_struct *vma, unsigned long addr,
+				unsigned long pfn)
+{
+	return -EINVAL;
+}
+
+/* files */
+struct inode;
+struct module;
+struct poll_table_struct;
+
+struct backing_dev_info {
+	unsigned long ra_pages;
+	unsigned int capabilities;
+};
+
+#define BDI_CAP_NO_ACCT_AND_WRITEBACK	0x7
+#define BDI_CAP_READ_MAP		0x20
+#define BDI_CAP_WRITE_MAP		0x40
+
+struct address_space {
+	struct backing_dev_info *backing_dev_info;
+};
+
+struct file {
+	const struct file_operations *f_op;
+	void *private_data;
+	struct address_space *f_mapping;
+	struct address_space f_data;
+	unsigned int f_flags;
+	loff_t f_pos;
+};
+
+struct file_operations {
+	struct module *owner;
+	int (*open)(struct inode *, struct file *);
+	int (*release)(struct inode *, struct file *);
+	long (*unlocked_ioctl)(struct file *, unsigned int, unsigned long);
+	int (*mmap)(struct file *, struct vm_area_struct *);
+	ssize_t (*read)(struct file *, char __user *, size_t, loff_t *);
+	ssize_t (*write)(struct file *, const char __user *, size_t,
+			 loff_t *);
+	loff_t (*llseek)(struct file *, loff_t, int);
+};
+
+struct inode {
+	void *i_private;
+};
+
+#define nonseekable_open(i, f)	0
+#define fget(fd)		((struct file *)NULL)
+#define fput(f)			do { } while (0)
+
+struct seq_file {
+	char *buf;
+	size_t size;
+	size_t count;
+	void *private;
+	int (*show)(struct seq_file *, void *);
+};
+
+int seq_printf(struct seq_file *s, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+int seq_puts(struct seq_file *s, const char *str);
+#define seq_putc(s, c)		seq_printf(s, "%c", c)
+int single_open(struct file *file, int (*show)(struct seq_file *, void *),
+		void *data);
+int single_release(struct inode *inode, struct file *file);
+ssize_t seq_read(struct file *file, char __user *buf, size_t size,
+		 loff_t *ppos);
+loff_t seq_lseek(struct file *file, loff_t offset, int origin);
+
+struct dentry;
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent);
+struct dentry *debugfs_create_file(const char *name, mode_t mode,
+				   struct dentry *parent, void *data,
+				   const struct file_operations *fops);
+
+/* devices */
+struct kobject {
+	const char *name;
+};
+
+struct attribute {
+	const char *name;
+	mode_t mode;
+};
+
+struct device;
+
+struct device_attribute {
+	struct attribute attr;
+	ssize_t (*show)(struct device *dev, struct device_attribute *attr,
+			char *buf);
+	ssize_t (*store)(struct device *dev, struct device_attribute *attr,
+			 const char *buf, size_t count);
+};
+
+#define __ATTR(_name, _mode, _show, _store) {				\
+	.attr = { .name = #_name, .mode = _mode },			\
+	.show = _show,							\
+	.store = _store,						\
+}
+#define DEVICE_ATTR(_name, _mode, _show, _store)			\
+	struct device_attribute dev_attr_##_name =			\
+		__ATTR(_name, _mode, _show, _store)
+
+struct attribute_group {
+	const char *name;
+	struct attribute **attrs;
+};
+
+struct device_driver {
+	const char *name;
+	struct module *owner;
+};
+
+struct device {
+	struct device *parent;
+	struct kobject kobj;
+	struct device_driver *driver;
+	void (*release)(struct device *dev);
+	void *driver_data;
+	void *platform_data;
+	char name[64];
+};
+
+int dev_set_name(struct device *dev, const char *fmt, ...);
+#define dev_name(d)		((const char *)(d)->name)
+#define dev_get_drvdata(d)	((d)->driver_data)
+#define dev_set_drvdata(d, p)	((d)->driver_data = (p))
+int device_register(struct device *dev);
+void device_unregister(struct device *dev);
+int sysfs_create_group(struct kobject *kobj, const struct attribute_group *grp);
+void sysfs_remove_group(struct kobject *kobj,
+			const struct attribute_group *grp);
+
+typedef struct {
+	int event;
+} pm_message_t;
+
+struct platform_device {
+	const char *name;
+	int id;
+	struct device dev;
+};
+
+struct platform_driver {
+	int (*probe)(struct platform_device *);
+	int (*remove)(struct platform_device *);
+	int (*suspend)(struct platform_device *, pm_message_t state);
+	int (*resume)(struct platform_device *);
+	struct device_driver driver;
+};
+
+#define platform_get_drvdata(p)	dev_get_drvdata(&(p)->dev)
+#define platform_set_drvdata(p, d) dev_set_drvdata(&(p)->dev, d)
+int platform_driver_register(struct platform_driver *drv);
+void platform_driver_unregister(struct platform_driver *drv);
+
+#define MISC_DYNAMIC_MINOR	255
+
+struct miscdevice {
+	int minor;
+	const char *name;
+	const struct file_operations *fops;
+	struct list_head list;
+	struct device *parent;
+	struct device *this_device;
+	const char *nodename;
+	mode_t mode;
+};
+
+int misc_register(struct miscdevice *misc);
+int misc_deregister(struct miscdevice *misc);
+
+/* memory pressure */
+#define OOM_ADJUST_MIN		(-16)
+#define OOM_ADJUST_MAX		15
+
+#define DEFAULT_SEEKS		2
+
+struct shrinker {
+	int (*shrink)(struct shrinker *, int nr_to_scan, gfp_t gfp_mask);
+	int seeks;
+	struct list_head list;
+};
+
+void register_shrinker(struct shrinker *s);
+void unregister_shrinker(struct shrinker *s);
+
+/* harness interface, see kernel.c */
+int fake_kernel_init(size_t sysmem, size_t carveout, phys_addr_t *co_base);
+int fake_platform_device_register(struct platform_device *pdev);
+void fake_platform_device_unregister(struct platform_device *pdev);
+struct file *fake_misc_open(const char *name);
+void fake_misc_close(struct file *file);
+struct vm_area_struct *fake_mmap(struct file *file, size_t len);
+void fake_munmap(struct vm_area_struct *vma);
+ssize_t fake_sysfs_read(const char *dev, const char *attr, char *buf);
+ssize_t fake_debugfs_read(const char *path, char *buf, size_t size);
+int fake_shrink_all(void);
+void fake_flush_work(void);
+unsigned long fake_kmalloc_live(void);
+unsigned long fake_pages_live(void);
+void fake_set_cpu(unsigned int cpu);
+
+/* harness interface, see iovmm.c */
+int fake_iovmm_init(size_t size);
+int fake_iovmm_check(unsigned long addr, size_t len);
+void fake_iovmm_stats(unsigned long *clients, unsigned long *areas,
+		      unsigned long *mapped);
+
+#endif
@@ -0,0 +1,262 @@
+/*
+ * iovmm.c -- a fake tegra_iovmm for running nvmap on the build host
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * One domain covers the whole I/O virtual space, like the GART on Tegra 2.
+ * Areas are handed out first fit from a page bitmap and remember the pfn
+ * behind each of their pages, so the harness can check that an address
+ * nvmap returned from a pin is backed by live memory.  Every mapped page
+ * is counted in its struct page; the fake page allocator warns when a
+ * page is freed with that count still raised.
+ */
+
+#include <mach/iovmm.h>
+
+#define IOVMM_BASE		0x40000000UL
+
+struct fake_area {
+	struct tegra_iovmm_area vm;
+	unsigned long *pfn;
+	struct list_head list;
+};
+
+static struct tegra_iovmm_device iovmm_dev = {
+	.name		= "fake-iovmm",
+	.pgsize_bits	= PAGE_SHIFT,
+};
+
+static struct tegra_iovmm_domain iovmm_domain = {
+	.dev		= &iovmm_dev,
+};
+
+static pthread_mutex_t iovmm_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long *iovmm_bits;
+static unsigned long iovmm_pages;
+static LIST_HEAD(iovmm_areas);
+static unsigned long nr_clients;
+static unsigned long nr_areas;
+static unsigned long nr_mapped;
+
+int fake_iovmm_init(size_t size)
+{
+	iovmm_pages = size >> PAGE_SHIFT;
+	iovmm_bits = calloc(BITS_TO_LONGS(iovmm_pages), sizeof(long));
+	return iovmm_bits ? 0 : -ENOMEM;
+}
+
+void fake_iovmm_stats(unsigned long *clients, unsigned long *areas,
+		      unsigned long *mapped)
+{
+	pthread_mutex_lock(&iovmm_lock);
+	*clients = nr_clients;
+	*areas = nr_areas;
+	*mapped = nr_mapped;
+	pthread_mutex_unlock(&iovmm_lock);
+}
+
+static struct fake_area *find_area_locked(unsigned long addr)
+{
+	struct fake_area *a;
+
+	list_for_each_entry(a, &iovmm_areas, list)
+		if (addr >= a->vm.iovm_start &&
+		    addr < a->vm.iovm_start + a->vm.iovm_length)
+			return a;
+	return NULL;
+}
+
+/* returns 0 if [addr, addr + len) is I/O virtual space backed by live
+ * pages, or doesn't belong to the IOVMM at all (physical addresses) */
+int fake_iovmm_check(unsigned long addr, size_t len)
+{
+	unsigned long end = addr + len;
+	struct fake_area *a;
+	unsigned long pfn;
+	int err = 0;
+
+	if (addr < IOVMM_BASE || addr >= IOVMM_BASE +
+	    (iovmm_pages << PAGE_SHIFT))
+		return 0;
+
+	pthread_mutex_lock(&iovmm_lock);
+	a = find_area_locked(addr);
+	if (!a || end > a->vm.iovm_start + a->vm.iovm_length) {
+		err = -EFAULT;
+		goto out;
+	}
+	for (addr &= PAGE_MASK; addr < end; addr += PAGE_SIZE) {
+		pfn = a->pfn[(addr - a->vm.iovm_start) >> PAGE_SHIFT];
+		if (!pfn || !page_count(pfn_to_page(pfn))) {
+			err = -EFAULT;
+			break;
+		}
+	}
+out:
+	pthread_mutex_unlock(&iovmm_lock);
+	return err;
+}
+
+struct tegra_iovmm_client *tegra_iovmm_alloc_client(const char *name,
+	const char *share_group, struct miscdevice *misc_dev)
+{
+	struct tegra_iovmm_client *c = calloc(1, sizeof(*c));
+
+	if (!c)
+		return NULL;
+	c->name = name;
+	c->domain = &iovmm_domain;
+	c->misc_dev = misc_dev;
+	pthread_mutex_lock(&iovmm_lock);
+	nr_clients++;
+	pthread_mutex_unlock(&iovmm_lock);
+	return c;
+}
+
+void tegra_iovmm_free_client(struct tegra_iovmm_client *client)
+{
+	if (!client)
+		return;
+	pthread_mutex_lock(&iovmm_lock);
+	nr_clients--;
+	pthread_mutex_unlock(&iovmm_lock);
+	free(client);
+}
+
+size_t tegra_iovmm_get_vm_size(struct tegra_iovmm_client *client)
+{
+	return client ? iovmm_pages << PAGE_SHIFT : 0;
+}
+
+size_t tegra_iovmm_get_max_free(struct tegra_iovmm_client *client)
+{
+	unsigned long start, end, best = 0;
+
+	pthread_mutex_lock(&iovmm_lock);
+	for (start = find_next_zero_bit(iovmm_bits, iovmm_pages, 0);
+	     start < iovmm_pages;
+	     start = find_next_zero_bit(iovmm_bits, iovmm_pages, end)) {
+		end = find_next_bit(iovmm_bits, iovmm_pages, start);
+		best = max(best, end - start);
+	}
+	pthread_mutex_unlock(&iovmm_lock);
+	return best << PAGE_SHIFT;
+}
+
+struct tegra_iovmm_area *tegra_iovmm_create_vm(
+	struct tegra_iovmm_client *client, struct tegra_iovmm_area_ops *ops,
+	size_t size, size_t align, pgprot_t pgprot, unsigned long iovm_start)
+{
+	unsigned long nr = PAGE_ALIGN(size) >> PAGE_SHIFT;
+	unsigned long mask = (max_t(size_t, align, PAGE_SIZE) >> PAGE_SHIFT) - 1;
+	unsigned long bit;
+	struct fake_area *a;
+
+	if (!client || !nr)
+		return NULL;
+
+	a = calloc(1, sizeof(*a));
+	if (a)
+		a->pfn = calloc(nr, sizeof(*a->pfn));
+	if (!a || !a->pfn)
+		goto fail;
+
+	pthread_mutex_lock(&iovmm_lock);
+	if (iovm_start) {
+		bit = (iovm_start - IOVMM_BASE) >> PAGE_SHIFT;
+		if (iovm_start < IOVMM_BASE || bit + nr > iovmm_pages ||
+		    find_next_bit(iovmm_bits, bit + nr, bit) < bit + nr)
+			bit = iovmm_pages;
+	} else {
+		bit = bitmap_find_next_zero_area(iovmm_bits, iovmm_pages, 0,
+						 nr, mask);
+	}
+	if (bit + nr > iovmm_pages) {
+		pthread_mutex_unlock(&iovmm_lock);
+		goto fail;
+	}
+	bitmap_set(iovmm_bits, bit, nr);
+	list_add(&a->list, &iovmm_areas);
+	nr_areas++;
+	pthread_mutex_unlock(&iovmm_lock);
+
+	a->vm.domain = &iovmm_domain;
+	a->vm.iovm_start = IOVMM_BASE + (bit << PAGE_SHIFT);
+	a->vm.iovm_length = nr << PAGE_SHIFT;
+	a->vm.pgprot = pgprot;
+	a->vm.ops = ops;
+	return &a->vm;
+
+fail:
+	if (a)
+		free(a->pfn);
+	free(a);
+	return NULL;
+}
+
+void tegra_iovmm_vm_insert_pfn(struct tegra_iovmm_area *vm,
+	tegra_iovmm_addr_t vaddr, unsigned long pfn)
+{
+	struct fake_area *a = container_of(vm, struct fake_area, vm);
+	unsigned long idx = (vaddr - vm->iovm_start) >> PAGE_SHIFT;
+	struct page *page = pfn_to_page(pfn);
+
+	BUG_ON(vaddr & ~PAGE_MASK);
+	BUG_ON(vaddr >= vm->iovm_start + vm->iovm_length);
+	BUG_ON(vaddr < vm->iovm_start);
+	BUG_ON(vm->ops);
+	WARN(!page_count(page), "IOVMM mapping of free pfn %lx\n", pfn);
+
+	pthread_mutex_lock(&iovmm_lock);
+	if (a->pfn[idx])
+		atomic_dec(&pfn_to_page(a->pfn[idx])->_iomap);
+	else
+		nr_mapped++;
+	a->pfn[idx] = pfn;
+	atomic_inc(&page->_iomap);
+	pthread_mutex_unlock(&iovmm_lock);
+}
+
+static void zap_locked(struct fake_area *a)
+{
+	unsigned long i;
+
+	for (i = 0; i < a->vm.iovm_length >> PAGE_SHIFT; i++) {
+		if (!a->pfn[i])
+			continue;
+		atomic_dec(&pfn_to_page(a->pfn[i])->_iomap);
+		a->pfn[i] = 0;
+		nr_mapped--;
+	}
+}
+
+void tegra_iovmm_zap_vm(struct tegra_iovmm_area *vm)
+{
+	struct fake_area *a = container_of(vm, struct fake_area, vm);
+
+	pthread_mutex_lock(&iovmm_lock);
+	zap_locked(a);
+	pthread_mutex_unlock(&iovmm_lock);
+}
+
+void tegra_iovmm_free_vm(struct tegra_iovmm_area *vm)
+{
+	struct fake_area *a;
+
+	if (!vm)
+		return;
+	a = container_of(vm, struct fake_area, vm);
+
+	pthread_mutex_lock(&iovmm_lock);
+	zap_locked(a);
+	bitmap_clear(iovmm_bits, (vm->iovm_start - IOVMM_BASE) >> PAGE_SHIFT,
+		     vm->iovm_length >> PAGE_SHIFT);
+	list_del(&a->list);
+	nr_areas--;
+	pthread_mutex_unlock(&iovmm_lock);
+
+	free(a->pfn);
+	free(a);
+}
@@ -0,0 +1,1515 @@
+/*
+ * kernel.c -- runtime behind fake_kernel.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Three pieces of address space are set up by fake_kernel_init():
+ *
+ *  - a kmalloc arena below 4GiB, carved into power-of-two size classes.
+ *    Freed blocks are poisoned and double or stray kfree()s are fatal;
+ *  - "physical memory", a memfd holding system memory followed by the
+ *    carveout, mapped linearly for __va() and described by mem_map.
+ *    System pages come from a bitmap allocator which BUGs on refcount
+ *    underflow and warns when a page is freed while the fake IOVMM still
+ *    maps it;
+ *  - a vmalloc range whose kernel PTEs are real: set_pte_at() maps the
+ *    physical page at that address, so reads and writes nvmap does through
+ *    its PTE windows land in the same memory as __va() and the IOVMM.
+ *
+ * Everything the fake kernel needs for its own bookkeeping comes from the
+ * C library, so the kmalloc and page counters only ever see the driver.
+ */
+
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+struct mm_struct init_mm;
+struct page *mem_map;
+char *fake_linear_map;
+unsigned long totalram_pages;
+int fake_loglevel = 4;
+unsigned long fake_errors;
+unsigned long fake_warnings;
+
+static int phys_fd = -1;
+static unsigned long nr_sys_pages;
+static unsigned long nr_phys_pages;
+
+/* log */
+
+int printk(const char *fmt, ...)
+{
+	char buf[512];
+	const char *msg = buf;
+	int level = 4;
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (buf[0] == '<' && buf[1] >= '0' && buf[1] <= '7' && buf[2] == '>') {
+		level = buf[1] - '0';
+		msg += 3;
+	}
+	if (level <= 3)
+		__atomic_add_fetch(&fake_errors, 1, __ATOMIC_RELAXED);
+	if (level <= fake_loglevel)
+		fprintf(stderr, "kernel: %s", msg);
+	return n;
+}
+
+void fake_bug(const char *file, int line)
+{
+	fprintf(stderr, "kernel BUG at %s:%d!\n", file, line);
+	abort();
+}
+
+void fake_warn(const char *file, int line, const char *cond)
+{
+	__atomic_add_fetch(&fake_warnings, 1, __ATOMIC_SEQ_CST);
+	fprintf(stderr, "WARNING: at %s:%d: %s\n", file, line, cond);
+}
+
+/* bitmaps */
+
+unsigned long find_next_bit(const unsigned long *addr, unsigned long size,
+			    unsigned long offset)
+{
+	unsigned long word;
+
+	while (offset < size) {
+		word = addr[BIT_WORD(offset)] >> (offset % BITS_PER_LONG);
+		if (word)
+			return min(offset + __ffs(word), size);
+		offset = ALIGN(offset + 1, BITS_PER_LONG);
+	}
+	return size;
+}
+
+unsigned long find_next_zero_bit(const unsigned long *addr, unsigned long size,
+				 unsigned long offset)
+{
+	unsigned long word;
+
+	while (offset < size) {
+		word = ~addr[BIT_WORD(offset)] >> (offset % BITS_PER_LONG);
+		if (word)
+			return min(offset + __ffs(word), size);
+		offset = ALIGN(offset + 1, BITS_PER_LONG);
+	}
+	return size;
+}
+
+void bitmap_set(unsigned long *map, int start, int nr)
+{
+	while (nr--)
+		__set_bit(start++, map);
+}
+
+void bitmap_clear(unsigned long *map, int start, int nr)
+{
+	while (nr--)
+		__clear_bit(start++, map);
+}
+
+unsigned long bitmap_find_next_zero_area(unsigned long *map,
+					 unsigned long size,
+					 unsigned long start,
+					 unsigned int nr,
+					 unsigned long align_mask)
+{
+	unsigned long index, end, i;
+
+again:
+	index = find_next_zero_bit(map, size, start);
+	index = (index + align_mask) & ~align_mask;
+	end = index + nr;
+	if (end > size)
+		return end;
+	i = find_next_bit(map, end, index);
+	if (i < end) {
+		start = i + 1;
+		goto again;
+	}
+	return index;
+}
+
+/* time */
+
+static u64 mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+unsigned long fake_jiffies(void)
+{
+	return mono_ns() / (1000000000ULL / HZ);
+}
+
+ktime_t ktime_get(void)
+{
+	return mono_ns();
+}
+
+static void sleep_ns(u64 ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000ULL,
+		.tv_nsec = ns % 1000000000ULL,
+	};
+
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+void msleep(unsigned int msecs)
+{
+	sleep_ns(msecs * 1000000ULL);
+}
+
+void udelay(unsigned long usecs)
+{
+	sleep_ns(usecs * 1000ULL);
+}
+
+void schedule(void)
+{
+	sched_yield();
+}
+
+void sort(void *base, size_t num, size_t size,
+	  int (*cmp)(const void *, const void *),
+	  void (*swap_fn)(void *, void *, int))
+{
+	qsort(base, num, size, cmp);
+}
+
+int fake_strtoul(const char *s, unsigned int base, unsigned long *res)
+{
+	char *end;
+
+	errno = 0;
+	*res = strtoul(s, &end, base);
+	if (errno || end == s || (*end && *end != '\n'))
+		return -EINVAL;
+	return 0;
+}
+
+/* tasks */
+
+static struct signal_struct init_signal;
+static __thread struct task_struct *cur_task;
+static __thread int cur_cpu = -1;
+static unsigned int nr_cpus = 1;
+static unsigned int next_cpu;
+
+static struct task_struct *task_alloc(const char *comm, unsigned int flags)
+{
+	struct task_struct *t = calloc(1, sizeof(*t));
+
+	if (!t)
+		return NULL;
+	t->flags = flags;
+	snprintf(t->comm, sizeof(t->comm), "%s", comm);
+	t->group_leader = t;
+	t->mm = (flags & PF_KTHREAD) ? NULL : &init_mm;
+	t->active_mm = &init_mm;
+	t->signal = &init_signal;
+	atomic_set(&t->usage, 1);
+	return t;
+}
+
+struct task_struct *fake_current(void)
+{
+	if (!cur_task) {
+		cur_task = task_alloc("nvmap-stress", 0);
+		if (!cur_task)
+			BUG();
+		cur_task->pid = syscall(SYS_gettid);
+	}
+	return cur_task;
+}
+
+unsigned int fake_cpu(void)
+{
+	if (cur_cpu < 0)
+		cur_cpu = __atomic_fetch_add(&next_cpu, 1, __ATOMIC_RELAXED) %
+			nr_cpus;
+	return cur_cpu;
+}
+
+unsigned int fake_nr_cpus(void)
+{
+	return nr_cpus;
+}
+
+void fake_set_cpu(unsigned int cpu)
+{
+	cur_cpu = cpu % nr_cpus;
+}
+
+static void *kthread_main(void *arg)
+{
+	struct task_struct *t = arg;
+
+	cur_task = t;
+	t->pid = syscall(SYS_gettid);
+	return (void *)(long)t->threadfn(t->data);
+}
+
+struct task_struct *kthread_create(int (*fn)(void *data), void *data,
+				   const char *namefmt, ...)
+{
+	struct task_struct *t;
+	char comm[TASK_COMM_LEN];
+	va_list ap;
+
+	va_start(ap, namefmt);
+	vsnprintf(comm, sizeof(comm), namefmt, ap);
+	va_end(ap);
+
+	t = task_alloc(comm, PF_KTHREAD);
+	if (!t)
+		return ERR_PTR(-ENOMEM);
+	t->threadfn = fn;
+	t->data = data;
+	t->state = TASK_UNINTERRUPTIBLE;
+	return t;
+}
+
+int wake_up_process(struct task_struct *t)
+{
+	if (!t->threadfn || t->state == TASK_RUNNING)
+		return 0;
+	t->state = TASK_RUNNING;
+	if (pthread_create(&t->thread, NULL, kthread_main, t))
+		BUG();
+	return 1;
+}
+
+int kthread_should_stop(void)
+{
+	return ACCESS_ONCE(current->should_stop);
+}
+
+int kthread_stop(struct task_struct *t)
+{
+	void *ret = NULL;
+
+	t->should_stop = 1;
+	smp_mb();
+	if (t->state == TASK_RUNNING)
+		pthread_join(t->thread, &ret);
+	free(t);
+	return (int)(long)ret;
+}
+
+/* wait queues */
+
+void init_waitqueue_head(wait_queue_head_t *q)
+{
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	q->waiters = 0;
+	q->gen = 0;
+}
+
+unsigned int fake_wait_begin(wait_queue_head_t *q)
+{
+	unsigned int gen;
+
+	pthread_mutex_lock(&q->lock);
+	q->waiters++;
+	gen = q->gen;
+	pthread_mutex_unlock(&q->lock);
+	return gen;
+}
+
+void fake_wait_sleep(wait_queue_head_t *q, unsigned int *gen)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->gen == *gen) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 10000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&q->cond, &q->lock, &ts);
+	}
+	*gen = q->gen;
+	pthread_mutex_unlock(&q->lock);
+}
+
+void fake_wait_end(wait_queue_head_t *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->waiters--;
+	pthread_mutex_unlock(&q->lock);
+}
+
+void wake_up(wait_queue_head_t *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->gen++;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* workqueues: one worker runs every queue, in deadline order */
+
+struct workqueue_struct {
+	const char *name;
+};
+
+static struct workqueue_struct events_wq = { "events" };
+static struct workqueue_struct events_long_wq = { "events_long" };
+struct workqueue_struct *system_wq = &events_wq;
+struct workqueue_struct *system_long_wq = &events_long_wq;
+
+static pthread_mutex_t wq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wq_cond = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(wq_pending);
+static struct work_struct *wq_running;
+static struct task_struct *wq_worker;
+
+static int worker_thread(void *unused)
+{
+	struct work_struct *work, *next;
+	struct timespec ts;
+
+	pthread_mutex_lock(&wq_lock);
+	while (!kthread_should_stop()) {
+		next = NULL;
+		list_for_each_entry(work, &wq_pending, entry)
+			if (!next || time_before(work->when, next->when))
+				next = work;
+
+		if (next && !time_after(next->when, jiffies)) {
+			list_del_init(&next->entry);
+			next->pending = 0;
+			wq_running = next;
+			pthread_mutex_unlock(&wq_lock);
+			next->func(next);
+			pthread_mutex_lock(&wq_lock);
+			wq_running = NULL;
+			pthread_cond_broadcast(&wq_cond);
+			continue;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 1000000000 / HZ;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&wq_cond, &wq_lock, &ts);
+	}
+	pthread_mutex_unlock(&wq_lock);
+	return 0;
+}
+
+int queue_delayed_work(struct workqueue_struct *wq, struct delayed_work *dw,
+		       unsigned long delay)
+{
+	struct work_struct *work = &dw->work;
+	int queued = 0;
+
+	pthread_mutex_lock(&wq_lock);
+	if (!work->pending) {
+		work->pending = 1;
+		work->when = jiffies + delay;
+		list_add_tail(&work->entry, &wq_pending);
+		pthread_cond_broadcast(&wq_cond);
+		queued = 1;
+	}
+	pthread_mutex_unlock(&wq_lock);
+	return queued;
+}
+
+bool cancel_delayed_work_sync(struct delayed_work *dw)
+{
+	struct work_struct *work = &dw->work;
+	bool pending;
+
+	pthread_mutex_lock(&wq_lock);
+	pending = work->pending;
+	if (pending) {
+		list_del_init(&work->entry);
+		work->pending = 0;
+	}
+	while (wq_running == work)
+		pthread_cond_wait(&wq_cond, &wq_lock);
+	pthread_mutex_unlock(&wq_lock);
+	return pending;
+}
+
+/* waits until no work is queued or running, delayed work included */
+void fake_flush_work(void)
+{
+	pthread_mutex_lock(&wq_lock);
+	while (!list_empty(&wq_pending) || wq_running) {
+		pthread_mutex_unlock(&wq_lock);
+		msleep(1000 / HZ);
+		pthread_mutex_lock(&wq_lock);
+	}
+	pthread_mutex_unlock(&wq_lock);
+}
+
+void flush_scheduled_work(void)
+{
+	fake_flush_work();
+}
+
+/* kmalloc */
+
+#define ARENA_SIZE		(512UL << 20)
+#define KMALLOC_MIN_SHIFT	5
+#define KMALLOC_MAX_SHIFT	28
+#define KMALLOC_LIVE		0x6b6c6976u
+#define KMALLOC_FREE		0x6b667265u
+#define POISON_FREE		0x6b
+
+struct kmalloc_hdr {
+	u32 magic;
+	u32 shift;
+	u64 size;
+};
+
+struct kmalloc_free {
+	struct kmalloc_hdr hdr;
+	struct kmalloc_free *next;
+};
+
+static char *arena;
+static unsigned long arena_brk;
+static struct {
+	pthread_mutex_t lock;
+	struct kmalloc_free *free;
+} kmalloc_class[KMALLOC_MAX_SHIFT + 1];
+static unsigned long kmalloc_live;
+static unsigned long kmalloc_live_bytes;
+
+void *kmalloc(size_t size, gfp_t flags)
+{
+	size_t total = size + sizeof(struct kmalloc_hdr);
+	unsigned int shift = KMALLOC_MIN_SHIFT;
+	struct kmalloc_hdr *hdr;
+	struct kmalloc_free *f;
+	unsigned long off;
+
+	while ((1UL << shift) < total)
+		shift++;
+	if (shift > KMALLOC_MAX_SHIFT)
+		return NULL;
+
+	pthread_mutex_lock(&kmalloc_class[shift].lock);
+	f = kmalloc_class[shift].free;
+	if (f)
+		kmalloc_class[shift].free = f->next;
+	pthread_mutex_unlock(&kmalloc_class[shift].lock);
+
+	if (f) {
+		hdr = &f->hdr;
+		if (hdr->magic != KMALLOC_FREE)
+			BUG();
+	} else {
+		off = __atomic_fetch_add(&arena_brk, 1UL << shift,
+					 __ATOMIC_RELAXED);
+		if (off + (1UL << shift) > ARENA_SIZE)
+			return NULL;
+		hdr = (struct kmalloc_hdr *)(arena + off);
+	}
+
+	hdr->magic = KMALLOC_LIVE;
+	hdr->shift = shift;
+	hdr->size = size;
+	__atomic_add_fetch(&kmalloc_live, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&kmalloc_live_bytes, size, __ATOMIC_RELAXED);
+
+	if (flags & __GFP_ZERO)
+		memset(hdr + 1, 0, size);
+	return hdr + 1;
+}
+
+void kfree(const void *p)
+{
+	struct kmalloc_hdr *hdr;
+	struct kmalloc_free *f;
+	unsigned int shift;
+
+	if (!p)
+		return;
+
+	hdr = (struct kmalloc_hdr *)p - 1;
+	if ((char *)hdr < arena || (char *)hdr >= arena + ARENA_SIZE) {
+		printk(KERN_EMERG "kfree of %p, which kmalloc never returned\n",
+		       p);
+		BUG();
+	}
+	if (hdr->magic == KMALLOC_FREE) {
+		printk(KERN_EMERG "double kfree of %p\n", p);
+		BUG();
+	}
+	if (hdr->magic != KMALLOC_LIVE) {
+		printk(KERN_EMERG "kfree of corrupted block %p\n", p);
+		BUG();
+	}
+
+	shift = hdr->shift;
+	__atomic_sub_fetch(&kmalloc_live, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&kmalloc_live_bytes, hdr->size, __ATOMIC_RELAXED);
+	memset(hdr + 1, POISON_FREE, hdr->size);
+	hdr->magic = KMALLOC_FREE;
+
+	f = (struct kmalloc_free *)hdr;
+	pthread_mutex_lock(&kmalloc_class[shift].lock);
+	f->next = kmalloc_class[shift].free;
+	kmalloc_class[shift].free = f;
+	pthread_mutex_unlock(&kmalloc_class[shift].lock);
+}
+
+char *kstrdup(const char *s, gfp_t gfp)
+{
+	size_t len;
+	char *p;
+
+	if (!s)
+		return NULL;
+	len = strlen(s) + 1;
+	p = kmalloc(len, gfp);
+	if (p)
+		memcpy(p, s, len);
+	return p;
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, unsigned long flags,
+				     void (*ctor)(void *))
+{
+	struct kmem_cache *c = calloc(1, sizeof(*c));
+
+	if (c) {
+		c->name = name;
+		c->size = size;
+	}
+	return c;
+}
+
+void kmem_cache_destroy(struct kmem_cache *c)
+{
+	free(c);
+}
+
+unsigned long fake_kmalloc_live(void)
+{
+	return __atomic_load_n(&kmalloc_live, __ATOMIC_RELAXED);
+}
+
+/* pages */
+
+#define PAGE_ORDER_MASK		0xff
+#define POISON_PAGE		0x5a
+
+static pthread_mutex_t page_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long *page_bits;
+static unsigned long page_hint;
+static unsigned long pages_live;
+
+int fake_pfn_valid(unsigned long pfn)
+{
+	return pfn >= PHYS_PFN_OFFSET && pfn < PHYS_PFN_OFFSET + nr_sys_pages;
+}
+
+struct page *alloc_pages(gfp_t gfp, unsigned int order)
+{
+	unsigned long nr = 1UL << order;
+	unsigned long bit, i;
+	struct page *page;
+
+	pthread_mutex_lock(&page_lock);
+	bit = bitmap_find_next_zero_area(page_bits, nr_sys_pages, page_hint,
+					 nr, nr - 1);
+	if (bit + nr > nr_sys_pages && page_hint)
+		bit = bitmap_find_next_zero_area(page_bits, nr_sys_pages, 0,
+						 nr, nr - 1);
+	if (bit + nr > nr_sys_pages) {
+		pthread_mutex_unlock(&page_lock);
+		return NULL;
+	}
+	bitmap_set(page_bits, bit, nr);
+	page_hint = (bit + nr) % nr_sys_pages;
+	pages_live += nr;
+	pthread_mutex_unlock(&page_lock);
+
+	page = mem_map + bit;
+	for (i = 0; i < nr; i++) {
+		page[i].flags = 0;
+		page[i].private = 0;
+		atomic_set(&page[i]._count, 0);
+	}
+	page->flags = order;
+	atomic_set(&page->_count, 1);
+
+	if (gfp & __GFP_ZERO)
+		memset(page_address(page), 0, nr << PAGE_SHIFT);
+	return page;
+}
+
+static void free_page_run(struct page *page, unsigned int order)
+{
+	unsigned long nr = 1UL << order;
+	unsigned long bit = page - mem_map;
+	unsigned long i;
+
+	for (i = 0; i < nr; i++) {
+		if (WARN(atomic_read(&page[i]._iomap),
+			 "pfn %lx freed while the IOVMM maps it\n",
+			 page_to_pfn(page + i)))
+			break;
+	}
+	memset(page_address(page), POISON_PAGE, nr << PAGE_SHIFT);
+
+	pthread_mutex_lock(&page_lock);
+	for (i = 0; i < nr; i++)
+		if (!test_bit(bit + i, page_bits))
+			BUG();
+	bitmap_clear(page_bits, bit, nr);
+	pages_live -= nr;
+	pthread_mutex_unlock(&page_lock);
+}
+
+static void put_page_order(struct page *page, unsigned int order)
+{
+	int count = atomic_dec_return(&page->_count);
+
+	if (count < 0) {
+		printk(KERN_EMERG "pfn %lx: page refcount underflow\n",
+		       page_to_pfn(page));
+		BUG();
+	}
+	if (!count)
+		free_page_run(page, order);
+}
+
+void __free_pages(struct page *page, unsigned int order)
+{
+	put_page_order(page, order);
+}
+
+void put_page(struct page *page)
+{
+	put_page_order(page, page->flags & PAGE_ORDER_MASK);
+}
+
+void split_page(struct page *page, unsigned int order)
+{
+	unsigned long i;
+
+	BUG_ON((page->flags & PAGE_ORDER_MASK) != order);
+	for (i = 0; i < (1UL << order); i++) {
+		page[i].flags = 0;
+		atomic_set(&page[i]._count, 1);
+	}
+}
+
+unsigned long global_page_state(enum zone_stat_item item)
+{
+	if (item == NR_FREE_PAGES)
+		return nr_sys_pages - pages_live;
+	return 0;
+}
+
+unsigned long fake_pages_live(void)
+{
+	unsigned long live;
+
+	pthread_mutex_lock(&page_lock);
+	live = pages_live;
+	pthread_mutex_unlock(&page_lock);
+	return live;
+}
+
+/* caches */
+
+void v7_flush_kern_cache_all(void *info)
+{
+}
+
+void v7_clean_kern_cache_all(void *info)
+{
+}
+
+void __flush_dcache_page(struct address_space *mapping, struct page *page)
+{
+}
+
+/* vmalloc space and kernel PTEs */
+
+#define VMALLOC_SIZE		(256UL << 20)
+
+static pthread_mutex_t vm_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *vm_base;
+static unsigned long vm_pages;
+static unsigned long *vm_bits;
+static unsigned long vm_hint;
+static pte_t *vm_ptes;
+static unsigned int *vm_len;
+static struct vm_struct **vm_owner;
+
+static unsigned long vm_index(unsigned long addr)
+{
+	unsigned long idx = (addr - (unsigned long)vm_base) >> PAGE_SHIFT;
+
+	if (addr < (unsigned long)vm_base || idx >= vm_pages) {
+		printk(KERN_EMERG "address %lx is outside the vmalloc range\n",
+		       addr);
+		BUG();
+	}
+	return idx;
+}
+
+pte_t *pte_alloc_kernel(pmd_t *pmd, unsigned long addr)
+{
+	return &vm_ptes[vm_index(addr)];
+}
+
+void set_pte_at(struct mm_struct *mm, unsigned long addr, pte_t *ptep,
+		pte_t pte)
+{
+	unsigned long pfn = pte_pfn(pte);
+	void *p;
+
+	BUG_ON(ptep != &vm_ptes[vm_index(addr)]);
+	*ptep = pte;
+
+	if (pte & L_PTE_PRESENT) {
+		BUG_ON(pfn < PHYS_PFN_OFFSET ||
+		       pfn >= PHYS_PFN_OFFSET + nr_phys_pages);
+		p = mmap((void *)addr, PAGE_SIZE, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_FIXED, phys_fd,
+			 (pfn - PHYS_PFN_OFFSET) << PAGE_SHIFT);
+	} else {
+		p = mmap((void *)addr, PAGE_SIZE, PROT_NONE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED |
+			 MAP_NORESERVE, -1, 0);
+	}
+	if (p == MAP_FAILED)
+		BUG();
+}
+
+/* reserves nr pages plus a guard page of vmalloc space */
+static void *vm_reserve(unsigned long nr)
+{
+	unsigned long bit;
+
+	pthread_mutex_lock(&vm_lock);
+	bit = bitmap_find_next_zero_area(vm_bits, vm_pages, vm_hint,
+					 nr + 1, 0);
+	if (bit + nr + 1 > vm_pages && vm_hint)
+		bit = bitmap_find_next_zero_area(vm_bits, vm_pages, 0,
+						 nr + 1, 0);
+	if (bit + nr + 1 > vm_pages) {
+		pthread_mutex_unlock(&vm_lock);
+		return NULL;
+	}
+	bitmap_set(vm_bits, bit, nr + 1);
+	vm_hint = bit + nr + 1;
+	vm_len[bit] = nr;
+	pthread_mutex_unlock(&vm_lock);
+	return vm_base + (bit << PAGE_SHIFT);
+}
+
+static void vm_release(const void *addr, unsigned long nr)
+{
+	unsigned long bit = vm_index((unsigned long)addr);
+	unsigned long i;
+
+	BUG_ON(vm_len[bit] != nr);
+	for (i = 0; i < nr; i++)
+		if (vm_ptes[bit + i])
+			set_pte_at(&init_mm, (unsigned long)addr +
+				   (i << PAGE_SHIFT), &vm_ptes[bit + i], 0);
+
+	pthread_mutex_lock(&vm_lock);
+	vm_len[bit] = 0;
+	vm_owner[bit] = NULL;
+	bitmap_clear(vm_bits, bit, nr + 1);
+	pthread_mutex_unlock(&vm_lock);
+}
+
+struct vm_struct *alloc_vm_area(size_t size)
+{
+	struct vm_struct *area;
+	unsigned long nr = PAGE_ALIGN(size) >> PAGE_SHIFT;
+
+	area = kmalloc(sizeof(*area), GFP_KERNEL);
+	if (!area)
+		return NULL;
+	area->addr = vm_reserve(nr);
+	if (!area->addr) {
+		kfree(area);
+		return NULL;
+	}
+	area->size = nr << PAGE_SHIFT;
+	vm_owner[vm_index((unsigned long)area->addr)] = area;
+	return area;
+}
+
+struct vm_struct *remove_vm_area(const void *addr)
+{
+	unsigned long bit = vm_index((unsigned long)addr);
+	struct vm_struct *area = vm_owner[bit];
+
+	if (!area || area->addr != addr)
+		return NULL;
+	vm_release(addr, area->size >> PAGE_SHIFT);
+	return area;
+}
+
+void free_vm_area(struct vm_struct *area)
+{
+	struct vm_struct *ret = remove_vm_area(area->addr);
+
+	BUG_ON(ret != area);
+	kfree(area);
+}
+
+void *vm_map_ram(struct page **pages, unsigned int count, int node,
+		 pgprot_t prot)
+{
+	char *addr = vm_reserve(count);
+	unsigned long bit;
+	unsigned int i;
+
+	if (!addr)
+		return NULL;
+	bit = vm_index((unsigned long)addr);
+	for (i = 0; i < count; i++)
+		set_pte_at(&init_mm, (unsigned long)addr + (i << PAGE_SHIFT),
+			   &vm_ptes[bit + i],
+			   pfn_pte(page_to_pfn(pages[i]), prot));
+	return addr;
+}
+
+void vm_unmap_ram(const void *mem, unsigned int count)
+{
+	vm_release(mem, count);
+}
+
+/* seq_file */
+
+int seq_printf(struct seq_file *s, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (s->count >= s->size)
+		return -1;
+	va_start(ap, fmt);
+	n = vsnprintf(s->buf + s->count, s->size - s->count, fmt, ap);
+	va_end(ap);
+	if (n < 0 || s->count + n >= s->size) {
+		s->count = s->size;
+		return -1;
+	}
+	s->count += n;
+	return 0;
+}
+
+int seq_puts(struct seq_file *s, const char *str)
+{
+	return seq_printf(s, "%s", str);
+}
+
+int single_open(struct file *file, int (*show)(struct seq_file *, void *),
+		void *data)
+{
+	struct seq_file *s = calloc(1, sizeof(*s));
+
+	if (!s)
+		return -ENOMEM;
+	s->show = show;
+	s->private = data;
+	file->private_data = s;
+	return 0;
+}
+
+int single_release(struct inode *inode, struct file *file)
+{
+	struct seq_file *s = file->private_data;
+
+	free(s->buf);
+	free(s);
+	return 0;
+}
+
+ssize_t seq_read(struct file *file, char __user *buf, size_t size,
+		 loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	size_t n;
+
+	while (!s->buf || s->count >= s->size) {
+		s->size = s->size ? s->size * 2 : 4096;
+		free(s->buf);
+		s->buf = malloc(s->size);
+		if (!s->buf)
+			return -ENOMEM;
+		s->count = 0;
+		s->show(s, (void *)1);
+	}
+
+	if (*ppos >= (loff_t)s->count)
+		return 0;
+	n = min(size, s->count - (size_t)*ppos);
+	memcpy(buf, s->buf + *ppos, n);
+	*ppos += n;
+	return n;
+}
+
+loff_t seq_lseek(struct file *file, loff_t offset, int origin)
+{
+	file->f_pos = offset;
+	return offset;
+}
+
+/* debugfs and sysfs, looked up by name from the harness */
+
+struct dentry {
+	char path[256];
+	void *data;
+	const struct file_operations *fops;
+	struct dentry *next;
+};
+
+struct sysfs_group {
+	struct kobject *kobj;
+	const struct attribute_group *grp;
+	struct sysfs_group *next;
+};
+
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dentry *debugfs_files;
+static struct sysfs_group *sysfs_groups;
+
+static struct dentry *debugfs_add(const char *name, struct dentry *parent,
+				  void *data, const struct file_operations *fops)
+{
+	struct dentry *d = calloc(1, sizeof(*d));
+
+	if (!d)
+		return NULL;
+	if (snprintf(d->path, sizeof(d->path), "%s%s%s",
+		     parent ? parent->path : "", parent ? "/" : "",
+		     name) >= (int)sizeof(d->path)) {
+		free(d);
+		return NULL;
+	}
+	d->data = data;
+	d->fops = fops;
+
+	pthread_mutex_lock(&fs_lock);
+	d->next = debugfs_files;
+	debugfs_files = d;
+	pthread_mutex_unlock(&fs_lock);
+	return d;
+}
+
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent)
+{
+	return debugfs_add(name, parent, NULL, NULL);
+}
+
+struct dentry *debugfs_create_file(const char *name, mode_t mode,
+				   struct dentry *parent, void *data,
+				   const struct file_operations *fops)
+{
+	return debugfs_add(name, parent, data, fops);
+}
+
+ssize_t fake_debugfs_read(const char *path, char *buf, size_t size)
+{
+	struct inode inode = { NULL };
+	struct file file;
+	struct dentry *d;
+	loff_t pos = 0;
+	ssize_t n, total = 0;
+
+	pthread_mutex_lock(&fs_lock);
+	for (d = debugfs_files; d; d = d->next)
+		if (d->fops && !strcmp(d->path, path))
+			break;
+	pthread_mutex_unlock(&fs_lock);
+	if (!d)
+		return -ENOENT;
+
+	memset(&file, 0, sizeof(file));
+	file.f_op = d->fops;
+	file.f_mapping = &file.f_data;
+	inode.i_private = d->data;
+	n = d->fops->open(&inode, &file);
+	if (n)
+		return n;
+	while ((size_t)total < size - 1) {
+		n = d->fops->read(&file, buf + total, size - 1 - total, &pos);
+		if (n <= 0)
+			break;
+		total += n;
+	}
+	buf[total] = '\0';
+	d->fops->release(&inode, &file);
+	return total;
+}
+
+int sysfs_create_group(struct kobject *kobj, const struct attribute_group *grp)
+{
+	struct sysfs_group *g = calloc(1, sizeof(*g));
+
+	if (!g)
+		return -ENOMEM;
+	g->kobj = kobj;
+	g->grp = grp;
+	pthread_mutex_lock(&fs_lock);
+	g->next = sysfs_groups;
+	sysfs_groups = g;
+	pthread_mutex_unlock(&fs_lock);
+	return 0;
+}
+
+void sysfs_remove_group(struct kobject *kobj,
+			const struct attribute_group *grp)
+{
+	struct sysfs_group **p, *g;
+
+	pthread_mutex_lock(&fs_lock);
+	for (p = &sysfs_groups; (g = *p); p = &g->next) {
+		if (g->kobj == kobj && g->grp == grp) {
+			*p = g->next;
+			free(g);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fs_lock);
+}
+
+ssize_t fake_sysfs_read(const char *dev, const char *attr, char *buf)
+{
+	struct device_attribute *dattr = NULL;
+	struct kobject *kobj = NULL;
+	struct sysfs_group *g;
+	struct attribute **a;
+
+	pthread_mutex_lock(&fs_lock);
+	for (g = sysfs_groups; g && !kobj; g = g->next) {
+		if (!g->kobj->name || strcmp(g->kobj->name, dev))
+			continue;
+		for (a = g->grp->attrs; *a; a++) {
+			if (!strcmp((*a)->name, attr)) {
+				dattr = container_of(*a,
+					struct device_attribute, attr);
+				kobj = g->kobj;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&fs_lock);
+	if (!dattr || !dattr->show)
+		return -ENOENT;
+	return dattr->show(container_of(kobj, struct device, kobj), dattr,
+			   buf);
+}
+
+/* devices */
+
+int dev_set_name(struct device *dev, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(dev->name, sizeof(dev->name), fmt, ap);
+	va_end(ap);
+	dev->kobj.name = dev->name;
+	return 0;
+}
+
+int device_register(struct device *dev)
+{
+	if (!dev->kobj.name)
+		dev->kobj.name = dev->name;
+	return 0;
+}
+
+void device_unregister(struct device *dev)
+{
+	if (dev->release)
+		dev->release(dev);
+}
+
+#define MAX_DEVICES		8
+
+static pthread_mutex_t dev_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct platform_driver *platform_drivers[MAX_DEVICES];
+static struct platform_device *platform_devices[MAX_DEVICES];
+static struct miscdevice *misc_devices[MAX_DEVICES];
+
+static int platform_bind(struct platform_device *pdev,
+			 struct platform_driver *drv)
+{
+	int err;
+
+	if (pdev->dev.driver || strcmp(pdev->name, drv->driver.name))
+		return 0;
+	pdev->dev.driver = &drv->driver;
+	err = drv->probe(pdev);
+	if (err)
+		pdev->dev.driver = NULL;
+	return err;
+}
+
+static void platform_unbind(struct platform_device *pdev)
+{
+	struct platform_driver *drv;
+
+	if (!pdev->dev.driver)
+		return;
+	drv = container_of(pdev->dev.driver, struct platform_driver, driver);
+	if (drv->remove)
+		drv->remove(pdev);
+	pdev->dev.driver = NULL;
+}
+
+int platform_driver_register(struct platform_driver *drv)
+{
+	int i;
+
+	pthread_mutex_lock(&dev_lock);
+	for (i = 0; i < MAX_DEVICES && platform_drivers[i]; i++)
+		;
+	if (i == MAX_DEVICES) {
+		pthread_mutex_unlock(&dev_lock);
+		return -ENOSPC;
+	}
+	platform_drivers[i] = drv;
+	pthread_mutex_unlock(&dev_lock);
+
+	for (i = 0; i < MAX_DEVICES; i++)
+		if (platform_devices[i])
+			platform_bind(platform_devices[i], drv);
+	return 0;
+}
+
+void platform_driver_unregister(struct platform_driver *drv)
+{
+	int i;
+
+	for (i = 0; i < MAX_DEVICES; i++)
+		if (platform_devices[i] &&
+		    platform_devices[i]->dev.driver == &drv->driver)
+			platform_unbind(platform_devices[i]);
+
+	pthread_mutex_lock(&dev_lock);
+	for (i = 0; i < MAX_DEVICES; i++)
+		if (platform_drivers[i] == drv)
+			platform_drivers[i] = NULL;
+	pthread_mutex_unlock(&dev_lock);
+}
+
+int fake_platform_device_register(struct platform_device *pdev)
+{
+	int i, err = 0;
+
+	if (pdev->id < 0)
+		dev_set_name(&pdev->dev, "%s", pdev->name);
+	else
+		dev_set_name(&pdev->dev, "%s.%d", pdev->name, pdev->id);
+
+	pthread_mutex_lock(&dev_lock);
+	for (i = 0; i < MAX_DEVICES && platform_devices[i]; i++)
+		;
+	if (i == MAX_DEVICES) {
+		pthread_mutex_unlock(&dev_lock);
+		return -ENOSPC;
+	}
+	platform_devices[i] = pdev;
+	pthread_mutex_unlock(&dev_lock);
+
+	for (i = 0; i < MAX_DEVICES && !err; i++)
+		if (platform_drivers[i])
+			err = platform_bind(pdev, platform_drivers[i]);
+	return err;
+}
+
+void fake_platform_device_unregister(struct platform_device *pdev)
+{
+	int i;
+
+	platform_unbind(pdev);
+	pthread_mutex_lock(&dev_lock);
+	for (i = 0; i < MAX_DEVICES; i++)
+		if (platform_devices[i] == pdev)
+			platform_devices[i] = NULL;
+	pthread_mutex_unlock(&dev_lock);
+}
+
+int misc_register(struct miscdevice *misc)
+{
+	struct device *dev;
+	int i;
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return -ENOMEM;
+	dev->parent = misc->parent;
+	dev_set_name(dev, "%s", misc->name);
+
+	pthread_mutex_lock(&dev_lock);
+	for (i = 0; i < MAX_DEVICES && misc_devices[i]; i++)
+		;
+	if (i == MAX_DEVICES) {
+		pthread_mutex_unlock(&dev_lock);
+		free(dev);
+		return -EBUSY;
+	}
+	misc->this_device = dev;
+	misc_devices[i] = misc;
+	pthread_mutex_unlock(&dev_lock);
+	return 0;
+}
+
+int misc_deregister(struct miscdevice *misc)
+{
+	int i;
+
+	pthread_mutex_lock(&dev_lock);
+	for (i = 0; i < MAX_DEVICES; i++)
+		if (misc_devices[i] == misc)
+			misc_devices[i] = NULL;
+	pthread_mutex_unlock(&dev_lock);
+	free(misc->this_device);
+	misc->this_device = NULL;
+	return 0;
+}
+
+struct file *fake_misc_open(const char *name)
+{
+	struct miscdevice *misc = NULL;
+	struct inode inode = { NULL };
+	struct file *file;
+	int i, err;
+
+	pthread_mutex_lock(&dev_lock);
+	for (i = 0; i < MAX_DEVICES && !misc; i++)
+		if (misc_devices[i] && !strcmp(misc_devices[i]->name, name))
+			misc = misc_devices[i];
+	pthread_mutex_unlock(&dev_lock);
+	if (!misc) {
+		errno = ENODEV;
+		return NULL;
+	}
+
+	file = calloc(1, sizeof(*file));
+	if (!file) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	file->f_op = misc->fops;
+	file->f_mapping = &file->f_data;
+	file->private_data = misc;
+	err = file->f_op->open(&inode, file);
+	if (err) {
+		free(file);
+		errno = -err;
+		return NULL;
+	}
+	return file;
+}
+
+void fake_misc_close(struct file *file)
+{
+	struct inode inode = { NULL };
+
+	file->f_op->release(&inode, file);
+	free(file);
+}
+
+/* user mappings: every thread shares init_mm, and a mapping is just a
+ * reserved range of addresses handed to the driver's mmap, which nothing
+ * ever touches through */
+
+struct vm_area_struct *find_vma(struct mm_struct *mm, unsigned long addr)
+{
+	struct vm_area_struct *vma, *ret = NULL;
+
+	for (vma = mm->mmap; vma; vma = vma->vm_next)
+		if (vma->vm_end > addr && (!ret || vma->vm_end < ret->vm_end))
+			ret = vma;
+	return ret;
+}
+
+struct vm_area_struct *fake_mmap(struct file *file, size_t len)
+{
+	struct vm_area_struct *vma = calloc(1, sizeof(*vma));
+	void *addr;
+	int err;
+
+	if (!vma) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	len = PAGE_ALIGN(len);
+	addr = mmap(NULL, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS |
+		    MAP_NORESERVE, -1, 0);
+	if (addr == MAP_FAILED) {
+		free(vma);
+		return NULL;
+	}
+	vma->vm_start = (unsigned long)addr;
+	vma->vm_end = vma->vm_start + len;
+	vma->vm_page_prot = PAGE_KERNEL;
+	vma->vm_file = file;
+	vma->vm_mm = current->mm;
+
+	down_write(&vma->vm_mm->mmap_sem);
+	err = file->f_op->mmap(file, vma);
+	if (!err) {
+		vma->vm_next = vma->vm_mm->mmap;
+		vma->vm_mm->mmap = vma;
+	}
+	up_write(&vma->vm_mm->mmap_sem);
+	if (err) {
+		munmap(addr, len);
+		free(vma);
+		errno = -err;
+		return NULL;
+	}
+	return vma;
+}
+
+void fake_munmap(struct vm_area_struct *vma)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	struct vm_area_struct **p;
+
+	down_write(&mm->mmap_sem);
+	for (p = &mm->mmap; *p != vma; p = &(*p)->vm_next)
+		;
+	*p = vma->vm_next;
+	if (vma->vm_ops && vma->vm_ops->close)
+		vma->vm_ops->close(vma);
+	up_write(&mm->mmap_sem);
+	munmap((void *)vma->vm_start, vma->vm_end - vma->vm_start);
+	free(vma);
+}
+
+/* shrinkers */
+
+static pthread_mutex_t shrinker_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(shrinker_list);
+
+void register_shrinker(struct shrinker *s)
+{
+	pthread_mutex_lock(&shrinker_lock);
+	list_add_tail(&s->list, &shrinker_list);
+	pthread_mutex_unlock(&shrinker_lock);
+}
+
+void unregister_shrinker(struct shrinker *s)
+{
+	pthread_mutex_lock(&shrinker_lock);
+	list_del(&s->list);
+	pthread_mutex_unlock(&shrinker_lock);
+}
+
+/* asks every shrinker to give back everything it caches, as a kernel under
+ * heavy memory pressure would; returns the number of objects released */
+int fake_shrink_all(void)
+{
+	struct shrinker *s;
+	int before, after, total = 0;
+
+	pthread_mutex_lock(&shrinker_lock);
+	list_for_each_entry(s, &shrinker_list, list) {
+		before = s->shrink(s, 0, GFP_KERNEL);
+		while (before > 0) {
+			after = s->shrink(s, before, GFP_KERNEL);
+			if (after >= before)
+				break;
+			total += before - after;
+			before = after;
+		}
+	}
+	pthread_mutex_unlock(&shrinker_lock);
+	return total;
+}
+
+/* setup */
+
+static void *map_low(size_t size, int prot)
+{
+	void *p = mmap(NULL, size, prot, MAP_PRIVATE | MAP_ANONYMOUS |
+		       MAP_32BIT | MAP_NORESERVE, -1, 0);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+int fake_kernel_init(size_t sysmem, size_t carveout, phys_addr_t *co_base)
+{
+	size_t physmem = PAGE_ALIGN(sysmem) + PAGE_ALIGN(carveout);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int i;
+
+	if (physmem > (size_t)~PHYS_OFFSET + 1)
+		return -EINVAL;
+
+	nr_cpus = clamp_t(long, cpus, 1, 16);
+	init_rwsem(&init_mm.mmap_sem);
+	for (i = 0; i <= KMALLOC_MAX_SHIFT; i++)
+		pthread_mutex_init(&kmalloc_class[i].lock, NULL);
+
+	arena = map_low(ARENA_SIZE, PROT_READ | PROT_WRITE);
+	vm_base = map_low(VMALLOC_SIZE, PROT_NONE);
+	if (!arena || !vm_base)
+		return -ENOMEM;
+	vm_pages = VMALLOC_SIZE >> PAGE_SHIFT;
+	vm_bits = calloc(BITS_TO_LONGS(vm_pages), sizeof(long));
+	vm_ptes = calloc(vm_pages, sizeof(*vm_ptes));
+	vm_len = calloc(vm_pages, sizeof(*vm_len));
+	vm_owner = calloc(vm_pages, sizeof(*vm_owner));
+
+	phys_fd = memfd_create("nvmap-phys", 0);
+	if (phys_fd < 0)
+		return -errno;
+	if (ftruncate(phys_fd, physmem))
+		return -errno;
+	fake_linear_map = mmap(NULL, physmem, PROT_READ | PROT_WRITE,
+			       MAP_SHARED, phys_fd, 0);
+	if (fake_linear_map == MAP_FAILED)
+		return -errno;
+
+	nr_sys_pages = PAGE_ALIGN(sysmem) >> PAGE_SHIFT;
+	nr_phys_pages = physmem >> PAGE_SHIFT;
+	totalram_pages = nr_sys_pages;
+	mem_map = calloc(nr_phys_pages, sizeof(*mem_map));
+	page_bits = calloc(BITS_TO_LONGS(nr_sys_pages), sizeof(long));
+	if (!vm_bits || !vm_ptes || !vm_len || !vm_owner || !mem_map ||
+	    !page_bits)
+		return -ENOMEM;
+	*co_base = PHYS_OFFSET + PAGE_ALIGN(sysmem);
+
+	wq_worker = kthread_run(worker_thread, NULL, "events");
+	return IS_ERR(wq_worker) ? PTR_ERR(wq_worker) : 0;
+}
@@ -0,0 +1,472 @@
+/*
+ * nvmap-bench.c -- nvmap handle allocation churn benchmark
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Starts -t threads that each create, allocate and free -n handles of -s
+ * bytes through /dev/nvmap, keeping up to -k handles alive at once the way
+ * a game streams textures in and out.  Reports the allocation rate and the
+ * average, median, 99th percentile and worst latency of the create+alloc
+ * pair, which is what the render thread stalls on.
+ *
+ * When the kernel keeps page pools (CONFIG_NVMAP_PAGE_POOLS), the pool
+ * hit and miss counters for the selected cache attribute are read from
+ * sysfs before and after the run and the hit rate is reported as well.
+ *
+ * With -m cache, each thread instead allocates one cacheable handle of -s
+ * bytes, maps it, and -n times dirties it and issues -b cache maintenance
+ * requests of -l bytes at random offsets, either one NVMAP_IOC_CACHE each
+ * or, with -L, as a single NVMAP_IOC_CACHE_LIST.  Reports requests per
+ * second and the average latency of a batch.
+ */
+
+/* $(CROSS_COMPILE)cc -Wall -O2 -o nvmap-bench nvmap-bench.c -lpthread -lrt */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+/* from drivers/video/tegra/nvmap/nvmap_ioctl.h and mach/nvmap.h, which
+ * are not exported to userspace */
+struct nvmap_create_handle {
+	union {
+		uint32_t key;
+		uint32_t id;
+		uint32_t size;
+	};
+	uint32_t handle;
+};
+
+struct nvmap_alloc_handle {
+	uint32_t handle;
+	uint32_t heap_mask;
+	uint32_t flags;
+	uint32_t align;
+};
+
+struct nvmap_map_caller {
+	uint32_t handle;
+	uint32_t offset;
+	uint32_t length;
+	uint32_t flags;
+	unsigned long addr;
+};
+
+struct nvmap_cache_op {
+	unsigned long addr;
+	uint32_t handle;
+	uint32_t len;
+	int32_t op;
+};
+
+struct nvmap_cache_op_list {
+	unsigned long ops;
+	uint32_t nr;
+};
+
+#define NVMAP_IOC_MAGIC		'N'
+#define NVMAP_IOC_CREATE	_IOWR(NVMAP_IOC_MAGIC, 0, struct nvmap_create_handle)
+#define NVMAP_IOC_ALLOC		_IOW(NVMAP_IOC_MAGIC, 3, struct nvmap_alloc_handle)
+#define NVMAP_IOC_FREE		_IO(NVMAP_IOC_MAGIC, 4)
+#define NVMAP_IOC_MMAP		_IOWR(NVMAP_IOC_MAGIC, 5, struct nvmap_map_caller)
+#define NVMAP_IOC_CACHE		_IOW(NVMAP_IOC_MAGIC, 12, struct nvmap_cache_op)
+#define NVMAP_IOC_CACHE_LIST	_IOW(NVMAP_IOC_MAGIC, 14, struct nvmap_cache_op_list)
+
+#define NVMAP_CACHE_OP_WB	0
+#define NVMAP_CACHE_OP_INV	1
+#define NVMAP_CACHE_OP_WB_INV	2
+
+#define NVMAP_HEAP_SYSMEM		(1ul << 31)
+#define NVMAP_HEAP_IOVMM		(1ul << 30)
+#define NVMAP_HEAP_CARVEOUT_GENERIC	(1ul << 0)
+
+#define NVMAP_HANDLE_UNCACHEABLE	(0x0ul << 0)
+#define NVMAP_HANDLE_WRITE_COMBINE	(0x1ul << 0)
+#define NVMAP_HANDLE_INNER_CACHEABLE	(0x2ul << 0)
+#define NVMAP_HANDLE_CACHEABLE		(0x3ul << 0)
+
+#define NVMAP_DEV	"/dev/nvmap"
+#define POOL_SYSFS	"/sys/class/misc/nvmap/pagepool"
+
+struct thread_stats {
+	pthread_t thread;
+	uint64_t *lat_ns;
+	unsigned done;
+	unsigned errors;
+};
+
+static const char *nvmap_dev = NVMAP_DEV;
+static unsigned nr_threads = 1;
+static unsigned iterations = 10000;
+static unsigned keep = 16;
+static size_t alloc_size = 256 * 1024;
+static uint32_t heap_mask = NVMAP_HEAP_IOVMM;
+static uint32_t cache_flags = NVMAP_HANDLE_WRITE_COMBINE;
+static const char *pool_name = "wc";
+static int cache_mode;
+static int use_list;
+static unsigned batch = 16;
+static size_t op_len = 4096;
+static int cache_op = NVMAP_CACHE_OP_WB;
+
+static pthread_barrier_t start_barrier;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static uint64_t ts_ns(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000000000ULL +
+	       b->tv_nsec - a->tv_nsec;
+}
+
+static void *bench_thread(void *arg)
+{
+	struct thread_stats *ts = arg;
+	struct timespec t0, t1;
+	uint32_t *live;
+	unsigned i, slot;
+	int fd;
+
+	fd = open(nvmap_dev, O_RDWR);
+	if (fd < 0)
+		die("open " NVMAP_DEV);
+
+	live = calloc(keep, sizeof(*live));
+	if (!live)
+		die("calloc");
+
+	pthread_barrier_wait(&start_barrier);
+
+	for (i = 0; i < iterations; i++) {
+		struct nvmap_create_handle create = { .size = alloc_size };
+		struct nvmap_alloc_handle alloc = {
+			.heap_mask = heap_mask,
+			.flags = cache_flags,
+			.align = 4096,
+		};
+
+		slot = i % keep;
+		if (live[slot]) {
+			ioctl(fd, NVMAP_IOC_FREE, live[slot]);
+			live[slot] = 0;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (ioctl(fd, NVMAP_IOC_CREATE, &create)) {
+			ts->errors++;
+			continue;
+		}
+		alloc.handle = create.handle;
+		if (ioctl(fd, NVMAP_IOC_ALLOC, &alloc)) {
+			ioctl(fd, NVMAP_IOC_FREE, create.handle);
+			ts->errors++;
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		live[slot] = create.handle;
+		ts->lat_ns[ts->done++] = ts_ns(&t0, &t1);
+	}
+
+	for (slot = 0; slot < keep; slot++)
+		if (live[slot])
+			ioctl(fd, NVMAP_IOC_FREE, live[slot]);
+
+	free(live);
+	close(fd);
+	return NULL;
+}
+
+static void *cache_thread(void *arg)
+{
+	struct thread_stats *ts = arg;
+	struct nvmap_create_handle create = { .size = alloc_size };
+	struct nvmap_alloc_handle alloc = {
+		.heap_mask = heap_mask,
+		.flags = cache_flags,
+		.align = 4096,
+	};
+	struct nvmap_map_caller map = { .length = alloc_size };
+	struct nvmap_cache_op *ops;
+	struct nvmap_cache_op_list list;
+	struct timespec t0, t1;
+	unsigned seed = (unsigned) (uintptr_t) ts;
+	unsigned i, k, slots;
+	char *buf;
+	int fd;
+
+	fd = open(nvmap_dev, O_RDWR);
+	if (fd < 0)
+		die("open " NVMAP_DEV);
+
+	if (ioctl(fd, NVMAP_IOC_CREATE, &create))
+		die("NVMAP_IOC_CREATE");
+	alloc.handle = create.handle;
+	if (ioctl(fd, NVMAP_IOC_ALLOC, &alloc))
+		die("NVMAP_IOC_ALLOC");
+
+	buf = mmap(NULL, alloc_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	if (buf == MAP_FAILED)
+		die("mmap " NVMAP_DEV);
+	map.handle = create.handle;
+	map.flags = cache_flags;
+	map.addr = (unsigned long) buf;
+	if (ioctl(fd, NVMAP_IOC_MMAP, &map))
+		die("NVMAP_IOC_MMAP");
+
+	ops = calloc(batch, sizeof(*ops));
+	if (!ops)
+		die("calloc");
+	slots = alloc_size / op_len;
+	list.ops = (unsigned long) ops;
+	list.nr = batch;
+
+	pthread_barrier_wait(&start_barrier);
+
+	for (i = 0; i < iterations; i++) {
+		memset(buf, i, alloc_size);
+		for (k = 0; k < batch; k++) {
+			ops[k].addr = (unsigned long) buf +
+				      (rand_r(&seed) % slots) * op_len;
+			ops[k].handle = create.handle;
+			ops[k].len = op_len;
+			ops[k].op = cache_op;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (use_list) {
+			if (ioctl(fd, NVMAP_IOC_CACHE_LIST, &list))
+				ts->errors++;
+		} else {
+			for (k = 0; k < batch; k++)
+				if (ioctl(fd, NVMAP_IOC_CACHE, &ops[k]))
+					ts->errors++;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		ts->lat_ns[ts->done++] = ts_ns(&t0, &t1);
+	}
+
+	free(ops);
+	munmap(buf, alloc_size);
+	ioctl(fd, NVMAP_IOC_FREE, create.handle);
+	close(fd);
+	return NULL;
+}
+
+static int read_pool_stat(const char *stat, unsigned long *val)
+{
+	char path[256];
+	FILE *f;
+	int ret;
+
+	snprintf(path, sizeof(path), POOL_SYSFS "/%s_%s", pool_name, stat);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	ret = fscanf(f, "%lu", val) == 1 ? 0 : -1;
+	fclose(f);
+	return ret;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d dev] [-t threads] [-n iterations] [-s size]\n"
+		"          [-k live handles] [-h sysmem|iovmm|carveout]\n"
+		"          [-c wc|uc|iwb|cached] [-m alloc|cache]\n"
+		"          [-b batch] [-l op length] [-o wb|inv|wb_inv] [-L]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct thread_stats *ts;
+	struct timespec t0, t1;
+	unsigned long hits0 = 0, misses0 = 0, hits1 = 0, misses1 = 0;
+	uint64_t *all, total_ns = 0, wall_ns;
+	unsigned i, j, n = 0, errors = 0;
+	int pool_stats;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:t:n:s:k:h:c:m:b:l:o:L")) != -1) {
+		switch (opt) {
+		case 'd':
+			nvmap_dev = optarg;
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 's':
+			alloc_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			keep = atoi(optarg);
+			break;
+		case 'h':
+			if (!strcmp(optarg, "sysmem"))
+				heap_mask = NVMAP_HEAP_SYSMEM;
+			else if (!strcmp(optarg, "iovmm"))
+				heap_mask = NVMAP_HEAP_IOVMM;
+			else if (!strcmp(optarg, "carveout"))
+				heap_mask = NVMAP_HEAP_CARVEOUT_GENERIC;
+			else
+				usage(argv[0]);
+			break;
+		case 'c':
+			pool_name = optarg;
+			if (!strcmp(optarg, "wc"))
+				cache_flags = NVMAP_HANDLE_WRITE_COMBINE;
+			else if (!strcmp(optarg, "uc"))
+				cache_flags = NVMAP_HANDLE_UNCACHEABLE;
+			else if (!strcmp(optarg, "iwb"))
+				cache_flags = NVMAP_HANDLE_INNER_CACHEABLE;
+			else if (!strcmp(optarg, "cached"))
+				cache_flags = NVMAP_HANDLE_CACHEABLE;
+			else
+				usage(argv[0]);
+			break;
+		case 'm':
+			if (!strcmp(optarg, "cache"))
+				cache_mode = 1;
+			else if (strcmp(optarg, "alloc"))
+				usage(argv[0]);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'l':
+			op_len = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			if (!strcmp(optarg, "wb"))
+				cache_op = NVMAP_CACHE_OP_WB;
+			else if (!strcmp(optarg, "inv"))
+				cache_op = NVMAP_CACHE_OP_INV;
+			else if (!strcmp(optarg, "wb_inv"))
+				cache_op = NVMAP_CACHE_OP_WB_INV;
+			else
+				usage(argv[0]);
+			break;
+		case 'L':
+			use_list = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!nr_threads || !iterations || !keep || !alloc_size)
+		usage(argv[0]);
+	if (cache_mode && (!batch || !op_len || op_len > alloc_size))
+		usage(argv[0]);
+
+	ts = calloc(nr_threads, sizeof(*ts));
+	if (!ts)
+		die("calloc");
+	for (i = 0; i < nr_threads; i++) {
+		ts[i].lat_ns = calloc(iterations, sizeof(uint64_t));
+		if (!ts[i].lat_ns)
+			die("calloc");
+	}
+
+	pool_stats = !read_pool_stat("hits", &hits0) &&
+		     !read_pool_stat("misses", &misses0);
+
+	pthread_barrier_init(&start_barrier, NULL, nr_threads + 1);
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(&ts[i].thread, NULL,
+				   cache_mode ? cache_thread : bench_thread,
+				   &ts[i]))
+			die("pthread_create");
+
+	pthread_barrier_wait(&start_barrier);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(ts[i].thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	wall_ns = ts_ns(&t0, &t1);
+
+	if (pool_stats)
+		pool_stats = !read_pool_stat("hits", &hits1) &&
+			     !read_pool_stat("misses", &misses1);
+
+	all = malloc(nr_threads * iterations * sizeof(uint64_t));
+	if (!all)
+		die("malloc");
+	for (i = 0; i < nr_threads; i++) {
+		for (j = 0; j < ts[i].done; j++) {
+			all[n++] = ts[i].lat_ns[j];
+			total_ns += ts[i].lat_ns[j];
+		}
+		errors += ts[i].errors;
+	}
+	if (!n) {
+		fprintf(stderr, "no allocation succeeded (%u errors)\n", errors);
+		return 1;
+	}
+	qsort(all, n, sizeof(*all), cmp_u64);
+
+	if (cache_mode)
+		printf("%u threads x %u batches of %u x %zu byte %s requests"
+		       " (%s): %.0f requests/s\n",
+		       nr_threads, iterations, batch, op_len,
+		       cache_op == NVMAP_CACHE_OP_WB ? "wb" :
+		       cache_op == NVMAP_CACHE_OP_INV ? "inv" : "wb_inv",
+		       use_list ? "list" : "single",
+		       (double) n * batch * 1e9 / wall_ns);
+	else
+		printf("%u threads x %u allocs of %zu bytes, %u live: "
+		       "%.0f allocs/s\n", nr_threads, iterations, alloc_size,
+		       keep, n * 1e9 / wall_ns);
+	printf("%s latency: avg %llu us, p50 %llu us, p99 %llu us, "
+	       "max %llu us\n",
+	       cache_mode ? "batch" : "alloc",
+	       (unsigned long long) (total_ns / n / 1000),
+	       (unsigned long long) (all[n / 2] / 1000),
+	       (unsigned long long) (all[(n - 1) * 99 / 100] / 1000),
+	       (unsigned long long) (all[n - 1] / 1000));
+	if (errors)
+		printf("errors: %u\n", errors);
+	if (pool_stats && !cache_mode) {
+		unsigned long hits = hits1 - hits0, misses = misses1 - misses0;
+
+		printf("%s pool: %lu page hits, %lu misses (%.1f%% hit rate)\n",
+		       pool_name, hits, misses,
+		       hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+	}
+
+	free(all);
+	for (i = 0; i < nr_threads; i++)
+		free(ts[i].lat_ns);
+	free(ts);
+	return 0;
+}
@@ -0,0 +1,576 @@
+/*
+ * nvmap-replay.c -- replay an allocation trace against an nvmap heap
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Reads a trace of handle allocations and frees and replays it through
+ * /dev/nvmap, by default against the generic carveout.  The trace is plain
+ * text, one operation per line:
+ *
+ *	a <id> <size> [align]	allocate handle <id>
+ *	f <id>			free handle <id>
+ *
+ * Blank lines and lines starting with '#' are ignored.  Ids are small
+ * integers chosen by whoever wrote the trace.  -r replays the trace several
+ * times in a row; handles still live at the end of one pass are kept until
+ * the end of the next, so long-lived buffers from each pass sit in between
+ * the next pass's allocations the way they do on a long-running device.
+ *
+ * Every -i operations the heap's free space and largest free block are
+ * read from sysfs and printed, so the fragmentation can be followed over
+ * the run.  At the end the number of failed allocations and the latency of
+ * the successful ones are reported.
+ *
+ * -g <ops> writes a synthetic trace (a mix of framebuffer, video and
+ * texture sized buffers with random lifetimes) to stdout instead.
+ *
+ * nvmap-replay-host is the same program linked with the nvmap driver and
+ * the fake kernel in fake/, as nvmap-stress is, so a trace can be replayed
+ * on the build host.  It probes the driver with a -S MiB system memory, a
+ * -C MiB generic carveout and a -I MiB fake IOVMM, and once the trace is
+ * done checks that every handle went back: no kmalloc()ed objects or
+ * pages outstanding, a whole carveout and not one WARN.  Driver messages
+ * are counted, and printed with -v.
+ */
+
+/* $(CROSS_COMPILE)cc -Wall -O2 -o nvmap-replay nvmap-replay.c -lrt
+ * make nvmap-replay-host; see the Makefile */
+
+#ifndef NVMAP_FAKE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#ifdef NVMAP_FAKE
+#include <mach/nvmap.h>
+#include "nvmap_ioctl.h"
+#else
+/* from drivers/video/tegra/nvmap/nvmap_ioctl.h and mach/nvmap.h, which
+ * are not exported to userspace */
+struct nvmap_create_handle {
+	union {
+		uint32_t key;
+		uint32_t id;
+		uint32_t size;
+	};
+	uint32_t handle;
+};
+
+struct nvmap_alloc_handle {
+	uint32_t handle;
+	uint32_t heap_mask;
+	uint32_t flags;
+	uint32_t align;
+};
+
+#define NVMAP_IOC_MAGIC		'N'
+#define NVMAP_IOC_CREATE	_IOWR(NVMAP_IOC_MAGIC, 0, struct nvmap_create_handle)
+#define NVMAP_IOC_ALLOC		_IOW(NVMAP_IOC_MAGIC, 3, struct nvmap_alloc_handle)
+#define NVMAP_IOC_FREE		_IO(NVMAP_IOC_MAGIC, 4)
+
+#define NVMAP_HEAP_SYSMEM		(1ul << 31)
+#define NVMAP_HEAP_IOVMM		(1ul << 30)
+#define NVMAP_HEAP_CARVEOUT_GENERIC	(1ul << 0)
+
+#define NVMAP_HANDLE_UNCACHEABLE	(0x0ul << 0)
+#define NVMAP_HANDLE_WRITE_COMBINE	(0x1ul << 0)
+#define NVMAP_HANDLE_INNER_CACHEABLE	(0x2ul << 0)
+#define NVMAP_HANDLE_CACHEABLE		(0x3ul << 0)
+#endif
+
+#define NVMAP_DEV	"/dev/nvmap"
+#define HEAP_SYSFS	"/sys/class/misc/nvmap/heap-"
+
+struct trace_op {
+	char op;
+	unsigned id;
+	uint32_t size;
+	uint32_t align;
+};
+
+#ifndef NVMAP_FAKE
+static const char *nvmap_dev = NVMAP_DEV;
+#endif
+static const char *heap_name = "generic-0";
+static uint32_t heap_mask = NVMAP_HEAP_CARVEOUT_GENERIC;
+static uint32_t cache_flags = NVMAP_HANDLE_WRITE_COMBINE;
+static unsigned repeat = 1;
+static unsigned interval = 1000;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+#ifdef NVMAP_FAKE
+static size_t sysmem_mb = 256;
+static size_t carveout_mb = 128;
+static size_t iovmm_mb = 64;
+
+static struct nvmap_platform_carveout carveout = {
+	.name		= "generic-0",
+	.usage_mask	= NVMAP_HEAP_CARVEOUT_GENERIC,
+	.buddy_size	= SZ_32K,
+};
+static struct nvmap_platform_data pdata = {
+	.carveouts	= &carveout,
+	.nr_carveouts	= 1,
+};
+static struct platform_device pdev = {
+	.name		= "tegra-nvmap",
+	.id		= -1,
+	.dev		= { .platform_data = &pdata },
+};
+static unsigned long kmalloc0, pages0;
+
+extern int (*const fake_initcall)(void);
+extern void (*const fake_exitcall)(void);
+
+static struct file *nvmap_file;
+
+static void nvmap_open(void)
+{
+	phys_addr_t co_base;
+	int err;
+
+	err = fake_kernel_init(sysmem_mb << 20, carveout_mb << 20, &co_base);
+	if (!err)
+		err = fake_iovmm_init(iovmm_mb << 20);
+	if (err) {
+		errno = -err;
+		die("fake kernel");
+	}
+	carveout.base = co_base;
+	carveout.size = carveout_mb << 20;
+
+	err = fake_initcall();
+	if (!err)
+		err = fake_platform_device_register(&pdev);
+	if (err) {
+		errno = -err;
+		die("nvmap probe");
+	}
+	fake_flush_work();
+	kmalloc0 = fake_kmalloc_live();
+	pages0 = fake_pages_live();
+
+	nvmap_file = fake_misc_open("nvmap");
+	if (!nvmap_file)
+		die("open nvmap");
+}
+
+static int nvmap_ioctl(unsigned int cmd, void *arg)
+{
+	return nvmap_file->f_op->unlocked_ioctl(nvmap_file, cmd,
+						(unsigned long) arg);
+}
+
+static int read_heap_stat(const char *stat, unsigned long *val)
+{
+	char dev[64], buf[PAGE_SIZE];
+
+	snprintf(dev, sizeof(dev), "heap-%s", heap_name);
+	if (fake_sysfs_read(dev, stat, buf) < 0)
+		return -1;
+	*val = strtoul(buf, NULL, 0);
+	return 0;
+}
+
+/* closes the client and checks the driver is back to where it started;
+ * returns non-zero if not */
+static int nvmap_close(void)
+{
+	unsigned long free_size = 0, free_count = 0;
+	int failed = 0;
+
+	fake_misc_close(nvmap_file);
+	fake_flush_work();
+	fake_shrink_all();
+	fake_flush_work();
+
+	if (fake_kmalloc_live() != kmalloc0) {
+		printf("FAIL: %ld kmalloc()ed objects leaked\n",
+		       (long) (fake_kmalloc_live() - kmalloc0));
+		failed = 1;
+	}
+	if (fake_pages_live() != pages0) {
+		printf("FAIL: %ld pages leaked\n",
+		       (long) (fake_pages_live() - pages0));
+		failed = 1;
+	}
+	read_heap_stat("free_size", &free_size);
+	read_heap_stat("free_count", &free_count);
+	if (heap_mask == NVMAP_HEAP_CARVEOUT_GENERIC &&
+	    (free_size != carveout.size || free_count != 1)) {
+		printf("FAIL: carveout has %lu of %zu bytes free in %lu "
+		       "blocks\n", free_size, carveout.size, free_count);
+		failed = 1;
+	}
+	if (fake_warnings) {
+		printf("FAIL: %lu warnings\n", fake_warnings);
+		failed = 1;
+	}
+	if (!failed)
+		printf("PASS: nothing leaked\n");
+
+	if (fake_errors)
+		printf("%lu driver error messages (-v prints them)\n",
+		       fake_errors);
+
+	fake_platform_device_unregister(&pdev);
+	fake_exitcall();
+	return failed;
+}
+#else
+static int nvmap_fd = -1;
+
+static void nvmap_open(void)
+{
+	nvmap_fd = open(nvmap_dev, O_RDWR);
+	if (nvmap_fd < 0)
+		die("open " NVMAP_DEV);
+}
+
+static int nvmap_ioctl(unsigned int cmd, void *arg)
+{
+	return ioctl(nvmap_fd, cmd, arg);
+}
+
+static int read_heap_stat(const char *stat, unsigned long *val)
+{
+	char path[256];
+	FILE *f;
+	int ret;
+
+	snprintf(path, sizeof(path), HEAP_SYSFS "%s/%s", heap_name, stat);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	ret = fscanf(f, "%lu", val) == 1 ? 0 : -1;
+	fclose(f);
+	return ret;
+}
+
+static int nvmap_close(void)
+{
+	close(nvmap_fd);
+	return 0;
+}
+#endif
+
+static void handle_free(uint32_t handle)
+{
+	nvmap_ioctl(NVMAP_IOC_FREE, (void *) (unsigned long) handle);
+}
+
+static uint64_t ts_ns(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000000000ULL +
+	       b->tv_nsec - a->tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static struct trace_op *read_trace(FILE *f, unsigned *nr, unsigned *max_id)
+{
+	struct trace_op *ops = NULL;
+	unsigned alloced = 0, lineno = 0;
+	char line[256];
+
+	*nr = 0;
+	*max_id = 0;
+	while (fgets(line, sizeof(line), f)) {
+		struct trace_op op = { .align = 4096 };
+		int n;
+
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		n = sscanf(line, " %c %u %u %u", &op.op, &op.id, &op.size,
+			   &op.align);
+		if (!((op.op == 'a' && n >= 3) || (op.op == 'f' && n >= 2))) {
+			fprintf(stderr, "line %u: bad trace entry\n", lineno);
+			exit(1);
+		}
+
+		if (*nr == alloced) {
+			alloced = alloced ? alloced * 2 : 1024;
+			ops = realloc(ops, alloced * sizeof(*ops));
+			if (!ops)
+				die("realloc");
+		}
+		ops[(*nr)++] = op;
+		if (op.id > *max_id)
+			*max_id = op.id;
+	}
+	return ops;
+}
+
+static void generate_trace(unsigned nr_ops)
+{
+	/* rough carveout mix: a few screen sized surfaces, video frames,
+	 * and lots of textures from 4KiB up to 1MiB */
+	static const uint32_t big[] = {
+		1280 * 800 * 4, 1920 * 1088 * 3 / 2, 1280 * 720 * 3 / 2,
+	};
+	unsigned live[256];
+	unsigned nr_live = 0, next_id = 1, i;
+
+	srand(1);
+	printf("# synthetic nvmap trace, %u ops\n", nr_ops);
+	for (i = 0; i < nr_ops; i++) {
+		if (nr_live == 256 || (nr_live && rand() % 100 < 45)) {
+			unsigned k = rand() % nr_live;
+
+			printf("f %u\n", live[k]);
+			live[k] = live[--nr_live];
+		} else {
+			uint32_t size;
+
+			if (rand() % 100 < 5)
+				size = big[rand() % 3];
+			else
+				size = 4096 << (rand() % 9);
+			printf("a %u %u\n", next_id, size);
+			live[nr_live++] = next_id++;
+		}
+	}
+}
+
+static void sample_heap(unsigned long done)
+{
+	unsigned long free_size, free_max, free_count;
+
+	if (read_heap_stat("free_size", &free_size) ||
+	    read_heap_stat("free_max", &free_max) ||
+	    read_heap_stat("free_count", &free_count))
+		return;
+
+	printf("%10lu ops: free %8lu KiB in %5lu blocks, largest %8lu KiB"
+	       " (%3lu%%)\n", done, free_size >> 10, free_count,
+	       free_max >> 10, free_size ? free_max * 100 / free_size : 100);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+#ifdef NVMAP_FAKE
+		"usage: %s [-S sysmem MiB] [-C carveout MiB] [-I iovmm MiB] [-v]\n"
+		"          [-h sysmem|iovmm|carveout] [-H heap name]\n"
+#else
+		"usage: %s [-d dev] [-h sysmem|iovmm|carveout] [-H heap name]\n"
+#endif
+		"          [-c wc|uc|iwb|cached] [-r repeat] [-i interval]\n"
+		"          trace\n"
+		"       %s -g ops > trace\n", prog, prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct trace_op *ops;
+	struct timespec t0, t1;
+	uint32_t *handles, *prev;
+	uint64_t *lat, total_ns = 0;
+	unsigned long done = 0;
+	unsigned nr_ops, max_id, i, r, n = 0, fails = 0, bad = 0;
+	FILE *f;
+	int opt, failed;
+
+#ifdef NVMAP_FAKE
+	/* the compactor logs every pass it makes; count its messages and
+	 * only print them with -v */
+	fake_loglevel = 2;
+#endif
+	while ((opt = getopt(argc, argv, "d:h:H:c:r:i:g:S:C:I:v")) != -1) {
+		switch (opt) {
+#ifdef NVMAP_FAKE
+		case 'S':
+			sysmem_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'C':
+			carveout_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'I':
+			iovmm_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			fake_loglevel = 7;
+			break;
+#else
+		case 'd':
+			nvmap_dev = optarg;
+			break;
+#endif
+		case 'h':
+			if (!strcmp(optarg, "sysmem"))
+				heap_mask = NVMAP_HEAP_SYSMEM;
+			else if (!strcmp(optarg, "iovmm"))
+				heap_mask = NVMAP_HEAP_IOVMM;
+			else if (!strcmp(optarg, "carveout"))
+				heap_mask = NVMAP_HEAP_CARVEOUT_GENERIC;
+			else
+				usage(argv[0]);
+			break;
+		case 'H':
+			heap_name = optarg;
+			break;
+		case 'c':
+			if (!strcmp(optarg, "wc"))
+				cache_flags = NVMAP_HANDLE_WRITE_COMBINE;
+			else if (!strcmp(optarg, "uc"))
+				cache_flags = NVMAP_HANDLE_UNCACHEABLE;
+			else if (!strcmp(optarg, "iwb"))
+				cache_flags = NVMAP_HANDLE_INNER_CACHEABLE;
+			else if (!strcmp(optarg, "cached"))
+				cache_flags = NVMAP_HANDLE_CACHEABLE;
+			else
+				usage(argv[0]);
+			break;
+		case 'r':
+			repeat = atoi(optarg);
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'g':
+			generate_trace(atoi(optarg));
+			return 0;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 1 || !repeat || !interval)
+		usage(argv[0]);
+#ifdef NVMAP_FAKE
+	if (!sysmem_mb || !carveout_mb || !iovmm_mb)
+		usage(argv[0]);
+#endif
+
+	f = strcmp(argv[optind], "-") ? fopen(argv[optind], "r") : stdin;
+	if (!f)
+		die(argv[optind]);
+	ops = read_trace(f, &nr_ops, &max_id);
+	if (f != stdin)
+		fclose(f);
+	if (!nr_ops) {
+		fprintf(stderr, "empty trace\n");
+		return 1;
+	}
+
+	handles = calloc(max_id + 1, sizeof(*handles));
+	prev = calloc(max_id + 1, sizeof(*prev));
+	lat = calloc((uint64_t) nr_ops * repeat, sizeof(*lat));
+	if (!handles || !prev || !lat)
+		die("calloc");
+
+	nvmap_open();
+
+	sample_heap(0);
+	for (r = 0; r < repeat; r++) {
+		for (i = 0; i < nr_ops; i++) {
+			struct trace_op *op = &ops[i];
+			struct nvmap_create_handle create = {
+				.size = op->size,
+			};
+			struct nvmap_alloc_handle alloc = {
+				.heap_mask = heap_mask,
+				.flags = cache_flags,
+				.align = op->align,
+			};
+
+			if (op->op == 'f') {
+				if (handles[op->id])
+					handle_free(handles[op->id]);
+				else
+					bad++;
+				handles[op->id] = 0;
+				goto next;
+			}
+
+			if (handles[op->id]) {
+				/* id reused without a free: drop the old one */
+				handle_free(handles[op->id]);
+				handles[op->id] = 0;
+				bad++;
+			}
+
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			if (nvmap_ioctl(NVMAP_IOC_CREATE, &create)) {
+				fails++;
+				goto next;
+			}
+			alloc.handle = create.handle;
+			if (nvmap_ioctl(NVMAP_IOC_ALLOC, &alloc)) {
+				handle_free(create.handle);
+				fails++;
+				goto next;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+
+			handles[op->id] = create.handle;
+			lat[n] = ts_ns(&t0, &t1);
+			total_ns += lat[n++];
+next:
+			if (++done % interval == 0)
+				sample_heap(done);
+		}
+
+		/* drop the previous pass's leftovers, keep this pass's */
+		for (i = 0; i <= max_id; i++) {
+			if (prev[i])
+				handle_free(prev[i]);
+			prev[i] = handles[i];
+			handles[i] = 0;
+		}
+	}
+	for (i = 0; i <= max_id; i++)
+		if (prev[i])
+			handle_free(prev[i]);
+	sample_heap(done);
+
+	printf("%lu ops (%u passes of %u), %u allocations failed",
+	       done, repeat, nr_ops, fails);
+	if (bad)
+		printf(", %u trace entries out of order", bad);
+	printf("\n");
+
+	if (n) {
+		qsort(lat, n, sizeof(*lat), cmp_u64);
+		printf("alloc latency: avg %llu us, p50 %llu us, p99 %llu us, "
+		       "max %llu us\n",
+		       (unsigned long long) (total_ns / n / 1000),
+		       (unsigned long long) (lat[n / 2] / 1000),
+		       (unsigned long long) (lat[n * 99 / 100] / 1000),
+		       (unsigned long long) (lat[n - 1] / 1000));
+	}
+	failed = nvmap_close();
+
+	free(lat);
+	free(prev);
+	free(handles);
+	free(ops);
+	if (failed)
+		return 1;
+	return fails ? 2 : 0;
+}
@@ -0,0 +1,688 @@
+/*
+ * nvmap-stress.c -- nvmap handle core stress test on the build host
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Links the nvmap driver itself against the fake kernel in fake/ and
+ * probes it with a -S MiB system memory, a -C MiB generic carveout and a
+ * -I MiB fake IOVMM.  Then -t threads each open two clients and run -n
+ * random operations on up to -k handles per client: create and allocate
+ * from any heap with any cache attribute, pin and unpin singly, pin a
+ * batch the way a channel submit does, export a handle from one client to
+ * the other with GET_ID and FROM_ID, write a pattern through the driver
+ * and read it back, map a handle and clean or invalidate ranges of it
+ * with CACHE and CACHE_LIST, and free, sometimes while still pinned.
+ * Every address a pin returns is checked to be backed by live pages.
+ *
+ * Reports operations per second, then closes every client, drains the
+ * page pools through the shrinker and checks that the driver is back to
+ * where it started: no kmalloc()ed objects or pages outstanding, no IOVMM
+ * area left, a whole carveout and not one WARN.  Exits non-zero if not.
+ * A refcount underflow, double free or freeing of mapped memory BUGs.
+ * Driver messages are counted, and printed with -v.
+ */
+
+/* make nvmap-stress; see the Makefile */
+
+#include <getopt.h>
+#include <time.h>
+
+#include <mach/nvmap.h>
+#include "nvmap_ioctl.h"
+
+#define SLOT_EMPTY	0
+#define SLOT_CREATED	1
+#define SLOT_ALLOCATED	2
+
+#define PIN_MAX		4
+#define SUBMIT_MAX	8
+#define RW_LEN		256
+#define CACHE_OPS_MAX	8
+
+enum {
+	OP_ALLOC,
+	OP_FREE,
+	OP_PIN,
+	OP_UNPIN,
+	OP_SUBMIT,
+	OP_SHARE,
+	OP_RW,
+	OP_CACHE,
+	NR_OPS,
+};
+
+static const char *const op_names[NR_OPS] = {
+	"alloc", "free", "pin", "unpin", "submit", "share", "rw", "cache",
+};
+
+/* cumulative percentages */
+static const unsigned int op_weights[NR_OPS] = {
+	30, 50, 64, 78, 86, 91, 96, 100,
+};
+
+static const u32 heaps[] = {
+	NVMAP_HEAP_IOVMM,
+	NVMAP_HEAP_SYSMEM,
+	NVMAP_HEAP_CARVEOUT_GENERIC,
+	NVMAP_HEAP_CARVEOUT_GENERIC | NVMAP_HEAP_IOVMM,
+};
+
+static const u32 cache_flags[] = {
+	NVMAP_HANDLE_WRITE_COMBINE,
+	NVMAP_HANDLE_UNCACHEABLE,
+	NVMAP_HANDLE_INNER_CACHEABLE,
+	NVMAP_HANDLE_CACHEABLE,
+};
+
+struct slot {
+	u32 handle;
+	u32 size;
+	int state;
+	int pins;
+};
+
+struct client {
+	struct file *file;
+	struct slot *slots;
+};
+
+struct thread_stats {
+	pthread_t thread;
+	unsigned int seed;
+	struct client clients[2];
+	unsigned long ops[NR_OPS];
+	unsigned long errors[NR_OPS];
+	unsigned long corrupt;
+};
+
+static unsigned int nr_threads = 4;
+static unsigned long iterations = 100000;
+static unsigned int keep = 32;
+static size_t max_size = 1 << 20;
+static size_t sysmem_mb = 256;
+static size_t carveout_mb = 32;
+static size_t iovmm_mb = 64;
+static unsigned int seed;
+
+static pthread_barrier_t start_barrier;
+
+extern int (*const fake_initcall)(void);
+extern void (*const fake_exitcall)(void);
+
+static void die(const char *what, int err)
+{
+	fprintf(stderr, "%s: %s\n", what, strerror(err));
+	exit(1);
+}
+
+static int nvmap_ioctl(struct file *file, unsigned int cmd, void *arg)
+{
+	return file->f_op->unlocked_ioctl(file, cmd, (unsigned long)arg);
+}
+
+static int check_pin(struct thread_stats *ts, unsigned long addr, u32 size)
+{
+	if (!fake_iovmm_check(addr, size))
+		return 0;
+	fprintf(stderr, "pinned address %#lx (%u bytes) is not backed\n",
+		addr, size);
+	ts->corrupt++;
+	return -EFAULT;
+}
+
+static struct slot *pick(struct thread_stats *ts, struct client *c,
+			 int state)
+{
+	unsigned int i, start = rand_r(&ts->seed) % keep;
+
+	for (i = 0; i < keep; i++) {
+		struct slot *s = &c->slots[(start + i) % keep];
+
+		if (s->state == state)
+			return s;
+	}
+	return NULL;
+}
+
+static int handle_create(struct client *c, struct slot *s, u32 size)
+{
+	struct nvmap_create_handle op = { .size = size };
+	int err;
+
+	err = nvmap_ioctl(c->file, NVMAP_IOC_CREATE, &op);
+	if (err)
+		return err;
+	s->handle = op.handle;
+	s->size = size;
+	s->state = SLOT_CREATED;
+	s->pins = 0;
+	return 0;
+}
+
+static void handle_free(struct client *c, struct slot *s)
+{
+	nvmap_ioctl(c->file, NVMAP_IOC_FREE, (void *)(unsigned long)s->handle);
+	s->state = SLOT_EMPTY;
+}
+
+static int op_alloc(struct thread_stats *ts, struct client *c)
+{
+	struct nvmap_alloc_handle op;
+	struct slot *s = pick(ts, c, SLOT_EMPTY);
+	unsigned int pages = max_size >> PAGE_SHIFT;
+	int err;
+
+	if (!s)
+		return 0;
+
+	/* mostly small buffers, with the odd large one */
+	if (rand_r(&ts->seed) % 8)
+		pages = max(pages / 16, 1U);
+	pages = 1 + rand_r(&ts->seed) % pages;
+
+	err = handle_create(c, s, pages << PAGE_SHIFT);
+	if (err)
+		return err;
+
+	op.handle = s->handle;
+	op.heap_mask = heaps[rand_r(&ts->seed) % ARRAY_SIZE(heaps)];
+	op.flags = cache_flags[rand_r(&ts->seed) % ARRAY_SIZE(cache_flags)];
+	op.align = PAGE_SIZE;
+	/* only the carveout serves alignments above a page */
+	if ((op.heap_mask & NVMAP_HEAP_CARVEOUT_GENERIC) &&
+	    !(rand_r(&ts->seed) % 4))
+		op.align = SZ_64K;
+	err = nvmap_ioctl(c->file, NVMAP_IOC_ALLOC, &op);
+	if (err) {
+		handle_free(c, s);
+		return err;
+	}
+	s->state = SLOT_ALLOCATED;
+	return 0;
+}
+
+static int op_free(struct thread_stats *ts, struct client *c)
+{
+	struct slot *s = pick(ts, c, SLOT_ALLOCATED);
+	struct nvmap_pin_handle op;
+
+	if (!s)
+		return 0;
+
+	/* one free in eight leaves its pins for the driver to drop */
+	if (rand_r(&ts->seed) % 8) {
+		while (s->pins) {
+			op.handles = s->handle;
+			op.addr = 0;
+			op.count = 1;
+			nvmap_ioctl(c->file, NVMAP_IOC_UNPIN_MULT, &op);
+			s->pins--;
+		}
+	}
+	handle_free(c, s);
+	return 0;
+}
+
+static int op_pin(struct thread_stats *ts, struct client *c)
+{
+	struct slot *s = pick(ts, c, SLOT_ALLOCATED);
+	struct nvmap_pin_handle op;
+	int err;
+
+	if (!s || s->pins == PIN_MAX)
+		return 0;
+
+	op.handles = s->handle;
+	op.addr = 0;
+	op.count = 1;
+	err = nvmap_ioctl(c->file, NVMAP_IOC_PIN_MULT, &op);
+	if (err)
+		return err;
+	s->pins++;
+	return check_pin(ts, op.addr, s->size);
+}
+
+static int op_unpin(struct thread_stats *ts, struct client *c)
+{
+	struct nvmap_pin_handle op;
+	unsigned int i;
+
+	for (i = 0; i < keep; i++) {
+		struct slot *s = &c->slots[i];
+
+		if (s->state != SLOT_ALLOCATED || !s->pins)
+			continue;
+		op.handles = s->handle;
+		op.addr = 0;
+		op.count = 1;
+		s->pins--;
+		return nvmap_ioctl(c->file, NVMAP_IOC_UNPIN_MULT, &op);
+	}
+	return 0;
+}
+
+/* pins a set of buffers, as a channel submit does, and unpins them again
+ * once the "job" is done */
+static int op_submit(struct thread_stats *ts, struct client *c)
+{
+	unsigned long handles[SUBMIT_MAX], addrs[SUBMIT_MAX];
+	struct slot *slots[SUBMIT_MAX];
+	struct nvmap_pin_handle op;
+	unsigned int i, nr = 0;
+	int err;
+
+	for (i = 0; i < SUBMIT_MAX; i++) {
+		struct slot *s = pick(ts, c, SLOT_ALLOCATED);
+
+		if (!s)
+			break;
+		slots[nr] = s;
+		handles[nr++] = s->handle;
+	}
+	if (nr < 2)
+		return 0;
+
+	op.handles = (unsigned long)handles;
+	op.addr = (unsigned long)addrs;
+	op.count = nr;
+	err = nvmap_ioctl(c->file, NVMAP_IOC_PIN_MULT, &op);
+	if (err)
+		return err;
+	for (i = 0; i < nr && !err; i++)
+		err = check_pin(ts, addrs[i], slots[i]->size);
+
+	op.addr = 0;
+	nvmap_ioctl(c->file, NVMAP_IOC_UNPIN_MULT, &op);
+	return err;
+}
+
+/* hands a buffer from one of the thread's clients to the other, the way
+ * a producer process passes a surface to its consumer */
+static int op_share(struct thread_stats *ts, struct client *from,
+		    struct client *to)
+{
+	struct slot *src = pick(ts, from, SLOT_ALLOCATED);
+	struct slot *dst = pick(ts, to, SLOT_EMPTY);
+	struct nvmap_create_handle op;
+	int err;
+
+	if (!src || !dst)
+		return 0;
+
+	op.handle = src->handle;
+	err = nvmap_ioctl(from->file, NVMAP_IOC_GET_ID, &op);
+	if (err)
+		return err;
+	err = nvmap_ioctl(to->file, NVMAP_IOC_FROM_ID, &op);
+	if (err)
+		return err;
+
+	dst->handle = op.handle;
+	dst->size = src->size;
+	dst->state = SLOT_ALLOCATED;
+	dst->pins = 0;
+	return 0;
+}
+
+/* writes a pattern through the driver's kernel mapping of the handle and
+ * reads it back */
+static int op_rw(struct thread_stats *ts, struct client *c)
+{
+	struct slot *s = pick(ts, c, SLOT_ALLOCATED);
+	unsigned char wbuf[RW_LEN], rbuf[RW_LEN];
+	struct nvmap_rw_handle op;
+	unsigned char fill;
+	int err;
+
+	if (!s)
+		return 0;
+
+	fill = rand_r(&ts->seed);
+	memset(wbuf, fill, sizeof(wbuf));
+	memset(rbuf, ~fill, sizeof(rbuf));
+
+	op.handle = s->handle;
+	op.offset = rand_r(&ts->seed) % (s->size - RW_LEN + 1);
+	op.elem_size = RW_LEN;
+	op.hmem_stride = RW_LEN;
+	op.user_stride = RW_LEN;
+	op.count = 1;
+	op.addr = (unsigned long)wbuf;
+	err = nvmap_ioctl(c->file, NVMAP_IOC_WRITE, &op);
+	if (err)
+		return err;
+	/* the driver hands back the number of bytes copied in count */
+	op.addr = (unsigned long)rbuf;
+	op.count = 1;
+	err = nvmap_ioctl(c->file, NVMAP_IOC_READ, &op);
+	if (err)
+		return err;
+
+	if (memcmp(wbuf, rbuf, RW_LEN)) {
+		fprintf(stderr, "handle %#x offset %u: read back differs\n",
+			s->handle, op.offset);
+		ts->corrupt++;
+		return -EIO;
+	}
+	return 0;
+}
+
+/* maps a buffer the way a CPU client does, with any cache attribute, and
+ * cleans or invalidates random ranges of it: one range with CACHE, a few
+ * with CACHE_LIST.  unmapping drops the reference the mapping took */
+static int op_cache(struct thread_stats *ts, struct client *c)
+{
+	struct slot *s = pick(ts, c, SLOT_ALLOCATED);
+	struct nvmap_cache_op ops[CACHE_OPS_MAX];
+	struct nvmap_cache_op_list list;
+	struct nvmap_map_caller map;
+	struct vm_area_struct *vma;
+	unsigned int i, nr;
+	int err;
+
+	if (!s)
+		return 0;
+
+	vma = fake_mmap(c->file, s->size);
+	if (!vma)
+		return -errno;
+
+	map.handle = s->handle;
+	map.offset = 0;
+	map.length = s->size;
+	map.flags = cache_flags[rand_r(&ts->seed) % ARRAY_SIZE(cache_flags)];
+	map.addr = vma->vm_start;
+	err = nvmap_ioctl(c->file, NVMAP_IOC_MMAP, &map);
+	if (err)
+		goto out;
+
+	nr = 1 + rand_r(&ts->seed) % CACHE_OPS_MAX;
+	for (i = 0; i < nr; i++) {
+		u32 start = rand_r(&ts->seed) % s->size;
+
+		ops[i].addr = vma->vm_start + start;
+		ops[i].handle = s->handle;
+		ops[i].len = 1 + rand_r(&ts->seed) % (s->size - start);
+		ops[i].op = NVMAP_CACHE_OP_WB + rand_r(&ts->seed) % 3;
+	}
+	if (nr == 1) {
+		err = nvmap_ioctl(c->file, NVMAP_IOC_CACHE, &ops[0]);
+	} else {
+		list.ops = (unsigned long)ops;
+		list.nr = nr;
+		err = nvmap_ioctl(c->file, NVMAP_IOC_CACHE_LIST, &list);
+	}
+out:
+	fake_munmap(vma);
+	return err;
+}
+
+static void *stress_thread(void *arg)
+{
+	struct thread_stats *ts = arg;
+	unsigned long i;
+	unsigned int r, op;
+	int which, err;
+
+	for (which = 0; which < 2; which++) {
+		ts->clients[which].file = fake_misc_open("nvmap");
+		if (!ts->clients[which].file)
+			die("open nvmap", errno);
+	}
+
+	pthread_barrier_wait(&start_barrier);
+
+	for (i = 0; i < iterations; i++) {
+		struct client *c, *other;
+
+		which = rand_r(&ts->seed) & 1;
+		c = &ts->clients[which];
+		other = &ts->clients[!which];
+
+		r = rand_r(&ts->seed) % 100;
+		for (op = 0; r >= op_weights[op]; op++)
+			;
+
+		switch (op) {
+		case OP_ALLOC:
+			err = op_alloc(ts, c);
+			break;
+		case OP_FREE:
+			err = op_free(ts, c);
+			break;
+		case OP_PIN:
+			err = op_pin(ts, c);
+			break;
+		case OP_UNPIN:
+			err = op_unpin(ts, c);
+			break;
+		case OP_SUBMIT:
+			err = op_submit(ts, c);
+			break;
+		case OP_SHARE:
+			err = op_share(ts, c, other);
+			break;
+		case OP_RW:
+			err = op_rw(ts, c);
+			break;
+		default:
+			err = op_cache(ts, c);
+			break;
+		}
+		ts->ops[op]++;
+		if (err)
+			ts->errors[op]++;
+	}
+
+	return NULL;
+}
+
+static unsigned long heap_stat(const char *attr)
+{
+	char buf[PAGE_SIZE];
+
+	if (fake_sysfs_read("heap-generic-0", attr, buf) < 0)
+		return 0;
+	return strtoul(buf, NULL, 0);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-t threads] [-n ops] [-k handles] "
+		"[-s max size] [-S sysmem MiB] [-C carveout MiB] "
+		"[-I iovmm MiB] [-r seed] [-v]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	static struct nvmap_platform_carveout carveout = {
+		.name		= "generic-0",
+		.usage_mask	= NVMAP_HEAP_CARVEOUT_GENERIC,
+		.buddy_size	= SZ_32K,
+	};
+	static struct nvmap_platform_data pdata = {
+		.carveouts	= &carveout,
+		.nr_carveouts	= 1,
+	};
+	static struct platform_device pdev = {
+		.name		= "tegra-nvmap",
+		.id		= -1,
+		.dev		= { .platform_data = &pdata },
+	};
+	unsigned long kmalloc0, pages0, clients0, clients, areas, mapped;
+	unsigned long total_ops = 0, total_errors = 0, corrupt = 0;
+	unsigned long ops[NR_OPS] = { 0 }, errors[NR_OPS] = { 0 };
+	struct timespec t0, t1;
+	struct thread_stats *ts;
+	phys_addr_t co_base;
+	char buf[PAGE_SIZE];
+	double secs;
+	int failed = 0;
+	unsigned int i, j;
+	int opt, err;
+
+	seed = time(NULL);
+	/* the driver complains about every free of a pinned handle; count
+	 * its messages and only print them with -v */
+	fake_loglevel = 2;
+	while ((opt = getopt(argc, argv, "t:n:k:s:S:C:I:r:v")) != -1) {
+		switch (opt) {
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			keep = atoi(optarg);
+			break;
+		case 's':
+			max_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			sysmem_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'C':
+			carveout_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'I':
+			iovmm_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			fake_loglevel = 7;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!nr_threads || !iterations || !keep || max_size < PAGE_SIZE ||
+	    !sysmem_mb || !carveout_mb || !iovmm_mb)
+		usage(argv[0]);
+
+	err = fake_kernel_init(sysmem_mb << 20, carveout_mb << 20, &co_base);
+	if (err)
+		die("fake kernel", -err);
+	err = fake_iovmm_init(iovmm_mb << 20);
+	if (err)
+		die("fake iovmm", -err);
+	carveout.base = co_base;
+	carveout.size = carveout_mb << 20;
+
+	err = fake_initcall();
+	if (!err)
+		err = fake_platform_device_register(&pdev);
+	if (err)
+		die("nvmap probe", -err);
+
+	fake_flush_work();
+	kmalloc0 = fake_kmalloc_live();
+	pages0 = fake_pages_live();
+	fake_iovmm_stats(&clients0, &areas, &mapped);
+
+	ts = calloc(nr_threads, sizeof(*ts));
+	if (!ts)
+		die("calloc", ENOMEM);
+	for (i = 0; i < nr_threads; i++) {
+		ts[i].seed = seed + i;
+		for (j = 0; j < 2; j++) {
+			ts[i].clients[j].slots = calloc(keep, sizeof(struct slot));
+			if (!ts[i].clients[j].slots)
+				die("calloc", ENOMEM);
+		}
+	}
+
+	pthread_barrier_init(&start_barrier, NULL, nr_threads + 1);
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(&ts[i].thread, NULL, stress_thread, &ts[i]))
+			die("pthread_create", errno);
+	pthread_barrier_wait(&start_barrier);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(ts[i].thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	for (i = 0; i < nr_threads; i++) {
+		for (j = 0; j < NR_OPS; j++) {
+			ops[j] += ts[i].ops[j];
+			errors[j] += ts[i].errors[j];
+		}
+		corrupt += ts[i].corrupt;
+	}
+	for (j = 0; j < NR_OPS; j++) {
+		total_ops += ops[j];
+		total_errors += errors[j];
+	}
+
+	printf("seed %u: %u threads x %lu ops, %u handles per client: "
+	       "%.0f ops/s\n", seed, nr_threads, iterations, keep,
+	       total_ops / secs);
+	for (j = 0; j < NR_OPS; j++)
+		printf("  %-7s %9lu ops, %7lu failed\n", op_names[j], ops[j],
+		       errors[j]);
+	if (fake_errors)
+		printf("%lu driver error messages (-v prints them)\n",
+		       fake_errors);
+	if (fake_debugfs_read("nvmap/generic-0/stats", buf, sizeof(buf)) > 0)
+		printf("generic-0 heap:\n%s", buf);
+
+	/* every handle still held goes away with its client */
+	for (i = 0; i < nr_threads; i++)
+		for (j = 0; j < 2; j++)
+			fake_misc_close(ts[i].clients[j].file);
+	fake_flush_work();
+	fake_shrink_all();
+	fake_flush_work();
+
+	if (corrupt) {
+		printf("FAIL: %lu pins or reads hit the wrong memory\n",
+		       corrupt);
+		failed = 1;
+	}
+	if (fake_kmalloc_live() != kmalloc0) {
+		printf("FAIL: %ld kmalloc()ed objects leaked\n",
+		       (long)(fake_kmalloc_live() - kmalloc0));
+		failed = 1;
+	}
+	if (fake_pages_live() != pages0) {
+		printf("FAIL: %ld pages leaked\n",
+		       (long)(fake_pages_live() - pages0));
+		failed = 1;
+	}
+	fake_iovmm_stats(&clients, &areas, &mapped);
+	if (clients != clients0 || areas || mapped) {
+		printf("FAIL: IOVMM left with %ld clients, %lu areas and "
+		       "%lu pages mapped\n", (long)(clients - clients0),
+		       areas, mapped);
+		failed = 1;
+	}
+	if (heap_stat("free_size") != carveout.size ||
+	    heap_stat("free_count") != 1) {
+		printf("FAIL: carveout has %lu of %zu bytes free in %lu "
+		       "blocks\n", heap_stat("free_size"), carveout.size,
+		       heap_stat("free_count"));
+		failed = 1;
+	}
+	if (fake_warnings) {
+		printf("FAIL: %lu warnings\n", fake_warnings);
+		failed = 1;
+	}
+	if (!failed)
+		printf("PASS: %lu ops, %lu refused by the driver, nothing "
+		       "leaked\n", total_ops, total_errors);
+
+	fake_platform_device_unregister(&pdev);
+	fake_exitcall();
+
+	for (i = 0; i < nr_threads; i++)
+		for (j = 0; j < 2; j++)
+			free(ts[i].clients[j].slots);
+	free(ts);
+	return failed;
+}
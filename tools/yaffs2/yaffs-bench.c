@@ -0,0 +1,205 @@
+/*
+ * yaffs-bench.c -- multi-threaded file I/O benchmark for yaffs2 locking
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Each thread owns a file on the filesystem under test and does a mix of
+ * random page-sized reads and writes on it, fio style, with -r percent
+ * of the operations being reads.  Each read drops the page from the page
+ * cache first so that it reaches yaffs_readpage(), and each write is
+ * followed by fdatasync() so that it reaches yaffs_writepage().  The run is
+ * repeated for 1, 2, 4, ... up to -t threads and the aggregate
+ * operation rate is printed for each, so serialisation in the filesystem
+ * shows up as a flat curve.
+ *
+ * To run it against a simulated NAND device:
+ *
+ *	modprobe nandsim first_id_byte=0x20 second_id_byte=0xaa \
+ *		third_id_byte=0x00 fourth_id_byte=0x15
+ *	mount -t yaffs2 /dev/mtdblock0 /mnt
+ *	./yaffs-bench -d /mnt
+ *
+ * The ids above give a 256MB part with 2k pages; keep -t times -n pages
+ * well under that so that garbage collection does not dominate the run.
+ */
+
+/* $(CROSS_COMPILE)cc -Wall -O2 -o yaffs-bench yaffs-bench.c -lpthread -lrt */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PAGE_SZ		4096
+
+static const char *dir = ".";
+static size_t pages = 256;	/* per thread */
+static size_t ops = 4096;	/* per thread */
+static int read_pct = 70;
+
+struct worker {
+	pthread_t thread;
+	char path[PATH_MAX];
+	unsigned int seed;
+	int fd;
+	int err;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int create_file(struct worker *w)
+{
+	unsigned char buf[PAGE_SZ];
+	size_t i;
+
+	w->fd = open(w->path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (w->fd < 0)
+		return -1;
+	for (i = 0; i < pages; i++) {
+		memset(buf, (int)(i & 0xff), PAGE_SZ);
+		if (write(w->fd, buf, PAGE_SZ) != PAGE_SZ)
+			return -1;
+	}
+	if (fsync(w->fd))
+		return -1;
+	return posix_fadvise(w->fd, 0, 0, POSIX_FADV_DONTNEED) ? -1 : 0;
+}
+
+static void *mixer(void *arg)
+{
+	struct worker *w = arg;
+	unsigned char buf[PAGE_SZ];
+	off_t off;
+	size_t i;
+
+	memset(buf, 0x5a, sizeof(buf));
+	for (i = 0; i < ops; i++) {
+		off = (off_t)(rand_r(&w->seed) % pages) * PAGE_SZ;
+		if ((int)(rand_r(&w->seed) % 100) < read_pct) {
+			w->err = posix_fadvise(w->fd, off, PAGE_SZ,
+					       POSIX_FADV_DONTNEED);
+			if (w->err)
+				return NULL;
+			if (pread(w->fd, buf, PAGE_SZ, off) != PAGE_SZ)
+				goto fail;
+		} else {
+			if (pwrite(w->fd, buf, PAGE_SZ, off) != PAGE_SZ)
+				goto fail;
+			/* push it through writepage, not just the page cache */
+			if (fdatasync(w->fd))
+				goto fail;
+		}
+	}
+	return NULL;
+fail:
+	w->err = errno ? errno : EIO;
+	return NULL;
+}
+
+static int run(int nthreads)
+{
+	struct worker *w;
+	double t0, t;
+	int i, err = 0;
+
+	w = calloc(nthreads, sizeof(*w));
+	if (!w)
+		return -1;
+
+	for (i = 0; i < nthreads; i++) {
+		snprintf(w[i].path, sizeof(w[i].path), "%s/yaffs-bench.%d",
+			 dir, i);
+		w[i].seed = i + 1;
+		if (create_file(&w[i])) {
+			perror(w[i].path);
+			exit(1);
+		}
+	}
+
+	t0 = now();
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&w[i].thread, NULL, mixer, &w[i]);
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(w[i].thread, NULL);
+		if (w[i].err && !err)
+			err = w[i].err;
+	}
+	t = now() - t0;
+
+	for (i = 0; i < nthreads; i++) {
+		close(w[i].fd);
+		unlink(w[i].path);
+	}
+
+	if (err)
+		fprintf(stderr, "%d threads: %s\n", nthreads, strerror(err));
+	else
+		printf("%3d threads %10.0f ops/s\n", nthreads,
+		       (double)ops * nthreads / t);
+
+	free(w);
+	return err ? -1 : 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d dir] [-t max_threads] [-n pages] [-o ops] "
+		"[-r read_pct]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+	int opt, n;
+
+	while ((opt = getopt(argc, argv, "d:t:n:o:r:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'n':
+			pages = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			ops = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			read_pct = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (max_threads < 1 || pages < 1 || ops < 1 ||
+	    read_pct < 0 || read_pct > 100)
+		usage(argv[0]);
+
+	printf("%s: %zu pages, %zu ops per thread, %d%% reads\n",
+	       dir, pages, ops, read_pct);
+	for (n = 1; n <= max_threads; n *= 2)
+		if (run(n))
+			return 1;
+
+	return 0;
+}
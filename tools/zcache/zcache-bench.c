@@ -0,0 +1,221 @@
+/*
+ * zcache-bench.c -- cleancache put/get throughput benchmark for zcache
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Each thread owns a file on a cleancache-enabled filesystem and cycles
+ * through it a page at a time: pread() the page, which is a zcache get
+ * once the page has been dropped, then drop it from the page cache with
+ * POSIX_FADV_DONTNEED, which puts it back into zcache.  The run is
+ * repeated for 1, 2, 4, ... up to -t threads and the aggregate rate of
+ * put/get pairs is printed for each, with the cleancache hit ratio when
+ * /sys/kernel/mm/cleancache is available, so lock contention in zcache
+ * and tmem shows up as a flattening of the curve.
+ *
+ * The kernel must be booted with "zcache", and the files should fit in
+ * zcache (-n pages per thread), or the run measures the disk instead.
+ */
+
+/* $(CROSS_COMPILE)cc -Wall -O2 -o zcache-bench zcache-bench.c -lpthread -lrt */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CLEANCACHE_SYSFS	"/sys/kernel/mm/cleancache/"
+#define PAGE_SZ		4096
+
+static const char *dir = ".";
+static size_t pages = 2048;	/* per thread */
+static int passes = 8;
+
+struct worker {
+	pthread_t thread;
+	char path[PATH_MAX];
+	int fd;
+	int err;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* returns the counter, or -1 if cleancache stats are not available */
+static long long cleancache_stat(const char *name)
+{
+	char path[PATH_MAX];
+	long long val = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), CLEANCACHE_SYSFS "%s", name);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%lld", &val) != 1)
+		val = -1;
+	fclose(f);
+	return val;
+}
+
+/* half random, half compressible: lzo gets it down to ~half a page */
+static int create_file(struct worker *w, unsigned int seed)
+{
+	unsigned char buf[PAGE_SZ];
+	size_t i, j;
+
+	w->fd = open(w->path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (w->fd < 0)
+		return -1;
+	for (i = 0; i < pages; i++) {
+		for (j = 0; j < PAGE_SZ / 2; j++)
+			buf[j] = rand_r(&seed);
+		memset(buf + PAGE_SZ / 2, (int)(i & 0xff) | 1, PAGE_SZ / 2);
+		if (write(w->fd, buf, PAGE_SZ) != PAGE_SZ)
+			return -1;
+	}
+	/* dirty pages are not put, so write back before the first pass */
+	if (fsync(w->fd))
+		return -1;
+	return posix_fadvise(w->fd, 0, 0, POSIX_FADV_DONTNEED) ? -1 : 0;
+}
+
+static void *cycler(void *arg)
+{
+	struct worker *w = arg;
+	unsigned char buf[PAGE_SZ];
+	off_t off;
+	size_t i;
+	int p;
+
+	for (p = 0; p < passes; p++) {
+		for (i = 0; i < pages; i++) {
+			off = (off_t)i * PAGE_SZ;
+			if (pread(w->fd, buf, PAGE_SZ, off) != PAGE_SZ) {
+				w->err = errno ? errno : EIO;
+				return NULL;
+			}
+			w->err = posix_fadvise(w->fd, off, PAGE_SZ,
+					       POSIX_FADV_DONTNEED);
+			if (w->err)
+				return NULL;
+		}
+	}
+	return NULL;
+}
+
+static int run(int nthreads)
+{
+	struct worker *w;
+	long long gets0, puts0, gets, puts;
+	double t0, t;
+	int i, err = 0;
+
+	w = calloc(nthreads, sizeof(*w));
+	if (!w)
+		return -1;
+
+	for (i = 0; i < nthreads; i++) {
+		snprintf(w[i].path, sizeof(w[i].path), "%s/zcache-bench.%d",
+			 dir, i);
+		if (create_file(&w[i], i + 1)) {
+			perror(w[i].path);
+			exit(1);
+		}
+	}
+
+	gets0 = cleancache_stat("succ_gets");
+	puts0 = cleancache_stat("puts");
+	t0 = now();
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&w[i].thread, NULL, cycler, &w[i]);
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(w[i].thread, NULL);
+		if (w[i].err && !err)
+			err = w[i].err;
+	}
+	t = now() - t0;
+	gets = cleancache_stat("succ_gets");
+	puts = cleancache_stat("puts");
+
+	for (i = 0; i < nthreads; i++) {
+		close(w[i].fd);
+		unlink(w[i].path);
+	}
+
+	if (err) {
+		fprintf(stderr, "%d threads: %s\n", nthreads, strerror(err));
+	} else {
+		double ops = (double)pages * nthreads * passes;
+
+		printf("%3d threads %10.0f put+get/s", nthreads, ops / t);
+		if (gets0 >= 0 && puts0 >= 0 && gets >= 0 && puts >= 0)
+			printf(" %8lld gets %8lld puts %5.1f%% hit",
+			       gets - gets0, puts - puts0,
+			       100.0 * (gets - gets0) / ops);
+		printf("\n");
+	}
+
+	free(w);
+	return err ? -1 : 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d dir] [-t max_threads] [-n pages] [-p passes]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+	int opt, n;
+
+	while ((opt = getopt(argc, argv, "d:t:n:p:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'n':
+			pages = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			passes = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (max_threads < 1 || passes < 1 || pages < 1)
+		usage(argv[0]);
+
+	if (cleancache_stat("puts") < 0)
+		fprintf(stderr, "warning: no " CLEANCACHE_SYSFS
+			", is cleancache enabled?\n");
+
+	printf("%s: %zu pages per thread, %d passes\n", dir, pages, passes);
+	for (n = 1; n <= max_threads; n *= 2)
+		if (run(n))
+			return 1;
+
+	return 0;
+}
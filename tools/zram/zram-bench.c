@@ -0,0 +1,204 @@
+/*
+ * zram-bench.c -- parallel page writer benchmark for /dev/zramN
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Emulates swap-out: each writer thread issues O_DIRECT single-page
+ * pwrite()s to its own slice of an initialized zram device, filling pages
+ * with partly compressible data.  The run is repeated for 1, 2, 4, ... up
+ * to -t threads and the aggregate rate is printed for each, so the scaling
+ * of concurrent compression can be read straight off the table.
+ *
+ * The device must be set up first, e.g.
+ *	echo $((256 << 20)) > /sys/block/zram0/disksize
+ */
+
+/* $(CROSS_COMPILE)cc -Wall -O2 -o zram-bench zram-bench.c -lpthread -lrt */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#define ZRAM_DEV	"/dev/zram0"
+#define PAGE_SZ		4096
+
+static const char *dev = ZRAM_DEV;
+static int passes = 4;
+static int fill = 50;		/* percent of each page that is random */
+
+struct worker {
+	pthread_t thread;
+	int fd;
+	unsigned int seed;
+	off_t start;
+	size_t pages;
+	int err;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill_page(unsigned char *buf, unsigned int *seed, size_t n)
+{
+	size_t rnd = PAGE_SZ * fill / 100;
+	size_t i;
+
+	for (i = 0; i < rnd; i++)
+		buf[i] = rand_r(seed);
+	/* the rest compresses well but is not a zero page */
+	memset(buf + rnd, (int)(n & 0xff) | 1, PAGE_SZ - rnd);
+}
+
+static void *writer(void *arg)
+{
+	struct worker *w = arg;
+	unsigned char *buf;
+	size_t i;
+	int p;
+
+	if (posix_memalign((void **)&buf, PAGE_SZ, PAGE_SZ)) {
+		w->err = ENOMEM;
+		return NULL;
+	}
+
+	for (p = 0; p < passes; p++) {
+		for (i = 0; i < w->pages; i++) {
+			fill_page(buf, &w->seed, i);
+			if (pwrite(w->fd, buf, PAGE_SZ,
+				   w->start + (off_t)i * PAGE_SZ) != PAGE_SZ) {
+				w->err = errno;
+				goto out;
+			}
+		}
+	}
+out:
+	free(buf);
+	return NULL;
+}
+
+static int run(int nthreads, size_t dev_pages)
+{
+	struct worker *w;
+	size_t per = dev_pages / nthreads;
+	double t0, t;
+	int i, err = 0;
+
+	w = calloc(nthreads, sizeof(*w));
+	if (!w)
+		return -1;
+
+	for (i = 0; i < nthreads; i++) {
+		w[i].fd = open(dev, O_WRONLY | O_DIRECT);
+		if (w[i].fd < 0) {
+			perror(dev);
+			exit(1);
+		}
+		w[i].seed = i + 1;
+		w[i].start = (off_t)i * per * PAGE_SZ;
+		w[i].pages = per;
+	}
+
+	t0 = now();
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&w[i].thread, NULL, writer, &w[i]);
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(w[i].thread, NULL);
+		if (w[i].err && !err)
+			err = w[i].err;
+		close(w[i].fd);
+	}
+	t = now() - t0;
+
+	if (err) {
+		fprintf(stderr, "%d threads: write failed: %s\n",
+			nthreads, strerror(err));
+	} else {
+		double mb = (double)per * nthreads * passes * PAGE_SZ / 1e6;
+
+		printf("%3d threads %10.1f MB/s %10.0f pages/s\n", nthreads,
+		       mb / t, per * nthreads * passes / t);
+	}
+
+	free(w);
+	return err ? -1 : 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d dev] [-t max_threads] [-n pages] [-p passes]"
+		" [-f random_pct]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+	size_t pages = 0;
+	uint64_t size;
+	int opt, fd, n;
+
+	while ((opt = getopt(argc, argv, "d:t:n:p:f:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev = optarg;
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'n':
+			pages = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			passes = atoi(optarg);
+			break;
+		case 'f':
+			fill = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (max_threads < 1 || passes < 1 || fill < 0 || fill > 100)
+		usage(argv[0]);
+
+	fd = open(dev, O_RDONLY);
+	if (fd < 0 || ioctl(fd, BLKGETSIZE64, &size)) {
+		perror(dev);
+		return 1;
+	}
+	close(fd);
+
+	if (!pages || pages > size / PAGE_SZ)
+		pages = size / PAGE_SZ;
+	if (pages < (size_t)max_threads) {
+		fprintf(stderr, "%s: too small (%zu pages)\n", dev, pages);
+		return 1;
+	}
+
+	printf("%s: %zu pages, %d passes, %d%% random\n",
+	       dev, pages, passes, fill);
+	for (n = 1; n <= max_threads; n *= 2)
+		if (run(n, pages))
+			return 1;
+
+	return 0;
+}